@@ -3,7 +3,7 @@ defmodule Imagex do
   Documentation for Imagex.
   """
 
-  @dialyzer {:nowarn_function, to_tensor: 2}
+  @dialyzer {:nowarn_function, to_tensor: 3}
 
   alias Imagex.Image
 
@@ -28,22 +28,59 @@ defmodule Imagex do
     end
   end
 
-  @spec encode(Nx.Tensor.t(), :jpeg | :png | :jxl | :ppm | :bmp, keyword()) :: Imagex.C.compress_ret_type()
-  @spec encode(Nx.Tensor.t(), :jpeg | :png | :jxl | :ppm | :bmp) :: Imagex.C.compress_ret_type()
-  @spec encode(Image.t(), :jpeg | :png | :jxl | :ppm | :bmp, keyword()) :: Imagex.C.compress_ret_type()
-  @spec encode(Image.t(), :jpeg | :png | :jxl | :ppm | :bmp) :: Imagex.C.compress_ret_type()
+  @spec encode(Nx.Tensor.t(), :jpeg | :png | :jxl | :webp | :ppm | :bmp, keyword()) :: Imagex.C.compress_ret_type()
+  @spec encode(Nx.Tensor.t(), :jpeg | :png | :jxl | :webp | :ppm | :bmp) :: Imagex.C.compress_ret_type()
+  @spec encode(Image.t(), :jpeg | :png | :jxl | :webp | :ppm | :bmp, keyword()) :: Imagex.C.compress_ret_type()
+  @spec encode(Image.t(), :jpeg | :png | :jxl | :webp | :ppm | :bmp) :: Imagex.C.compress_ret_type()
   def encode(image, format, options \\ [])
 
   def encode(image, :jpeg, options) when is_tensor(image) do
-    with {:ok, options} <- Keyword.validate(options, quality: 75, metadata: nil),
-         {:ok, exif_binary} <- exif_binary_from_metadata(Keyword.get(options, :metadata)),
-         {:ok, xmp_binary} <- xmp_binary_from_metadata(Keyword.get(options, :metadata)) do
-      quality = Keyword.get(options, :quality)
+    {target_size, options} = Keyword.pop(options, :target_size)
+    {threads, options} = Keyword.pop(options, :threads, if(target_size == nil, do: 1, else: :auto))
+
+    with :ok <- validate_target_size(target_size, options, [:quality]),
+         {:ok, threads} <- Imagex.Options.parse_threads(threads),
+         {:ok, jpeg} <- jpeg_compress_options(options) do
       pixels = Nx.to_binary(image)
       {h, w, c} = standardize_shape(image.shape)
-      Imagex.C.jpeg_compress(pixels, w, h, c, quality, exif_binary, xmp_binary)
-    else
-      error -> error
+
+      case target_size do
+        nil ->
+          Imagex.C.jpeg_compress(
+            pixels,
+            w,
+            h,
+            c,
+            jpeg.quality,
+            jpeg.optimize_coding,
+            jpeg.progressive,
+            jpeg.subsampling,
+            jpeg.dct_method,
+            jpeg.grayscale,
+            jpeg.exif_binary,
+            jpeg.xmp_binary,
+            jpeg.icc_profile,
+            threads
+          )
+
+        _ ->
+          Imagex.C.jpeg_compress_to_size(
+            pixels,
+            w,
+            h,
+            c,
+            target_size,
+            jpeg.optimize_coding,
+            jpeg.progressive,
+            jpeg.subsampling,
+            jpeg.dct_method,
+            jpeg.grayscale,
+            jpeg.exif_binary,
+            jpeg.xmp_binary,
+            jpeg.icc_profile,
+            threads
+          )
+      end
     end
   end
 
@@ -52,12 +89,21 @@ defmodule Imagex do
   end
 
   def encode(image, :png, options) when is_tensor(image) do
-    with {:ok, options} <- Keyword.validate(options, metadata: nil),
+    with {:ok, options} <-
+           Keyword.validate(options,
+             compression_level: :default,
+             filter: :adaptive,
+             strategy: :default,
+             fast: false,
+             threads: 1,
+             metadata: nil
+           ),
+         {:ok, {compression_level, filter, strategy, threads}} <- Imagex.Png.compress_options(options),
          {:ok, png_texts} <- Imagex.Png.texts_from_metadata(Keyword.get(options, :metadata)) do
       pixels = Nx.to_binary(image)
       {h, w, c} = standardize_shape(image.shape)
       bit_depth = get_bit_depth(image)
-      Imagex.C.png_compress(pixels, w, h, c, bit_depth, png_texts)
+      Imagex.C.png_compress(pixels, w, h, c, bit_depth, png_texts, compression_level, filter, strategy, threads)
     else
       error -> error
     end
@@ -68,6 +114,173 @@ defmodule Imagex do
   end
 
   def encode(image, :jxl, options) when is_tensor(image) do
+    {target_size, options} = Keyword.pop(options, :target_size)
+
+    with :ok <- validate_target_size(target_size, options, [:distance, :lossless]),
+         {:ok, jxl} <- jxl_compress_options(options) do
+      pixels = Nx.to_binary(image)
+      {h, w, c} = standardize_shape(image.shape)
+      bit_depth = get_bit_depth(image)
+
+      case target_size do
+        nil ->
+          Imagex.C.jxl_compress(
+            pixels,
+            w,
+            h,
+            c,
+            bit_depth,
+            jxl.exif_binary,
+            jxl.boxes,
+            jxl.distance,
+            jxl.lossless,
+            jxl.effort,
+            jxl.progressive,
+            jxl.order
+          )
+
+        _ ->
+          Imagex.C.jxl_compress_to_size(
+            pixels,
+            w,
+            h,
+            c,
+            bit_depth,
+            jxl.exif_binary,
+            jxl.boxes,
+            target_size,
+            jxl.effort,
+            jxl.progressive,
+            jxl.order
+          )
+      end
+    end
+  end
+
+  def encode(image, :webp, options) when is_tensor(image) do
+    with {:ok, options} <-
+           Keyword.validate(options, quality: 75, lossless: false, method: 4, threads: 1, metadata: nil),
+         {:ok, {quality, lossless, method, multithreaded}} <- Imagex.Webp.compress_options(options),
+         :ok <- Imagex.Webp.validate_type(image.type),
+         {:ok, exif_binary} <- exif_binary_from_metadata(Keyword.get(options, :metadata)),
+         {:ok, xmp_binary} <- xmp_binary_from_metadata(Keyword.get(options, :metadata)),
+         {:ok, icc_profile} <- icc_profile_from_metadata(Keyword.get(options, :metadata)) do
+      pixels = Nx.to_binary(image)
+      {h, w, c} = standardize_shape(image.shape)
+
+      Imagex.C.webp_compress(
+        pixels,
+        w,
+        h,
+        c,
+        quality,
+        lossless,
+        method,
+        multithreaded,
+        exif_binary,
+        xmp_binary,
+        icc_profile
+      )
+    end
+  end
+
+  def encode(%Image{tensor: tensor, metadata: metadata}, :webp, options) do
+    encode(tensor, :webp, Keyword.put(options, :metadata, metadata))
+  end
+
+  def encode(image, :ppm, []) when is_tensor(image) do
+    Imagex.PPM.encode(image)
+  end
+
+  def encode(image, :bmp, []) when is_tensor(image) do
+    Imagex.BMP.encode(image)
+  end
+
+  def encode(%Image{tensor: tensor, metadata: metadata}, :jxl, options) do
+    encode(tensor, :jxl, Keyword.put(options, :metadata, metadata))
+  end
+
+  def encode(image, format, options) when is_image(image) do
+    encode(image.tensor, format, options)
+  end
+
+  defp validate_target_size(nil, _options, _conflicting), do: :ok
+
+  defp validate_target_size(target_size, options, conflicting) do
+    cond do
+      not is_integer(target_size) or target_size <= 0 ->
+        {:error, "target_size must be a positive integer, got: #{inspect(target_size)}"}
+
+      option = Enum.find(conflicting, &Keyword.has_key?(options, &1)) ->
+        {:error, "target_size cannot be combined with #{option}"}
+
+      true ->
+        :ok
+    end
+  end
+
+  # Validates JPEG encoder options into the values that the JPEG encoder NIFs take after the image shape, shared with
+  # Imagex.Encoder
+  @doc false
+  def jpeg_compress_options(options) do
+    with {:ok, options} <-
+           Keyword.validate(options,
+             quality: 75,
+             optimize_coding: false,
+             progressive: false,
+             subsampling: "4:2:0",
+             dct_method: :islow,
+             grayscale: false,
+             metadata: nil
+           ),
+         {:ok, optimize_coding} <- parse_boolean(options, :optimize_coding),
+         {:ok, progressive} <- parse_boolean(options, :progressive),
+         {:ok, grayscale} <- parse_boolean(options, :grayscale),
+         {:ok, subsampling} <- parse_subsampling(Keyword.get(options, :subsampling)),
+         {:ok, dct_method} <- parse_dct_method(Keyword.get(options, :dct_method)),
+         {:ok, exif_binary} <- exif_binary_from_metadata(Keyword.get(options, :metadata)),
+         {:ok, xmp_binary} <- xmp_binary_from_metadata(Keyword.get(options, :metadata)),
+         {:ok, icc_profile} <- icc_profile_from_metadata(Keyword.get(options, :metadata)) do
+      {:ok,
+       %{
+         quality: Keyword.get(options, :quality),
+         optimize_coding: optimize_coding,
+         progressive: progressive,
+         subsampling: subsampling,
+         dct_method: dct_method,
+         grayscale: grayscale,
+         exif_binary: exif_binary,
+         xmp_binary: xmp_binary,
+         icc_profile: icc_profile
+       }}
+    end
+  end
+
+  defp parse_boolean(options, key) do
+    case Keyword.get(options, key) do
+      value when is_boolean(value) -> {:ok, value}
+      value -> {:error, "#{key} must be a boolean, got: #{inspect(value)}"}
+    end
+  end
+
+  defp parse_subsampling("4:4:4"), do: {:ok, 0}
+  defp parse_subsampling("4:2:2"), do: {:ok, 1}
+  defp parse_subsampling("4:2:0"), do: {:ok, 2}
+
+  defp parse_subsampling(subsampling),
+    do: {:error, ~s(subsampling must be "4:4:4", "4:2:2" or "4:2:0", got: #{inspect(subsampling)})}
+
+  defp parse_dct_method(:islow), do: {:ok, 0}
+  defp parse_dct_method(:ifast), do: {:ok, 1}
+  defp parse_dct_method(:float), do: {:ok, 2}
+
+  defp parse_dct_method(dct_method),
+    do: {:error, "dct_method must be :islow, :ifast or :float, got: #{inspect(dct_method)}"}
+
+  # Validates JXL encoder options into the values that the JXL encoder NIFs take after the image, shared with
+  # Imagex.Async
+  @doc false
+  def jxl_compress_options(options) do
     with {:ok, options} <-
            Keyword.validate(options,
              distance: 1.0,
@@ -77,7 +290,6 @@ defmodule Imagex do
              order: :center,
              metadata: nil
            ),
-         bit_depth <- get_bit_depth(image),
          lossless <- Keyword.get(options, :lossless),
          {:ok, distance} <- parse_jxl_distance(Keyword.get(options, :distance), lossless),
          {:ok, {exif_binary, jxl_boxes}} <- Imagex.Jxl.metadata_to_boxes(Keyword.get(options, :metadata)) do
@@ -97,101 +309,459 @@ defmodule Imagex do
           level when is_integer(level) and level in 0..1 -> level
         end
 
-      pixels = Nx.to_binary(image)
-      {h, w, c} = standardize_shape(image.shape)
-
-      Imagex.C.jxl_compress(
-        pixels,
-        w,
-        h,
-        c,
-        bit_depth,
-        exif_binary,
-        jxl_boxes,
-        distance,
-        lossless,
-        effort,
-        progressive,
-        order
-      )
+      {:ok,
+       %{
+         exif_binary: exif_binary,
+         boxes: jxl_boxes,
+         distance: distance,
+         lossless: lossless,
+         effort: effort,
+         progressive: progressive,
+         order: order
+       }}
     else
       error -> error
     end
   end
 
-  def encode(image, :ppm, []) when is_tensor(image) do
-    Imagex.PPM.encode(image)
-  end
+  @doc """
+  Decodes an encoded image, or loads a PDF or TIFF document.
 
-  def encode(image, :bmp, []) when is_tensor(image) do
-    Imagex.BMP.encode(image)
-  end
+  Options:
 
-  def encode(%Image{tensor: tensor, metadata: metadata}, :jxl, options) do
-    encode(tensor, :jxl, Keyword.put(options, :metadata, metadata))
-  end
+    * `:format` - the format of `bytes`, detected from its contents when not given.
+    * `:parse_metadata` - whether to parse EXIF, XMP, ICC and other metadata into `image.metadata`, or a list of the
+      kinds to parse, out of `:exif`, `:xmp`, `:icc` and `:text` (PNG text chunks). Defaults to `true`. JPEG, PNG, JPEG
+      XL and WebP decoders skip the markers, chunks and boxes holding the other kinds, instead of reading,
+      decompressing and copying them; with `false`, they extract none. JFIF and JUMBF data only come with `true`, and
+      previews and cached images always come with all of their metadata.
+    * `:verify_checksums` and `:keep_palette` - PNG only, see the README.
+    * `:crop` - a `{x, y, width, height}` region to decode. JPEG only.
+    * `:preview` - decode a small version of a JPEG, PNG, JPEG XL or WebP image whose longer side is at least this many
+      pixels, instead of the image itself, when the file allows it: the JPEG thumbnail of its EXIF data or the preview
+      frame of a JPEG XL if they are large enough, else a JPEG decoded at 1/2, 1/4 or 1/8 scale. Other images are
+      decoded in full, so the result is never smaller than asked for, unless the image is. The metadata is that of the
+      full image.
+    * `:cache` - look JPEG, PNG, JPEG XL and WebP images up in the decode cache, and add them to it when they aren't
+      there, see `Imagex.Cache`. Defaults to `false`.
+    * `:into` - an `Imagex.PixelBuffer` to decode a JPEG, PNG or JPEG XL image into, instead of a new binary. The
+      tensor is a view of the buffer, whose memory later decodes reuse once the tensor is gone.
 
-  def encode(image, format, options) when is_image(image) do
-    encode(image.tensor, format, options)
-  end
+  The following options produce a tensor that can be fed to a model directly. They are applied natively in a single
+  pass over the decoded pixels, instead of a transpose, a cast and a normalization in Nx:
 
+    * `:layout` - `:hwc` (the default) for interleaved pixels, or `:chw` for one plane per channel. CHW tensors have
+      shape `{channels, height, width}`, also for grayscale images.
+    * `:type` - the tensor type, one of `{:u, 8}`, `{:u, 16}`, `{:f, 16}` and `{:f, 32}`. Defaults to the type of the
+      decoded pixels. Integer types round to nearest and saturate.
+    * `:scale` and `:bias` - every sample becomes `sample * scale + bias`, with either one number for all channels or
+      a list with one number per channel. Default to `1` and `0`.
+
+  To normalize 8-bit RGB pixels with a per-channel mean and standard deviation given for values in `0..1`, pass
+  `scale: Enum.map(std, &(1 / (255 * &1)))` and `bias: Enum.zip_with(mean, std, &(-&1 / &2))`.
+  """
   @spec decode(binary(), keyword()) :: {:ok, Imagex.Image.t()} | {:error, String.t()}
   @spec decode(binary()) :: {:ok, Imagex.Image.t()} | {:error, String.t()}
   def decode(bytes, options \\ []) do
     parse_metadata = Keyword.get(options, :parse_metadata, true)
+    crop = Keyword.get(options, :crop)
+    preview = Keyword.get(options, :preview)
+    into = Keyword.get(options, :into)
 
-    case Keyword.get_lazy(options, :format, fn -> Imagex.Detect.detect(bytes) end) do
-      :jpeg ->
-        case to_tensor(Imagex.C.jpeg_decompress(bytes), parse_metadata) do
-          {:ok, %Image{tensor: tensor, metadata: nil} = image} ->
-            if parse_metadata do
-              {:ok, %Image{tensor: tensor, metadata: Imagex.Jfif.read_metadata_from_jpeg(bytes)}}
-            else
-              {:ok, image}
-            end
-
-          {:error, _error_msg} = error ->
-            error
-        end
+    with {:ok, metadata} <- metadata_mask(parse_metadata),
+         {:ok, output} <- output_options(options),
+         :ok <- validate_preview(preview, options),
+         :ok <- validate_into(into, options, output) do
+      {planar, type_id, scale, bias} = native_output(output)
 
-      :png ->
-        to_tensor(Imagex.C.png_decompress(bytes), parse_metadata)
+      case Keyword.get_lazy(options, :format, fn -> Imagex.Detect.detect(bytes) end) do
+        format when crop != nil and format not in [:jpeg, nil] ->
+          crop_unsupported(format)
 
-      :jxl ->
-        to_tensor(Imagex.C.jxl_decompress(bytes), parse_metadata)
+        format when preview != nil and format not in [:jpeg, :png, :jxl, :webp, nil] ->
+          preview_unsupported(format)
 
-      :ppm ->
-        Imagex.PPM.decode(bytes)
+        format when output != nil and format in [:pdf, :tiff] ->
+          {:error, "layout, type, scale and bias are not supported for #{format} documents"}
 
-      :bmp ->
-        Imagex.BMP.decode(bytes)
+        format when preview != nil and format != nil ->
+          result = Imagex.Budget.run(fn -> Imagex.C.decompress_preview(bytes, preview) end)
+          to_tensor(result, parse_metadata, output)
 
-      :pdf ->
-        case Imagex.C.pdf_load_document(bytes) do
-          {:ok, {ref, num_pages}} -> {:ok, %Imagex.Pdf{ref: ref, num_pages: num_pages}}
-          error -> error
-        end
+        format when format in [:jpeg, :png, :jxl, :webp] and options[:cache] == true ->
+          verify_checksums = Keyword.get(options, :verify_checksums, true)
+          keep_palette = Keyword.get(options, :keep_palette, false)
+
+          with {:ok, {x, y, width, height}} <- parse_crop(crop) do
+            format_id = mapped_format_id(format)
+
+            result =
+              Imagex.Budget.run(fn ->
+                Imagex.C.decompress_cached(bytes, format_id, verify_checksums, keep_palette, x, y, width, height)
+              end)
+
+            to_tensor(result, parse_metadata, output)
+          end
+
+        format when into != nil and format in [:jpeg, :png, :jxl] ->
+          verify_checksums = Keyword.get(options, :verify_checksums, true)
+          keep_palette = Keyword.get(options, :keep_palette, false)
+
+          with {:ok, {x, y, width, height}} <- parse_crop(crop) do
+            %Imagex.PixelBuffer{ref: buffer} = into
+            format_id = mapped_format_id(format)
+
+            result =
+              Imagex.Budget.run(fn ->
+                Imagex.C.decompress_into(
+                  buffer,
+                  bytes,
+                  format_id,
+                  verify_checksums,
+                  keep_palette,
+                  x,
+                  y,
+                  width,
+                  height,
+                  metadata
+                )
+              end)
+
+            to_tensor(result, parse_metadata, nil)
+          end
+
+        format when into != nil and format != nil ->
+          into_unsupported(format)
+
+        :jpeg ->
+          with {:ok, {x, y, width, height}} <- parse_crop(crop) do
+            result =
+              Imagex.Budget.run(fn ->
+                Imagex.C.jpeg_decompress(bytes, x, y, width, height, metadata, planar, type_id, scale, bias)
+              end)
+
+            to_tensor(result, parse_metadata, converted(output))
+          end
+
+        :png ->
+          verify_checksums = Keyword.get(options, :verify_checksums, true)
+          keep_palette = Keyword.get(options, :keep_palette, false)
+
+          result =
+            Imagex.Budget.run(fn ->
+              Imagex.C.png_decompress(bytes, verify_checksums, keep_palette, metadata, planar, type_id, scale, bias)
+            end)
+
+          to_tensor(result, parse_metadata, converted(output))
+
+        :jxl ->
+          result = Imagex.Budget.run(fn -> Imagex.C.jxl_decompress(bytes, metadata, planar, type_id, scale, bias) end)
+          to_tensor(result, parse_metadata, converted(output))
+
+        :webp ->
+          result = Imagex.Budget.run(fn -> Imagex.C.webp_decompress(bytes, metadata, planar, type_id, scale, bias) end)
+          to_tensor(result, parse_metadata, converted(output))
+
+        :ppm ->
+          Imagex.PPM.decode(bytes) |> convert_output(output)
+
+        :bmp ->
+          Imagex.BMP.decode(bytes) |> convert_output(output)
+
+        :pdf ->
+          case Imagex.C.pdf_load_document(bytes) do
+            {:ok, {ref, num_pages}} -> {:ok, %Imagex.Pdf{ref: ref, num_pages: num_pages}}
+            error -> error
+          end
+
+        :tiff ->
+          case Imagex.C.tiff_load_document(bytes) do
+            {:ok, {ref, num_pages}} -> {:ok, %Imagex.Tiff{ref: ref, num_pages: num_pages}}
+            error -> error
+          end
+
+        nil ->
+          {:error, "failed to decode"}
+      end
+    end
+  end
+
+  @doc """
+  Decodes a list of encoded JPEG, PNG, JXL and WebP images concurrently on native threads, without going through the
+  dirty scheduler pool once per image. The format of each image is detected natively.
+
+  Returns one `{:ok, image}` or `{:error, reason}` per input, in input order; images in other formats get an error.
+
+  Options:
 
-      :tiff ->
-        case Imagex.C.tiff_load_document(bytes) do
-          {:ok, {ref, num_pages}} -> {:ok, %Imagex.Tiff{ref: ref, num_pages: num_pages}}
-          error -> error
+    * `:threads` - number of decoding threads, or `:auto` for one per core. Defaults to `:auto`.
+    * `:parse_metadata` - same as in `decode/2`. Defaults to `true`.
+    * `:layout`, `:type`, `:scale` and `:bias` - same as in `decode/2`, applied to every image.
+  """
+  @spec decode_batch(list(binary()), keyword()) ::
+          {:ok, list({:ok, Imagex.Image.t()} | {:error, String.t()})} | {:error, String.t()}
+  def decode_batch(images, options \\ []) when is_list(images) do
+    with {:ok, options} <-
+           Keyword.validate(options,
+             threads: :auto,
+             parse_metadata: true,
+             layout: :hwc,
+             type: nil,
+             scale: nil,
+             bias: nil
+           ),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)),
+         {:ok, metadata} <- metadata_mask(Keyword.get(options, :parse_metadata)),
+         {:ok, output} <- output_options(options),
+         {planar, type_id, scale, bias} = native_output(output),
+         {:ok, results} <- Imagex.C.decompress_batch(images, threads, metadata, planar, type_id, scale, bias) do
+      parse_metadata = Keyword.get(options, :parse_metadata)
+      {:ok, Enum.map(results, &to_tensor(&1, parse_metadata, converted(output)))}
+    end
+  end
+
+  @doc """
+  Decodes a list of encoded JPEG, PNG, JXL and WebP images concurrently on native threads straight into one batch
+  tensor of shape `{length(images), height, width, channels}`, resizing each image to fit. There is no per-image
+  tensor, resize or `Nx.stack/1` in between.
+
+  Images are converted to `channels`, which is 1 (luma), 3 (RGB) or 4 (RGBA), and resampled with an antialiasing
+  triangle filter. Returns `{:ok, {batch, results}}`, where `results` has one `{:ok, {width, height}}` with the
+  original size of each image, or `{:error, reason}` for images that could not be decoded, whose slots are left as
+  padding.
+
+  Options:
+
+    * `:fit` - how an image with a different aspect ratio is fitted. `:stretch` resizes it to the slot size,
+      `:letterbox` resizes it to fit inside the slot, centered, and pads the rest, and `:crop` resizes it to cover the
+      slot and crops the overflow evenly on both sides. Defaults to `:stretch`.
+    * `:pad` - the value of padding samples, on the same `0..255` scale as pixels before `:scale` and `:bias` are
+      applied. Defaults to `0`.
+    * `:layout` - `:nhwc` (the default), or `:nchw` for one plane per channel and a `{n, channels, height, width}`
+      batch.
+    * `:type`, `:scale` and `:bias` - same as in `decode/2`. Pixels of every bit depth are first brought to the
+      `0..255` range, or to `0..65535` for `{:u, 16}`, and the type defaults to `{:u, 8}`.
+    * `:threads` - number of decoding threads, or `:auto` for one per core. Defaults to `:auto`.
+  """
+  @spec decode_into_batch(list(binary()), {pos_integer(), pos_integer(), pos_integer()}, keyword()) ::
+          {:ok, {Nx.Tensor.t(), list({:ok, {pos_integer(), pos_integer()}} | {:error, String.t()})}}
+          | {:error, String.t()}
+  def decode_into_batch(images, {height, width, channels}, options \\ [])
+      when is_list(images) and images != [] and is_integer(height) and height > 0 and is_integer(width) and
+             width > 0 and channels in [1, 3, 4] do
+    with {:ok, options} <-
+           Keyword.validate(options,
+             fit: :stretch,
+             pad: 0,
+             layout: :nhwc,
+             type: {:u, 8},
+             scale: nil,
+             bias: nil,
+             threads: :auto
+           ),
+         {:ok, fit} <- parse_fit(Keyword.get(options, :fit)),
+         {:ok, planar} <- parse_batch_layout(Keyword.get(options, :layout)),
+         {:ok, type} <- parse_output_type(Keyword.get(options, :type)),
+         {:ok, scale} <- parse_per_channel(:scale, Keyword.get(options, :scale)),
+         {:ok, scale} <- per_channel(:scale, scale, 1.0, channels),
+         {:ok, bias} <- parse_per_channel(:bias, Keyword.get(options, :bias)),
+         {:ok, bias} <- per_channel(:bias, bias, 0.0, channels),
+         {:ok, pad} <- parse_pad(Keyword.get(options, :pad)),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)),
+         {:ok, {batch, results}} <-
+           Imagex.C.decompress_into_batch(
+             images,
+             threads,
+             height,
+             width,
+             channels,
+             fit,
+             pad,
+             planar,
+             pixel_type_id(type),
+             scale,
+             bias
+           ) do
+      shape =
+        if planar,
+          do: {length(images), channels, height, width},
+          else: {length(images), height, width, channels}
+
+      {:ok, {Nx.from_binary(batch, type) |> Nx.reshape(shape), results}}
+    end
+  end
+
+  defp parse_fit(:stretch), do: {:ok, 0}
+  defp parse_fit(:letterbox), do: {:ok, 1}
+  defp parse_fit(:crop), do: {:ok, 2}
+  defp parse_fit(fit), do: {:error, "fit must be :stretch, :letterbox or :crop, got: #{inspect(fit)}"}
+
+  defp parse_batch_layout(:nhwc), do: {:ok, false}
+  defp parse_batch_layout(:nchw), do: {:ok, true}
+  defp parse_batch_layout(layout), do: {:error, "layout must be :nhwc or :nchw, got: #{inspect(layout)}"}
+
+  defp parse_pad(pad) when is_number(pad), do: {:ok, pad / 1}
+  defp parse_pad(pad), do: {:error, "pad must be a number, got: #{inspect(pad)}"}
+
+  @doc """
+  Reads the metadata of a JPEG, PNG, JXL or TIFF image without decoding any pixel data.
+
+  Returns a map with the image `:width` and `:height`, the raw `:exif_binary` (TIFF-structured EXIF payload), `:xmp`
+  and `:icc_profile` payloads, any `:png_chunks` / `:jxl_boxes`, and the most commonly used EXIF tags under `:tags`.
+  Values that aren't present in the image are `nil`.
+
+  Pass `parse_exif: true` to also run the full EXIF parser, which adds the same `:exif` map that `decode/2` returns.
+  """
+  @spec read_metadata(binary(), keyword()) :: {:ok, map()} | {:error, String.t()}
+  def read_metadata(bytes, options \\ []) do
+    with {:ok, options} <- Keyword.validate(options, parse_exif: false),
+         {:ok,
+          {width, height, exif_binary, xmp, icc_profile, png_texts, xml_boxes, jumb_boxes,
+           {orientation, make, model, software, date_time, date_time_original}}} <-
+           Imagex.C.read_metadata(bytes) do
+      metadata = %{
+        width: width,
+        height: height,
+        exif_binary: exif_binary,
+        xmp: xmp,
+        icc_profile: icc_profile,
+        tags: %{
+          orientation: orientation,
+          make: make,
+          model: model,
+          software: software,
+          date_time: date_time,
+          date_time_original: date_time_original
+        }
+      }
+
+      png_data = Imagex.Png.metadata_from_texts(png_texts) |> Map.take([:png_chunks])
+      jxl_data = (Imagex.Jxl.boxes_to_metadata({nil, xml_boxes, jumb_boxes}) || %{}) |> Map.take([:jxl_boxes])
+
+      exif_data =
+        if Keyword.get(options, :parse_exif) and is_binary(exif_binary) do
+          Imagex.Exif.read_exif_from_tiff(exif_binary)
+        else
+          %{}
         end
 
-      nil ->
-        {:error, "failed to decode"}
+      {:ok, metadata |> Map.merge(png_data) |> Map.merge(jxl_data) |> Map.merge(exif_data)}
     end
   end
 
   @dialyzer {:nowarn_function, open: 2}
 
-  @spec open(String.t(), keyword()) :: {:ok, Imagex.Image.t()} | {:error, String.t()}
+  @doc """
+  Opens and decodes the file at `path`, taking the same options as `decode/2`.
+
+  JPEG, PNG, JPEG XL, WebP, TIFF and PDF files are memory-mapped and decoded in place rather than read onto the BEAM
+  heap first. TIFF and PDF documents keep the mapping open until they are garbage collected, so the file must not be
+  truncated while they are in use.
+  """
+  @spec open(String.t(), keyword()) :: {:ok, Imagex.Image.t() | Imagex.Pdf.t() | Imagex.Tiff.t()} | {:error, String.t()}
   def open(path, options \\ []) when is_path(path) do
-    with {:ok, file_content} <- File.read(path),
-         {:ok, result} <- decode(file_content, options) do
-      {:ok, result}
-    else
-      error -> error
+    parse_metadata = Keyword.get(options, :parse_metadata, true)
+    crop = Keyword.get(options, :crop)
+    preview = Keyword.get(options, :preview)
+    into = Keyword.get(options, :into)
+
+    with {:ok, metadata} <- metadata_mask(parse_metadata),
+         {:ok, output} <- output_options(options),
+         :ok <- validate_preview(preview, options),
+         :ok <- validate_into(into, options, output),
+         {:ok, {file, detected_format}} <- Imagex.C.open_path(IO.chardata_to_string(path)) do
+      case Keyword.get_lazy(options, :format, fn -> mapped_format(detected_format) end) do
+        format when crop != nil and format not in [:jpeg, nil] ->
+          crop_unsupported(format)
+
+        format when preview != nil and format not in [:jpeg, :png, :jxl, :webp] ->
+          preview_unsupported(format)
+
+        format when output != nil and format in [:pdf, :tiff] ->
+          {:error, "layout, type, scale and bias are not supported for #{format} documents"}
+
+        _format when preview != nil ->
+          result = Imagex.Budget.run(fn -> Imagex.C.decompress_mapped_preview(file, preview) end)
+          to_tensor(result, parse_metadata, output)
+
+        format when into != nil and format in [:jpeg, :png, :jxl] ->
+          verify_checksums = Keyword.get(options, :verify_checksums, true)
+          keep_palette = Keyword.get(options, :keep_palette, false)
+
+          with {:ok, {x, y, width, height}} <- parse_crop(crop) do
+            %Imagex.PixelBuffer{ref: buffer} = into
+            format_id = mapped_format_id(format)
+
+            result =
+              Imagex.Budget.run(fn ->
+                Imagex.C.decompress_mapped_into(
+                  buffer,
+                  file,
+                  format_id,
+                  verify_checksums,
+                  keep_palette,
+                  x,
+                  y,
+                  width,
+                  height,
+                  metadata
+                )
+              end)
+
+            to_tensor(result, parse_metadata, nil)
+          end
+
+        format when into != nil ->
+          into_unsupported(format)
+
+        format when format in [:jpeg, :png, :jxl, :webp] ->
+          verify_checksums = Keyword.get(options, :verify_checksums, true)
+          keep_palette = Keyword.get(options, :keep_palette, false)
+
+          with {:ok, {x, y, width, height}} <- parse_crop(crop) do
+            format_id = mapped_format_id(format)
+            {planar, type_id, scale, bias} = native_output(output)
+
+            result =
+              Imagex.Budget.run(fn ->
+                Imagex.C.decompress_mapped(
+                  file,
+                  format_id,
+                  verify_checksums,
+                  keep_palette,
+                  x,
+                  y,
+                  width,
+                  height,
+                  metadata,
+                  planar,
+                  type_id,
+                  scale,
+                  bias
+                )
+              end)
+
+            to_tensor(result, parse_metadata, converted(output))
+          end
+
+        :pdf ->
+          case Imagex.C.pdf_load_mapped(file) do
+            {:ok, {ref, num_pages}} -> {:ok, %Imagex.Pdf{ref: ref, num_pages: num_pages}}
+            error -> error
+          end
+
+        :tiff ->
+          case Imagex.C.tiff_load_mapped(file) do
+            {:ok, {ref, num_pages}} -> {:ok, %Imagex.Tiff{ref: ref, num_pages: num_pages}}
+            error -> error
+          end
+
+        # the remaining formats are decoded in Elixir, from a binary
+        _ ->
+          with {:ok, file_content} <- File.read(path) do
+            decode(file_content, options)
+          end
+      end
     end
   end
 
@@ -208,9 +778,88 @@ defmodule Imagex do
     end
   end
 
+  # Validates a {x, y, width, height} crop region; nil is encoded as an empty region, which decodes the whole image
+  @doc false
+  def parse_crop(nil), do: {:ok, {0, 0, 0, 0}}
+
+  def parse_crop({x, y, width, height} = crop)
+      when is_integer(x) and is_integer(y) and is_integer(width) and is_integer(height) and x >= 0 and y >= 0 and
+             width > 0 and height > 0,
+      do: {:ok, crop}
+
+  def parse_crop(crop), do: {:error, "crop must be {x, y, width, height}, got: #{inspect(crop)}"}
+
+  @metadata_kinds %{exif: 1, xmp: 2, icc: 4, text: 8}
+
+  # Turns the :parse_metadata option into the bit mask of the kinds of metadata that the decode NIFs extract
+  # Converts parse_metadata into the mask of metadata kinds that the decoding NIFs take, shared with Imagex.Async
+  @doc false
+  def metadata_mask(true), do: {:ok, 0b11111}
+  def metadata_mask(false), do: {:ok, 0}
+
+  def metadata_mask(kinds) when is_list(kinds) do
+    Enum.reduce_while(kinds, {:ok, 0}, fn kind, {:ok, mask} ->
+      case Map.fetch(@metadata_kinds, kind) do
+        {:ok, bit} -> {:cont, {:ok, Bitwise.bor(mask, bit)}}
+        :error -> {:halt, invalid_parse_metadata(kinds)}
+      end
+    end)
+  end
+
+  def metadata_mask(parse_metadata), do: invalid_parse_metadata(parse_metadata)
+
+  defp invalid_parse_metadata(parse_metadata) do
+    kinds = ":exif, :xmp, :icc and :text"
+    {:error, "parse_metadata must be a boolean or a list of #{kinds}, got: #{inspect(parse_metadata)}"}
+  end
+
+  defp validate_preview(nil, _options), do: :ok
+
+  defp validate_preview(min_size, options) when is_integer(min_size) and min_size > 0 do
+    cond do
+      Keyword.get(options, :crop) != nil -> {:error, "preview cannot be combined with crop"}
+      Keyword.get(options, :cache, false) -> {:error, "preview cannot be combined with cache"}
+      true -> :ok
+    end
+  end
+
+  defp validate_preview(min_size, _options),
+    do: {:error, "preview must be a positive integer, got: #{inspect(min_size)}"}
+
+  defp validate_into(nil, _options, _output), do: :ok
+
+  defp validate_into(%Imagex.PixelBuffer{}, options, output) do
+    cond do
+      Keyword.get(options, :preview) != nil -> {:error, "into cannot be combined with preview"}
+      Keyword.get(options, :cache, false) -> {:error, "into cannot be combined with cache"}
+      output != nil -> {:error, "into cannot be combined with layout, type, scale and bias"}
+      true -> :ok
+    end
+  end
+
+  defp validate_into(into, _options, _output),
+    do: {:error, "into must be an Imagex.PixelBuffer, got: #{inspect(into)}"}
+
+  defp into_unsupported(format),
+    do: {:error, "into is only supported for JPEG, PNG and JPEG XL images, got: #{inspect(format)}"}
+
+  defp preview_unsupported(format),
+    do: {:error, "preview is only supported for JPEG, PNG, JPEG XL and WebP images, got: #{inspect(format)}"}
+
+  defp crop_unsupported(:tiff),
+    do: {:error, "crop is not supported when opening TIFF documents, use Imagex.Tiff.render_page/3"}
+  defp crop_unsupported(format), do: {:error, "crop is only supported for JPEG images, got: #{inspect(format)}"}
+
+  # Converts a raw decoder result tuple into an Imagex.Image, shared with Imagex.Async
+  @doc false
+  def decoded_to_image(result, parse_metadata), do: to_tensor(result, parse_metadata, nil)
+
   defp to_tensor(
-         {:ok, {pixels, width, height, channels, bit_depth, exif_binary, png_texts, xml_boxes, jumb_boxes}},
-         parse_metadata
+         {:ok,
+          {pixels, width, height, channels, bit_depth, exif_binary, png_texts, xml_boxes, jumb_boxes, palette, xmp,
+           icc_profile, app0_segments}},
+         parse_metadata,
+         output
        ) do
     metadata =
       if parse_metadata do
@@ -223,29 +872,163 @@ defmodule Imagex do
 
         png_data = Imagex.Png.metadata_from_texts(png_texts)
         jxl_data = Imagex.Jxl.boxes_to_metadata({nil, xml_boxes, jumb_boxes}) || %{}
+        jfif_data = Imagex.Jfif.metadata_from_app0_segments(app0_segments) || %{}
+        xmp_data = if is_binary(xmp), do: %{xmp: xmp}, else: %{}
+        icc_data = if is_binary(icc_profile), do: %{icc_profile: icc_profile}, else: %{}
+
+        metadata =
+          jfif_data
+          |> Map.merge(exif_data)
+          |> Map.merge(xmp_data)
+          |> Map.merge(icc_data)
+          |> Map.merge(png_data)
+          |> Map.merge(jxl_data)
 
-        metadata = exif_data |> Map.merge(png_data) |> Map.merge(jxl_data)
         if metadata == %{}, do: nil, else: metadata
       else
         nil
       end
 
+    with {:ok, tensor} <- pixels_to_tensor(pixels, {height, width, channels}, bit_depth, palette, output) do
+      {:ok, %Imagex.Image{tensor: tensor, metadata: metadata, palette: palette_to_tensor(palette)}}
+    end
+  end
+
+  defp to_tensor({:error, _error_msg} = error, _parse_metadata, _output) do
+    error
+  end
+
+  defp pixels_to_tensor(pixels, {height, width, channels}, bit_depth, _palette, nil) do
     shape = if channels == 1, do: {height, width}, else: {height, width, channels}
+    {:ok, Nx.from_binary(pixels, bit_depth_type(bit_depth)) |> Nx.reshape(shape)}
+  end
+
+  defp pixels_to_tensor(_pixels, _shape, _bit_depth, {_entries, _channels}, _output),
+    do: {:error, "layout, type, scale and bias cannot be combined with keep_palette: true"}
+
+  # pixels that the native decoder already converted as it decoded them
+  defp pixels_to_tensor(pixels, shape, bit_depth, nil, {:converted, layout, type}) do
+    type = type || bit_depth_type(bit_depth)
+    {:ok, Nx.from_binary(pixels, type) |> Nx.reshape(output_shape(layout, shape))}
+  end
+
+  defp pixels_to_tensor(pixels, {_height, _width, channels} = shape, bit_depth, nil, {layout, type, scale, bias}) do
+    type = type || bit_depth_type(bit_depth)
+
+    with {:ok, scale} <- per_channel(:scale, scale, 1.0, channels),
+         {:ok, bias} <- per_channel(:bias, bias, 0.0, channels),
+         {:ok, converted} <-
+           Imagex.C.convert_pixels(pixels, channels, bit_depth, layout == :chw, pixel_type_id(type), scale, bias) do
+      {:ok, Nx.from_binary(converted, type) |> Nx.reshape(output_shape(layout, shape))}
+    end
+  end
+
+  defp output_shape(:chw, {height, width, channels}), do: {channels, height, width}
+  defp output_shape(_layout, {height, width, 1}), do: {height, width}
+  defp output_shape(_layout, shape), do: shape
+
+  defp bit_depth_type(8), do: {:u, 8}
+  defp bit_depth_type(16), do: {:u, 16}
+  defp bit_depth_type(32), do: {:f, 32}
+
+  # Applies the output options to an image decoded in Elixir
+  defp convert_output(result, nil), do: result
 
-    type =
-      case bit_depth do
-        8 -> {:u, 8}
-        16 -> {:u, 16}
-        32 -> {:f, 32}
+  defp convert_output({:ok, %Image{tensor: tensor} = image}, output) do
+    {height, width, channels} =
+      case Nx.shape(tensor) do
+        {height, width} -> {height, width, 1}
+        shape -> shape
       end
 
-    tensor = Nx.from_binary(pixels, type) |> Nx.reshape(shape)
-    image = %Imagex.Image{tensor: tensor, metadata: metadata}
-    {:ok, image}
+    {_, bits} = Nx.type(tensor)
+    pixels = Nx.to_binary(tensor)
+
+    with {:ok, tensor} <- pixels_to_tensor(pixels, {height, width, channels}, bits, nil, output) do
+      {:ok, %Image{image | tensor: tensor}}
+    end
+  end
+
+  defp convert_output(error, _output), do: error
+
+  # Parses the options that change the layout, type and scale of decoded pixels, into nil when they are all defaults
+  defp output_options(options) do
+    layout = Keyword.get(options, :layout, :hwc)
+    type = Keyword.get(options, :type)
+    scale = Keyword.get(options, :scale)
+    bias = Keyword.get(options, :bias)
+
+    cond do
+      layout not in [:hwc, :chw] ->
+        {:error, "layout must be :hwc or :chw, got: #{inspect(layout)}"}
+
+      layout == :hwc and type == nil and scale == nil and bias == nil ->
+        {:ok, nil}
+
+      true ->
+        with {:ok, _type} <- parse_output_type(type || {:u, 8}),
+             {:ok, scale} <- parse_per_channel(:scale, scale),
+             {:ok, bias} <- parse_per_channel(:bias, bias) do
+          {:ok, {layout, type, scale, bias}}
+        end
+    end
   end
 
-  defp to_tensor({:error, _error_msg} = output, _parse_metadata) do
-    output
+  defp parse_output_type(type) when type in [{:u, 8}, {:u, 16}, {:f, 16}, {:f, 32}], do: {:ok, type}
+
+  defp parse_output_type(type),
+    do: {:error, "type must be one of {:u, 8}, {:u, 16}, {:f, 16} and {:f, 32}, got: #{inspect(type)}"}
+
+  defp parse_per_channel(_name, value) when is_nil(value) or is_number(value), do: {:ok, value}
+
+  defp parse_per_channel(name, values) when is_list(values) and values != [] do
+    if Enum.all?(values, &is_number/1), do: {:ok, values}, else: per_channel_error(name, values)
+  end
+
+  defp parse_per_channel(name, value), do: per_channel_error(name, value)
+
+  defp per_channel_error(name, value),
+    do: {:error, "#{name} must be a number or a list of numbers, got: #{inspect(value)}"}
+
+  # The output options as the native decoders take them: planar or not, a pixel_type value or -1 for the decoded type,
+  # and the scale and bias as one value per channel, one value for all channels, or none for the defaults
+  defp native_output(nil), do: {false, -1, [], []}
+
+  defp native_output({layout, type, scale, bias}) do
+    type_id = if type, do: pixel_type_id(type), else: -1
+    {layout == :chw, type_id, native_per_channel(scale), native_per_channel(bias)}
+  end
+
+  defp native_per_channel(nil), do: []
+  defp native_per_channel(value) when is_number(value), do: [value / 1]
+  defp native_per_channel(values), do: Enum.map(values, &(&1 / 1))
+
+  # The output options of a result that the native decoder converted, which only decide the tensor type and shape
+  defp converted(nil), do: nil
+  defp converted({layout, type, _scale, _bias}), do: {:converted, layout, type}
+
+  # Expands a value parsed by parse_per_channel to one float per channel
+  defp per_channel(_name, nil, default, channels), do: {:ok, List.duplicate(default, channels)}
+
+  defp per_channel(_name, value, _default, channels) when is_number(value),
+    do: {:ok, List.duplicate(value / 1, channels)}
+
+  defp per_channel(_name, values, _default, channels) when length(values) == channels,
+    do: {:ok, Enum.map(values, &(&1 / 1))}
+
+  defp per_channel(name, values, _default, channels),
+    do: {:error, "#{name} has #{length(values)} values but the image has #{channels} channels"}
+
+  # pixel_type values on the native side
+  defp pixel_type_id({:u, 8}), do: 0
+  defp pixel_type_id({:u, 16}), do: 1
+  defp pixel_type_id({:f, 16}), do: 2
+  defp pixel_type_id({:f, 32}), do: 3
+
+  defp palette_to_tensor(nil), do: nil
+
+  defp palette_to_tensor({entries, channels}) do
+    Nx.from_binary(entries, {:u, 8}) |> Nx.reshape({div(byte_size(entries), channels), channels})
   end
 
   defp exif_binary_from_metadata(nil), do: {:ok, nil}
@@ -274,21 +1057,54 @@ defmodule Imagex do
   defp xmp_binary_from_metadata(metadata),
     do: {:error, "image metadata must be a map or nil, got: #{inspect(metadata)}"}
 
+  defp icc_profile_from_metadata(nil), do: {:ok, nil}
+
+  defp icc_profile_from_metadata(metadata) when is_map(metadata) do
+    case Map.get(metadata, :icc_profile) do
+      nil -> {:ok, nil}
+      icc_profile when is_binary(icc_profile) -> {:ok, icc_profile}
+      icc_profile -> {:error, "ICC profile must be a binary, got: #{inspect(icc_profile)}"}
+    end
+  end
+
+  defp icc_profile_from_metadata(metadata),
+    do: {:error, "image metadata must be a map or nil, got: #{inspect(metadata)}"}
+
   defp parse_jxl_distance(0, false), do: {:error, "JXL distance 0 requires lossless: true"}
 
   defp parse_jxl_distance(value, _lossless) when 0 <= value and value <= 15 do
     {:ok, value + 0.0}
   end
 
-  defp standardize_shape({h, w}), do: {h, w, 1}
-  defp standardize_shape({_h, _w, _c} = shape), do: shape
+  # format ids of the native image_format enum, as returned by Imagex.C.open_path/1
+  defp mapped_format(1), do: :jpeg
+  defp mapped_format(2), do: :png
+  defp mapped_format(3), do: :jxl
+  defp mapped_format(4), do: :bmp
+  defp mapped_format(5), do: :ppm
+  defp mapped_format(6), do: :tiff
+  defp mapped_format(7), do: :pdf
+  defp mapped_format(8), do: :webp
+  defp mapped_format(_), do: nil
+
+  defp mapped_format_id(:jpeg), do: 1
+  defp mapped_format_id(:png), do: 2
+  defp mapped_format_id(:jxl), do: 3
+  defp mapped_format_id(:webp), do: 8
+
+  # The {height, width, channels} of an image tensor and the bit depth of its samples, shared with Imagex.Async
+  @doc false
+  def standardize_shape({h, w}), do: {h, w, 1}
+  def standardize_shape({_h, _w, _c} = shape), do: shape
 
-  defp get_bit_depth(%Nx.Tensor{type: {:u, bit_depth}}), do: bit_depth
+  @doc false
+  def get_bit_depth(%Nx.Tensor{type: {:u, bit_depth}}), do: bit_depth
 
   defp ext_to_format(".jpeg"), do: :jpeg
   defp ext_to_format(".jpg"), do: :jpeg
   defp ext_to_format(".png"), do: :png
   defp ext_to_format(".jxl"), do: :jxl
+  defp ext_to_format(".webp"), do: :webp
   defp ext_to_format(".pgm"), do: :ppm
   defp ext_to_format(".ppm"), do: :ppm
   defp ext_to_format(".bmp"), do: :bmp
@@ -0,0 +1,10 @@
+defmodule Imagex.Application do
+  @moduledoc false
+
+  use Application
+
+  @impl true
+  def start(_type, _args) do
+    Supervisor.start_link([Imagex.Budget], strategy: :one_for_one, name: Imagex.Supervisor)
+  end
+end
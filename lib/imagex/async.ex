@@ -0,0 +1,148 @@
+defmodule Imagex.Async do
+  @moduledoc """
+  Runs decoding, JXL encoding and PDF rendering on a thread pool owned by imagex instead of a dirty scheduler.
+
+  Each call returns a job right away; the result is sent to the calling process as a message once a worker thread has
+  finished, and `await/2` waits for it. Jobs are queued by priority (`:high`, `:normal` or `:low`) and the queue is
+  bounded, so submitting to a full queue returns an error instead of piling up work.
+
+  The job monitors the calling process, and is dropped from the queue if that process exits before a worker has started
+  on it, so abandoned requests neither occupy a worker nor count toward the bound of the queue.
+  """
+
+  @enforce_keys [:ref, :handle, :finish, :start, :priority]
+  defstruct [:ref, :handle, :finish, :start, :priority]
+
+  @type t :: %__MODULE__{
+          ref: reference(),
+          handle: reference(),
+          finish: (term() -> term()),
+          start: (reference(), non_neg_integer(), boolean() -> {:ok, reference()} | {:error, String.t()}),
+          priority: non_neg_integer()
+        }
+
+  @doc """
+  Starts decoding a JPEG, PNG, JXL or WebP image.
+
+  Options:
+
+    * `:priority` - `:high`, `:normal` or `:low`. Defaults to `:normal`.
+    * `:parse_metadata` - same as in `Imagex.decode/2`. Defaults to `true`.
+  """
+  @spec decode(binary(), keyword()) :: {:ok, t()} | {:error, String.t()}
+  def decode(bytes, options \\ []) when is_binary(bytes) do
+    with {:ok, options} <- Keyword.validate(options, priority: :normal, parse_metadata: true),
+         parse_metadata = Keyword.get(options, :parse_metadata),
+         {:ok, metadata} <- Imagex.metadata_mask(parse_metadata) do
+      submit(Keyword.get(options, :priority), &Imagex.decoded_to_image(&1, parse_metadata), fn ref, priority, retry ->
+        Imagex.C.decompress_async(ref, priority, bytes, metadata, retry)
+      end)
+    end
+  end
+
+  @doc """
+  Starts encoding an image. Only `:jxl` is supported; options are the same as in `Imagex.encode/3`, plus `:priority`.
+  """
+  @spec encode(Nx.Tensor.t() | Imagex.Image.t(), :jxl, keyword()) :: {:ok, t()} | {:error, String.t()}
+  def encode(image, format, options \\ [])
+
+  def encode(%Imagex.Image{tensor: tensor, metadata: metadata}, :jxl, options) do
+    encode(tensor, :jxl, Keyword.put_new(options, :metadata, metadata))
+  end
+
+  def encode(%Nx.Tensor{} = tensor, :jxl, options) do
+    {priority, options} = Keyword.pop(options, :priority, :normal)
+
+    with {:ok, jxl} <- Imagex.jxl_compress_options(options) do
+      pixels = Nx.to_binary(tensor)
+      {h, w, c} = Imagex.standardize_shape(tensor.shape)
+      bit_depth = Imagex.get_bit_depth(tensor)
+
+      submit(priority, & &1, fn ref, priority, _retry ->
+        Imagex.C.jxl_compress_async(
+          ref,
+          priority,
+          pixels,
+          w,
+          h,
+          c,
+          bit_depth,
+          jxl.exif_binary,
+          jxl.boxes,
+          jxl.distance,
+          jxl.lossless,
+          jxl.effort,
+          jxl.progressive,
+          jxl.order
+        )
+      end)
+    end
+  end
+
+  @doc """
+  Starts rendering a page of a PDF document.
+
+  Options:
+
+    * `:dpi` - rendering resolution. Defaults to 72.
+    * `:priority` - `:high`, `:normal` or `:low`. Defaults to `:normal`.
+  """
+  @spec render_page(Imagex.Pdf.t(), non_neg_integer(), keyword()) :: {:ok, t()} | {:error, String.t()}
+  def render_page(%Imagex.Pdf{ref: ref, num_pages: num_pages}, page_idx, options \\ [])
+      when page_idx >= 0 and page_idx < num_pages do
+    with {:ok, options} <- Keyword.validate(options, dpi: 72, priority: :normal) do
+      dpi = Keyword.get(options, :dpi)
+
+      submit(Keyword.get(options, :priority), &Imagex.Pdf.rendered_to_image/1, fn reply_ref, priority, retry ->
+        Imagex.C.pdf_render_page_async(reply_ref, priority, ref, page_idx, dpi, retry)
+      end)
+    end
+  end
+
+  @doc """
+  Waits for a job to finish and returns its result, in the same shape as the synchronous call would.
+
+  Returns `{:error, :timeout}` if no result arrives within `timeout` milliseconds; the job keeps running and can be
+  awaited again. A job that `Imagex.Budget` turned away is submitted again once it has waited its turn for the budget,
+  which the timeout doesn't cover.
+  """
+  @spec await(t(), timeout()) :: term()
+  def await(%__MODULE__{ref: ref, finish: finish} = job, timeout \\ :infinity) do
+    receive do
+      {^ref, result} -> result |> Imagex.Budget.retry_busy(fn -> rerun(job) end) |> finish.()
+    after
+      timeout -> {:error, :timeout}
+    end
+  end
+
+  defp submit(priority, finish, start) do
+    with {:ok, priority} <- parse_priority(priority) do
+      ref = make_ref()
+
+      case start.(ref, priority, false) do
+        {:ok, handle} -> {:ok, %__MODULE__{ref: ref, handle: handle, finish: finish, start: start, priority: priority}}
+        error -> error
+      end
+    end
+  end
+
+  # the job runs again in the turn that Imagex.Budget gave it, ahead of the decodes still queued there
+  defp rerun(%__MODULE__{start: start, priority: priority}) do
+    ref = make_ref()
+
+    case start.(ref, priority, true) do
+      {:ok, _handle} ->
+        receive do
+          {^ref, result} -> result
+        end
+
+      error ->
+        error
+    end
+  end
+
+  defp parse_priority(:high), do: {:ok, 0}
+  defp parse_priority(:normal), do: {:ok, 1}
+  defp parse_priority(:low), do: {:ok, 2}
+  defp parse_priority(priority), do: {:error, "priority must be :high, :normal or :low, got: #{inspect(priority)}"}
+end
@@ -0,0 +1,293 @@
+defmodule Imagex.Budget do
+  @moduledoc """
+  Admission control for decoding, so that a burst of large images queues up instead of pushing the node into swap.
+
+  Every decode reserves the size of its pixels natively, right after reading the header and before allocating them,
+  and gives it back when it returns. Then:
+
+    * an image with more than `:max_pixels` pixels fails with `{:error, "image exceeds the pixel budget"}`, and one
+      whose pixels alone are more than `:max_bytes` with `{:error, "image exceeds the memory budget"}`;
+    * once the decodes in flight hold `:max_bytes`, later ones wait for them in FIFO order, or fail right away with
+      `{:error, "memory budget exhausted"}` when `when_exhausted: :reject`. A decode that waits longer than
+      `:queue_timeout` fails with `{:error, "timed out waiting for the memory budget"}`.
+
+  The budget covers JPEG, PNG, JPEG XL and WebP decodes, including batches, previews, `Imagex.Async` jobs and
+  `Imagex.Decoder`, whose reservation is held until `Imagex.Decoder.finish/2`, as well as TIFF and PDF page renders.
+  Decodes into an `Imagex.PixelBuffer` are held to the limits too, and the buffer reserves its memory whenever it
+  allocates it, for as long as the buffer or a tensor decoded into it refers to it.
+
+  Nothing waits natively: a decode that doesn't fit returns, and the calling process waits in the queue of this
+  server, which runs it again once enough of the budget has been released. While decodes are queued, later ones are
+  turned away natively too, except for the one whose turn it is, so none can take the budget ahead of them. The images
+  of a batch and the pushes of an `Imagex.Decoder` can't be run again on their own, so they fail with
+  `{:error, "memory budget exhausted"}` instead of waiting. The budget is shared by the whole VM and starts out
+  unlimited.
+  """
+
+  use GenServer
+
+  # returned by the NIFs when a decode doesn't fit in what is left of the budget
+  @busy "decode budget busy"
+
+  @type stats :: %{
+          bytes_in_use: non_neg_integer(),
+          waiting: non_neg_integer(),
+          admitted: non_neg_integer(),
+          queued: non_neg_integer(),
+          rejected: non_neg_integer(),
+          max_pixels: non_neg_integer(),
+          max_bytes: non_neg_integer()
+        }
+
+  @doc false
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(_options) do
+    GenServer.start_link(__MODULE__, nil, name: __MODULE__)
+  end
+
+  @doc """
+  Configures the budget. Options that aren't given go back to their defaults.
+
+  Options:
+
+    * `:max_pixels` - the largest number of pixels a decode may produce. `0`, the default, is no limit.
+    * `:max_bytes` - the most bytes of pixels that decodes may hold at once. `0`, the default, is no limit.
+    * `:when_exhausted` - `:queue` (the default) to wait for the budget, or `:reject` to fail right away.
+    * `:queue_timeout` - how long to wait for the budget, in milliseconds, or `:infinity` (the default).
+  """
+  @spec configure(keyword()) :: :ok | {:error, String.t()}
+  def configure(options) do
+    with {:ok, options} <-
+           Keyword.validate(options, max_pixels: 0, max_bytes: 0, when_exhausted: :queue, queue_timeout: :infinity),
+         {:ok, max_pixels} <- parse_limit(options, :max_pixels),
+         {:ok, max_bytes} <- parse_limit(options, :max_bytes),
+         {:ok, reject} <- parse_when_exhausted(Keyword.get(options, :when_exhausted)),
+         {:ok, queue_timeout} <- parse_queue_timeout(Keyword.get(options, :queue_timeout)) do
+      Imagex.C.decode_budget_configure(max_pixels, max_bytes, reject)
+      GenServer.call(__MODULE__, {:configure, queue_timeout})
+    end
+  end
+
+  @doc """
+  Returns the bytes held by decodes in flight and the number of decodes waiting for the budget, the number of decodes
+  admitted, made to wait and rejected since the VM started, and the limits.
+  """
+  @spec stats() :: stats()
+  def stats do
+    {bytes_in_use, admitted, rejected, max_pixels, max_bytes} = Imagex.C.decode_budget_stats()
+    %{waiting: waiting, queued: queued, timed_out: timed_out} = GenServer.call(__MODULE__, :stats)
+
+    %{
+      bytes_in_use: bytes_in_use,
+      waiting: waiting,
+      admitted: admitted,
+      queued: queued,
+      rejected: rejected + timed_out,
+      max_pixels: max_pixels,
+      max_bytes: max_bytes
+    }
+  end
+
+  # Calls decode, which runs a decoding NIF, and runs it again in its turn while the budget turns it away as busy. It
+  # joins the queue right away when decodes are waiting there.
+  @doc false
+  @spec run((-> result)) :: result when result: term()
+  def run(decode) do
+    if Imagex.C.decode_budget_queued(), do: retry_busy({:error, @busy}, decode), else: retry_busy(decode.(), decode)
+  end
+
+  # Returns result, unless it is the busy error of a decode, which is then run again with decode in its turn.
+  @doc false
+  @spec retry_busy(result, (-> result)) :: result when result: term()
+  def retry_busy({:error, @busy}, decode), do: retry(decode, GenServer.call(__MODULE__, :wait, :infinity))
+  def retry_busy(result, _decode), do: result
+
+  defp retry(decode, :ok) do
+    result =
+      try do
+        decode.()
+      catch
+        kind, reason ->
+          GenServer.cast(__MODULE__, {:done, self()})
+          :erlang.raise(kind, reason, __STACKTRACE__)
+      end
+
+    case result do
+      {:error, @busy} ->
+        retry(decode, GenServer.call(__MODULE__, :still_busy, :infinity))
+
+      result ->
+        GenServer.cast(__MODULE__, {:done, self()})
+        result
+    end
+  end
+
+  defp retry(_decode, error), do: error
+
+  # The waiting decodes are queued here, oldest first, and run one at a time: the first one is let go as soon as it
+  # joins an empty queue, and then whenever a reservation is released while none is running. One that is still busy
+  # goes back to the front, and one that fits lets the next one go, which may fit in what is left.
+  @impl true
+  def init(nil) do
+    {:ok,
+     %{
+       waiting: :queue.new(),
+       running: nil,
+       released: false,
+       listening: false,
+       queue_timeout: :infinity,
+       queued: 0,
+       timed_out: 0
+     }}
+  end
+
+  @impl true
+  def handle_call({:configure, queue_timeout}, _from, state) do
+    # the new limits may let the first decode in
+    {:reply, :ok, %{state | queue_timeout: queue_timeout} |> released()}
+  end
+
+  def handle_call(:stats, _from, state) do
+    running = if state.running == nil, do: 0, else: 1
+    stats = %{waiting: :queue.len(state.waiting) + running, queued: state.queued, timed_out: state.timed_out}
+    {:reply, stats, state}
+  end
+
+  def handle_call(:wait, {pid, _} = from, state) do
+    monitor = Process.monitor(pid)
+
+    timer =
+      if state.queue_timeout != :infinity,
+        do: Process.send_after(self(), {:queue_timeout, monitor}, state.queue_timeout)
+
+    waiter = %{from: from, monitor: monitor, timer: timer, timed_out: false}
+    {:noreply, %{state | waiting: :queue.in(waiter, state.waiting), queued: state.queued + 1} |> listen()}
+  end
+
+  def handle_call(:still_busy, from, %{running: %{timed_out: true} = waiter} = state) do
+    GenServer.reply(from, timed_out_error())
+    forget(waiter)
+    {:noreply, %{state | running: nil, timed_out: state.timed_out + 1} |> next_if_released() |> listen()}
+  end
+
+  def handle_call(:still_busy, from, %{running: waiter} = state) when waiter != nil do
+    waiting = :queue.in_r(%{waiter | from: from}, state.waiting)
+    {:noreply, %{state | waiting: waiting, running: nil} |> listen() |> next_if_released()}
+  end
+
+  @impl true
+  def handle_cast({:done, pid}, %{running: %{from: {pid, _}} = waiter} = state) do
+    forget(waiter)
+    {:noreply, %{state | running: nil} |> next() |> listen()}
+  end
+
+  def handle_cast({:done, _pid}, state), do: {:noreply, state}
+
+  @impl true
+  def handle_info(:decode_budget_released, state) do
+    {:noreply, released(state)}
+  end
+
+  def handle_info({:queue_timeout, monitor}, %{running: %{monitor: monitor} = waiter} = state) do
+    # it is told once it is found to be still busy
+    {:noreply, %{state | running: %{waiter | timed_out: true}}}
+  end
+
+  def handle_info({:queue_timeout, monitor}, state) do
+    case take_waiter(state.waiting, monitor) do
+      {waiter, waiting} ->
+        GenServer.reply(waiter.from, timed_out_error())
+        Process.demonitor(monitor, [:flush])
+        {:noreply, %{state | waiting: waiting, timed_out: state.timed_out + 1} |> listen()}
+
+      nil ->
+        {:noreply, state}
+    end
+  end
+
+  def handle_info({:DOWN, monitor, :process, _pid, _reason}, %{running: %{monitor: monitor} = waiter} = state) do
+    cancel_timer(waiter)
+    {:noreply, %{state | running: nil} |> next() |> listen()}
+  end
+
+  def handle_info({:DOWN, monitor, :process, _pid, _reason}, state) do
+    case take_waiter(state.waiting, monitor) do
+      {waiter, waiting} ->
+        cancel_timer(waiter)
+        {:noreply, %{state | waiting: waiting} |> listen()}
+
+      nil ->
+        {:noreply, state}
+    end
+  end
+
+  defp released(%{running: nil} = state), do: next(state)
+  defp released(state), do: %{state | released: true}
+
+  # a release while the running decode was being run may have left room for it
+  defp next_if_released(%{released: true} = state), do: next(state)
+  defp next_if_released(state), do: state
+
+  # the native budget opens the turn before the decode is let go, so it isn't turned away as behind the queue
+  defp next(%{running: nil} = state) do
+    case :queue.out(state.waiting) do
+      {{:value, waiter}, waiting} ->
+        state = listen(%{state | waiting: waiting, running: waiter, released: false})
+        GenServer.reply(waiter.from, :ok)
+        state
+
+      {:empty, _} ->
+        state
+    end
+  end
+
+  defp next(state), do: state
+
+  # Tells the native budget how many decodes are queued, counting the running one, and whether it has its turn, and
+  # has releases sent here while decodes are waiting. The first decode is let go once listening starts, as the
+  # releases since it was turned away went unnoticed.
+  defp listen(state) do
+    running = state.running != nil
+    waiting = :queue.len(state.waiting) + if(running, do: 1, else: 0)
+    active = waiting > 0
+    ^active = Imagex.C.decode_budget_queue(if(active, do: self()), waiting, running)
+
+    if active and not state.listening, do: next(%{state | listening: true}), else: %{state | listening: active}
+  end
+
+  defp take_waiter(waiting, monitor) do
+    case Enum.split_with(:queue.to_list(waiting), &(&1.monitor == monitor)) do
+      {[waiter], rest} -> {waiter, :queue.from_list(rest)}
+      {[], _} -> nil
+    end
+  end
+
+  defp forget(waiter) do
+    cancel_timer(waiter)
+    Process.demonitor(waiter.monitor, [:flush])
+  end
+
+  defp cancel_timer(%{timer: nil}), do: :ok
+  defp cancel_timer(%{timer: timer}), do: Process.cancel_timer(timer)
+
+  defp timed_out_error, do: {:error, "timed out waiting for the memory budget"}
+
+  defp parse_limit(options, key) do
+    case Keyword.get(options, key) do
+      limit when is_integer(limit) and limit >= 0 -> {:ok, limit}
+      limit -> {:error, "#{key} must be a non-negative integer, got: #{inspect(limit)}"}
+    end
+  end
+
+  defp parse_when_exhausted(:queue), do: {:ok, false}
+  defp parse_when_exhausted(:reject), do: {:ok, true}
+
+  defp parse_when_exhausted(when_exhausted),
+    do: {:error, "when_exhausted must be :queue or :reject, got: #{inspect(when_exhausted)}"}
+
+  defp parse_queue_timeout(:infinity), do: {:ok, :infinity}
+  defp parse_queue_timeout(timeout) when is_integer(timeout) and timeout > 0, do: {:ok, timeout}
+
+  defp parse_queue_timeout(timeout),
+    do: {:error, "queue_timeout must be a positive integer or :infinity, got: #{inspect(timeout)}"}
+end
@@ -2,39 +2,184 @@ defmodule Imagex.C do
   use Expp, path: Application.app_dir(:imagex, "priv/imagex")
 
   # Dialyzer suppressions for NIF stub functions that call exit()
-  @dialyzer {:nowarn_function, jpeg_decompress: 1}
-  @dialyzer {:nowarn_function, jpeg_compress: 7}
-  @dialyzer {:nowarn_function, png_decompress: 1}
-  @dialyzer {:nowarn_function, png_compress: 6}
-  @dialyzer {:nowarn_function, jxl_decompress: 1}
+  @dialyzer {:nowarn_function, jpeg_decompress: 10}
+  @dialyzer {:nowarn_function, jpeg_compress: 14}
+  @dialyzer {:nowarn_function, jpeg_compress_to_size: 14}
+  @dialyzer {:nowarn_function, png_decompress: 8}
+  @dialyzer {:nowarn_function, png_compress: 10}
+  @dialyzer {:nowarn_function, jxl_decompress: 6}
   @dialyzer {:nowarn_function, jxl_compress: 12}
+  @dialyzer {:nowarn_function, jxl_compress_to_size: 11}
   @dialyzer {:nowarn_function, jxl_transcode_from_jpeg: 3}
   @dialyzer {:nowarn_function, jxl_transcode_to_jpeg: 1}
+  @dialyzer {:nowarn_function, webp_decompress: 6}
+  @dialyzer {:nowarn_function, webp_compress: 11}
   @dialyzer {:nowarn_function, pdf_load_document: 1}
   @dialyzer {:nowarn_function, pdf_render_page: 3}
   @dialyzer {:nowarn_function, tiff_load_document: 1}
-  @dialyzer {:nowarn_function, tiff_render_page: 2}
+  @dialyzer {:nowarn_function, tiff_render_page: 6}
+  @dialyzer {:nowarn_function, tiff_page_size: 2}
+  @dialyzer {:nowarn_function, read_metadata: 1}
+  @dialyzer {:nowarn_function, jpeg_transform: 8}
+  @dialyzer {:nowarn_function, decompress_batch: 7}
+  @dialyzer {:nowarn_function, convert_pixels: 7}
+  @dialyzer {:nowarn_function, decompress_into_batch: 11}
+  @dialyzer {:nowarn_function, image_hash: 1}
+  @dialyzer {:nowarn_function, image_hash_batch: 2}
+  @dialyzer {:nowarn_function, pixels_hash: 5}
+  @dialyzer {:nowarn_function, image_quality: 9}
+  @dialyzer {:nowarn_function, decompress_cached: 8}
+  @dialyzer {:nowarn_function, decode_cache_configure: 1}
+  @dialyzer {:nowarn_function, decode_cache_clear: 0}
+  @dialyzer {:nowarn_function, decode_cache_stats: 0}
+  @dialyzer {:nowarn_function, decode_budget_configure: 3}
+  @dialyzer {:nowarn_function, decode_budget_stats: 0}
+  @dialyzer {:nowarn_function, decode_budget_queue: 3}
+  @dialyzer {:nowarn_function, decode_budget_queued: 0}
+  @dialyzer {:nowarn_function, pixel_buffer_new: 1}
+  @dialyzer {:nowarn_function, pixel_buffer_capacity: 1}
+  @dialyzer {:nowarn_function, decompress_into: 10}
+  @dialyzer {:nowarn_function, decompress_mapped_into: 10}
+  @dialyzer {:nowarn_function, tiff_render_page_into: 7}
+  @dialyzer {:nowarn_function, decompress_async: 5}
+  @dialyzer {:nowarn_function, jxl_compress_async: 14}
+  @dialyzer {:nowarn_function, pdf_render_page_async: 6}
+  @dialyzer {:nowarn_function, decoder_new: 3}
+  @dialyzer {:nowarn_function, decoder_push: 2}
+  @dialyzer {:nowarn_function, decoder_finish: 1}
+  @dialyzer {:nowarn_function, jpeg_encoder_new: 12}
+  @dialyzer {:nowarn_function, png_encoder_new: 8}
+  @dialyzer {:nowarn_function, encoder_push: 2}
+  @dialyzer {:nowarn_function, encoder_finish: 1}
+  @dialyzer {:nowarn_function, pyramid_new: 9}
+  @dialyzer {:nowarn_function, pyramid_open_jpeg: 7}
+  @dialyzer {:nowarn_function, pyramid_push: 2}
+  @dialyzer {:nowarn_function, pyramid_read: 2}
+  @dialyzer {:nowarn_function, pyramid_finish: 1}
+  @dialyzer {:nowarn_function, open_path: 1}
+  @dialyzer {:nowarn_function, decompress_mapped: 13}
+  @dialyzer {:nowarn_function, decompress_preview: 2}
+  @dialyzer {:nowarn_function, decompress_mapped_preview: 2}
+  @dialyzer {:nowarn_function, pdf_load_mapped: 1}
+  @dialyzer {:nowarn_function, tiff_load_mapped: 1}
 
   @type decompress_ret_type ::
           {:ok,
            {binary(), integer(), integer(), integer(), integer(), binary() | nil,
-            list({binary(), binary(), binary(), binary()}), list(binary()), list(binary())}}
+            list({binary(), binary(), binary(), binary()}), list(binary()), list(binary()),
+            {binary(), integer()} | nil, binary() | nil, binary() | nil, list(binary())}}
           | {:error, String.t()}
   @type compress_ret_type :: {:ok, binary()} | {:error, String.t()}
+  @type async_ret_type :: {:ok, reference()} | {:error, String.t()}
+  @type encoder_ret_type :: {:ok, list(binary())} | {:error, String.t()}
+  @type exif_tags_type ::
+          {integer() | nil, binary() | nil, binary() | nil, binary() | nil, binary() | nil, binary() | nil}
+  @type metadata_ret_type ::
+          {:ok,
+           {integer() | nil, integer() | nil, binary() | nil, binary() | nil, binary() | nil,
+            list({binary(), binary(), binary(), binary()}), list(binary()), list(binary()), exif_tags_type()}}
+          | {:error, String.t()}
 
-  @spec jpeg_decompress(binary()) :: decompress_ret_type()
-  def jpeg_decompress(_bytes) do
+  @spec jpeg_decompress(
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          boolean(),
+          integer(),
+          list(float()),
+          list(float())
+        ) :: decompress_ret_type()
+  def jpeg_decompress(
+        _bytes,
+        _crop_x,
+        _crop_y,
+        _crop_width,
+        _crop_height,
+        _metadata,
+        _planar,
+        _type,
+        _scale,
+        _bias
+      ) do
     exit(:nif_library_not_loaded)
   end
 
-  @spec jpeg_compress(binary(), integer(), integer(), integer(), integer(), binary() | nil, binary() | nil) ::
-          compress_ret_type()
-  def jpeg_compress(_pixels, _width, _height, _channels, _quality, _exif_binary, _xmp_binary) do
+  @spec jpeg_compress(
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          boolean(),
+          binary() | nil,
+          binary() | nil,
+          binary() | nil,
+          integer()
+        ) :: compress_ret_type()
+  def jpeg_compress(
+        _pixels,
+        _width,
+        _height,
+        _channels,
+        _quality,
+        _optimize_coding,
+        _progressive,
+        _subsampling,
+        _dct_method,
+        _grayscale,
+        _exif_binary,
+        _xmp_binary,
+        _icc_profile,
+        _threads
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec jpeg_compress_to_size(
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          boolean(),
+          binary() | nil,
+          binary() | nil,
+          binary() | nil,
+          integer()
+        ) :: compress_ret_type()
+  def jpeg_compress_to_size(
+        _pixels,
+        _width,
+        _height,
+        _channels,
+        _target_size,
+        _optimize_coding,
+        _progressive,
+        _subsampling,
+        _dct_method,
+        _grayscale,
+        _exif_binary,
+        _xmp_binary,
+        _icc_profile,
+        _threads
+      ) do
     exit(:nif_library_not_loaded)
   end
 
-  @spec png_decompress(binary()) :: decompress_ret_type()
-  def png_decompress(_bytes) do
+  @spec png_decompress(binary(), boolean(), boolean(), integer(), boolean(), integer(), list(float()), list(float())) ::
+          decompress_ret_type()
+  def png_decompress(_bytes, _verify_checksums, _keep_palette, _metadata, _planar, _type, _scale, _bias) do
     exit(:nif_library_not_loaded)
   end
 
@@ -44,15 +189,30 @@ defmodule Imagex.C do
           integer(),
           integer(),
           integer(),
-          list({binary(), binary(), binary(), binary()}) | nil
+          list({binary(), binary(), binary(), binary()}) | nil,
+          integer(),
+          integer(),
+          integer(),
+          integer()
         ) ::
           compress_ret_type()
-  def png_compress(_pixels, _width, _height, _channels, _bit_depth, _png_texts) do
+  def png_compress(
+        _pixels,
+        _width,
+        _height,
+        _channels,
+        _bit_depth,
+        _png_texts,
+        _compression_level,
+        _filter,
+        _strategy,
+        _threads
+      ) do
     exit(:nif_library_not_loaded)
   end
 
-  @spec jxl_decompress(binary()) :: decompress_ret_type()
-  def jxl_decompress(_bytes) do
+  @spec jxl_decompress(binary(), integer(), boolean(), integer(), list(float()), list(float())) :: decompress_ret_type()
+  def jxl_decompress(_bytes, _metadata, _planar, _type, _scale, _bias) do
     exit(:nif_library_not_loaded)
   end
 
@@ -88,6 +248,36 @@ defmodule Imagex.C do
     exit(:nif_library_not_loaded)
   end
 
+  @spec jxl_compress_to_size(
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          binary() | nil,
+          list({atom(), binary()}) | nil,
+          integer(),
+          integer(),
+          integer(),
+          integer()
+        ) ::
+          compress_ret_type()
+  def jxl_compress_to_size(
+        _pixels,
+        _width,
+        _height,
+        _channels,
+        _bit_depth,
+        _exif_binary,
+        _jxl_boxes,
+        _target_size,
+        _effort,
+        _progressive,
+        _order
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
   @spec jxl_transcode_from_jpeg(binary(), integer(), boolean()) :: {:ok, binary()} | {:error, String.t()}
   def jxl_transcode_from_jpeg(_jpeg_bytes, _effort, _store_jpeg_metadata) do
     exit(:nif_library_not_loaded)
@@ -98,6 +288,41 @@ defmodule Imagex.C do
     exit(:nif_library_not_loaded)
   end
 
+  @spec webp_decompress(binary(), integer(), boolean(), integer(), list(float()), list(float())) ::
+          decompress_ret_type()
+  def webp_decompress(_bytes, _metadata, _planar, _type, _scale, _bias) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec webp_compress(
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          float(),
+          boolean(),
+          integer(),
+          boolean(),
+          binary() | nil,
+          binary() | nil,
+          binary() | nil
+        ) :: compress_ret_type()
+  def webp_compress(
+        _pixels,
+        _width,
+        _height,
+        _channels,
+        _quality,
+        _lossless,
+        _method,
+        _multithreaded,
+        _exif_binary,
+        _xmp_binary,
+        _icc_profile
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
   @spec pdf_load_document(binary()) :: {:ok, {reference(), integer()}} | {:error, String.t()}
   def pdf_load_document(_bytes) do
     exit(:nif_library_not_loaded)
@@ -113,8 +338,451 @@ defmodule Imagex.C do
     exit(:nif_library_not_loaded)
   end
 
-  @spec tiff_render_page(reference(), integer()) :: decompress_ret_type()
-  def tiff_render_page(_document, _page_idx) do
+  @spec tiff_render_page(reference(), integer(), integer(), integer(), integer(), integer()) ::
+          decompress_ret_type()
+  def tiff_render_page(_document, _page_idx, _crop_x, _crop_y, _crop_width, _crop_height) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec tiff_page_size(reference(), integer()) :: {:ok, {integer(), integer(), integer()}} | {:error, String.t()}
+  def tiff_page_size(_document, _page_idx) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec read_metadata(binary()) :: metadata_ret_type()
+  def read_metadata(_bytes) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec jpeg_transform(binary(), integer(), boolean(), integer(), integer(), integer(), integer(), boolean()) ::
+          compress_ret_type()
+  def jpeg_transform(
+        _jpeg_bytes,
+        _transform,
+        _auto_orient,
+        _crop_x,
+        _crop_y,
+        _crop_width,
+        _crop_height,
+        _copy_metadata
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_batch(list(binary()), integer(), integer(), boolean(), integer(), list(float()), list(float())) ::
+          {:ok, list(decompress_ret_type())} | {:error, String.t()}
+  def decompress_batch(_images, _num_threads, _metadata, _planar, _type, _scale, _bias) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec convert_pixels(binary(), integer(), integer(), boolean(), integer(), list(float()), list(float())) ::
+          {:ok, binary()} | {:error, String.t()}
+  def convert_pixels(_pixels, _channels, _bit_depth, _planar, _type, _scale, _bias) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_into_batch(
+          list(binary()),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          float(),
+          boolean(),
+          integer(),
+          list(float()),
+          list(float())
+        ) ::
+          {:ok, {binary(), list({:ok, {integer(), integer()}} | {:error, String.t()})}} | {:error, String.t()}
+  def decompress_into_batch(
+        _images,
+        _num_threads,
+        _height,
+        _width,
+        _channels,
+        _fit,
+        _pad,
+        _planar,
+        _type,
+        _scale,
+        _bias
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @type image_hash_type :: {non_neg_integer(), non_neg_integer(), non_neg_integer(), binary()}
+
+  @spec image_hash(binary()) :: {:ok, image_hash_type()} | {:error, String.t()}
+  def image_hash(_bytes) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec image_hash_batch(list(binary()), integer()) ::
+          {:ok, list({:ok, image_hash_type()} | {:error, String.t()})} | {:error, String.t()}
+  def image_hash_batch(_images, _num_threads) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pixels_hash(binary(), integer(), integer(), integer(), integer()) ::
+          {:ok, image_hash_type()} | {:error, String.t()}
+  def pixels_hash(_pixels, _width, _height, _channels, _bit_depth) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec image_quality(
+          binary(),
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer()
+        ) :: {:ok, {float(), float() | nil, float() | nil}} | {:error, String.t()}
+  def image_quality(_reference, _distorted, _width, _height, _channels, _bit_depth, _ssim, _ms_ssim, _num_threads) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_cached(
+          binary(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          integer(),
+          integer()
+        ) :: decompress_ret_type()
+  def decompress_cached(
+        _bytes,
+        _format,
+        _verify_checksums,
+        _keep_palette,
+        _crop_x,
+        _crop_y,
+        _crop_width,
+        _crop_height
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @type decode_cache_stats_type ::
+          {non_neg_integer(), non_neg_integer(), non_neg_integer(), non_neg_integer(), non_neg_integer(),
+           non_neg_integer()}
+
+  @type decode_budget_stats_type ::
+          {non_neg_integer(), non_neg_integer(), non_neg_integer(), non_neg_integer(), non_neg_integer()}
+
+  @spec decode_cache_configure(non_neg_integer()) :: decode_cache_stats_type()
+  def decode_cache_configure(_max_bytes) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decode_cache_clear() :: decode_cache_stats_type()
+  def decode_cache_clear() do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decode_cache_stats() :: decode_cache_stats_type()
+  def decode_cache_stats() do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decode_budget_configure(non_neg_integer(), non_neg_integer(), boolean()) :: decode_budget_stats_type()
+  def decode_budget_configure(_max_pixels, _max_bytes, _reject_when_exhausted) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decode_budget_stats() :: decode_budget_stats_type()
+  def decode_budget_stats() do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decode_budget_queue(pid() | nil, non_neg_integer(), boolean()) :: boolean() | {:error, String.t()}
+  def decode_budget_queue(_pid, _waiting, _turn_open) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decode_budget_queued() :: boolean()
+  def decode_budget_queued() do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pixel_buffer_new(pos_integer()) :: {:ok, reference()} | {:error, String.t()}
+  def pixel_buffer_new(_capacity) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pixel_buffer_capacity(reference()) :: non_neg_integer()
+  def pixel_buffer_capacity(_buffer) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_into(
+          reference(),
+          binary(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          integer()
+        ) :: decompress_ret_type()
+  def decompress_into(
+        _buffer,
+        _bytes,
+        _format,
+        _verify_checksums,
+        _keep_palette,
+        _crop_x,
+        _crop_y,
+        _crop_width,
+        _crop_height,
+        _metadata
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_mapped_into(
+          reference(),
+          reference(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          integer()
+        ) :: decompress_ret_type()
+  def decompress_mapped_into(
+        _buffer,
+        _file,
+        _format,
+        _verify_checksums,
+        _keep_palette,
+        _crop_x,
+        _crop_y,
+        _crop_width,
+        _crop_height,
+        _metadata
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec tiff_render_page_into(reference(), reference(), integer(), integer(), integer(), integer(), integer()) ::
+          decompress_ret_type()
+  def tiff_render_page_into(_buffer, _document, _page_idx, _crop_x, _crop_y, _crop_width, _crop_height) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_async(reference(), integer(), binary(), non_neg_integer(), boolean()) :: async_ret_type()
+  def decompress_async(_ref, _priority, _bytes, _metadata, _retry) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec jxl_compress_async(
+          reference(),
+          integer(),
+          binary(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          binary() | nil,
+          list({atom(), binary()}) | nil,
+          float(),
+          boolean(),
+          integer(),
+          integer(),
+          integer()
+        ) ::
+          async_ret_type()
+  def jxl_compress_async(
+        _ref,
+        _priority,
+        _pixels,
+        _width,
+        _height,
+        _channels,
+        _bit_depth,
+        _exif_binary,
+        _jxl_boxes,
+        _distance,
+        _lossless,
+        _effort,
+        _progressive,
+        _order
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pdf_render_page_async(reference(), integer(), reference(), integer(), integer(), boolean()) ::
+          async_ret_type()
+  def pdf_render_page_async(_ref, _priority, _document, _page_idx, _dpi, _retry) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decoder_new(integer(), boolean(), boolean()) :: {:ok, reference()} | {:error, String.t()}
+  def decoder_new(_format, _verify_checksums, _keep_palette) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decoder_push(reference(), binary()) ::
+          {:ok, {integer(), integer(), integer(), integer(), integer(), binary()} | nil} | {:error, String.t()}
+  def decoder_push(_decoder, _chunk) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decoder_finish(reference()) :: decompress_ret_type()
+  def decoder_finish(_decoder) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec jpeg_encoder_new(
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          boolean(),
+          binary() | nil,
+          binary() | nil,
+          binary() | nil
+        ) ::
+          {:ok, reference()} | {:error, String.t()}
+  def jpeg_encoder_new(
+        _width,
+        _height,
+        _channels,
+        _quality,
+        _optimize_coding,
+        _progressive,
+        _subsampling,
+        _dct_method,
+        _grayscale,
+        _exif_binary,
+        _xmp_binary,
+        _icc_profile
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec png_encoder_new(
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          list({binary(), binary(), binary(), binary()}) | nil,
+          integer(),
+          integer(),
+          integer()
+        ) :: {:ok, reference()} | {:error, String.t()}
+  def png_encoder_new(_width, _height, _channels, _bit_depth, _png_texts, _compression_level, _filter, _strategy) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec encoder_push(reference(), binary()) :: encoder_ret_type()
+  def encoder_push(_encoder, _rows) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec encoder_finish(reference()) :: encoder_ret_type()
+  def encoder_finish(_encoder) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @type pyramid_tiles_type :: {:ok, list({integer(), integer(), integer(), binary()})} | {:error, String.t()}
+
+  @spec pyramid_new(integer(), integer(), integer(), integer(), integer(), integer(), number(), integer(), integer()) ::
+          {:ok, reference()} | {:error, String.t()}
+  def pyramid_new(_width, _height, _channels, _tile_size, _overlap, _format, _quality, _effort, _num_threads) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pyramid_open_jpeg(reference(), integer(), integer(), integer(), number(), integer(), integer()) ::
+          {:ok, {reference(), integer(), integer(), integer()}} | {:error, String.t()}
+  def pyramid_open_jpeg(_file, _tile_size, _overlap, _format, _quality, _effort, _num_threads) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pyramid_push(reference(), binary()) :: pyramid_tiles_type()
+  def pyramid_push(_pyramid, _rows) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pyramid_read(reference(), integer()) :: pyramid_tiles_type()
+  def pyramid_read(_pyramid, _max_rows) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pyramid_finish(reference()) :: pyramid_tiles_type()
+  def pyramid_finish(_pyramid) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec open_path(binary()) :: {:ok, {reference(), integer()}} | {:error, String.t()}
+  def open_path(_path) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_mapped(
+          reference(),
+          integer(),
+          boolean(),
+          boolean(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          integer(),
+          boolean(),
+          integer(),
+          list(float()),
+          list(float())
+        ) :: decompress_ret_type()
+  def decompress_mapped(
+        _file,
+        _format,
+        _verify_checksums,
+        _keep_palette,
+        _crop_x,
+        _crop_y,
+        _crop_width,
+        _crop_height,
+        _metadata,
+        _planar,
+        _type,
+        _scale,
+        _bias
+      ) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_preview(binary(), integer()) :: decompress_ret_type()
+  def decompress_preview(_bytes, _min_size) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec decompress_mapped_preview(reference(), integer()) :: decompress_ret_type()
+  def decompress_mapped_preview(_file, _min_size) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec pdf_load_mapped(reference()) :: {:ok, {reference(), integer()}} | {:error, String.t()}
+  def pdf_load_mapped(_file) do
+    exit(:nif_library_not_loaded)
+  end
+
+  @spec tiff_load_mapped(reference()) :: {:ok, {reference(), integer()}} | {:error, String.t()}
+  def tiff_load_mapped(_file) do
     exit(:nif_library_not_loaded)
   end
 end
@@ -0,0 +1,65 @@
+defmodule Imagex.Cache do
+  @moduledoc """
+  A native cache of decoded images, for workloads that decode the same images (logos, watermarks, templates) over and
+  over.
+
+  Images decoded with `Imagex.decode(bytes, cache: true)` are looked up by a hash of their encoded bytes and the decode
+  options that change the result, and the bytes are compared on a match. A hit returns the cached pixels without
+  decoding or copying them: the tensor binary refers to the cached buffer, which stays alive while any tensor uses it,
+  even after the entry is evicted. Metadata is still parsed on every call unless `parse_metadata: false` is passed.
+
+  The cache is shared by the whole VM and starts out disabled. Give it a byte budget with `configure/1`; once the cached
+  pixels, metadata and encoded bytes exceed it, the least recently used images are evicted.
+  """
+
+  @type stats :: %{
+          hits: non_neg_integer(),
+          misses: non_neg_integer(),
+          evictions: non_neg_integer(),
+          entries: non_neg_integer(),
+          bytes: non_neg_integer(),
+          max_bytes: non_neg_integer()
+        }
+
+  @doc """
+  Configures the cache.
+
+  Options:
+
+    * `:max_bytes` - the byte budget. Shrinking it evicts images right away, and `0` disables the cache.
+  """
+  @spec configure(keyword()) :: :ok | {:error, String.t()}
+  def configure(options) do
+    with {:ok, options} <- Keyword.validate(options, [:max_bytes]) do
+      case Keyword.get(options, :max_bytes) do
+        max_bytes when is_integer(max_bytes) and max_bytes >= 0 ->
+          Imagex.C.decode_cache_configure(max_bytes)
+          :ok
+
+        max_bytes ->
+          {:error, "max_bytes must be a non-negative integer, got: #{inspect(max_bytes)}"}
+      end
+    end
+  end
+
+  @doc """
+  Returns the hit, miss and eviction counts since the VM started, and the number and total size of cached images.
+  """
+  @spec stats() :: stats()
+  def stats do
+    Imagex.C.decode_cache_stats() |> to_stats()
+  end
+
+  @doc """
+  Evicts every image, keeping the byte budget and counters.
+  """
+  @spec clear() :: :ok
+  def clear do
+    Imagex.C.decode_cache_clear()
+    :ok
+  end
+
+  defp to_stats({hits, misses, evictions, entries, bytes, max_bytes}) do
+    %{hits: hits, misses: misses, evictions: evictions, entries: entries, bytes: bytes, max_bytes: max_bytes}
+  end
+end
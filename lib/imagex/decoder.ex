@@ -0,0 +1,85 @@
+defmodule Imagex.Decoder do
+  @moduledoc """
+  Decodes JPEG, PNG, JPEG XL and WebP images while their bytes are still arriving.
+
+  Create a decoder with `new/2`, feed it chunks of the file with `push/2` as they are received, and call `finish/2`
+  after the last one. Each push decodes as far as the data received so far allows and returns the rows that were
+  completed by it, so decoding overlaps with receiving the file instead of starting after the last byte.
+
+  Rows are returned from the top of the image down. Baseline JPEGs, non-interlaced PNGs and WebP images produce rows as
+  their data arrives; progressive JPEGs, interlaced PNGs and JPEG XL images produce all of their rows once they are
+  complete.
+
+  A decoder keeps state between calls; a process that shares one with others must order its pushes itself.
+  """
+
+  @enforce_keys [:ref, :format]
+  defstruct [:ref, :format]
+
+  @type t :: %__MODULE__{ref: reference(), format: :jpeg | :png | :jxl | :webp}
+
+  @doc """
+  Creates a decoder for the given format.
+
+  Options (PNG only):
+
+    * `:verify_checksums` - same as in `Imagex.decode/2`. Defaults to `true`.
+    * `:keep_palette` - same as in `Imagex.decode/2`. Defaults to `false`.
+  """
+  @spec new(:jpeg | :png | :jxl | :webp, keyword()) :: {:ok, t()} | {:error, String.t()}
+  def new(format, options \\ []) do
+    with {:ok, options} <- Keyword.validate(options, verify_checksums: true, keep_palette: false),
+         {:ok, format_id} <- format_id(format),
+         verify_checksums = Keyword.get(options, :verify_checksums),
+         keep_palette = Keyword.get(options, :keep_palette),
+         {:ok, ref} <- Imagex.C.decoder_new(format_id, verify_checksums, keep_palette) do
+      {:ok, %__MODULE__{ref: ref, format: format}}
+    end
+  end
+
+  @doc """
+  Feeds the next chunk of the encoded image to the decoder.
+
+  Returns `{:ok, {first_row, rows}}` where `rows` is a tensor with the rows that were completed by this chunk, starting
+  at row `first_row` of the image, or `{:ok, nil}` if no rows were completed. Once a push fails, the decoder keeps
+  returning the same error.
+  """
+  @spec push(t(), binary()) :: {:ok, {non_neg_integer(), Nx.Tensor.t()} | nil} | {:error, String.t()}
+  def push(%__MODULE__{ref: ref}, chunk) when is_binary(chunk) do
+    case Imagex.C.decoder_push(ref, chunk) do
+      {:ok, {width, _height, channels, bit_depth, first_row, pixels}} ->
+        num_rows = div(byte_size(pixels), width * channels * div(bit_depth, 8))
+        shape = if channels == 1, do: {num_rows, width}, else: {num_rows, width, channels}
+        {:ok, {first_row, Nx.from_binary(pixels, pixel_type(bit_depth)) |> Nx.reshape(shape)}}
+
+      other ->
+        other
+    end
+  end
+
+  @doc """
+  Signals the end of the input and returns the decoded image, along with its metadata.
+
+  Truncated JPEGs are padded, like `Imagex.decode/2` does; truncated PNG and JPEG XL images are an error.
+
+  Options:
+
+    * `:parse_metadata` - same as in `Imagex.decode/2`. Defaults to `true`.
+  """
+  @spec finish(t(), keyword()) :: {:ok, Imagex.Image.t()} | {:error, String.t()}
+  def finish(%__MODULE__{ref: ref}, options \\ []) do
+    with {:ok, options} <- Keyword.validate(options, parse_metadata: true) do
+      Imagex.decoded_to_image(Imagex.C.decoder_finish(ref), Keyword.get(options, :parse_metadata))
+    end
+  end
+
+  defp format_id(:jpeg), do: {:ok, 0}
+  defp format_id(:png), do: {:ok, 1}
+  defp format_id(:jxl), do: {:ok, 2}
+  defp format_id(:webp), do: {:ok, 3}
+  defp format_id(format), do: {:error, "unsupported format for incremental decoding: #{inspect(format)}"}
+
+  defp pixel_type(8), do: {:u, 8}
+  defp pixel_type(16), do: {:u, 16}
+  defp pixel_type(32), do: {:f, 32}
+end
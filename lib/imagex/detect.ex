@@ -15,6 +15,8 @@ defmodule Imagex.Detect do
 
   def detect(<<"MM", 0x002A::size(16), _rest::binary>>), do: :tiff
 
+  def detect(<<"RIFF", _size::size(32), "WEBP", _rest::binary>>), do: :webp
+
   def detect(<<"%PDF-1.", n::size(8), "\n%", _rest::binary>>) when n in ?0..?9, do: :pdf
 
   # we don't recognize anything else at this time
@@ -0,0 +1,125 @@
+defmodule Imagex.Encoder do
+  @moduledoc """
+  Encodes JPEG and PNG images that are handed over a few rows at a time.
+
+  Create an encoder with `new/3`, give it the rows of the image from the top down with `push/2`, and call `finish/1`
+  after the last one. Each call returns the compressed data produced so far as iodata, so it can be written to a file
+  or socket right away instead of holding both the whole image and the whole encoded file in memory.
+
+  JPEG XL is not supported: a frame starts with the table of contents of its sections, so no byte of it is final
+  before the whole frame is encoded. Use `Imagex.encode/3` for it.
+
+  An encoder keeps state between calls; a process that shares one with others must order its pushes itself.
+  """
+
+  @enforce_keys [:ref, :format, :shape, :type]
+  defstruct [:ref, :format, :shape, :type]
+
+  @type t :: %__MODULE__{
+          ref: reference(),
+          format: :jpeg | :png,
+          shape: {non_neg_integer(), non_neg_integer(), non_neg_integer()},
+          type: Nx.Type.t()
+        }
+
+  @doc """
+  Creates an encoder for an image of the given shape, `{height, width}` or `{height, width, channels}`.
+
+  Options:
+
+    * `:type` - the type of the pixels that will be pushed, `{:u, 8}` or `{:u, 16}`. Defaults to `{:u, 8}`. JPEG only
+      supports `{:u, 8}`.
+
+  The other options are those of `Imagex.encode/3` for the format, except for `:threads` and `:target_size`. Progressive
+  and `optimize_coding: true` JPEGs need the whole image, so their data is all returned by `finish/1`.
+  """
+  @spec new(:jpeg | :png, tuple(), keyword()) :: {:ok, t()} | {:error, String.t()}
+  def new(format, shape, options \\ []) do
+    {type, options} = Keyword.pop(options, :type, {:u, 8})
+
+    with {:ok, {h, w, c}} <- standardize_shape(shape),
+         {:ok, bit_depth} <- bit_depth(format, type),
+         {:ok, ref} <- new_encoder(format, w, h, c, bit_depth, options) do
+      {:ok, %__MODULE__{ref: ref, format: format, shape: {h, w, c}, type: type}}
+    end
+  end
+
+  @doc """
+  Encodes the next rows of the image.
+
+  `rows` is either a tensor of shape `{num_rows, width}` or `{num_rows, width, channels}`, or a binary holding whole
+  rows in that layout. Returns `{:ok, iodata}` with the compressed data produced by this call, which may be empty. Once
+  encoding fails, the encoder keeps returning the same error.
+  """
+  @spec push(t(), Nx.Tensor.t() | binary()) :: {:ok, iodata()} | {:error, String.t()}
+  def push(%__MODULE__{} = encoder, rows) when is_binary(rows) do
+    Imagex.C.encoder_push(encoder.ref, rows)
+  end
+
+  def push(%__MODULE__{shape: {_h, w, c}, type: type} = encoder, %Nx.Tensor{} = rows) do
+    case {Nx.type(rows), Nx.shape(rows)} do
+      {^type, {_num_rows, ^w}} when c == 1 -> push(encoder, Nx.to_binary(rows))
+      {^type, {_num_rows, ^w, ^c}} -> push(encoder, Nx.to_binary(rows))
+      _ -> {:error, "rows must be a #{inspect(type)} tensor of shape {num_rows, #{w}, #{c}}"}
+    end
+  end
+
+  @doc """
+  Completes the image once all of its rows have been pushed, returning `{:ok, iodata}` with the rest of the file.
+  """
+  @spec finish(t()) :: {:ok, iodata()} | {:error, String.t()}
+  def finish(%__MODULE__{ref: ref}) do
+    Imagex.C.encoder_finish(ref)
+  end
+
+  defp new_encoder(:jpeg, w, h, c, _bit_depth, options) do
+    with {:ok, jpeg} <- Imagex.jpeg_compress_options(options) do
+      Imagex.C.jpeg_encoder_new(
+        w,
+        h,
+        c,
+        jpeg.quality,
+        jpeg.optimize_coding,
+        jpeg.progressive,
+        jpeg.subsampling,
+        jpeg.dct_method,
+        jpeg.grayscale,
+        jpeg.exif_binary,
+        jpeg.xmp_binary,
+        jpeg.icc_profile
+      )
+    end
+  end
+
+  defp new_encoder(:png, w, h, c, bit_depth, options) do
+    with {:ok, options} <-
+           Keyword.validate(options,
+             compression_level: :default,
+             filter: :adaptive,
+             strategy: :default,
+             fast: false,
+             metadata: nil
+           ),
+         {:ok, {compression_level, filter, strategy, _threads}} <-
+           Imagex.Png.compress_options(Keyword.put(options, :threads, 1)),
+         {:ok, png_texts} <- Imagex.Png.texts_from_metadata(Keyword.get(options, :metadata)) do
+      Imagex.C.png_encoder_new(w, h, c, bit_depth, png_texts, compression_level, filter, strategy)
+    end
+  end
+
+  defp new_encoder(format, _w, _h, _c, _bit_depth, _options),
+    do: {:error, "unsupported format for streaming encoding: #{inspect(format)}"}
+
+  defp standardize_shape({h, w}), do: standardize_shape({h, w, 1})
+
+  defp standardize_shape({h, w, c} = shape) when is_integer(h) and is_integer(w) and is_integer(c) and h > 0 and w > 0,
+    do: {:ok, shape}
+
+  defp standardize_shape(shape), do: {:error, "unsupported image shape: #{inspect(shape)}"}
+
+  defp bit_depth(:jpeg, {:u, 8}), do: {:ok, 8}
+  defp bit_depth(:jpeg, type), do: {:error, "JPEG only supports {:u, 8} pixels, got: #{inspect(type)}"}
+  defp bit_depth(_format, {:u, 8}), do: {:ok, 8}
+  defp bit_depth(_format, {:u, 16}), do: {:ok, 16}
+  defp bit_depth(_format, type), do: {:error, "unsupported pixel type: #{inspect(type)}"}
+end
@@ -0,0 +1,98 @@
+defmodule Imagex.Hash do
+  @moduledoc """
+  Perceptual hashes for finding near-duplicate images.
+
+  All hashes are computed natively from one small luma thumbnail of the image, so resized, re-encoded or lightly edited
+  copies of an image get hashes that differ in only a few bits, which `distance/2` counts:
+
+    * `:ahash` - the average hash, whether each pixel of an 8x8 thumbnail is brighter than their mean.
+    * `:dhash` - the difference hash, whether each pixel of a 9x8 thumbnail is darker than its right neighbour.
+    * `:phash` - the perceptual hash, whether each of the lowest 8x8 DCT coefficients of a 32x32 thumbnail is above
+      their median. The most robust of the three to scaling, compression and small color changes.
+    * `:block_mean` - a 256-bit signature, as a 32-byte binary, of whether the mean of each of the 16x16 blocks is above
+      their median.
+
+  Bits are in row-major order, most significant first. Hashing encoded JPEGs doesn't decode the full image: only the
+  luma is decoded, at a DCT scale of down to 1/8, which is a fraction of the work of a decode. Other formats are
+  decoded in full and hashed in the same native pass. Hashes of a JPEG and of its decoded tensor may differ in a bit
+  or two.
+  """
+
+  # Suppress dialyzer warnings for functions that call NIFs
+  @dialyzer {:nowarn_function, compute: 1, compute_batch: 2}
+
+  @type t :: %{
+          ahash: non_neg_integer(),
+          dhash: non_neg_integer(),
+          phash: non_neg_integer(),
+          block_mean: binary()
+        }
+
+  @doc """
+  Computes the hashes of an encoded JPEG, PNG, JPEG XL or WebP image, of an `Imagex.Image` or of a tensor.
+
+  Tensors have shape `{height, width}` or `{height, width, channels}` with 1 to 4 channels, and type `{:u, 8}`,
+  `{:u, 16}` or `{:f, 32}` (in `0..1`). Alpha is ignored.
+  """
+  @spec compute(binary() | Nx.Tensor.t() | Imagex.Image.t()) :: {:ok, t()} | {:error, String.t()}
+  def compute(bytes) when is_binary(bytes) do
+    Imagex.Budget.run(fn -> Imagex.C.image_hash(bytes) end) |> to_hashes()
+  end
+
+  def compute(%Imagex.Image{tensor: tensor}), do: compute(tensor)
+
+  def compute(%Nx.Tensor{} = tensor) do
+    with {:ok, {height, width, channels}} <- shape(Nx.shape(tensor)),
+         {:ok, bit_depth} <- bit_depth(Nx.type(tensor)) do
+      Imagex.C.pixels_hash(Nx.to_binary(tensor), width, height, channels, bit_depth) |> to_hashes()
+    end
+  end
+
+  @doc """
+  Computes the hashes of a list of encoded images concurrently on native threads, returning one `{:ok, hashes}` or
+  `{:error, reason}` per input, in input order.
+
+  Options:
+
+    * `:threads` - number of threads, or `:auto` for one per core. Defaults to `:auto`.
+  """
+  @spec compute_batch(list(binary()), keyword()) ::
+          {:ok, list({:ok, t()} | {:error, String.t()})} | {:error, String.t()}
+  def compute_batch(images, options \\ []) when is_list(images) do
+    with {:ok, options} <- Keyword.validate(options, threads: :auto),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)),
+         {:ok, results} <- Imagex.C.image_hash_batch(images, threads) do
+      {:ok, Enum.map(results, &to_hashes/1)}
+    end
+  end
+
+  @doc """
+  Counts the bits that differ between two hashes of the same kind, or between every hash of two `t:t/0` maps.
+  """
+  @spec distance(t(), t()) :: %{atom() => non_neg_integer()}
+  @spec distance(non_neg_integer() | binary(), non_neg_integer() | binary()) :: non_neg_integer()
+  def distance(%{} = a, %{} = b) do
+    Map.new([:ahash, :dhash, :phash, :block_mean], &{&1, distance(Map.fetch!(a, &1), Map.fetch!(b, &1))})
+  end
+
+  def distance(a, b) when is_integer(a) and is_integer(b), do: count_ones(:binary.encode_unsigned(Bitwise.bxor(a, b)))
+
+  def distance(a, b) when is_binary(a) and is_binary(b) and byte_size(a) == byte_size(b),
+    do: distance(:binary.decode_unsigned(a), :binary.decode_unsigned(b))
+
+  defp count_ones(bits), do: for(<<bit::1 <- bits>>, reduce: 0, do: (count -> count + bit))
+
+  defp to_hashes({:ok, {ahash, dhash, phash, block_mean}}),
+    do: {:ok, %{ahash: ahash, dhash: dhash, phash: phash, block_mean: block_mean}}
+
+  defp to_hashes({:error, _reason} = error), do: error
+
+  defp shape({height, width}), do: {:ok, {height, width, 1}}
+  defp shape({_height, _width, channels} = shape) when channels in 1..4, do: {:ok, shape}
+  defp shape(shape), do: {:error, "unsupported image shape: #{inspect(shape)}"}
+
+  defp bit_depth({:u, 8}), do: {:ok, 8}
+  defp bit_depth({:u, 16}), do: {:ok, 16}
+  defp bit_depth({:f, 32}), do: {:ok, 32}
+  defp bit_depth(type), do: {:error, "unsupported pixel type: #{inspect(type)}"}
+end
@@ -6,8 +6,14 @@ defmodule Imagex.Image do
   @type tensor :: Nx.Tensor.t()
   @type metadata :: map()
 
-  @type t :: %Imagex.Image{tensor: tensor, metadata: metadata}
+  @typedoc """
+  For palette-indexed images decoded with `keep_palette: true`, the `{n, 3}` (RGB) or `{n, 4}` (RGBA, when the image
+  has transparency) palette that the indices in `tensor` refer to.
+  """
+  @type palette :: Nx.Tensor.t() | nil
+
+  @type t :: %Imagex.Image{tensor: tensor, metadata: metadata, palette: palette}
 
   @enforce_keys [:tensor]
-  defstruct [:tensor, :metadata]
+  defstruct [:tensor, :metadata, :palette]
 end
@@ -19,6 +19,22 @@ defmodule Imagex.Jfif do
     end
   end
 
+  @doc """
+  Builds JFIF metadata from APP0 segment payloads (without the marker and length), in file order.
+
+  Like `read_metadata_from_jpeg/1`, stops at the first APP0 segment that is neither JFIF nor JFXX.
+  """
+  def metadata_from_app0_segments(segments) when is_list(segments) do
+    segments
+    |> Enum.reduce_while(%{}, fn payload, metadata ->
+      case parse_jfif(payload) do
+        nil -> {:halt, metadata}
+        app0_metadata -> {:cont, merge_metadata(metadata, app0_metadata)}
+      end
+    end)
+    |> blank_to_nil()
+  end
+
   defp read_metadata_from_jpeg_impl(<<>>, metadata), do: blank_to_nil(metadata)
 
   defp read_metadata_from_jpeg_impl(<<0xFFE0::16, len::16-big, rest::binary>>, metadata) do
@@ -0,0 +1,66 @@
+defmodule Imagex.Jpeg do
+  @moduledoc """
+  JPEG codec functions that work on the compressed data directly.
+  """
+
+  # Suppress dialyzer warnings for functions that call NIFs
+  @dialyzer {:nowarn_function, transform: 2}
+
+  @type transform ::
+          :none
+          | :flip_horizontal
+          | :flip_vertical
+          | :transpose
+          | :transverse
+          | :rotate_90
+          | :rotate_180
+          | :rotate_270
+
+  @transforms [
+    none: 0,
+    flip_horizontal: 1,
+    flip_vertical: 2,
+    transpose: 3,
+    transverse: 4,
+    rotate_90: 5,
+    rotate_180: 6,
+    rotate_270: 7
+  ]
+
+  @doc """
+  Losslessly rotates, flips and/or crops a JPEG by rearranging its DCT coefficients, like `jpegtran`. Nothing is
+  decoded or re-quantized, so this is much faster than `decode/2` followed by `encode/3` and loses no quality.
+
+  Options:
+
+    * `:transform` - one of `t:transform/0`, rotations are clockwise. Defaults to `:none`.
+    * `:auto_orient` - take the transform from the EXIF orientation tag and reset the tag to 1. Cannot be combined
+      with `:transform`. Defaults to `false`.
+    * `:crop` - `{x, y, width, height}` in the transformed image. The origin is rounded down to an MCU boundary (8 or
+      16 pixels), growing the region by the same amount. Defaults to `nil`.
+    * `:copy_metadata` - keep the APPn and COM segments of the source. Defaults to `true`.
+
+  Edges that would have to move but are not a whole MCU are trimmed, the same as `jpegtran -trim`.
+  """
+  @spec transform(binary(), keyword()) :: {:ok, binary()} | {:error, String.t()}
+  def transform(jpeg_bytes, options \\ []) when is_binary(jpeg_bytes) do
+    with {:ok, options} <-
+           Keyword.validate(options, transform: nil, auto_orient: false, crop: nil, copy_metadata: true),
+         {:ok, transform} <- parse_transform(Keyword.get(options, :transform), Keyword.get(options, :auto_orient)),
+         {:ok, {x, y, width, height}} <- Imagex.parse_crop(Keyword.get(options, :crop)) do
+      auto_orient = Keyword.get(options, :auto_orient) == true
+      copy_metadata = Keyword.get(options, :copy_metadata) == true
+      Imagex.C.jpeg_transform(jpeg_bytes, transform, auto_orient, x, y, width, height, copy_metadata)
+    end
+  end
+
+  defp parse_transform(nil, _auto_orient), do: {:ok, 0}
+  defp parse_transform(_transform, true), do: {:error, "transform cannot be combined with auto_orient: true"}
+
+  defp parse_transform(transform, _auto_orient) do
+    case Keyword.fetch(@transforms, transform) do
+      {:ok, value} -> {:ok, value}
+      :error -> {:error, "unsupported JPEG transform: #{inspect(transform)}"}
+    end
+  end
+end
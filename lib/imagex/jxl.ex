@@ -44,12 +44,14 @@ defmodule Imagex.Jxl do
 
   @spec read_metadata_from_jxl(binary()) :: {:ok, map() | nil} | {:error, String.t()}
   def read_metadata_from_jxl(jxl_bytes) when is_binary(jxl_bytes) do
-    case Imagex.C.jxl_decompress(jxl_bytes) do
-      {:ok, {_pixels, _width, _height, _channels, _bit_depth, exif_binary, _png_texts, xml_boxes, jumb_boxes}} ->
-        {:ok, boxes_to_metadata({exif_binary, xml_boxes, jumb_boxes})}
-
-      {:error, _} = error ->
-        error
+    # read_metadata dispatches on the format, so anything but JPEG XL is rejected here like the decoder would
+    with :jxl <- Imagex.Detect.detect(jxl_bytes),
+         {:ok, {_width, _height, exif_binary, _xmp, _icc_profile, _png_texts, xml_boxes, jumb_boxes, _exif_tags}} <-
+           Imagex.C.read_metadata(jxl_bytes) do
+      {:ok, boxes_to_metadata({exif_binary, xml_boxes, jumb_boxes})}
+    else
+      {:error, _} = error -> error
+      _format -> {:error, "Decoder error"}
     end
   end
 
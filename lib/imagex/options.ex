@@ -0,0 +1,11 @@
+defmodule Imagex.Options do
+  @moduledoc false
+
+  @doc """
+  Validates a `:threads` option, turning `:auto` into 0, which the native side reads as one thread per core.
+  """
+  @spec parse_threads(term()) :: {:ok, non_neg_integer()} | {:error, String.t()}
+  def parse_threads(:auto), do: {:ok, 0}
+  def parse_threads(threads) when is_integer(threads) and threads > 0, do: {:ok, threads}
+  def parse_threads(threads), do: {:error, "threads must be a positive integer or :auto, got: #{inspect(threads)}"}
+end
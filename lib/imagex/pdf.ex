@@ -2,19 +2,29 @@ defmodule Imagex.Pdf do
   @enforce_keys [:ref, :num_pages]
   defstruct [:ref, :num_pages]
 
+  @type t :: %__MODULE__{ref: reference(), num_pages: integer()}
+
   def render_page(%Imagex.Pdf{ref: ref, num_pages: num_pages}, page_idx, options \\ [])
       when page_idx >= 0 and page_idx < num_pages do
     with {:ok, options} <- Keyword.validate(options, dpi: 72) do
       dpi = Keyword.get(options, :dpi)
-
-      {:ok, {pixels, width, height, channels, bit_depth, _exif_data, _png_texts, _xml_boxes, _jumb_boxes}} =
-        Imagex.C.pdf_render_page(ref, page_idx, dpi)
-
-      shape = if channels == 1, do: {height, width}, else: {height, width, channels}
-      tensor = Nx.from_binary(pixels, {:u, bit_depth}) |> Nx.reshape(shape)
-      {:ok, %Imagex.Image{tensor: tensor}}
+      rendered_to_image(Imagex.Budget.run(fn -> Imagex.C.pdf_render_page(ref, page_idx, dpi) end))
     else
       error -> error
     end
   end
+
+  # Converts a raw render result tuple into an Imagex.Image, shared with Imagex.Async
+  @doc false
+  def rendered_to_image(
+        {:ok,
+         {pixels, width, height, channels, bit_depth, _exif_data, _png_texts, _xml_boxes, _jumb_boxes, _palette, _xmp,
+          _icc_profile, _app0_segments}}
+      ) do
+    shape = if channels == 1, do: {height, width}, else: {height, width, channels}
+    tensor = Nx.from_binary(pixels, {:u, bit_depth}) |> Nx.reshape(shape)
+    {:ok, %Imagex.Image{tensor: tensor}}
+  end
+
+  def rendered_to_image({:error, _reason} = error), do: error
 end
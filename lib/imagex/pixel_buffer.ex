@@ -0,0 +1,44 @@
+defmodule Imagex.PixelBuffer do
+  @moduledoc """
+  Native memory that images are decoded into over and over, for loops that decode many images of the same size, such
+  as the frames of a camera feed.
+
+  Pass a buffer to `Imagex.decode/2` (JPEG, PNG and JPEG XL) or `Imagex.Tiff.render_page/3` with the `:into` option,
+  and the pixels are decoded straight into it instead of into a new binary. The tensor that comes back is a view of the
+  buffer: nothing is copied, and no memory is allocated or faulted in once the buffer is large enough.
+
+  The memory is copy-on-write: a decode only reuses it once the tensors of earlier decodes have been garbage collected,
+  and otherwise copies, that is, moves the buffer to new memory, so tensors never change under their holders. The
+  buffer keeps the memory it moved off and decodes into it again once it is free, so a loop that holds on to the last
+  frame alternates between two blocks of memory instead of allocating for every frame, as long as the processes
+  holding the frames garbage collect in between. A buffer too small for an image is replaced by one that fits, which
+  later decodes reuse. A buffer can't be decoded into by two processes at once; the second decode fails with
+  `{:error, "pixel buffer is in use by another decode"}`.
+
+  The memory is reserved in `Imagex.Budget` whenever it is allocated, by `new/1` as well as by a decode that moves the
+  buffer, and is given back once neither the buffer nor a tensor refers to it.
+  """
+
+  @enforce_keys [:ref]
+  defstruct [:ref]
+
+  @type t :: %__MODULE__{ref: reference()}
+
+  @doc """
+  Allocates a buffer of `capacity` bytes, e.g. `1920 * 1080 * 3` for 8-bit RGB 1080p frames.
+  """
+  @spec new(pos_integer()) :: {:ok, t()} | {:error, String.t()}
+  def new(capacity) when is_integer(capacity) and capacity > 0 do
+    with {:ok, ref} <- Imagex.Budget.run(fn -> Imagex.C.pixel_buffer_new(capacity) end) do
+      {:ok, %__MODULE__{ref: ref}}
+    end
+  end
+
+  def new(capacity), do: {:error, "capacity must be a positive integer, got: #{inspect(capacity)}"}
+
+  @doc """
+  Returns the size of the buffer in bytes, which grows to fit the largest image decoded into it.
+  """
+  @spec capacity(t()) :: non_neg_integer()
+  def capacity(%__MODULE__{ref: ref}), do: Imagex.C.pixel_buffer_capacity(ref)
+end
@@ -29,6 +29,46 @@ defmodule Imagex.Png do
     |> Map.merge(xmp_metadata)
   end
 
+  @filters [none: 0, sub: 1, up: 2, avg: 3, paeth: 4, adaptive: 5]
+  @strategies [default: 0, filtered: 1, huffman_only: 2, rle: 3, fixed: 4]
+
+  @doc """
+  Converts the validated `Imagex.encode/3` PNG options into the integer arguments expected by
+  `Imagex.C.png_compress/10`: `{compression_level, filter, strategy, threads}`.
+
+  `fast: true` is a preset for `compression_level: 1, filter: :sub, strategy: :rle`, and takes precedence over those
+  options.
+  """
+  @spec compress_options(keyword()) :: {:ok, {integer(), integer(), integer(), integer()}} | {:error, String.t()}
+  def compress_options(options) do
+    {compression_level, filter, strategy} =
+      if Keyword.get(options, :fast) do
+        {1, :sub, :rle}
+      else
+        {Keyword.get(options, :compression_level), Keyword.get(options, :filter), Keyword.get(options, :strategy)}
+      end
+
+    with {:ok, compression_level} <- parse_compression_level(compression_level),
+         {:ok, filter} <- parse_keyword(@filters, filter, "PNG filter"),
+         {:ok, strategy} <- parse_keyword(@strategies, strategy, "PNG compression strategy"),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)) do
+      {:ok, {compression_level, filter, strategy, threads}}
+    end
+  end
+
+  defp parse_compression_level(:default), do: {:ok, -1}
+  defp parse_compression_level(level) when level in 0..9, do: {:ok, level}
+
+  defp parse_compression_level(level),
+    do: {:error, "PNG compression level must be 0-9 or :default, got: #{inspect(level)}"}
+
+  defp parse_keyword(values, value, name) do
+    case Keyword.fetch(values, value) do
+      {:ok, int_value} -> {:ok, int_value}
+      :error -> {:error, "unsupported #{name}: #{inspect(value)}"}
+    end
+  end
+
   @spec texts_from_metadata(map() | nil) :: {:ok, list(png_text_t) | nil} | {:error, String.t()}
   def texts_from_metadata(nil), do: {:ok, nil}
 
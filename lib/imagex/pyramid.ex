@@ -0,0 +1,273 @@
+defmodule Imagex.Pyramid do
+  @moduledoc """
+  Builds Deep Zoom and IIIF tile pyramids from images too large to hold in memory.
+
+  The last level of a pyramid is the full image, and every level before it is half the size of the next one, rounded
+  up, down to level 0, a single pixel. Each level is cut into `tile_size` tiles that also take in `overlap` pixels of
+  their neighbours on every side, as in Deep Zoom; with `overlap: 0`, the tile at `{column, row}` of a level that is
+  `2^k` times smaller than the image is the IIIF tile of region `{column, row} * tile_size * 2^k` at scale factor `2^k`.
+
+  Rows go in from the top down, either pushed by the caller with `push/2` or read from a source by `reduce/3`. Each
+  level keeps only the rows of its current row of tiles, lower levels are built from 2x2 averages of the rows above as
+  they arrive, and tiles are encoded and handed back as soon as their last row is in. Peak memory stays around a row
+  of tiles per level, whatever the size of the image.
+
+  Tiles are `{level, column, row, bytes}` tuples. Pixels are `{:u, 8}`.
+  """
+
+  # Suppress dialyzer warnings for functions that call NIFs
+  @dialyzer {:nowarn_function, new: 3, open: 2, push: 2, finish: 1, reduce: 3}
+
+  @enforce_keys [:ref, :width, :height, :channels, :tile_size, :overlap, :format, :source]
+  defstruct [:ref, :width, :height, :channels, :tile_size, :overlap, :format, :source]
+
+  @type tile :: {non_neg_integer(), non_neg_integer(), non_neg_integer(), binary()}
+  @type format :: :jpeg | :png | :jxl
+
+  @type t :: %__MODULE__{
+          ref: reference(),
+          width: pos_integer(),
+          height: pos_integer(),
+          channels: 1..4,
+          tile_size: pos_integer(),
+          overlap: non_neg_integer(),
+          format: format(),
+          source: nil | :native | {:tensor, Nx.Tensor.t()} | {:tiff, Imagex.Tiff.t(), non_neg_integer()}
+        }
+
+  @options [
+    tile_size: 254,
+    overlap: 1,
+    format: :jpeg,
+    quality: 75,
+    compression_level: 6,
+    distance: 1.0,
+    effort: 7,
+    threads: :auto
+  ]
+
+  @doc """
+  Creates a pyramid for an image of `width` x `height` pixels with `channels` channels, whose rows are given with
+  `push/2`.
+
+  Options:
+
+    * `:tile_size` - the size of the tiles, not counting the overlap. Defaults to `254`.
+    * `:overlap` - the pixels each tile shares with its neighbours on every side. Defaults to `1`.
+    * `:format` - the tile format, `:jpeg`, `:png` or `:jxl`. Defaults to `:jpeg`, which needs 1 or 3 channels.
+    * `:quality` - the JPEG quality, `1..100`. Defaults to `75`.
+    * `:compression_level` - the PNG compression level, `0..9`. Defaults to `6`.
+    * `:distance` and `:effort` - the JPEG XL distance, where `0` is lossless, and effort. Default to `1.0` and `7`.
+    * `:threads` - the number of threads that encode the tiles of a row, or `:auto` for one per core. Defaults to
+      `:auto`.
+  """
+  @spec new(pos_integer(), pos_integer(), keyword()) :: {:ok, t()} | {:error, String.t()}
+  def new(width, height, options \\ []) when is_integer(width) and is_integer(height) do
+    {channels, options} = Keyword.pop(options, :channels, 3)
+
+    with {:ok, {tile_size, overlap, format, {format_id, quality, effort, threads}}} <- tile_options(options),
+         {:ok, ref} <-
+           Imagex.C.pyramid_new(width, height, channels, tile_size, overlap, format_id, quality, effort, threads) do
+      {:ok, build(ref, width, height, channels, tile_size, overlap, format, nil)}
+    end
+  end
+
+  @doc """
+  Creates a pyramid whose rows are read from `source` by `reduce/3`, in bands, so that the full image is never
+  decoded at once.
+
+  `source` is the path to a JPEG or TIFF file, an `Imagex.Tiff` document, or an image already in memory as a tensor
+  or an `Imagex.Image`. JPEGs are decoded natively a band of rows at a time, with CMYK converted to RGB. TIFF pages are
+  rendered a band at a time, which only decodes the strips or tiles of the band, except for pages that are not stored
+  top-down, which are rendered whole once; their alpha channel is dropped for JPEG tiles.
+
+  Options are those of `new/3`, and `:page` to pick the page of a TIFF, which defaults to `0`.
+  """
+  @spec open(String.t() | Imagex.Tiff.t() | Nx.Tensor.t() | Imagex.Image.t(), keyword()) ::
+          {:ok, t()} | {:error, String.t()}
+  def open(source, options \\ [])
+
+  def open(%Imagex.Image{tensor: tensor}, options), do: open(tensor, options)
+
+  def open(%Nx.Tensor{} = tensor, options) do
+    {height, width, channels} =
+      case Nx.shape(tensor) do
+        {height, width} -> {height, width, 1}
+        shape -> shape
+      end
+
+    if Nx.type(tensor) == {:u, 8} do
+      with {:ok, pyramid} <- new(width, height, Keyword.put(options, :channels, channels)) do
+        {:ok, %__MODULE__{pyramid | source: {:tensor, tensor}}}
+      end
+    else
+      {:error, "pyramids only support {:u, 8} pixels, got: #{inspect(Nx.type(tensor))}"}
+    end
+  end
+
+  def open(%Imagex.Tiff{num_pages: num_pages} = tiff, options) do
+    {page, options} = Keyword.pop(options, :page, 0)
+    channels = if Keyword.get(options, :format, :jpeg) == :jpeg, do: 3, else: 4
+
+    with true <- is_integer(page) and page >= 0 and page < num_pages || {:error, "page index out of bounds"},
+         {:ok, {width, height, orientation}} <- Imagex.C.tiff_page_size(tiff.ref, page) do
+      open_tiff_page(tiff, page, width, height, orientation, Keyword.put(options, :channels, channels))
+    end
+  end
+
+  def open(path, options) when is_binary(path) do
+    with {:ok, {file, format_id}} <- Imagex.C.open_path(path) do
+      case format_id do
+        # JPEG
+        1 ->
+          with {:ok, {tile_size, overlap, format, {format_id, quality, effort, threads}}} <-
+                 tile_options(Keyword.delete(options, :page)),
+               {:ok, {ref, width, height, channels}} <-
+                 Imagex.C.pyramid_open_jpeg(file, tile_size, overlap, format_id, quality, effort, threads) do
+            {:ok, build(ref, width, height, channels, tile_size, overlap, format, :native)}
+          end
+
+        # TIFF
+        6 ->
+          with {:ok, {ref, num_pages}} <- Imagex.C.tiff_load_mapped(file) do
+            open(%Imagex.Tiff{ref: ref, num_pages: num_pages}, options)
+          end
+
+        _ ->
+          {:error, "pyramids can only read JPEG and TIFF files"}
+      end
+    end
+  end
+
+  @doc """
+  Adds the next rows of the image, a tensor of shape `{num_rows, width}` or `{num_rows, width, channels}`, or a binary
+  holding whole rows in that layout. Returns `{:ok, tiles}` with the tiles those rows complete, which may be none.
+  """
+  @spec push(t(), Nx.Tensor.t() | binary()) :: {:ok, list(tile())} | {:error, String.t()}
+  def push(%__MODULE__{ref: ref}, rows) when is_binary(rows), do: Imagex.C.pyramid_push(ref, rows)
+
+  def push(%__MODULE__{width: width, channels: channels} = pyramid, %Nx.Tensor{} = rows) do
+    case {Nx.type(rows), Nx.shape(rows)} do
+      {{:u, 8}, {_num_rows, ^width}} when channels == 1 -> push(pyramid, Nx.to_binary(rows))
+      {{:u, 8}, {_num_rows, ^width, ^channels}} -> push(pyramid, Nx.to_binary(rows))
+      _ -> {:error, "rows must be a {:u, 8} tensor of shape {num_rows, #{width}, #{channels}}"}
+    end
+  end
+
+  @doc """
+  Completes the pyramid once all of its rows are in. Every tile has been returned by then, so this only checks that
+  nothing is missing.
+  """
+  @spec finish(t()) :: {:ok, list(tile())} | {:error, String.t()}
+  def finish(%__MODULE__{ref: ref}), do: Imagex.C.pyramid_finish(ref)
+
+  @doc """
+  Reads every row of the pyramid's source, a band of `tile_size` rows at a time, calling `fun` with each tile and the
+  accumulator as the tiles are encoded. Returns `{:ok, acc}`, or the first error.
+
+      {:ok, pyramid} = Imagex.Pyramid.open("scan.jpg", tile_size: 510)
+
+      {:ok, count} =
+        Imagex.Pyramid.reduce(pyramid, 0, fn {level, column, row, bytes}, count ->
+          File.write!("scan_files/\#{level}/\#{column}_\#{row}.jpg", bytes)
+          count + 1
+        end)
+  """
+  @spec reduce(t(), acc, (tile(), acc -> acc)) :: {:ok, acc} | {:error, String.t()} when acc: term()
+  def reduce(%__MODULE__{source: nil}, _acc, _fun), do: {:error, "the pyramid has no source, push its rows instead"}
+
+  def reduce(%__MODULE__{height: height, tile_size: band_rows} = pyramid, acc, fun) do
+    0
+    |> Stream.iterate(&(&1 + band_rows))
+    |> Stream.take_while(&(&1 < height))
+    |> Enum.reduce_while({:ok, acc}, fn y, {:ok, acc} ->
+      case read_band(pyramid, y, min(band_rows, height - y)) do
+        {:ok, tiles} -> {:cont, {:ok, Enum.reduce(tiles, acc, fun)}}
+        error -> {:halt, error}
+      end
+    end)
+    |> case do
+      {:ok, acc} ->
+        with {:ok, tiles} <- finish(pyramid), do: {:ok, Enum.reduce(tiles, acc, fun)}
+
+      error ->
+        error
+    end
+  end
+
+  @doc """
+  Returns the number of the last level, the full image, which is `ceil(log2(max(width, height)))`.
+  """
+  @spec max_level(t()) :: non_neg_integer()
+  def max_level(%__MODULE__{width: width, height: height}), do: max_level(width, height, 0)
+
+  defp max_level(1, 1, level), do: level
+  defp max_level(width, height, level), do: max_level(div(width + 1, 2), div(height + 1, 2), level + 1)
+
+  @doc """
+  Returns the Deep Zoom (`.dzi`) descriptor of the pyramid.
+  """
+  @spec dzi(t()) :: String.t()
+  def dzi(%__MODULE__{} = pyramid) do
+    extension = %{jpeg: "jpg", png: "png", jxl: "jxl"}[pyramid.format]
+
+    ~s(<?xml version="1.0" encoding="UTF-8"?>\n) <>
+      ~s(<Image xmlns="http://schemas.microsoft.com/deepzoom/2008" Format="#{extension}" ) <>
+      ~s(Overlap="#{pyramid.overlap}" TileSize="#{pyramid.tile_size}">) <>
+      ~s(<Size Width="#{pyramid.width}" Height="#{pyramid.height}"/></Image>\n)
+  end
+
+  # Bands of pages stored top-down (orientation 1) are rendered one at a time. Any other orientation can only be
+  # rendered whole, so those pages are rendered once and tiled from memory.
+  defp open_tiff_page(tiff, page, width, height, orientation, options) when orientation == 1 do
+    with {:ok, pyramid} <- new(width, height, options) do
+      {:ok, %__MODULE__{pyramid | source: {:tiff, tiff, page}}}
+    end
+  end
+
+  defp open_tiff_page(tiff, page, _width, _height, _orientation, options) do
+    with {:ok, %Imagex.Image{tensor: rendered}} <- Imagex.Tiff.render_page(tiff, page) do
+      open(Nx.slice_along_axis(rendered, 0, Keyword.get(options, :channels), axis: 2), options)
+    end
+  end
+
+  defp read_band(%__MODULE__{source: :native, ref: ref}, _y, num_rows), do: Imagex.C.pyramid_read(ref, num_rows)
+
+  defp read_band(%__MODULE__{source: {:tensor, tensor}} = pyramid, y, num_rows),
+    do: push(pyramid, Nx.slice_along_axis(tensor, y, num_rows, axis: 0))
+
+  defp read_band(%__MODULE__{source: {:tiff, tiff, page}, width: width} = pyramid, y, num_rows) do
+    with {:ok, %Imagex.Image{tensor: band}} <- Imagex.Tiff.render_page(tiff, page, crop: {0, y, width, num_rows}) do
+      push(pyramid, Nx.slice_along_axis(band, 0, pyramid.channels, axis: 2))
+    end
+  end
+
+  defp tile_options(options) do
+    with {:ok, options} <- Keyword.validate(options, @options),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)) do
+      tile_size = Keyword.get(options, :tile_size)
+      overlap = Keyword.get(options, :overlap)
+      effort = Keyword.get(options, :effort)
+
+      case Keyword.get(options, :format) do
+        :jpeg -> {:ok, {tile_size, overlap, :jpeg, {0, Keyword.get(options, :quality) * 1.0, 0, threads}}}
+        :png -> {:ok, {tile_size, overlap, :png, {1, Keyword.get(options, :compression_level) * 1.0, 0, threads}}}
+        :jxl -> {:ok, {tile_size, overlap, :jxl, {2, Keyword.get(options, :distance) * 1.0, effort, threads}}}
+        format -> {:error, "unsupported tile format: #{inspect(format)}"}
+      end
+    end
+  end
+
+  defp build(ref, width, height, channels, tile_size, overlap, format, source) do
+    %__MODULE__{
+      ref: ref,
+      width: width,
+      height: height,
+      channels: channels,
+      tile_size: tile_size,
+      overlap: overlap,
+      format: format,
+      source: source
+    }
+  end
+end
@@ -0,0 +1,102 @@
+defmodule Imagex.Quality do
+  @moduledoc """
+  Full-reference image quality metrics, for comparing an encoded and decoded image with its original.
+
+    * `:psnr` - the peak signal-to-noise ratio in dB over all samples, alpha included, or `:infinity` for identical
+      images.
+    * `:ssim` - the structural similarity of the luma of the images, with an 11x11 Gaussian window. At most `1`, which
+      only identical images reach.
+    * `:ms_ssim` - the multi-scale structural similarity over five scales, from `0` to `1`. Needs images of at least
+      176x176 pixels.
+
+  The metrics are computed natively, on several threads, and don't depend on the number of threads. Samples are
+  scaled to `0..1` first, so they are comparable across bit depths.
+  """
+
+  # Suppress dialyzer warnings for functions that call NIFs
+  @dialyzer {:nowarn_function, compare: 3}
+
+  @type metric :: :psnr | :ssim | :ms_ssim
+  @type image :: binary() | Nx.Tensor.t() | Imagex.Image.t()
+
+  @doc """
+  Compares a distorted image with its reference. Both are tensors, `Imagex.Image` structs or encoded images, which are
+  decoded first, and must have the same shape and type: `{:u, 8}`, `{:u, 16}` or `{:f, 32}` (in `0..1`).
+
+  Returns `{:ok, metrics}`, a map with a float for each requested metric.
+
+  Options:
+
+    * `:metrics` - a list of `t:metric/0`. Defaults to `[:psnr, :ssim]`.
+    * `:threads` - number of threads, or `:auto` for one per core. Defaults to `:auto`.
+  """
+  @spec compare(image(), image(), keyword()) :: {:ok, %{metric() => float() | :infinity}} | {:error, String.t()}
+  def compare(reference, distorted, options \\ []) do
+    with {:ok, options} <- Keyword.validate(options, metrics: [:psnr, :ssim], threads: :auto),
+         {:ok, metrics} <- parse_metrics(Keyword.get(options, :metrics)),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)),
+         {:ok, reference} <- to_tensor(reference),
+         {:ok, distorted} <- to_tensor(distorted),
+         {:ok, {height, width, channels}, bit_depth} <- layout(reference, distorted),
+         {:ok, {mse, ssim, ms_ssim}} <-
+           Imagex.C.image_quality(
+             Nx.to_binary(reference),
+             Nx.to_binary(distorted),
+             width,
+             height,
+             channels,
+             bit_depth,
+             :ssim in metrics,
+             :ms_ssim in metrics,
+             threads
+           ) do
+      values = %{psnr: psnr(mse), ssim: ssim, ms_ssim: ms_ssim}
+      {:ok, Map.take(values, metrics)}
+    end
+  end
+
+  defp psnr(mse) when mse == 0, do: :infinity
+  defp psnr(mse), do: -10 * :math.log10(mse)
+
+  defp to_tensor(%Nx.Tensor{} = tensor), do: {:ok, tensor}
+  defp to_tensor(%Imagex.Image{tensor: tensor}), do: {:ok, tensor}
+
+  defp to_tensor(bytes) when is_binary(bytes) do
+    case Imagex.decode(bytes) do
+      {:ok, %Imagex.Image{tensor: tensor}} -> {:ok, tensor}
+      {:ok, _document} -> {:error, "only single images can be compared"}
+      error -> error
+    end
+  end
+
+  defp layout(reference, distorted) do
+    shape = Nx.shape(reference)
+    type = Nx.type(reference)
+
+    cond do
+      Nx.shape(distorted) != shape or Nx.type(distorted) != type ->
+        {:error,
+         "images must have the same shape and type, got: #{inspect({shape, type})} and " <>
+           inspect({Nx.shape(distorted), Nx.type(distorted)})}
+
+      type not in [{:u, 8}, {:u, 16}, {:f, 32}] ->
+        {:error, "unsupported pixel type: #{inspect(type)}"}
+
+      true ->
+        case shape do
+          {height, width} -> {:ok, {height, width, 1}, elem(type, 1)}
+          {_height, _width, channels} when channels in 1..4 -> {:ok, shape, elem(type, 1)}
+          _ -> {:error, "unsupported image shape: #{inspect(shape)}"}
+        end
+    end
+  end
+
+  defp parse_metrics(metrics) when is_list(metrics) and metrics != [] do
+    case Enum.reject(metrics, &(&1 in [:psnr, :ssim, :ms_ssim])) do
+      [] -> {:ok, Enum.uniq(metrics)}
+      [metric | _] -> {:error, "unsupported metric: #{inspect(metric)}"}
+    end
+  end
+
+  defp parse_metrics(metrics), do: {:error, "metrics must be a non-empty list, got: #{inspect(metrics)}"}
+end
@@ -4,25 +4,50 @@ defmodule Imagex.Tiff do
 
   @type t :: %__MODULE__{ref: reference(), num_pages: integer()}
 
-  @spec render_page(t(), integer()) :: {:ok, Imagex.Image.t()} | {:error, String.t()}
-  def render_page(%Imagex.Tiff{ref: ref, num_pages: num_pages}, page_idx)
+  @doc """
+  Renders the page at `page_idx` as an RGBA image.
+
+  Options:
+
+    * `:crop` - a `{x, y, width, height}` region of the page to render, clamped to the page. For tiled and stripped
+      pages stored top-left first, only the tiles or strips that intersect the region are decoded.
+    * `:into` - an `Imagex.PixelBuffer` to render the page into, instead of a new binary. The tensor is a view of the
+      buffer, whose memory later decodes reuse once the tensor is gone.
+  """
+  @spec render_page(t(), integer(), keyword()) :: {:ok, Imagex.Image.t()} | {:error, String.t()}
+  def render_page(tiff, page_idx, options \\ [])
+
+  def render_page(%Imagex.Tiff{ref: ref, num_pages: num_pages}, page_idx, options)
       when page_idx >= 0 and page_idx < num_pages do
-    case Imagex.C.tiff_render_page(ref, page_idx) do
-      {:ok, {pixels, width, height, channels, bit_depth, _exif_data, _png_texts, _xml_boxes, _jumb_boxes}} ->
-        shape = if channels == 1, do: {height, width}, else: {height, width, channels}
-        tensor = Nx.from_binary(pixels, {:u, bit_depth}) |> Nx.reshape(shape)
-        {:ok, %Imagex.Image{tensor: tensor}}
-
-      error ->
-        error
+    with {:ok, options} <- Keyword.validate(options, crop: nil, into: nil),
+         {:ok, {x, y, width, height}} <- Imagex.parse_crop(Keyword.get(options, :crop)) do
+      result =
+        case Keyword.get(options, :into) do
+          nil -> Imagex.Budget.run(fn -> Imagex.C.tiff_render_page(ref, page_idx, x, y, width, height) end)
+          %Imagex.PixelBuffer{ref: buffer} ->
+            Imagex.Budget.run(fn -> Imagex.C.tiff_render_page_into(buffer, ref, page_idx, x, y, width, height) end)
+          into -> {:error, "into must be an Imagex.PixelBuffer, got: #{inspect(into)}"}
+        end
+
+      case result do
+        {:ok,
+         {pixels, width, height, channels, bit_depth, _exif_data, _png_texts, _xml_boxes, _jumb_boxes, _palette, _xmp,
+          _icc_profile, _app0_segments}} ->
+          shape = if channels == 1, do: {height, width}, else: {height, width, channels}
+          tensor = Nx.from_binary(pixels, {:u, bit_depth}) |> Nx.reshape(shape)
+          {:ok, %Imagex.Image{tensor: tensor}}
+
+        error ->
+          error
+      end
     end
   end
 
-  def render_page(_, page_idx) when page_idx < 0 do
+  def render_page(_, page_idx, _options) when page_idx < 0 do
     {:error, "page index must be non-negative"}
   end
 
-  def render_page(%Imagex.Tiff{num_pages: num_pages}, page_idx) when page_idx >= num_pages do
+  def render_page(%Imagex.Tiff{num_pages: num_pages}, page_idx, _options) when page_idx >= num_pages do
     {:error, "page index out of bounds"}
   end
 end
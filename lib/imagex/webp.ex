@@ -0,0 +1,32 @@
+defmodule Imagex.Webp do
+  @moduledoc false
+
+  @doc """
+  Converts the validated `Imagex.encode/3` WebP options into the arguments expected by `Imagex.C.webp_compress/11`:
+  `{quality, lossless, method, multithreaded}`.
+
+  libwebp uses at most one extra thread, so any `:threads` value above 1 (or `:auto`) turns it on.
+  """
+  @spec compress_options(keyword()) :: {:ok, {float(), boolean(), integer(), boolean()}} | {:error, String.t()}
+  def compress_options(options) do
+    with {:ok, quality} <- parse_quality(Keyword.get(options, :quality)),
+         {:ok, lossless} <- parse_lossless(Keyword.get(options, :lossless)),
+         {:ok, method} <- parse_method(Keyword.get(options, :method)),
+         {:ok, threads} <- Imagex.Options.parse_threads(Keyword.get(options, :threads)) do
+      {:ok, {quality, lossless, method, threads != 1}}
+    end
+  end
+
+  @spec validate_type(Nx.Type.t()) :: :ok | {:error, String.t()}
+  def validate_type({:u, 8}), do: :ok
+  def validate_type(type), do: {:error, "WebP only supports {:u, 8} pixels, got: #{inspect(type)}"}
+
+  defp parse_quality(quality) when is_number(quality) and quality >= 0 and quality <= 100, do: {:ok, quality / 1}
+  defp parse_quality(quality), do: {:error, "WebP quality must be a number in 0..100, got: #{inspect(quality)}"}
+
+  defp parse_lossless(lossless) when is_boolean(lossless), do: {:ok, lossless}
+  defp parse_lossless(lossless), do: {:error, "lossless must be a boolean, got: #{inspect(lossless)}"}
+
+  defp parse_method(method) when method in 0..6, do: {:ok, method}
+  defp parse_method(method), do: {:error, "WebP method must be an integer in 0..6, got: #{inspect(method)}"}
+end
@@ -19,6 +19,7 @@ defmodule Imagex.MixProject do
   # Run "mix help compile.app" to learn about applications.
   def application do
     [
+      mod: {Imagex.Application, []},
       extra_applications: [:logger]
     ]
   end
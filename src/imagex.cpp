@@ -1,8 +1,20 @@
 #include "expp.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <coroutine>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <erl_nif.h>
+#include <exception>
+#include <fcntl.h>
+#include <functional>
 #include <jpeglib.h>
 #include <jxl/decode.h>
 #include <jxl/decode_cxx.h>
@@ -12,18 +24,29 @@
 #include <jxl/resizable_parallel_runner_cxx.h>
 #include <jxl/thread_parallel_runner.h>
 #include <jxl/thread_parallel_runner_cxx.h>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <png.h>
 #include <poppler/cpp/poppler-document.h>
 #include <poppler/cpp/poppler-page-renderer.h>
 #include <poppler/cpp/poppler-page.h>
 #include <poppler/cpp/poppler-version.h>
+#include <span>
 #include <sstream>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <tiffio.h>
 #include <tiffio.hxx>
 #include <tuple>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
+#include <webp/decode.h>
+#include <webp/encode.h>
+#include <zlib.h>
 
 using namespace std;
 using namespace expp;
@@ -31,1190 +54,8481 @@ using namespace expp;
 using text_chunk_t = std::tuple<std::vector<uint8_t>, std::vector<uint8_t>, std::vector<uint8_t>, std::vector<uint8_t>>;
 using text_chunks_t = std::vector<text_chunk_t>;
 constexpr string_view JPEG_XMP_APP1_IDENTIFIER = "http://ns.adobe.com/xap/1.0/\0"sv;
+constexpr string_view JPEG_EXIF_APP1_IDENTIFIER = "Exif\0\0"sv;
+constexpr string_view JPEG_ICC_APP2_IDENTIFIER = "ICC_PROFILE\0"sv;
+constexpr string_view PNG_XMP_KEYWORD = "XML:com.adobe.xmp";
 
-struct decompress_result_t
+
+static bool starts_with(const uint8_t* data, size_t size, string_view prefix)
 {
-    binary pixels;
-    uint32_t width;
-    uint32_t height;
-    uint32_t channels;
-    uint32_t bit_depth;
-    optional<binary> exif;
-    text_chunks_t text_chunks;
-    std::vector<binary> xml_boxes;
-    std::vector<binary> jumb_boxes;
-};
+    return size >= prefix.size() && std::equal(prefix.begin(), prefix.end(), data);
+}
 
 
-namespace expp
-{
-template <>
-struct type_cast<decompress_result_t>
+// Coroutine return type that runs one of the yielding decoders straight through on the calling thread, for callers
+// that are not on a scheduler thread and so have nothing to yield to. Intermediate `co_yield nullopt`s are ignored and
+// the last value yielded is kept.
+template <typename T>
+struct blocking
 {
-    static ERL_NIF_TERM to_term(ErlNifEnv* env, const decompress_result_t& result) noexcept
+    struct promise_type
     {
-        return enif_make_tuple9(
-            env,
-            type_cast<binary>::to_term(env, result.pixels),
-            type_cast<uint32_t>::to_term(env, result.width),
-            type_cast<uint32_t>::to_term(env, result.height),
-            type_cast<uint32_t>::to_term(env, result.channels),
-            type_cast<uint32_t>::to_term(env, result.bit_depth),
-            type_cast<optional<binary>>::to_term(env, result.exif),
-            type_cast<text_chunks_t>::to_term(env, result.text_chunks),
-            type_cast<std::vector<binary>>::to_term(env, result.xml_boxes),
-            type_cast<std::vector<binary>>::to_term(env, result.jumb_boxes));
-    }
-};
-}  // namespace expp
+        optional<T> value;
+        std::exception_ptr exception;
+
+        blocking get_return_object()
+        {
+            return blocking{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_always final_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never yield_value(std::nullopt_t) noexcept
+        {
+            return {};
+        }
+        template <typename U>
+        std::suspend_never yield_value(U&& new_value)
+        {
+            value.emplace(std::forward<U>(new_value));
+            return {};
+        }
+        void return_void() noexcept
+        {}
+        void unhandled_exception() noexcept
+        {
+            exception = std::current_exception();
+        }
+    };
 
+    std::coroutine_handle<promise_type> handle;
 
-// RAII guard for jpeg_decompress_struct.
-struct jpeg_decompress_guard
-{
-    jpeg_decompress_struct* cinfo;
-    explicit jpeg_decompress_guard(jpeg_decompress_struct* c) :
-        cinfo(c)
+    explicit blocking(std::coroutine_handle<promise_type> h) :
+        handle(h)
     {}
-    ~jpeg_decompress_guard()
+    blocking(const blocking&) = delete;
+    blocking& operator=(const blocking&) = delete;
+    ~blocking()
     {
-        if (cinfo)
-            jpeg_destroy_decompress(cinfo);
+        handle.destroy();
     }
-    jpeg_decompress_guard(const jpeg_decompress_guard&) = delete;
-    jpeg_decompress_guard& operator=(const jpeg_decompress_guard&) = delete;
-    void release()
+
+    // The coroutine has already run to completion by the time it returns this object.
+    T get()
     {
-        cinfo = nullptr;
+        if (handle.promise().exception)
+            std::rethrow_exception(handle.promise().exception);
+        return std::move(handle.promise().value.value());
     }
 };
 
 
-// RAII guard for jpeg_compress_struct.
-struct jpeg_compress_guard
+// Thrown by the libjpeg/libpng error callbacks. It is an erl_error, so it becomes {:error, message} when it escapes a
+// NIF, and it keeps the message around for callers that catch it themselves.
+struct codec_error : erl_error<string>
 {
-    jpeg_compress_struct* cinfo;
-    explicit jpeg_compress_guard(jpeg_compress_struct* c) :
-        cinfo(c)
+    string message;
+
+    explicit codec_error(string error_message) :
+        erl_error<string>(error_message),
+        message(std::move(error_message))
     {}
-    ~jpeg_compress_guard()
-    {
-        if (cinfo)
-            jpeg_destroy_compress(cinfo);
-    }
-    jpeg_compress_guard(const jpeg_compress_guard&) = delete;
-    jpeg_compress_guard& operator=(const jpeg_compress_guard&) = delete;
-    void release()
-    {
-        cinfo = nullptr;
-    }
 };
 
 
-void jpeg_error_exit(j_common_ptr cinfo)
+// The message of the exception being handled, for reporting exceptions caught on threads they must not escape.
+static string current_exception_message()
 {
-    char error_message[JMSG_LENGTH_MAX];
-    (*(cinfo->err->format_message))(cinfo, error_message);
-    throw erl_error<string>(error_message);
+    try
+    {
+        throw;
+    }
+    catch (codec_error& e)
+    {
+        return std::move(e.message);
+    }
+    catch (std::bad_alloc&)
+    {
+        return "out of memory";
+    }
+    catch (std::exception& e)
+    {
+        return e.what();
+    }
+    catch (...)
+    {
+        return "unknown error";
+    }
 }
 
 
-yielding<expected<decompress_result_t, string>> jpeg_decompress(std::vector<uint8_t> jpeg_bytes)
+// Runs f(i) for every i in [0, n) on up to num_threads threads (0 means one per hardware thread), and returns once
+// all of them have finished. An exception thrown by f(i) would terminate the VM if it escaped its thread, so it is
+// caught there and its message passed to on_error(i, message), to be reported as the error of that item.
+template <typename F, typename OnError>
+static void parallel_for(size_t n, size_t num_threads, F&& f, OnError&& on_error)
 {
-    struct jpeg_error_mgr err;
-    struct jpeg_decompress_struct cinfo;
-    jpeg_decompress_guard guard(&cinfo);
-    yielding_timer timer;
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(n, num_threads);
 
-    // create decompressor
-    cinfo.err = jpeg_std_error(&err);
-    jpeg_create_decompress(&cinfo);
-    cinfo.do_fancy_upsampling = FALSE;
-    err.error_exit = jpeg_error_exit;
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < n;)
+        {
+            try
+            {
+                f(i);
+            }
+            catch (...)
+            {
+                on_error(i, current_exception_message());
+            }
+        }
+    };
 
-    // set source buffer
-    jpeg_mem_src(&cinfo, jpeg_bytes.data(), jpeg_bytes.size());
+    vector<jthread> threads;
+    for (size_t i = 1; i < num_threads; i++)
+        threads.emplace_back(worker);
+    worker();
+}
 
-    // read jpeg header
-    jpeg_read_header(&cinfo, TRUE);
 
-    // decompress
-    jpeg_start_decompress(&cinfo);
+// parallel_for for work that fails as a whole: the first error is thrown as a codec_error once all threads finished.
+template <typename F>
+static void parallel_for(size_t n, size_t num_threads, F&& f)
+{
+    std::mutex mutex;
+    optional<string> error;
+    parallel_for(n, num_threads, std::forward<F>(f), [&](size_t, string message) {
+        std::lock_guard lock(mutex);
+        if (!error.has_value())
+            error = std::move(message);
+    });
+    if (error.has_value())
+        throw codec_error(std::move(error.value()));
+}
 
-    // Save dimensions before destroying the struct
-    const uint32_t out_width = cinfo.output_width;
-    const uint32_t out_height = cinfo.output_height;
-    const uint32_t num_components = static_cast<uint32_t>(cinfo.num_components);
 
-    unsigned output_bytes = out_width * out_height * num_components;
-    binary output(output_bytes);
+// A region of the image to decode instead of all of it, in pixels of the decoded image. A width of 0 means the whole
+// image, as with jpeg_transform's crop.
+struct crop_region
+{
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
 
-    // read scanlines
-    const auto row_stride = out_width * num_components;
-    while (cinfo.output_scanline < cinfo.output_height)
+    bool empty() const
     {
-        auto row_ptr = output.data + cinfo.output_scanline * row_stride;
-        jpeg_read_scanlines(&cinfo, &row_ptr, 1);
-
-        if (timer.times_up())
-        {
-            co_yield nullopt;
-            timer.reset();
-        }
+        return width == 0;
     }
 
-    // clean up
-    jpeg_finish_decompress(&cinfo);
-    guard.release();
-    jpeg_destroy_decompress(&cinfo);
+    // The part of the region inside an image of the given size, or the whole image if the region is empty.
+    expected<crop_region, string_view> clip(uint32_t image_width, uint32_t image_height) const
+    {
+        if (empty())
+            return crop_region{0, 0, image_width, image_height};
+        if (height == 0 || x >= image_width || y >= image_height)
+            return std::unexpected("crop region is outside of the image");
+        return crop_region{x, y, std::min(width, image_width - x), std::min(height, image_height - y)};
+    }
+};
 
-    co_yield decompress_result_t{
-        .pixels = std::move(output),
-        .width = out_width,
-        .height = out_height,
-        .channels = num_components,
-        .bit_depth = 8u,
-    };
-}
 
+// Returned by decode_budget::reserve when the budget is held by other decodes. Imagex.Budget queues the decodes that
+// get it and runs them again once enough of the budget has been released.
+constexpr string_view DECODE_BUDGET_BUSY = "decode budget busy";
 
-yielding<expected<binary, string>> jpeg_compress(
-    vector<uint8_t> pixels,
-    uint32_t width,
-    uint32_t height,
-    uint32_t channels,
-    int quality,
-    optional<vector<uint8_t>> exif_binary,
-    optional<vector<uint8_t>> xmp_binary)
-{
-    struct jpeg_error_mgr err;
-    struct jpeg_compress_struct cinfo;
-    jpeg_compress_guard guard(&cinfo);
-    yielding_timer timer;
 
-    // create the compressor
-    cinfo.err = jpeg_std_error(&err);
-    jpeg_create_compress(&cinfo);
-    err.error_exit = jpeg_error_exit;
+// Whether the decodes on this thread may take the turn of the decode that Imagex.Budget is retrying. It is cleared for
+// the decodes of callers that don't go through its queue: batch workers, incremental decoders and fresh async jobs.
+static thread_local bool budget_turn_allowed = true;
 
-    uint8_t* buf = nullptr;
-    unsigned long outsize = 0;
-    jpeg_mem_dest(&cinfo, &buf, &outsize);
 
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    cinfo.input_components = channels;
-    cinfo.in_color_space = JCS_RGB;
+// Clears budget_turn_allowed on this thread for as long as it lives, or sets it to allowed.
+struct budget_turn_scope
+{
+    bool previous;
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    explicit budget_turn_scope(bool allowed = false) :
+        previous(std::exchange(budget_turn_allowed, allowed))
+    {}
+    budget_turn_scope(const budget_turn_scope&) = delete;
+    budget_turn_scope& operator=(const budget_turn_scope&) = delete;
+    ~budget_turn_scope()
+    {
+        budget_turn_allowed = previous;
+    }
+};
 
-    // do the actual compression
-    jpeg_start_compress(&cinfo, TRUE);
 
-    if (exif_binary.has_value())
+// Node-wide admission control for decoded pixels. Decoders reserve the size of their output here once the header has
+// told them how large it is, before allocating it, and give it back when they return. Images of more than max_pixels
+// pixels are rejected outright. Reservations that would take more than max_bytes in flight are rejected, or turned
+// away as busy for Imagex.Budget to retry; nothing here waits, as a decode that blocked its thread could be waiting for
+// one that can't run. While Imagex.Budget has decodes queued, every reservation is busy except on the turn of the one
+// it is retrying, so later decodes can't keep a large one waiting. A limit of 0 is no limit, which is the default.
+struct decode_budget
+{
+    std::mutex mutex;
+    uint64_t max_pixels = 0;
+    uint64_t max_bytes = 0;
+    bool reject_when_exhausted = false;
+    uint64_t bytes_in_use = 0;
+    uint64_t admitted = 0;
+    uint64_t rejected = 0;
+
+    // Admits a decode of pixels pixels and bytes bytes. Throws a codec_error when it is rejected, whose message is
+    // DECODE_BUDGET_BUSY when it may be admitted once earlier decodes release enough of the budget.
+    void reserve(uint64_t pixels, uint64_t bytes)
     {
-        const auto& exif = exif_binary.value();
-        vector<uint8_t> app1_payload;
-        app1_payload.reserve(6 + exif.size());
-        app1_payload.insert(app1_payload.end(), {'E', 'x', 'i', 'f', 0, 0});
-        app1_payload.insert(app1_payload.end(), exif.data(), exif.data() + exif.size());
+        std::lock_guard lock(mutex);
+        check_limits(pixels, bytes);
 
-        if (app1_payload.size() > 65533)
+        const bool behind_queue = waiting > 0 && !(turn_open && budget_turn_allowed);
+        if (behind_queue || (max_bytes != 0 && bytes_in_use + bytes > max_bytes))
         {
-            co_yield std::unexpected("EXIF metadata is too large for a JPEG APP1 segment");
-            co_return;
+            if (reject_when_exhausted)
+                reject("memory budget exhausted");
+            throw codec_error(string(DECODE_BUDGET_BUSY));
         }
 
-        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1_payload.data(), static_cast<unsigned int>(app1_payload.size()));
+        bytes_in_use += bytes;
+        admitted++;
     }
 
-    if (xmp_binary.has_value())
+    // Rejects a decode of pixels pixels and bytes bytes that is over the limits, without admitting it.
+    void check(uint64_t pixels, uint64_t bytes)
     {
-        const auto& xmp = xmp_binary.value();
-        vector<uint8_t> app1_payload;
-        app1_payload.reserve(JPEG_XMP_APP1_IDENTIFIER.size() + xmp.size());
-        app1_payload.insert(app1_payload.end(), JPEG_XMP_APP1_IDENTIFIER.begin(), JPEG_XMP_APP1_IDENTIFIER.end());
-        app1_payload.insert(app1_payload.end(), xmp.data(), xmp.data() + xmp.size());
+        std::lock_guard lock(mutex);
+        check_limits(pixels, bytes);
+    }
 
-        if (app1_payload.size() > 65533)
+    // Whether Imagex.Budget has decodes queued, which new ones have to wait behind.
+    bool queued()
+    {
+        std::lock_guard lock(mutex);
+        return waiting > 0;
+    }
+
+    // Turns the busy error of a decode that can't be retried, such as one image of a batch or an incremental decoder
+    // that has consumed its input, into a rejection. Other errors are returned as they are.
+    string reject_busy(string message)
+    {
+        if (message != DECODE_BUDGET_BUSY)
+            return message;
+        std::lock_guard lock(mutex);
+        rejected++;
+        return "memory budget exhausted";
+    }
+
+    void release(uint64_t bytes)
+    {
         {
-            co_yield std::unexpected("XMP metadata is too large for a JPEG APP1 segment");
-            co_return;
+            std::lock_guard lock(mutex);
+            bytes_in_use -= bytes;
+            if (!listener.has_value())
+                return;
+            release_pending = true;
         }
+        notify.notify_one();
+    }
 
-        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1_payload.data(), static_cast<unsigned int>(app1_payload.size()));
+    void configure(uint64_t new_max_pixels, uint64_t new_max_bytes, bool reject_new)
+    {
+        std::lock_guard lock(mutex);
+        max_pixels = new_max_pixels;
+        max_bytes = new_max_bytes;
+        reject_when_exhausted = reject_new;
     }
 
-    while (cinfo.next_scanline < cinfo.image_height)
+    // Records the decodes that Imagex.Budget has queued, and whether the one it is retrying has its turn. Sends
+    // decode_budget_released to pid after every release, or stops when pid isn't a local pid. The messages are sent
+    // from a thread of their own, as releases happen in destructors that have no env to send from.
+    bool listen(ErlNifEnv* env, ERL_NIF_TERM pid, uint64_t num_waiting, bool turn)
     {
-        auto row = pixels.data() + cinfo.next_scanline * channels * width;
-        jpeg_write_scanlines(&cinfo, &row, 1);
+        std::lock_guard lock(mutex);
+        waiting = num_waiting;
+        turn_open = turn;
+        ErlNifPid listener_pid;
+        if (!enif_get_local_pid(env, pid, &listener_pid))
+        {
+            listener.reset();
+            return false;
+        }
 
-        if (timer.times_up())
+        listener = listener_pid;
+        if (!notifier.has_value())
         {
-            co_yield nullopt;
-            timer.reset();
+            ErlNifTid tid;
+            if (enif_thread_create(const_cast<char*>("imagex_budget"), &tid, notifier_main, this, nullptr) != 0)
+                throw codec_error("couldn't start the decode budget thread");
+            notifier = tid;
         }
+        return true;
     }
-    jpeg_finish_compress(&cinfo);
-    guard.release();
-    jpeg_destroy_compress(&cinfo);
-
-    // copy the buf to a binary object
-    binary out = binary::from_bytes(buf, outsize);
-    free(buf);  // free the buf created by jpeg_mem_dest
 
-    co_yield std::move(out);
-}
+    // Stops the thread that listen started, when the library is unloaded.
+    void shutdown()
+    {
+        optional<ErlNifTid> thread;
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+            listener.reset();
+            thread = std::exchange(notifier, nullopt);
+        }
+        notify.notify_all();
+        if (thread.has_value())
+            enif_thread_join(thread.value(), nullptr);
+    }
 
+private:
+    std::condition_variable notify;
+    optional<ErlNifPid> listener;
+    optional<ErlNifTid> notifier;
+    bool release_pending = false;
+    bool stopping = false;
+    // the decodes queued in Imagex.Budget, including the one it is retrying, if any
+    uint64_t waiting = 0;
+    bool turn_open = false;
+
+    void check_limits(uint64_t pixels, uint64_t bytes)
+    {
+        if (max_pixels != 0 && pixels > max_pixels)
+            reject("image exceeds the pixel budget");
+        if (max_bytes != 0 && bytes > max_bytes)
+            reject("image exceeds the memory budget");
+    }
 
-struct png_read_binary
-{
-    const vector<uint8_t>& data;
-    size_t offset = 8;
+    [[noreturn]] void reject(const char* message)
+    {
+        rejected++;
+        throw codec_error(message);
+    }
 
-    png_read_binary(const vector<uint8_t>& data) :
-        data(data)
-    {}
+    static void* notifier_main(void* budget)
+    {
+        static_cast<decode_budget*>(budget)->notify_releases();
+        return nullptr;
+    }
 
-    void read(png_bytep dest, png_size_t size_to_read)
+    void notify_releases()
     {
-        std::copy_n(this->data.data() + offset, size_to_read, dest);
-        this->offset += size_to_read;
+        ErlNifEnv* env = enif_alloc_env();
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            notify.wait(lock, [this] { return release_pending || stopping; });
+            if (stopping)
+                break;
+            release_pending = false;
+            if (!listener.has_value())
+                continue;
+
+            // several releases in a row are sent as one message
+            ErlNifPid pid = listener.value();
+            lock.unlock();
+            enif_send(nullptr, &pid, env, enif_make_atom(env, "decode_budget_released"));
+            enif_clear_env(env);
+            lock.lock();
+        }
+        enif_free_env(env);
     }
 };
 
 
-void png_error_exit(png_structp png_ptr, const char* error_message)
-{
-    throw erl_error<string>(error_message);
-}
+static decode_budget global_decode_budget;
 
 
-yielding<expected<decompress_result_t, string_view>> png_decompress(vector<uint8_t> png_bytes)
+// The share of the decode budget held by a decode, given back when it goes out of scope.
+struct budget_reservation
 {
-    yielding_timer timer;
+    uint64_t bytes = 0;
 
-    // check png signature
-    if (png_sig_cmp(png_bytes.data(), 0, 8))
+    budget_reservation() = default;
+    budget_reservation(const budget_reservation&) = delete;
+    budget_reservation& operator=(const budget_reservation&) = delete;
+
+    budget_reservation(budget_reservation&& other) noexcept :
+        bytes(std::exchange(other.bytes, 0))
+    {}
+
+    budget_reservation& operator=(budget_reservation&& other) noexcept
     {
-        co_yield std::unexpected("invalid png header");
-        co_return;
+        release();
+        bytes = std::exchange(other.bytes, 0);
+        return *this;
     }
 
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
-    if (!png_ptr)
+    ~budget_reservation()
     {
-        co_yield std::unexpected("couldn't initialize png read struct");
-        co_return;
+        release();
     }
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    void release()
     {
-        png_destroy_read_struct(&png_ptr, nullptr, nullptr);
-        co_yield std::unexpected("couldn't initialize png info struct");
-        co_return;
+        if (bytes != 0)
+            global_decode_budget.release(std::exchange(bytes, 0));
     }
+};
 
-    try
+
+struct pixel_buffer;
+
+
+// Reserves the output buffer, of the given size in bytes, of a decode of width x height pixels; see decode_budget.
+// Decodes into a pixel buffer are only checked against the limits here: the buffer reserves its storage itself when
+// it has to allocate it.
+static budget_reservation reserve_decode(
+    uint64_t width, uint64_t height, uint64_t bytes, const pixel_buffer* into = nullptr)
+{
+    if (into != nullptr)
     {
-        // read metadata
-        png_read_binary data_wrapper(png_bytes);
-        png_set_read_fn(
-            png_ptr,
-            reinterpret_cast<png_voidp>(&data_wrapper),
-            [](png_structp png_ptr, png_bytep dest, png_size_t size_to_read) {
-                auto data_wrapper = reinterpret_cast<png_read_binary*>(png_get_io_ptr(png_ptr));
-                data_wrapper->read(dest, size_to_read);
-            });
-        png_set_sig_bytes(png_ptr, 8);
-        png_read_info(png_ptr, info_ptr);
+        global_decode_budget.check(width * height, bytes);
+        return {};
+    }
+    global_decode_budget.reserve(width * height, bytes);
+    budget_reservation reservation;
+    reservation.bytes = bytes;
+    return reservation;
+}
 
-        const png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
-        const png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
-        png_uint_32 bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-        png_uint_32 channels = png_get_channels(png_ptr, info_ptr);
-        const png_uint_32 color_type = png_get_color_type(png_ptr, info_ptr);
-        const auto interlace_type = png_get_interlace_type(png_ptr, info_ptr);
 
-        switch (color_type)
-        {
-        case PNG_COLOR_TYPE_PALETTE:  // convert palette to RGB
-            png_set_palette_to_rgb(png_ptr);
-            channels = 3;
-            break;
-        case PNG_COLOR_TYPE_GRAY:  // expand 1, 2, or 4 bit grayscale to 8 bit grayscale
-            if (bit_depth < 8)
-                png_set_expand_gray_1_2_4_to_8(png_ptr);
-            break;
-        }
+// The memory of a pixel buffer. Decoded pixels are handed to the VM as resource binaries that hold a reference to it,
+// so it outlives a buffer that grows past it for as long as tensors use it, and holds its share of the decode budget
+// until then.
+struct pixel_storage
+{
+    std::unique_ptr<uint8_t[]> data;
+    size_t capacity;
+    budget_reservation reservation;
+};
 
-        if constexpr (std::endian::native == std::endian::little)
-        {
-            if (bit_depth == 16)
-                png_set_swap(png_ptr);
-        }
+typedef shared_ptr<pixel_storage> pixel_storage_ptr;
 
-        const unsigned int stride = width * bit_depth * channels / 8;
-        binary output(height * stride);
 
-        // Depending on whether the image is interlaced, we need to decode multiple passes
-        // See https://github.com/glennrp/libpng/blob/libpng16/libpng-manual.txt and
-        // libpng png_read_image's implementation
-        int num_passes = 1;
+// Memory that a caller allocates once and decodes image after image into, so that a loop over same-sized images
+// doesn't allocate and fault in new pixels for every one of them. A decode reuses the storage when no binary of an
+// earlier decode refers to it any more, which is once the processes holding them have garbage collected, and copies on
+// write otherwise, so the pixels of a tensor never change under it. The storage it moves off is kept as a spare to
+// decode into once it is free, so a loop that keeps one frame alive alternates between two of them rather than
+// allocating for every frame. Storage is reserved in the decode budget whenever it is allocated.
+struct pixel_buffer
+{
+    pixel_storage_ptr storage;
+    // storage that binaries still referred to when the buffer moved off it
+    pixel_storage_ptr spare;
+    std::atomic<size_t> capacity;
+    std::atomic<bool> in_use = false;
+    // the size of the pixels of the last decode
+    size_t size = 0;
+
+    explicit pixel_buffer(size_t initial_capacity) :
+        storage(make_storage(initial_capacity)),
+        capacity(initial_capacity)
+    {}
 
-        // if interlaced, we need to get the number of passes
-        if (interlace_type == PNG_INTERLACE_ADAM7)
+    // Returns room for new_size bytes of pixels: in the storage, or else the spare, when no binary refers to it and it
+    // is large enough, and in new storage otherwise. A use count of 1 is only ever the buffer's own, as binaries are
+    // only made from the storage by the decode that holds the buffer.
+    uint8_t* reserve(size_t new_size)
+    {
+        const auto fits = [new_size](const pixel_storage_ptr& candidate) {
+            return candidate != nullptr && candidate.use_count() == 1 && new_size <= candidate->capacity;
+        };
+        if (!fits(storage) && fits(spare))
+            std::swap(storage, spare);
+        if (!fits(storage))
         {
-            num_passes = png_set_interlace_handling(png_ptr);
-            png_start_read_image(png_ptr);
+            auto replaced = std::exchange(storage, make_storage(std::max(new_size, storage->capacity)));
+            spare = replaced.use_count() > 1 ? std::move(replaced) : nullptr;
         }
+        capacity = storage->capacity;
+        size = new_size;
+        return storage->data.get();
+    }
 
-        for (int pass = 0; pass < num_passes; pass++)
-        {
-            for (size_t i = 0; i < height; i++)
-            {
-                png_read_row(png_ptr, reinterpret_cast<png_bytep>(output.data) + i * stride, nullptr);
-
-                if (timer.times_up())
-                {
-                    co_yield nullopt;
-                    timer.reset();
-                }
-            }
-        }
+private:
+    static pixel_storage_ptr make_storage(size_t capacity)
+    {
+        auto reservation = reserve_decode(0, 0, capacity);
+        return std::make_shared<pixel_storage>(
+            pixel_storage{std::make_unique_for_overwrite<uint8_t[]>(capacity), capacity, std::move(reservation)});
+    }
+};
 
-        // read the exif data
-        optional<binary> exif_data = nullopt;
-        {
-            png_bytep exif = nullptr;
-            png_uint_32 exif_length;
-            if (png_get_eXIf_1(png_ptr, info_ptr, &exif_length, &exif) != 0)
-            {
-                if (exif_length > 0)
-                    exif_data = binary::from_bytes(exif, exif_length);
-            }
-        }
 
-        // read tEXt/iTxt/zTXt data
-        text_chunks_t text_data;
-        {
-            png_textp text_ptr = nullptr;
-            if (int num_text = png_get_text(png_ptr, info_ptr, &text_ptr, nullptr); num_text > 0)
-            {
-                for (int i = 0; i < num_text; i++)
-                {
-                    vector<uint8_t> key(text_ptr[i].key, text_ptr[i].key + strlen(text_ptr[i].key));
-                    png_size_t text_length = text_ptr[i].text_length;
-                    if (text_ptr[i].compression == PNG_ITXT_COMPRESSION_NONE ||
-                        text_ptr[i].compression == PNG_ITXT_COMPRESSION_zTXt)
-                    {
-                        text_length = text_ptr[i].itxt_length;
-                    }
-
-                    vector<uint8_t> text(text_ptr[i].text, text_ptr[i].text + text_length);
-                    string_view lang = text_ptr[i].lang != nullptr ? text_ptr[i].lang : "";
-                    string_view translated_keyword = text_ptr[i].lang_key != nullptr ? text_ptr[i].lang_key : "";
-                    vector<uint8_t> language_tag(lang.begin(), lang.end());
-                    vector<uint8_t> translated(translated_keyword.begin(), translated_keyword.end());
-
-                    text_data.push_back(
-                        {std::move(key), std::move(text), std::move(language_tag), std::move(translated)});
-                }
-            }
-        }
+// Makes room for the pixels of a decode: in the caller's pixel buffer if there is one, and in a new binary otherwise.
+static uint8_t* allocate_pixels(binary& pixels, size_t size, pixel_buffer* into)
+{
+    if (into != nullptr)
+        return into->reserve(size);
+    pixels = binary(size);
+    return pixels.data;
+}
 
-        png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
-        png_ptr = nullptr;
 
-        co_yield decompress_result_t{
-            .pixels = std::move(output),
-            .width = width,
-            .height = height,
-            .channels = channels,
-            .bit_depth = bit_depth,
-            .exif = std::move(exif_data),
-            .text_chunks = std::move(text_data),
-        };
-    }
-    catch (erl_error<string>& e)
+// Rounds a float to the nearest half-precision value, ties to even, and returns its IEEE 754 binary16 bits.
+static uint16_t float_to_half(float value)
+{
+    constexpr uint32_t f32_infinity = 255u << 23;
+    constexpr uint32_t f16_overflow = (127u + 16) << 23;
+    constexpr uint32_t f16_min_normal = 113u << 23;
+    // adding this lines the mantissa of a tiny value up with the half subnormals, so the FPU does the rounding
+    constexpr float subnormal_magic = std::bit_cast<float>(((127u - 15) + (23 - 10) + 1) << 23);
+
+    uint32_t bits = std::bit_cast<uint32_t>(value);
+    const uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+
+    uint32_t half;
+    if (bits >= f16_overflow)
+        half = bits > f32_infinity ? 0x7e00 : 0x7c00;
+    else if (bits < f16_min_normal)
+        half = std::bit_cast<uint32_t>(std::bit_cast<float>(bits) + subnormal_magic) -
+               std::bit_cast<uint32_t>(subnormal_magic);
+    else
     {
-        if (png_ptr)
-            png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
-        throw e;
+        const uint32_t mantissa_odd = (bits >> 13) & 1;
+        bits += (static_cast<uint32_t>(15 - 127) << 23) + 0xfff + mantissa_odd;
+        half = bits >> 13;
     }
+    return static_cast<uint16_t>(half | (sign >> 16));
 }
 
 
-yielding<expected<vector<png_byte>, string_view>> png_compress(
-    vector<uint8_t> pixels,
-    uint32_t width,
-    uint32_t height,
-    uint32_t channels,
-    uint32_t bit_depth,
-    optional<text_chunks_t> text_chunks)
+enum class pixel_type : int
 {
-    yielding_timer timer;
+    u8 = 0,
+    u16,
+    f16,
+    f32,
+};
 
-    if (channels == 0 || channels > 4)
-    {
-        co_yield std::unexpected("unsupported number of channels (must be 1-4)");
-        co_return;
-    }
 
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
-    if (!png_ptr)
-    {
-        co_yield std::unexpected("couldn't initialize png write struct");
-        co_return;
-    }
+struct half_t
+{
+    uint16_t bits;
+};
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
-    {
-        png_destroy_write_struct(&png_ptr, nullptr);
-        co_yield std::unexpected("couldn't initialize png info struct");
-        co_return;
-    }
 
-    try
+// How decoded pixels are handed to the caller: each sample becomes in * scale[c] + bias[c] for its channel c, stored
+// as type, either interleaved (HWC) or planar (CHW). Integer types round to nearest and saturate.
+struct output_format
+{
+    bool planar = false;
+    pixel_type type = pixel_type::u8;
+    vector<float> scale;
+    vector<float> bias;
+};
+
+
+static size_t pixel_type_size(pixel_type type)
+{
+    switch (type)
     {
-        // set up the output data, as well as the callback to write into that data
-        vector<png_byte> out_data;
-        auto png_chunk_producer = [](png_structp png_ptr, png_bytep data, png_size_t length) {
-            auto out_data_p = reinterpret_cast<vector<png_byte>*>(png_get_io_ptr(png_ptr));
-            std::copy_n(data, length, std::back_inserter(*out_data_p));
-        };
-        png_set_write_fn(png_ptr, &out_data, png_chunk_producer, nullptr);
+    case pixel_type::u8:
+        return 1;
+    case pixel_type::u16:
+    case pixel_type::f16:
+        return 2;
+    case pixel_type::f32:
+        return 4;
+    }
+    return 0;
+}
 
-        // write header
-        int color_type;
-        switch (channels)
-        {
-        case 1:
-            color_type = PNG_COLOR_TYPE_GRAY;
-            break;
-        case 2:
-            color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
-            break;
-        case 3:
-            color_type = PNG_COLOR_TYPE_RGB;
-            break;
-        case 4:
-            color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-            break;
-        default:
-            __builtin_unreachable();  // validated above
-        }
 
-        png_set_IHDR(
-            png_ptr,
-            info_ptr,
-            width,
-            height,
-            bit_depth,
-            color_type,
-            PNG_INTERLACE_NONE,
-            PNG_COMPRESSION_TYPE_BASE,
-            PNG_FILTER_TYPE_BASE);
-
-        if (text_chunks.has_value())
-        {
-            vector<string> text_keys;
-            vector<string> text_values;
-            vector<string> language_tags;
-            vector<string> translated_keywords;
-            vector<png_text> png_text_entries;
-
-            text_keys.reserve(text_chunks->size());
-            text_values.reserve(text_chunks->size());
-            language_tags.reserve(text_chunks->size());
-            translated_keywords.reserve(text_chunks->size());
-            png_text_entries.reserve(text_chunks->size());
-
-            for (const auto& [key, value, language_tag, translated_keyword] : *text_chunks)
-            {
-                text_keys.emplace_back(reinterpret_cast<const char*>(key.data()), key.size());
-                text_values.emplace_back(reinterpret_cast<const char*>(value.data()), value.size());
-                language_tags.emplace_back(reinterpret_cast<const char*>(language_tag.data()), language_tag.size());
-                translated_keywords.emplace_back(
-                    reinterpret_cast<const char*>(translated_keyword.data()), translated_keyword.size());
-
-                png_text entry = {};
-                entry.compression = PNG_ITXT_COMPRESSION_NONE;
-                entry.key = text_keys.back().data();
-                entry.text = text_values.back().data();
-                entry.text_length = text_values.back().size();
-                entry.itxt_length = text_values.back().size();
-                entry.lang = language_tags.back().data();
-                entry.lang_key = translated_keywords.back().data();
-                png_text_entries.push_back(entry);
-            }
+template <typename Out>
+static Out convert_sample(float value)
+{
+    if constexpr (std::is_same_v<Out, float>)
+        return value;
+    else if constexpr (std::is_same_v<Out, half_t>)
+        return half_t{float_to_half(value)};
+    else
+        return static_cast<Out>(std::clamp(value + 0.5f, 0.0f, static_cast<float>(std::numeric_limits<Out>::max())));
+}
 
-            if (!png_text_entries.empty())
-                png_set_text(png_ptr, info_ptr, png_text_entries.data(), png_text_entries.size());
-        }
 
-        png_write_info(png_ptr, info_ptr);
+// Every sample is read once, scaled and written to its final position. The pixels are num_pixels consecutive pixels
+// of an image of plane_size pixels, starting at first_pixel, and out points at the start of the converted image, so
+// that a decoder can convert its output a run of rows at a time. The channel count and layout are compile-time
+// constants so that the inner loop is branch-free and the compiler can vectorize it.
+template <typename In, typename Out, size_t Channels, bool Planar>
+static void convert_pixels_as(
+    const In* in,
+    Out* out,
+    size_t first_pixel,
+    size_t num_pixels,
+    size_t plane_size,
+    const output_format& format)
+{
+    std::array<float, Channels> scale, bias;
+    std::copy_n(format.scale.begin(), Channels, scale.begin());
+    std::copy_n(format.bias.begin(), Channels, bias.begin());
 
-        if constexpr (std::endian::native == std::endian::little)
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        const size_t pixel = first_pixel + i;
+        for (size_t c = 0; c < Channels; c++)
         {
-            if (bit_depth == 16)
-                png_set_swap(png_ptr);
+            const float value = static_cast<float>(in[i * Channels + c]) * scale[c] + bias[c];
+            out[Planar ? c * plane_size + pixel : pixel * Channels + c] = convert_sample<Out>(value);
         }
+    }
+}
 
-        // write the pixels
-        const unsigned int stride = width * channels * bit_depth / 8;
-        for (size_t i = 0; i < height; i++)
-        {
-            png_write_row(png_ptr, pixels.data() + i * stride);
-
-            if (timer.times_up())
-            {
-                co_yield nullopt;
-                timer.reset();
-            }
-        }
 
-        // cleanup
-        png_write_end(png_ptr, nullptr);
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        png_ptr = nullptr;
+template <typename In, typename Out>
+static void convert_pixels_to(
+    const uint8_t* in,
+    uint8_t* out,
+    size_t first_pixel,
+    size_t num_pixels,
+    size_t plane_size,
+    const output_format& format)
+{
+    const auto with_channels = [&](auto channels) {
+        constexpr size_t num_channels = decltype(channels)::value;
+        const auto* src = reinterpret_cast<const In*>(in);
+        auto* dst = reinterpret_cast<Out*>(out);
+        if (format.planar)
+            convert_pixels_as<In, Out, num_channels, true>(src, dst, first_pixel, num_pixels, plane_size, format);
+        else
+            convert_pixels_as<In, Out, num_channels, false>(src, dst, first_pixel, num_pixels, plane_size, format);
+    };
 
-        co_yield std::move(out_data);
-    }
-    catch (erl_error<string>& e)
+    switch (format.scale.size())
     {
-        if (png_ptr)
-            png_destroy_write_struct(&png_ptr, &info_ptr);
-        throw e;
+    case 1:
+        return with_channels(std::integral_constant<size_t, 1>{});
+    case 2:
+        return with_channels(std::integral_constant<size_t, 2>{});
+    case 3:
+        return with_channels(std::integral_constant<size_t, 3>{});
+    default:
+        return with_channels(std::integral_constant<size_t, 4>{});
     }
 }
 
 
-static_assert(JXL_ENC_SUCCESS == 0 && JXL_DEC_SUCCESS == 0);
-
-// NOTE: This macro uses `return`, NOT `co_return`. It is NOT safe to use inside coroutines.
-#define JXL_ENSURE_SUCCESS(func, ...)                                                                                  \
-    if (func(__VA_ARGS__) != 0)                                                                                        \
-    {                                                                                                                  \
-        return std::unexpected(#func " failed");                                                                       \
+template <typename In>
+static void convert_pixels_from(
+    const uint8_t* in,
+    uint8_t* out,
+    size_t first_pixel,
+    size_t num_pixels,
+    size_t plane_size,
+    const output_format& format)
+{
+    switch (format.type)
+    {
+    case pixel_type::u8:
+        return convert_pixels_to<In, uint8_t>(in, out, first_pixel, num_pixels, plane_size, format);
+    case pixel_type::u16:
+        return convert_pixels_to<In, uint16_t>(in, out, first_pixel, num_pixels, plane_size, format);
+    case pixel_type::f16:
+        return convert_pixels_to<In, half_t>(in, out, first_pixel, num_pixels, plane_size, format);
+    case pixel_type::f32:
+        return convert_pixels_to<In, float>(in, out, first_pixel, num_pixels, plane_size, format);
     }
+}
 
 
-static string_view unexpected_jxl_decoder_status_message(JxlDecoderStatus status)
+// Converts a run of decoded 8 or 16-bit integer or 32-bit float pixels to format, see convert_pixels_as.
+static void convert_pixel_run(
+    const uint8_t* in,
+    uint8_t* out,
+    size_t first_pixel,
+    size_t num_pixels,
+    size_t plane_size,
+    uint32_t bit_depth,
+    const output_format& format)
 {
-    switch (status)
+    switch (bit_depth)
     {
-    case JXL_DEC_NEED_PREVIEW_OUT_BUFFER:
-        return "JXL decoder requested unsupported preview output";
-    case JXL_DEC_FRAME:
-        return "JXL decoder returned unsupported frame event";
-    case JXL_DEC_FRAME_PROGRESSION:
-        return "JXL decoder returned unsupported frame progression event";
-    case JXL_DEC_BOX_COMPLETE:
-        return "JXL decoder returned unsupported box-complete event";
+    case 8:
+        return convert_pixels_from<uint8_t>(in, out, first_pixel, num_pixels, plane_size, format);
+    case 16:
+        return convert_pixels_from<uint16_t>(in, out, first_pixel, num_pixels, plane_size, format);
     default:
-        return "Unknown or unsupported JXL decoder status";
+        return convert_pixels_from<float>(in, out, first_pixel, num_pixels, plane_size, format);
     }
 }
 
 
-enum class jxl_box_kind
-{
-    none,
-    exif,
-    xml,
-    jumb,
-};
-
-
-static optional<binary> finalize_jxl_box_data(std::vector<uint8_t>& box_data, JxlDecoder* dec)
+// Converts decoded 8 or 16-bit integer or 32-bit float pixels with the given number of channels to format, in a
+// single pass that replaces a separate transpose, cast and normalization.
+static expected<binary, string_view> convert_decoded_pixels(
+    std::span<const uint8_t> pixels, uint32_t channels, uint32_t bit_depth, const output_format& format)
 {
-    size_t remaining = JxlDecoderReleaseBoxBuffer(dec);
-    if (remaining > box_data.size())
-        return nullopt;
-
-    box_data.resize(box_data.size() - remaining);
-    return binary::from_bytes(box_data.data(), box_data.size());
+    if (channels < 1 || channels > 4)
+        return std::unexpected("images must have 1 to 4 channels");
+    if (bit_depth != 8 && bit_depth != 16 && bit_depth != 32)
+        return std::unexpected("unsupported bit depth");
+    if (format.scale.size() != channels || format.bias.size() != channels)
+        return std::unexpected("scale and bias must have one value per channel");
+
+    const size_t pixel_size = channels * (bit_depth / 8);
+    if (pixels.size() % pixel_size != 0)
+        return std::unexpected("pixel data must be a whole number of pixels");
+
+    const size_t num_pixels = pixels.size() / pixel_size;
+    binary out{num_pixels * channels * pixel_type_size(format.type)};
+    convert_pixel_run(pixels.data(), out.data, 0, num_pixels, num_pixels, bit_depth, format);
+    return out;
 }
 
 
-// Parse JXL EXIF box data, handling the 4-byte big-endian offset prefix.
-static optional<binary> parse_jxl_exif(const binary& exif_data)
+// The output format arguments of the decode NIFs: planar or interleaved, a pixel_type value or -1 for the type of the
+// decoded samples, and a scale and a bias with either one value per channel, a single value for all channels, or none
+// for 1 and 0. Left at their defaults, they hand the pixels over as they are decoded.
+struct output_format_args
 {
-    if (exif_data.size < 4)
-        return nullopt;
+    bool planar = false;
+    int type = -1;
+    vector<double> scale;
+    vector<double> bias;
 
-    // The first 4 bytes are a big-endian offset (usually 0)
-    size_t offset = static_cast<size_t>(exif_data.data[0]) << 24 | static_cast<size_t>(exif_data.data[1]) << 16 |
-                    static_cast<size_t>(exif_data.data[2]) << 8 | static_cast<size_t>(exif_data.data[3]);
+    bool converts() const
+    {
+        return planar || type >= 0 || !scale.empty() || !bias.empty();
+    }
 
-    if (4 + offset >= exif_data.size)
-        return nullopt;
+    // The output format of a decoded image with the given channels and bit depth, or nullopt when the pixels are
+    // handed over as they are decoded. Throws a codec_error when the arguments don't fit the image.
+    optional<output_format> resolve(uint32_t channels, uint32_t bit_depth) const
+    {
+        if (!converts())
+            return nullopt;
+        if (channels < 1 || channels > 4)
+            throw codec_error("images must have 1 to 4 channels");
+        if (bit_depth != 8 && bit_depth != 16 && bit_depth != 32)
+            throw codec_error("unsupported bit depth");
+        if (type > static_cast<int>(pixel_type::f32))
+            throw codec_error("unsupported output type");
+
+        const pixel_type decoded_type = bit_depth == 8    ? pixel_type::u8
+                                        : bit_depth == 16 ? pixel_type::u16
+                                                          : pixel_type::f32;
+        return output_format{
+            .planar = planar,
+            .type = type < 0 ? decoded_type : static_cast<pixel_type>(type),
+            .scale = per_channel("scale", scale, 1.0f, channels),
+            .bias = per_channel("bias", bias, 0.0f, channels),
+        };
+    }
 
-    return binary::from_bytes(exif_data.data + 4 + offset, exif_data.size - 4 - offset);
-}
+private:
+    static vector<float> per_channel(
+        const string& name,
+        const vector<double>& values,
+        float default_value,
+        uint32_t channels)
+    {
+        if (values.empty())
+            return vector<float>(channels, default_value);
+        if (values.size() == 1)
+            return vector<float>(channels, static_cast<float>(values[0]));
+        if (values.size() != channels)
+            throw codec_error(
+                name + " has " + std::to_string(values.size()) + " values but the image has " +
+                std::to_string(channels) + " channels");
+        return vector<float>(values.begin(), values.end());
+    }
+};
 
 
-static optional<jxl_box_kind> jxl_box_kind_from_type(const JxlBoxType box_type)
+// Where a decoder writes the rows of an image. Without an output format, the rows go straight into the result pixels.
+// With one, the decoder writes up to batch_rows rows at a time to scratch space, and commit converts them from there
+// to their place, layout and type in the result, so that the result is written once and never held twice.
+struct row_sink
 {
-    const string_view type(box_type, 4);
-    if (type == "Exif")
-        return jxl_box_kind::exif;
-    if (type == "xml ")
-        return jxl_box_kind::xml;
-    if (type == "jumb")
-        return jxl_box_kind::jumb;
+    uint8_t* pixels = nullptr;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;
+    size_t row_size;
+    size_t batch_rows;
+    optional<output_format> format;
+    vector<uint8_t> scratch;
+
+    row_sink(
+        uint32_t width,
+        uint32_t height,
+        uint32_t channels,
+        uint32_t bit_depth,
+        size_t row_size,
+        const output_format_args& output,
+        size_t batch_rows = 1) :
+        width(width),
+        height(height),
+        bit_depth(bit_depth),
+        row_size(row_size),
+        batch_rows(std::min<size_t>(batch_rows, height)),
+        format(output.resolve(channels, bit_depth))
+    {}
 
-    return nullopt;
-}
+    // The size of the result pixels.
+    size_t output_size() const
+    {
+        if (!format.has_value())
+            return row_size * height;
+        return static_cast<size_t>(width) * height * format->scale.size() * pixel_type_size(format->type);
+    }
 
+    // The memory that the decode holds, to reserve from the decode budget.
+    size_t memory_size() const
+    {
+        return output_size() + (format.has_value() ? row_size * batch_rows : 0);
+    }
 
-static expected<void, string_view> append_jxl_box(decompress_result_t& result, jxl_box_kind box_kind, binary box_data)
-{
-    switch (box_kind)
+    // Allocates the result pixels, see allocate_pixels.
+    void allocate(binary& result, pixel_buffer* into)
     {
-    case jxl_box_kind::none:
-        return {};
+        pixels = allocate_pixels(result, output_size(), into);
+        if (format.has_value())
+            scratch.resize(row_size * batch_rows);
+    }
 
-    case jxl_box_kind::exif: {
-        optional<binary> exif = parse_jxl_exif(box_data);
-        if (!exif.has_value())
-            return std::unexpected("invalid JXL metadata box");
-        result.exif = std::move(exif.value());
+    // Where the decoder writes row y of the image.
+    uint8_t* row(size_t y)
+    {
+        if (!format.has_value())
+            return pixels + y * row_size;
+        return scratch.data() + (y % batch_rows) * row_size;
+    }
+
+    // Converts decoded pixels, num_pixels of them starting at first_pixel in row-major order, to the result.
+    void convert(const uint8_t* in, size_t first_pixel, size_t num_pixels) const
+    {
+        const size_t plane_size = static_cast<size_t>(width) * height;
+        convert_pixel_run(in, pixels, first_pixel, num_pixels, plane_size, bit_depth, *format);
+    }
+
+    // Hands over num_rows rows from first_row on, which were written to the same batch of rows.
+    void commit(size_t first_row, size_t num_rows)
+    {
+        if (format.has_value())
+            convert(row(first_row), first_row * width, num_rows * width);
+    }
+};
+
+
+// The kinds of metadata that a decode extracts, as a bit mask. Decodes skip the markers, chunks and boxes of the kinds
+// that aren't asked for, rather than reading, decompressing and copying them into the result only to be ignored.
+constexpr uint32_t METADATA_EXIF = 1 << 0;
+constexpr uint32_t METADATA_XMP = 1 << 1;
+constexpr uint32_t METADATA_ICC = 1 << 2;
+// PNG text chunks, other than the one holding the XMP packet
+constexpr uint32_t METADATA_TEXT = 1 << 3;
+// JFIF APP0 segments and JXL JUMBF boxes
+constexpr uint32_t METADATA_OTHER = 1 << 4;
+constexpr uint32_t METADATA_NONE = 0;
+constexpr uint32_t METADATA_ALL = (1 << 5) - 1;
+
+
+struct decompress_result_t
+{
+    binary pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t bit_depth;
+    optional<binary> exif;
+    text_chunks_t text_chunks;
+    std::vector<binary> xml_boxes;
+    std::vector<binary> jumb_boxes;
+    optional<tuple<binary, uint32_t>> palette;
+    optional<binary> xmp;
+    optional<binary> icc_profile;
+    std::vector<binary> app0_segments;
+};
+
+
+namespace expp
+{
+template <>
+struct type_cast<decompress_result_t>
+{
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const decompress_result_t& result) noexcept
+    {
+        return to_term(env, result, type_cast<binary>::to_term(env, result.pixels));
+    }
+
+    // Builds the result tuple around a pixels term made by the caller, such as a resource binary.
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const decompress_result_t& result, ERL_NIF_TERM pixels) noexcept
+    {
+        return enif_make_tuple(
+            env,
+            13,
+            pixels,
+            type_cast<uint32_t>::to_term(env, result.width),
+            type_cast<uint32_t>::to_term(env, result.height),
+            type_cast<uint32_t>::to_term(env, result.channels),
+            type_cast<uint32_t>::to_term(env, result.bit_depth),
+            type_cast<optional<binary>>::to_term(env, result.exif),
+            type_cast<text_chunks_t>::to_term(env, result.text_chunks),
+            type_cast<std::vector<binary>>::to_term(env, result.xml_boxes),
+            type_cast<std::vector<binary>>::to_term(env, result.jumb_boxes),
+            type_cast<optional<tuple<binary, uint32_t>>>::to_term(env, result.palette),
+            type_cast<optional<binary>>::to_term(env, result.xmp),
+            type_cast<optional<binary>>::to_term(env, result.icc_profile),
+            type_cast<std::vector<binary>>::to_term(env, result.app0_segments));
+    }
+};
+}  // namespace expp
+
+
+// State shared by the incremental decoders and encoders, which live in resources and are driven by several NIF calls.
+// The mutex serializes those calls.
+struct incremental_codec
+{
+    std::mutex mutex;
+    optional<string> error;
+    bool finished = false;
+
+    incremental_codec() = default;
+    incremental_codec(const incremental_codec&) = delete;
+    incremental_codec& operator=(const incremental_codec&) = delete;
+    virtual ~incremental_codec() = default;
+
+    virtual string_view finished_error() const = 0;
+
+    // Runs step, remembering the first failure so that later calls report it instead of touching a codec that libjpeg
+    // or libpng have abandoned halfway.
+    template <typename F>
+    expected<void, string> run(F&& step)
+    {
+        if (error.has_value())
+            return std::unexpected(error.value());
+        if (finished)
+            return std::unexpected(string(finished_error()));
+
+        try
+        {
+            const budget_turn_scope no_turn;
+            if (auto status = step(); !status.has_value())
+                error = string(status.error());
+        }
+        catch (codec_error& e)
+        {
+            // a push can't be retried once its input has been consumed
+            error = global_decode_budget.reject_busy(std::move(e.message));
+        }
+        catch (...)
+        {
+            error = current_exception_message();
+        }
+
+        if (error.has_value())
+            return std::unexpected(error.value());
         return {};
     }
+};
+
+
+// Decoder state for decoding an image as its bytes arrive. Subclasses consume each chunk as far as the codec allows and
+// write finished rows into result.pixels; rows_ready counts the rows from the top of the image that are final.
+struct incremental_decoder : incremental_codec
+{
+    decompress_result_t result{};
+    budget_reservation reservation;
+    bool header_ready = false;
+    bool done = false;
+    uint32_t rows_ready = 0;
+    uint32_t rows_returned = 0;
+
+    string_view finished_error() const override
+    {
+        return "decoder already finished";
+    }
+
+    // Consumes the next chunk of input.
+    virtual expected<void, string_view> push(const uint8_t* data, size_t size) = 0;
+
+    // Decodes whatever is left once the input is known to be complete.
+    virtual expected<void, string_view> close() = 0;
+};
+
+
+// Encoder state for encoding an image that is handed over a few rows at a time. Subclasses append the compressed data
+// the codec has produced to output, which each call hands back and clears.
+struct incremental_encoder : incremental_codec
+{
+    // Size of the compressed chunks handed back, other than the last one of each call.
+    static constexpr size_t chunk_size = 64 << 10;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t bit_depth;
+    uint32_t rows_written = 0;
+    std::vector<binary> output;
+
+    incremental_encoder(uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth) :
+        width(width),
+        height(height),
+        channels(channels),
+        bit_depth(bit_depth)
+    {}
+
+    string_view finished_error() const override
+    {
+        return "encoder already finished";
+    }
+
+    size_t stride() const
+    {
+        return static_cast<size_t>(width) * channels * bit_depth / 8;
+    }
+
+    // Encodes the next num_rows rows, which follow the ones written so far.
+    virtual expected<void, string_view> push_rows(const uint8_t* rows, uint32_t num_rows) = 0;
+
+    // Finishes the image once all rows have been pushed.
+    virtual expected<void, string_view> close() = 0;
+};
+
+
+enum class image_format
+{
+    unknown,
+    jpeg,
+    png,
+    jxl,
+    bmp,
+    ppm,
+    tiff,
+    pdf,
+    webp,
+};
+
+
+// Native counterpart of Imagex.Detect.detect/1.
+static image_format detect_format(const uint8_t* data, size_t size)
+{
+    const string_view bytes(reinterpret_cast<const char*>(data), size);
+    if (bytes.starts_with("\xff\xd8"sv))
+        return image_format::jpeg;
+    if (bytes.starts_with("\x89PNG\r\n\x1a\n"sv))
+        return image_format::png;
+    if (bytes.starts_with("\xff\x0a"sv) || bytes.starts_with("\0\0\0\x0cJXL \r\n\x87\n"sv))
+        return image_format::jxl;
+    if (bytes.starts_with("BM"sv))
+        return image_format::bmp;
+    if (bytes.size() >= 3 && bytes[0] == 'P' && (bytes[1] == '5' || bytes[1] == '6') && bytes[2] == '\n')
+        return image_format::ppm;
+    if (bytes.starts_with("II\x2a\0"sv) || bytes.starts_with("MM\0\x2a"sv))
+        return image_format::tiff;
+    if (bytes.size() >= 10 && bytes.starts_with("%PDF-1."sv) && bytes[7] >= '0' && bytes[7] <= '9' &&
+        bytes.substr(8, 2) == "\n%"sv)
+        return image_format::pdf;
+    if (bytes.size() >= 12 && bytes.starts_with("RIFF"sv) && bytes.substr(8, 4) == "WEBP"sv)
+        return image_format::webp;
+    return image_format::unknown;
+}
+
+
+// The commonly used EXIF tags, parsed natively so that callers don't need to run the full Imagex.Exif parser.
+struct exif_tags_t
+{
+    optional<uint32_t> orientation;
+    optional<binary> make;
+    optional<binary> model;
+    optional<binary> software;
+    optional<binary> date_time;
+    optional<binary> date_time_original;
+};
+
+
+struct metadata_result_t
+{
+    optional<uint32_t> width;
+    optional<uint32_t> height;
+    optional<binary> exif;
+    optional<binary> xmp;
+    optional<binary> icc_profile;
+    text_chunks_t text_chunks;
+    std::vector<binary> xml_boxes;
+    std::vector<binary> jumb_boxes;
+    exif_tags_t exif_tags;
+};
+
+
+namespace expp
+{
+template <>
+struct type_cast<exif_tags_t>
+{
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const exif_tags_t& tags) noexcept
+    {
+        return enif_make_tuple6(
+            env,
+            type_cast<optional<uint32_t>>::to_term(env, tags.orientation),
+            type_cast<optional<binary>>::to_term(env, tags.make),
+            type_cast<optional<binary>>::to_term(env, tags.model),
+            type_cast<optional<binary>>::to_term(env, tags.software),
+            type_cast<optional<binary>>::to_term(env, tags.date_time),
+            type_cast<optional<binary>>::to_term(env, tags.date_time_original));
+    }
+};
+
+
+template <>
+struct type_cast<metadata_result_t>
+{
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const metadata_result_t& result) noexcept
+    {
+        return enif_make_tuple9(
+            env,
+            type_cast<optional<uint32_t>>::to_term(env, result.width),
+            type_cast<optional<uint32_t>>::to_term(env, result.height),
+            type_cast<optional<binary>>::to_term(env, result.exif),
+            type_cast<optional<binary>>::to_term(env, result.xmp),
+            type_cast<optional<binary>>::to_term(env, result.icc_profile),
+            type_cast<text_chunks_t>::to_term(env, result.text_chunks),
+            type_cast<std::vector<binary>>::to_term(env, result.xml_boxes),
+            type_cast<std::vector<binary>>::to_term(env, result.jumb_boxes),
+            type_cast<exif_tags_t>::to_term(env, result.exif_tags));
+    }
+};
+}  // namespace expp
+
+
+// RAII guard for jpeg_decompress_struct.
+struct jpeg_decompress_guard
+{
+    jpeg_decompress_struct* cinfo;
+    explicit jpeg_decompress_guard(jpeg_decompress_struct* c) :
+        cinfo(c)
+    {}
+    ~jpeg_decompress_guard()
+    {
+        if (cinfo)
+            jpeg_destroy_decompress(cinfo);
+    }
+    jpeg_decompress_guard(const jpeg_decompress_guard&) = delete;
+    jpeg_decompress_guard& operator=(const jpeg_decompress_guard&) = delete;
+    void release()
+    {
+        cinfo = nullptr;
+    }
+};
+
+
+// RAII guard for jpeg_compress_struct.
+struct jpeg_compress_guard
+{
+    jpeg_compress_struct* cinfo;
+    explicit jpeg_compress_guard(jpeg_compress_struct* c) :
+        cinfo(c)
+    {}
+    ~jpeg_compress_guard()
+    {
+        if (cinfo)
+            jpeg_destroy_compress(cinfo);
+    }
+    jpeg_compress_guard(const jpeg_compress_guard&) = delete;
+    jpeg_compress_guard& operator=(const jpeg_compress_guard&) = delete;
+    void release()
+    {
+        cinfo = nullptr;
+    }
+};
+
+
+void jpeg_error_exit(j_common_ptr cinfo)
+{
+    char error_message[JMSG_LENGTH_MAX];
+    (*(cinfo->err->format_message))(cinfo, error_message);
+    throw codec_error(error_message);
+}
+
+
+// Converts CMYK pixels, which is what libjpeg decodes CMYK and YCCK JPEGs to, to RGB. Adobe writes CMYK inverted, so
+// that each of its samples is already the amount of light let through rather than of ink.
+static void jpeg_cmyk_to_rgb(const uint8_t* cmyk, uint8_t* rgb, size_t num_pixels, bool adobe_inverted)
+{
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+        const auto light = [&](size_t c) -> uint32_t {
+            const uint8_t sample = cmyk[i * 4 + c];
+            return adobe_inverted ? sample : 255 - sample;
+        };
+        const uint32_t k = light(3);
+        for (size_t c = 0; c < 3; c++)
+            rgb[i * 3 + c] = static_cast<uint8_t>((light(c) * k + 127) / 255);
+    }
+}
+
+
+// Moves the metadata out of the markers saved by jpeg_save_markers into result. ICC profiles may span several APP2
+// segments, which jpeg_read_icc_profile reassembles.
+static void read_jpeg_saved_markers(
+    jpeg_decompress_struct* cinfo, decompress_result_t& result, uint32_t metadata = METADATA_ALL)
+{
+    for (auto marker = cinfo->marker_list; marker != nullptr; marker = marker->next)
+    {
+        if (marker->marker == JPEG_APP0)
+        {
+            if (metadata & METADATA_OTHER)
+                result.app0_segments.push_back(binary::from_bytes(marker->data, marker->data_length));
+        }
+        else if (marker->marker == JPEG_APP0 + 1)
+        {
+            if ((metadata & METADATA_EXIF) && !result.exif.has_value() &&
+                starts_with(marker->data, marker->data_length, JPEG_EXIF_APP1_IDENTIFIER))
+                result.exif = binary::from_bytes(
+                    marker->data + JPEG_EXIF_APP1_IDENTIFIER.size(),
+                    marker->data_length - JPEG_EXIF_APP1_IDENTIFIER.size());
+            else if (
+                (metadata & METADATA_XMP) && !result.xmp.has_value() &&
+                starts_with(marker->data, marker->data_length, JPEG_XMP_APP1_IDENTIFIER))
+                result.xmp = binary::from_bytes(
+                    marker->data + JPEG_XMP_APP1_IDENTIFIER.size(),
+                    marker->data_length - JPEG_XMP_APP1_IDENTIFIER.size());
+        }
+    }
+
+    JOCTET* icc_data = nullptr;
+    unsigned int icc_length = 0;
+    if ((metadata & METADATA_ICC) && jpeg_read_icc_profile(cinfo, &icc_data, &icc_length))
+    {
+        if (icc_length > 0)
+            result.icc_profile = binary::from_bytes(icc_data, icc_length);
+        free(icc_data);
+    }
+}
+
+
+// Bytes is anything with data() and size(): an owned vector for the yielding NIF, or a span when the caller keeps the
+// bytes alive until decoding is done. A scale_denom of 2, 4 or 8 decodes the image at that fraction of its size in the
+// IDCT, and the crop region is then in scaled pixels. Given a pixel buffer, the pixels are decoded into it and
+// result.pixels is left empty. Only the markers holding the kinds of metadata in the mask are kept. Each row is
+// converted to the output format as soon as it is decoded, see row_sink.
+template <template <typename> typename Generator, typename Bytes>
+static Generator<expected<decompress_result_t, string>> jpeg_decompress_impl(
+    Bytes jpeg_bytes,
+    crop_region crop = {},
+    unsigned int scale_denom = 1,
+    pixel_buffer* into = nullptr,
+    uint32_t metadata = METADATA_ALL,
+    output_format_args output = {})
+{
+    struct jpeg_error_mgr err;
+    struct jpeg_decompress_struct cinfo;
+    jpeg_decompress_guard guard(&cinfo);
+    yielding_timer timer;
+
+    // create decompressor
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&cinfo);
+    cinfo.do_fancy_upsampling = FALSE;
+    err.error_exit = jpeg_error_exit;
+
+    // set source buffer
+    jpeg_mem_src(&cinfo, jpeg_bytes.data(), jpeg_bytes.size());
+
+    // keep the APP0 (JFIF), APP1 (EXIF/XMP) and APP2 (ICC) segments, so that the metadata comes out of this one pass
+    if (metadata & METADATA_OTHER)
+        jpeg_save_markers(&cinfo, JPEG_APP0, 0xffff);
+    if (metadata & (METADATA_EXIF | METADATA_XMP))
+        jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+    if (metadata & METADATA_ICC)
+        jpeg_save_markers(&cinfo, JPEG_APP0 + 2, 0xffff);
+
+    // read jpeg header
+    jpeg_read_header(&cinfo, TRUE);
+
+    decompress_result_t result{};
+    read_jpeg_saved_markers(&cinfo, result, metadata);
+
+    // decompress
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale_denom;
+    jpeg_start_decompress(&cinfo);
+
+    auto region = crop.clip(cinfo.output_width, cinfo.output_height);
+    if (!region.has_value())
+    {
+        co_yield std::unexpected(string(region.error()));
+        co_return;
+    }
+
+    // only decode the iMCU columns that overlap the region; libjpeg moves the start of the span it decodes back to an
+    // iMCU boundary, and the extra columns are trimmed off again below. Chroma upsampling near the ends of a cropped
+    // span can't see the samples outside of it, so the span is padded by a chroma sample on each side to come out the
+    // same as a full decode.
+    JDIMENSION decoded_x = region->x;
+    JDIMENSION decoded_width = region->width;
+    if (decoded_width < cinfo.output_width)
+    {
+        const JDIMENSION padding = cinfo.max_h_samp_factor;
+        decoded_x = region->x - std::min(region->x, padding);
+        decoded_width = std::min(region->x + region->width + padding, cinfo.output_width) - decoded_x;
+        jpeg_crop_scanline(&cinfo, &decoded_x, &decoded_width);
+    }
+
+    // and skip the rows above it without running the IDCT for them
+    if (region->y > 0)
+        jpeg_skip_scanlines(&cinfo, region->y);
+
+    // Save dimensions before destroying the struct
+    const uint32_t out_width = region->width;
+    const uint32_t out_height = region->height;
+    const uint32_t num_components = static_cast<uint32_t>(cinfo.num_components);
+
+    const size_t row_stride = static_cast<size_t>(out_width) * num_components;
+    row_sink sink(out_width, out_height, num_components, 8, row_stride, output);
+    auto reservation = reserve_decode(out_width, out_height, sink.memory_size(), into);
+    binary pixels;
+    sink.allocate(pixels, into);
+
+    // read scanlines
+    const auto trim_offset = (region->x - decoded_x) * num_components;
+    vector<uint8_t> decoded_row(trim_offset > 0 || decoded_width != out_width ? decoded_width * num_components : 0);
+    for (uint32_t row = 0; row < out_height; row++)
+    {
+        auto row_ptr = sink.row(row);
+        if (decoded_row.empty())
+        {
+            jpeg_read_scanlines(&cinfo, &row_ptr, 1);
+        }
+        else
+        {
+            auto decoded_row_ptr = decoded_row.data();
+            jpeg_read_scanlines(&cinfo, &decoded_row_ptr, 1);
+            std::copy_n(decoded_row.data() + trim_offset, row_stride, row_ptr);
+        }
+        sink.commit(row, 1);
+
+        if (timer.times_up())
+        {
+            co_yield nullopt;
+            timer.reset();
+        }
+    }
+
+    // clean up; rows below the region are never decoded
+    if (cinfo.output_scanline < cinfo.output_height)
+        jpeg_abort_decompress(&cinfo);
+    else
+        jpeg_finish_decompress(&cinfo);
+    guard.release();
+    jpeg_destroy_decompress(&cinfo);
+
+    result.pixels = std::move(pixels);
+    result.width = out_width;
+    result.height = out_height;
+    result.channels = num_components;
+    result.bit_depth = 8u;
+    co_yield std::move(result);
+}
+
+
+yielding<expected<decompress_result_t, string>> jpeg_decompress(
+    std::vector<uint8_t> jpeg_bytes,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height,
+    uint32_t metadata,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    return jpeg_decompress_impl<yielding>(
+        std::move(jpeg_bytes),
+        crop_region{crop_x, crop_y, crop_width, crop_height},
+        1,
+        nullptr,
+        metadata,
+        output_format_args{planar, type, std::move(scale), std::move(bias)});
+}
+
+
+// Incremental JPEG decoder. The source manager suspends libjpeg when it runs out of input instead of failing, and
+// each stage of decoding is resumed from where it suspended on the next push. Progressive JPEGs only produce rows once
+// all of their scans have arrived.
+struct jpeg_incremental_decoder : incremental_decoder
+{
+    enum class stage
+    {
+        header,
+        start,
+        scanlines,
+        finish,
+    };
+
+    jpeg_error_mgr err;
+    jpeg_decompress_struct cinfo;
+    jpeg_source_mgr src;
+    std::vector<uint8_t> buffer;
+    size_t bytes_to_skip = 0;
+    bool input_closed = false;
+    stage current_stage = stage::header;
+
+    jpeg_incremental_decoder()
+    {
+        cinfo.err = jpeg_std_error(&err);
+        err.error_exit = jpeg_error_exit;
+        jpeg_create_decompress(&cinfo);
+        cinfo.do_fancy_upsampling = FALSE;
+        cinfo.client_data = this;
+
+        src.next_input_byte = nullptr;
+        src.bytes_in_buffer = 0;
+        src.init_source = [](j_decompress_ptr) {};
+        src.fill_input_buffer = fill_input_buffer;
+        src.skip_input_data = skip_input_data;
+        src.resync_to_restart = jpeg_resync_to_restart;
+        src.term_source = [](j_decompress_ptr) {};
+        cinfo.src = &src;
+
+        jpeg_save_markers(&cinfo, JPEG_APP0, 0xffff);
+        jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+        jpeg_save_markers(&cinfo, JPEG_APP0 + 2, 0xffff);
+    }
+
+    ~jpeg_incremental_decoder() override
+    {
+        jpeg_destroy_decompress(&cinfo);
+    }
+
+    static boolean fill_input_buffer(j_decompress_ptr cinfo)
+    {
+        auto self = reinterpret_cast<jpeg_incremental_decoder*>(cinfo->client_data);
+        if (!self->input_closed)
+            return FALSE;
+
+        // the input ended early: insert a fake EOI marker, as jpeg_mem_src does, so the rest of the image is padded
+        static const JOCTET fake_eoi[] = {0xFF, JPEG_EOI};
+        self->src.next_input_byte = fake_eoi;
+        self->src.bytes_in_buffer = sizeof(fake_eoi);
+        return TRUE;
+    }
+
+    static void skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+    {
+        auto self = reinterpret_cast<jpeg_incremental_decoder*>(cinfo->client_data);
+        if (num_bytes <= 0)
+            return;
+
+        // a suspending source can't suspend here, so skips past the end of the buffer are applied to later chunks
+        const size_t skip = std::min<size_t>(num_bytes, self->src.bytes_in_buffer);
+        self->src.next_input_byte += skip;
+        self->src.bytes_in_buffer -= skip;
+        self->bytes_to_skip += num_bytes - skip;
+    }
+
+    expected<void, string_view> push(const uint8_t* data, size_t size) override
+    {
+        // drop what libjpeg has consumed; it never looks behind next_input_byte once it suspends
+        const size_t consumed = buffer.size() - src.bytes_in_buffer;
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+
+        const size_t skip = std::min(bytes_to_skip, size);
+        bytes_to_skip -= skip;
+        buffer.insert(buffer.end(), data + skip, data + size);
+
+        src.next_input_byte = buffer.data();
+        src.bytes_in_buffer = buffer.size();
+        decode();
+        return {};
+    }
+
+    expected<void, string_view> close() override
+    {
+        input_closed = true;
+        decode();
+        if (!done)
+            return std::unexpected("incomplete JPEG image");
+        return {};
+    }
+
+    // Runs the decoding stages until libjpeg suspends for more input or the image is done.
+    void decode()
+    {
+        if (done)
+            return;
+
+        if (current_stage == stage::header)
+        {
+            if (jpeg_read_header(&cinfo, TRUE) == JPEG_SUSPENDED)
+                return;
+            read_jpeg_saved_markers(&cinfo, result);
+            current_stage = stage::start;
+        }
+
+        if (current_stage == stage::start)
+        {
+            if (!jpeg_start_decompress(&cinfo))
+                return;
+            result.width = cinfo.output_width;
+            result.height = cinfo.output_height;
+            result.channels = static_cast<uint32_t>(cinfo.num_components);
+            result.bit_depth = 8u;
+            const size_t output_bytes = static_cast<size_t>(result.width) * result.height * result.channels;
+            reservation = reserve_decode(result.width, result.height, output_bytes);
+            result.pixels = binary(output_bytes);
+            header_ready = true;
+            current_stage = stage::scanlines;
+        }
+
+        if (current_stage == stage::scanlines)
+        {
+            const size_t row_stride = static_cast<size_t>(result.width) * result.channels;
+            while (cinfo.output_scanline < cinfo.output_height)
+            {
+                auto row_ptr = result.pixels.data + cinfo.output_scanline * row_stride;
+                if (jpeg_read_scanlines(&cinfo, &row_ptr, 1) == 0)
+                    return;
+                rows_ready = cinfo.output_scanline;
+            }
+            current_stage = stage::finish;
+        }
+
+        if (current_stage == stage::finish && jpeg_finish_decompress(&cinfo))
+            done = true;
+    }
+};
+
+
+// JPEG encoder settings, as validated by Imagex.jpeg_compress_options/1.
+struct jpeg_encode_params
+{
+    int quality;
+    bool optimize_coding;
+    bool progressive;
+    // 0 for 4:4:4, 1 for 4:2:2 and 2 for 4:2:0
+    int subsampling;
+    // 0 for the accurate integer DCT, 1 for the fast integer one and 2 for the floating point one
+    int dct_method;
+    // writes a single channel JPEG from RGB pixels
+    bool grayscale;
+};
+
+
+// Sets the image parameters and the encoder settings.
+static void jpeg_set_compress_params(
+    jpeg_compress_struct* cinfo, uint32_t width, uint32_t height, uint32_t channels, const jpeg_encode_params& params)
+{
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = channels;
+    cinfo->in_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, params.quality, TRUE);
+    if (params.grayscale)
+        jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+
+    // the chroma components keep libjpeg's 1x1 sampling, the luma one sets the ratio
+    if (cinfo->num_components == 3)
+    {
+        cinfo->comp_info[0].h_samp_factor = params.subsampling == 0 ? 1 : 2;
+        cinfo->comp_info[0].v_samp_factor = params.subsampling == 2 ? 2 : 1;
+    }
+
+    switch (params.dct_method)
+    {
+    case 1:
+        cinfo->dct_method = JDCT_IFAST;
+        break;
+    case 2:
+        cinfo->dct_method = JDCT_FLOAT;
+        break;
+    default:
+        cinfo->dct_method = JDCT_ISLOW;
+        break;
+    }
+
+    cinfo->optimize_coding = params.optimize_coding;
+    if (params.progressive)
+        jpeg_simple_progression(cinfo);
+}
+
+
+// Writes the EXIF and XMP APP1 segments and the ICC profile. Call right after jpeg_start_compress.
+static expected<void, string_view> jpeg_write_metadata_markers(
+    jpeg_compress_struct* cinfo,
+    const optional<vector<uint8_t>>& exif_binary,
+    const optional<vector<uint8_t>>& xmp_binary,
+    const optional<vector<uint8_t>>& icc_profile)
+{
+    if (exif_binary.has_value())
+    {
+        const auto& exif = exif_binary.value();
+        vector<uint8_t> app1_payload;
+        app1_payload.reserve(6 + exif.size());
+        app1_payload.insert(app1_payload.end(), {'E', 'x', 'i', 'f', 0, 0});
+        app1_payload.insert(app1_payload.end(), exif.data(), exif.data() + exif.size());
+
+        if (app1_payload.size() > 65533)
+            return std::unexpected("EXIF metadata is too large for a JPEG APP1 segment");
+
+        jpeg_write_marker(cinfo, JPEG_APP0 + 1, app1_payload.data(), static_cast<unsigned int>(app1_payload.size()));
+    }
+
+    if (xmp_binary.has_value())
+    {
+        const auto& xmp = xmp_binary.value();
+        vector<uint8_t> app1_payload;
+        app1_payload.reserve(JPEG_XMP_APP1_IDENTIFIER.size() + xmp.size());
+        app1_payload.insert(app1_payload.end(), JPEG_XMP_APP1_IDENTIFIER.begin(), JPEG_XMP_APP1_IDENTIFIER.end());
+        app1_payload.insert(app1_payload.end(), xmp.data(), xmp.data() + xmp.size());
+
+        if (app1_payload.size() > 65533)
+            return std::unexpected("XMP metadata is too large for a JPEG APP1 segment");
+
+        jpeg_write_marker(cinfo, JPEG_APP0 + 1, app1_payload.data(), static_cast<unsigned int>(app1_payload.size()));
+    }
+
+    // libjpeg splits the profile across as many APP2 segments as needed
+    if (icc_profile.has_value() && !icc_profile->empty())
+        jpeg_write_icc_profile(cinfo, icc_profile->data(), static_cast<unsigned int>(icc_profile->size()));
+
+    return {};
+}
+
+
+// Encodes a whole image into a memory buffer. The image must be in the encoder's input color space.
+static vector<uint8_t> jpeg_encode_to_memory(
+    const uint8_t* pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    const jpeg_encode_params& params,
+    const std::function<void(jpeg_compress_struct*)>& configure,
+    const optional<vector<uint8_t>>& exif_binary,
+    const optional<vector<uint8_t>>& xmp_binary,
+    const optional<vector<uint8_t>>& icc_profile)
+{
+    struct jpeg_error_mgr err;
+    struct jpeg_compress_struct cinfo;
+    jpeg_compress_guard guard(&cinfo);
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    err.error_exit = jpeg_error_exit;
+
+    // jpeg_mem_dest keeps buf pointing at its latest buffer, so this frees it on errors too
+    uint8_t* buf = nullptr;
+    unsigned long outsize = 0;
+    const std::unique_ptr<uint8_t*, decltype([](uint8_t** p) { free(*p); })> buf_owner(&buf);
+    jpeg_mem_dest(&cinfo, &buf, &outsize);
+
+    jpeg_set_compress_params(&cinfo, width, height, channels, params);
+    if (configure)
+        configure(&cinfo);
+    jpeg_start_compress(&cinfo, TRUE);
+    if (auto status = jpeg_write_metadata_markers(&cinfo, exif_binary, xmp_binary, icc_profile); !status.has_value())
+        throw codec_error(string(status.error()));
+
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        auto row = const_cast<JSAMPROW>(pixels + static_cast<size_t>(cinfo.next_scanline) * channels * width);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    return vector<uint8_t>(buf, buf + outsize);
+}
+
+
+// Returns the offset of the entropy-coded data of a JPEG written by libjpeg, right after its SOS segment, and the
+// offset of the image height in its SOF segment.
+static pair<size_t, size_t> jpeg_find_scan_data(const vector<uint8_t>& jpeg)
+{
+    constexpr uint8_t sof0 = 0xC0, sof2 = 0xC2, sos = 0xDA;
+    size_t height_offset = 0;
+    size_t offset = 2;
+    while (offset + 4 <= jpeg.size() && jpeg[offset] == 0xFF)
+    {
+        const uint8_t marker = jpeg[offset + 1];
+        const size_t length = (static_cast<size_t>(jpeg[offset + 2]) << 8) | jpeg[offset + 3];
+        if (marker >= sof0 && marker <= sof2)
+            height_offset = offset + 5;
+        if (marker == sos)
+            return {offset + 2 + length, height_offset};
+        offset += 2 + length;
+    }
+    throw codec_error("libjpeg wrote a JPEG without a scan");
+}
+
+
+// Encodes a baseline JPEG on several threads. The image is cut into bands of whole MCU rows that are encoded as
+// separate JPEGs with a restart interval of one band, so none of them contains a restart marker, and their scans are
+// joined with RST markers under the headers of the first one. Restart markers reset the DC predictors just like the
+// start of a scan does, so the result is the same file a single encoder writes with that restart interval.
+static vector<uint8_t> jpeg_encode_bands(
+    const uint8_t* pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    const jpeg_encode_params& params,
+    const optional<vector<uint8_t>>& exif_binary,
+    const optional<vector<uint8_t>>& xmp_binary,
+    const optional<vector<uint8_t>>& icc_profile,
+    uint32_t num_threads)
+{
+    // the MCU size depends on the sampling factors libjpeg settles on
+    uint32_t mcu_width, mcu_height;
+    {
+        struct jpeg_error_mgr err;
+        struct jpeg_compress_struct cinfo;
+        jpeg_compress_guard guard(&cinfo);
+        cinfo.err = jpeg_std_error(&err);
+        jpeg_create_compress(&cinfo);
+        err.error_exit = jpeg_error_exit;
+        jpeg_set_compress_params(&cinfo, width, height, channels, params);
+
+        // single component scans are not interleaved and have one block per MCU
+        int max_h = 1, max_v = 1;
+        for (int i = 0; cinfo.num_components > 1 && i < cinfo.num_components; i++)
+        {
+            max_h = std::max(max_h, cinfo.comp_info[i].h_samp_factor);
+            max_v = std::max(max_v, cinfo.comp_info[i].v_samp_factor);
+        }
+        mcu_width = DCTSIZE * max_h;
+        mcu_height = DCTSIZE * max_v;
+    }
+
+    const uint32_t mcus_per_row = (width + mcu_width - 1) / mcu_width;
+    const uint32_t mcu_rows = (height + mcu_height - 1) / mcu_height;
+    // the restart interval is a 16-bit count of MCUs
+    const uint32_t band_mcu_rows =
+        std::max(1u, std::min((mcu_rows + num_threads - 1) / num_threads, 65535u / mcus_per_row));
+    const uint32_t band_height = band_mcu_rows * mcu_height;
+    const size_t num_bands = (height + band_height - 1) / band_height;
+    const auto set_restart_interval = [&](jpeg_compress_struct* cinfo) {
+        cinfo->restart_interval = band_mcu_rows * mcus_per_row;
+    };
+
+    // a band that fails, running out of memory included, fails the whole image once all bands are done
+    vector<vector<uint8_t>> bands(num_bands);
+    parallel_for(num_bands, num_threads, [&](size_t i) {
+        const uint32_t y = static_cast<uint32_t>(i) * band_height;
+        const uint8_t* band_pixels = pixels + static_cast<size_t>(y) * width * channels;
+        // only the headers of the first band are kept
+        bands[i] = jpeg_encode_to_memory(
+            band_pixels,
+            width,
+            std::min(band_height, height - y),
+            channels,
+            params,
+            set_restart_interval,
+            i == 0 ? exif_binary : nullopt,
+            i == 0 ? xmp_binary : nullopt,
+            i == 0 ? icc_profile : nullopt);
+    });
+
+    auto& out = bands[0];
+    const size_t height_offset = jpeg_find_scan_data(out).second;
+    out[height_offset] = static_cast<uint8_t>(height >> 8);
+    out[height_offset + 1] = static_cast<uint8_t>(height);
+    // drop the EOI marker, scans run up to it
+    out.resize(out.size() - 2);
+    for (size_t i = 1; i < num_bands; i++)
+    {
+        const size_t scan = jpeg_find_scan_data(bands[i]).first;
+        out.push_back(0xFF);
+        out.push_back(static_cast<uint8_t>(JPEG_RST0 + (i - 1) % 8));
+        out.insert(out.end(), bands[i].begin() + scan, bands[i].end() - 2);
+        vector<uint8_t>().swap(bands[i]);
+    }
+    out.push_back(0xFF);
+    out.push_back(static_cast<uint8_t>(JPEG_EOI));
+    return std::move(out);
+}
+
+
+yielding<expected<binary, string>> jpeg_compress(
+    vector<uint8_t> pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    int quality,
+    bool optimize_coding,
+    bool progressive,
+    int subsampling,
+    int dct_method,
+    bool grayscale,
+    optional<vector<uint8_t>> exif_binary,
+    optional<vector<uint8_t>> xmp_binary,
+    optional<vector<uint8_t>> icc_profile,
+    uint32_t num_threads)
+{
+    const jpeg_encode_params params{quality, optimize_coding, progressive, subsampling, dct_method, grayscale};
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // optimized Huffman tables and progressive scans need the statistics of the whole image
+    if (num_threads > 1 && !optimize_coding && !progressive)
+    {
+        vector<uint8_t> out = jpeg_encode_bands(
+            pixels.data(), width, height, channels, params, exif_binary, xmp_binary, icc_profile, num_threads);
+        co_yield binary::from_bytes(out.data(), out.size());
+        co_return;
+    }
+
+    struct jpeg_error_mgr err;
+    struct jpeg_compress_struct cinfo;
+    jpeg_compress_guard guard(&cinfo);
+    yielding_timer timer;
+
+    // create the compressor
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    err.error_exit = jpeg_error_exit;
+
+    uint8_t* buf = nullptr;
+    unsigned long outsize = 0;
+    jpeg_mem_dest(&cinfo, &buf, &outsize);
+
+    jpeg_set_compress_params(&cinfo, width, height, channels, params);
+
+    // do the actual compression
+    jpeg_start_compress(&cinfo, TRUE);
+
+    if (auto status = jpeg_write_metadata_markers(&cinfo, exif_binary, xmp_binary, icc_profile); !status.has_value())
+    {
+        co_yield std::unexpected(status.error());
+        co_return;
+    }
+
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        auto row = pixels.data() + cinfo.next_scanline * channels * width;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+
+        if (timer.times_up())
+        {
+            co_yield nullopt;
+            timer.reset();
+        }
+    }
+    jpeg_finish_compress(&cinfo);
+    guard.release();
+    jpeg_destroy_compress(&cinfo);
+
+    // copy the buf to a binary object
+    binary out = binary::from_bytes(buf, outsize);
+    free(buf);  // free the buf created by jpeg_mem_dest
+
+    co_yield std::move(out);
+}
+
+
+// Incremental JPEG encoder. The destination manager hands out a fixed-size buffer and moves it to output every time
+// libjpeg fills it; whatever is in the buffer at the end of a call is handed back too, since libjpeg never revisits
+// bytes it has emitted.
+struct jpeg_incremental_encoder : incremental_encoder
+{
+    jpeg_error_mgr err;
+    jpeg_compress_struct cinfo;
+    jpeg_destination_mgr dest;
+    std::vector<uint8_t> buffer;
+
+    jpeg_incremental_encoder(uint32_t width, uint32_t height, uint32_t channels) :
+        incremental_encoder(width, height, channels, 8u),
+        buffer(chunk_size)
+    {
+        cinfo.err = jpeg_std_error(&err);
+        err.error_exit = jpeg_error_exit;
+        jpeg_create_compress(&cinfo);
+        cinfo.client_data = this;
+
+        dest.init_destination = [](j_compress_ptr cinfo) {
+            auto self = reinterpret_cast<jpeg_incremental_encoder*>(cinfo->client_data);
+            self->dest.next_output_byte = self->buffer.data();
+            self->dest.free_in_buffer = self->buffer.size();
+        };
+        dest.empty_output_buffer = [](j_compress_ptr cinfo) -> boolean {
+            auto self = reinterpret_cast<jpeg_incremental_encoder*>(cinfo->client_data);
+            // libjpeg calls this with the whole buffer filled, regardless of free_in_buffer
+            self->output.push_back(binary::from_bytes(self->buffer.data(), self->buffer.size()));
+            self->dest.next_output_byte = self->buffer.data();
+            self->dest.free_in_buffer = self->buffer.size();
+            return TRUE;
+        };
+        dest.term_destination = [](j_compress_ptr cinfo) {
+            reinterpret_cast<jpeg_incremental_encoder*>(cinfo->client_data)->flush();
+        };
+        cinfo.dest = &dest;
+    }
+
+    ~jpeg_incremental_encoder() override
+    {
+        jpeg_destroy_compress(&cinfo);
+    }
+
+    // Starts the image and writes the metadata segments.
+    expected<void, string_view> start(
+        const jpeg_encode_params& params,
+        const optional<vector<uint8_t>>& exif_binary,
+        const optional<vector<uint8_t>>& xmp_binary,
+        const optional<vector<uint8_t>>& icc_profile)
+    {
+        jpeg_set_compress_params(&cinfo, width, height, channels, params);
+        jpeg_start_compress(&cinfo, TRUE);
+        if (auto status = jpeg_write_metadata_markers(&cinfo, exif_binary, xmp_binary, icc_profile);
+            !status.has_value())
+            return status;
+        flush();
+        return {};
+    }
+
+    void flush()
+    {
+        const size_t used = buffer.size() - dest.free_in_buffer;
+        if (used > 0)
+            output.push_back(binary::from_bytes(buffer.data(), used));
+        dest.next_output_byte = buffer.data();
+        dest.free_in_buffer = buffer.size();
+    }
+
+    expected<void, string_view> push_rows(const uint8_t* rows, uint32_t num_rows) override
+    {
+        for (uint32_t i = 0; i < num_rows; i++)
+        {
+            auto row = const_cast<JSAMPROW>(rows + i * stride());
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        flush();
+        return {};
+    }
+
+    expected<void, string_view> close() override
+    {
+        jpeg_finish_compress(&cinfo);
+        return {};
+    }
+};
+
+
+// libjpeg's RGB to YCbCr conversion (jccolor.c), done once for all the candidates of a size search instead of once
+// per candidate. It is bit-identical to libjpeg's, so a candidate is the same file a plain encode at its quality makes.
+static vector<uint8_t> jpeg_rgb_to_ycc(const uint8_t* rgb, size_t num_pixels)
+{
+    constexpr int scale_bits = 16;
+    constexpr int32_t one_half = 1 << (scale_bits - 1);
+    constexpr int32_t cbcr_offset = 128 << scale_bits;
+    constexpr auto fix = [](double x) { return static_cast<int32_t>(x * (1 << scale_bits) + 0.5); };
+
+    vector<uint8_t> ycc(num_pixels * 3);
+    for (size_t i = 0; i < num_pixels * 3; i += 3)
+    {
+        const int32_t r = rgb[i], g = rgb[i + 1], b = rgb[i + 2];
+        ycc[i] =
+            static_cast<uint8_t>((fix(0.29900) * r + fix(0.58700) * g + fix(0.11400) * b + one_half) >> scale_bits);
+        ycc[i + 1] = static_cast<uint8_t>(
+            (-fix(0.16874) * r - fix(0.33126) * g + fix(0.50000) * b + cbcr_offset + one_half - 1) >> scale_bits);
+        ycc[i + 2] = static_cast<uint8_t>(
+            (fix(0.50000) * r - fix(0.41869) * g - fix(0.08131) * b + cbcr_offset + one_half - 1) >> scale_bits);
+    }
+    return ycc;
+}
+
+
+// Encodes at the highest quality whose output fits in target_size bytes. Each round encodes up to num_threads
+// qualities spread evenly over the remaining range in parallel and keeps the part of the range between the best one
+// that fits and the first one that doesn't, so a search takes 2 or 3 rounds instead of 7 sequential encodes.
+expected<binary, string> jpeg_compress_to_size(
+    binary pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t target_size,
+    bool optimize_coding,
+    bool progressive,
+    int subsampling,
+    int dct_method,
+    bool grayscale,
+    optional<vector<uint8_t>> exif_binary,
+    optional<vector<uint8_t>> xmp_binary,
+    optional<vector<uint8_t>> icc_profile,
+    uint32_t num_threads)
+{
+    const size_t num_pixels = static_cast<size_t>(width) * height;
+    if (pixels.size != num_pixels * channels)
+        return std::unexpected("pixel data does not match the image shape"s);
+
+    vector<uint8_t> ycc;
+    if (channels == 3)
+        ycc = jpeg_rgb_to_ycc(pixels.data, num_pixels);
+    const uint8_t* input = ycc.empty() ? pixels.data : ycc.data();
+
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const int num_probes = static_cast<int>(std::min(num_threads, 8u));
+
+    // the answer is in [fits, misses): fits is the best quality known to fit (0 for none yet), misses the lowest known
+    // not to
+    int fits = 0, misses = 101;
+    size_t smallest_miss = 0;
+    vector<uint8_t> best;
+    while (misses - fits > 1)
+    {
+        vector<int> qualities;
+        for (int i = 1; i <= num_probes; i++)
+        {
+            const int quality = fits + (misses - fits) * i / (num_probes + 1);
+            if (quality > fits && quality < misses && (qualities.empty() || quality != qualities.back()))
+                qualities.push_back(quality);
+        }
+
+        vector<expected<vector<uint8_t>, string>> candidates(qualities.size());
+        parallel_for(
+            qualities.size(),
+            qualities.size(),
+            [&](size_t i) {
+                const jpeg_encode_params params{
+                    qualities[i], optimize_coding, progressive, subsampling, dct_method, grayscale};
+                candidates[i] = jpeg_encode_to_memory(
+                    input,
+                    width,
+                    height,
+                    channels,
+                    params,
+                    [&](jpeg_compress_struct* cinfo) {
+                        if (!ycc.empty())
+                            cinfo->in_color_space = JCS_YCbCr;
+                    },
+                    exif_binary,
+                    xmp_binary,
+                    icc_profile);
+            },
+            [&](size_t i, string message) { candidates[i] = std::unexpected(std::move(message)); });
+
+        for (size_t i = 0; i < qualities.size(); i++)
+        {
+            if (!candidates[i].has_value())
+                return std::unexpected(std::move(candidates[i].error()));
+            if (candidates[i]->size() > target_size)
+            {
+                misses = qualities[i];
+                smallest_miss = candidates[i]->size();
+                break;
+            }
+            fits = qualities[i];
+            best = std::move(candidates[i].value());
+        }
+    }
+
+    if (fits == 0)
+        return std::unexpected(
+            "the image does not fit in " + std::to_string(target_size) + " bytes, it takes " +
+            std::to_string(smallest_miss) + " bytes at quality 1");
+    return binary::from_bytes(best.data(), best.size());
+}
+
+
+struct png_read_binary
+{
+    std::span<const uint8_t> data;
+    size_t offset = 8;
+
+    png_read_binary(std::span<const uint8_t> data) :
+        data(data)
+    {}
+
+    void read(png_structp png_ptr, png_bytep dest, png_size_t size_to_read)
+    {
+        // the data may be a file mapping, where reading past its end would crash the VM instead of failing the decode
+        if (offset > data.size() || size_to_read > data.size() - offset)
+            png_error(png_ptr, "unexpected end of PNG data");
+        std::copy_n(this->data.data() + offset, size_to_read, dest);
+        this->offset += size_to_read;
+    }
+};
+
+
+void png_error_exit(png_structp png_ptr, const char* error_message)
+{
+    throw codec_error(error_message);
+}
+
+
+// Number of rows handed to libpng per png_read_rows call.
+constexpr size_t PNG_ROWS_PER_BATCH = 16;
+
+
+// Returns the PLTE entries as packed RGB triples, or RGBA quads when a tRNS chunk is present, along with the number of
+// channels per entry. Palette entries beyond the end of the tRNS chunk are fully opaque.
+static optional<tuple<binary, uint32_t>> png_palette_entries(png_structp png_ptr, png_infop info_ptr)
+{
+    png_colorp palette = nullptr;
+    int num_palette = 0;
+    if (png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette) == 0 || num_palette <= 0)
+        return nullopt;
+
+    png_bytep trans_alpha = nullptr;
+    int num_trans = 0;
+    if (png_get_tRNS(png_ptr, info_ptr, &trans_alpha, &num_trans, nullptr) == 0)
+        num_trans = 0;
+
+    const uint32_t entry_size = num_trans > 0 ? 4 : 3;
+    binary entries(num_palette * entry_size);
+    for (int i = 0; i < num_palette; i++)
+    {
+        auto entry = entries.data + i * entry_size;
+        entry[0] = palette[i].red;
+        entry[1] = palette[i].green;
+        entry[2] = palette[i].blue;
+        if (entry_size == 4)
+            entry[3] = i < num_trans ? trans_alpha[i] : 255;
+    }
+
+    return make_tuple(std::move(entries), entry_size);
+}
+
+
+// Sets up the transformations that turn any PNG color type into 8 or 16 bit samples in native byte order. Returns the
+// palette when keep_palette is set and the image has one, in which case the indices are left as they are.
+static optional<tuple<binary, uint32_t>> png_set_output_transforms(
+    png_structp png_ptr, png_infop info_ptr, bool keep_palette)
+{
+    optional<tuple<binary, uint32_t>> palette = nullopt;
+
+    switch (png_get_color_type(png_ptr, info_ptr))
+    {
+    case PNG_COLOR_TYPE_PALETTE:
+        if (keep_palette)
+        {
+            // keep the indices, one byte per pixel, and return the palette alongside them
+            png_set_packing(png_ptr);
+            palette = png_palette_entries(png_ptr, info_ptr);
+        }
+        else
+        {
+            // convert palette to RGB (or RGBA if there is a tRNS chunk)
+            png_set_palette_to_rgb(png_ptr);
+        }
+        break;
+    case PNG_COLOR_TYPE_GRAY:  // expand 1, 2, or 4 bit grayscale to 8 bit grayscale
+        if (png_get_bit_depth(png_ptr, info_ptr) < 8)
+            png_set_expand_gray_1_2_4_to_8(png_ptr);
+        break;
+    }
+
+    if constexpr (std::endian::native == std::endian::little)
+    {
+        if (png_get_bit_depth(png_ptr, info_ptr) == 16)
+            png_set_swap(png_ptr);
+    }
+
+    return palette;
+}
+
+
+static optional<binary> png_exif(png_structp png_ptr, png_infop info_ptr)
+{
+    png_bytep exif = nullptr;
+    png_uint_32 exif_length;
+    if (png_get_eXIf_1(png_ptr, info_ptr, &exif_length, &exif) != 0 && exif_length > 0)
+        return binary::from_bytes(exif, exif_length);
+    return nullopt;
+}
+
+
+// Has libpng discard the ancillary chunks holding metadata that isn't in the mask as it reads them, instead of
+// inflating and storing them.
+static void png_skip_metadata_chunks(png_structp png_ptr, uint32_t metadata)
+{
+    if (!(metadata & (METADATA_TEXT | METADATA_XMP)))
+        png_set_keep_unknown_chunks(
+            png_ptr, PNG_HANDLE_CHUNK_NEVER, reinterpret_cast<png_const_bytep>("tEXt\0zTXt\0iTXt"), 3);
+    if (!(metadata & METADATA_EXIF))
+        png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, reinterpret_cast<png_const_bytep>("eXIf"), 1);
+}
+
+
+// Reads the tEXt/iTXt/zTXt chunks seen so far: the XMP packet with METADATA_XMP in the mask, and the others with
+// METADATA_TEXT.
+static text_chunks_t png_text_chunks(png_structp png_ptr, png_infop info_ptr, uint32_t metadata = METADATA_ALL)
+{
+    text_chunks_t text_data;
+    png_textp text_ptr = nullptr;
+    if (int num_text = png_get_text(png_ptr, info_ptr, &text_ptr, nullptr); num_text > 0)
+    {
+        for (int i = 0; i < num_text; i++)
+        {
+            const uint32_t kind = PNG_XMP_KEYWORD == text_ptr[i].key ? METADATA_XMP : METADATA_TEXT;
+            if (!(metadata & kind))
+                continue;
+
+            vector<uint8_t> key(text_ptr[i].key, text_ptr[i].key + strlen(text_ptr[i].key));
+            png_size_t text_length = text_ptr[i].text_length;
+            if (text_ptr[i].compression == PNG_ITXT_COMPRESSION_NONE ||
+                text_ptr[i].compression == PNG_ITXT_COMPRESSION_zTXt)
+            {
+                text_length = text_ptr[i].itxt_length;
+            }
+
+            vector<uint8_t> text(text_ptr[i].text, text_ptr[i].text + text_length);
+            string_view lang = text_ptr[i].lang != nullptr ? text_ptr[i].lang : "";
+            string_view translated_keyword = text_ptr[i].lang_key != nullptr ? text_ptr[i].lang_key : "";
+            vector<uint8_t> language_tag(lang.begin(), lang.end());
+            vector<uint8_t> translated(translated_keyword.begin(), translated_keyword.end());
+
+            text_data.push_back({std::move(key), std::move(text), std::move(language_tag), std::move(translated)});
+        }
+    }
+    return text_data;
+}
+
+
+// Rows of non-interlaced images are converted to the output format a batch at a time as they are decoded; interlaced
+// images are only complete after the last pass, and are converted then.
+template <template <typename> typename Generator, typename Bytes>
+static Generator<expected<decompress_result_t, string_view>> png_decompress_impl(
+    Bytes png_bytes,
+    bool verify_checksums,
+    bool keep_palette,
+    pixel_buffer* into = nullptr,
+    uint32_t metadata = METADATA_ALL,
+    output_format_args output = {})
+{
+    yielding_timer timer;
+
+    // check png signature
+    if (png_bytes.size() < 8 || png_sig_cmp(png_bytes.data(), 0, 8))
+    {
+        co_yield std::unexpected("invalid png header");
+        co_return;
+    }
+
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
+    if (!png_ptr)
+    {
+        co_yield std::unexpected("couldn't initialize png read struct");
+        co_return;
+    }
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        png_destroy_read_struct(&png_ptr, nullptr, nullptr);
+        co_yield std::unexpected("couldn't initialize png info struct");
+        co_return;
+    }
+
+    try
+    {
+        // for trusted inputs, skip the CRC and Adler-32 checks entirely
+        if (!verify_checksums)
+        {
+            png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#ifdef PNG_IGNORE_ADLER32
+            png_set_option(png_ptr, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+        }
+        png_skip_metadata_chunks(png_ptr, metadata);
+
+        // read metadata
+        png_read_binary data_wrapper(png_bytes);
+        png_set_read_fn(
+            png_ptr,
+            reinterpret_cast<png_voidp>(&data_wrapper),
+            [](png_structp png_ptr, png_bytep dest, png_size_t size_to_read) {
+                auto data_wrapper = reinterpret_cast<png_read_binary*>(png_get_io_ptr(png_ptr));
+                data_wrapper->read(png_ptr, dest, size_to_read);
+            });
+        png_set_sig_bytes(png_ptr, 8);
+        png_read_info(png_ptr, info_ptr);
+
+        const png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+        const png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+        optional<tuple<binary, uint32_t>> palette = png_set_output_transforms(png_ptr, info_ptr, keep_palette);
+
+        // Depending on whether the image is interlaced, we need to decode multiple passes
+        // See https://github.com/glennrp/libpng/blob/libpng16/libpng-manual.txt and
+        // libpng png_read_image's implementation
+        const int num_passes = png_set_interlace_handling(png_ptr);
+        png_read_update_info(png_ptr, info_ptr);
+
+        // the output format, after all of the transformations above have been applied
+        const png_uint_32 bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+        const png_uint_32 channels = png_get_channels(png_ptr, info_ptr);
+        const size_t stride = png_get_rowbytes(png_ptr, info_ptr);
+        if (palette.has_value() && output.converts())
+            throw codec_error("layout, type, scale and bias cannot be combined with keep_palette: true");
+        row_sink sink(width, height, channels, bit_depth, stride, output, num_passes > 1 ? height : PNG_ROWS_PER_BATCH);
+        auto reservation = reserve_decode(width, height, sink.memory_size(), into);
+        binary pixels;
+        sink.allocate(pixels, into);
+
+        array<png_bytep, PNG_ROWS_PER_BATCH> row_pointers;
+        for (int pass = 0; pass < num_passes; pass++)
+        {
+            for (size_t i = 0; i < height; i += PNG_ROWS_PER_BATCH)
+            {
+                const size_t num_rows = std::min<size_t>(PNG_ROWS_PER_BATCH, height - i);
+                for (size_t j = 0; j < num_rows; j++)
+                    row_pointers[j] = sink.row(i + j);
+                png_read_rows(png_ptr, row_pointers.data(), nullptr, num_rows);
+                if (pass == num_passes - 1)
+                    sink.commit(i, num_rows);
+
+                if (timer.times_up())
+                {
+                    co_yield nullopt;
+                    timer.reset();
+                }
+            }
+        }
+
+        optional<binary> exif_data = png_exif(png_ptr, info_ptr);
+        text_chunks_t text_data = png_text_chunks(png_ptr, info_ptr, metadata);
+
+        png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+        png_ptr = nullptr;
+
+        co_yield decompress_result_t{
+            .pixels = std::move(pixels),
+            .width = width,
+            .height = height,
+            .channels = channels,
+            .bit_depth = bit_depth,
+            .exif = std::move(exif_data),
+            .text_chunks = std::move(text_data),
+            .palette = std::move(palette),
+        };
+    }
+    catch (erl_error<string>&)
+    {
+        if (png_ptr)
+            png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+        throw;
+    }
+}
+
+
+yielding<expected<decompress_result_t, string_view>> png_decompress(
+    vector<uint8_t> png_bytes,
+    bool verify_checksums,
+    bool keep_palette,
+    uint32_t metadata,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    return png_decompress_impl<yielding>(
+        std::move(png_bytes),
+        verify_checksums,
+        keep_palette,
+        nullptr,
+        metadata,
+        output_format_args{planar, type, std::move(scale), std::move(bias)});
+}
+
+
+// Incremental PNG decoder on top of libpng's progressive reader. Rows of non-interlaced images become available as
+// their IDAT data arrives; interlaced images only complete their rows in the last pass, so they become available at the
+// end.
+struct png_incremental_decoder : incremental_decoder
+{
+    png_structp png_ptr = nullptr;
+    png_infop info_ptr = nullptr;
+    bool keep_palette;
+    int num_passes = 1;
+    size_t stride = 0;
+
+    png_incremental_decoder(bool verify_checksums, bool keep_palette) :
+        keep_palette(keep_palette)
+    {
+        png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
+        if (png_ptr)
+            info_ptr = png_create_info_struct(png_ptr);
+        if (!info_ptr)
+            return;
+
+        if (!verify_checksums)
+        {
+            png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#ifdef PNG_IGNORE_ADLER32
+            png_set_option(png_ptr, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+        }
+        // the progressive reader has no eXIf handler, so keep it as an unknown chunk and pick it up from there
+        png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_ALWAYS, reinterpret_cast<png_const_bytep>("eXIf"), 1);
+        png_set_progressive_read_fn(png_ptr, this, info_callback, row_callback, end_callback);
+    }
+
+    ~png_incremental_decoder() override
+    {
+        if (png_ptr)
+            png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : nullptr, nullptr);
+    }
+
+    static void info_callback(png_structp png_ptr, png_infop info_ptr)
+    {
+        auto self = reinterpret_cast<png_incremental_decoder*>(png_get_progressive_ptr(png_ptr));
+        self->result.palette = png_set_output_transforms(png_ptr, info_ptr, self->keep_palette);
+        self->num_passes = png_set_interlace_handling(png_ptr);
+        png_read_update_info(png_ptr, info_ptr);
+
+        self->result.width = png_get_image_width(png_ptr, info_ptr);
+        self->result.height = png_get_image_height(png_ptr, info_ptr);
+        self->result.bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+        self->result.channels = png_get_channels(png_ptr, info_ptr);
+        self->stride = png_get_rowbytes(png_ptr, info_ptr);
+        self->reservation =
+            reserve_decode(self->result.width, self->result.height, self->result.height * self->stride);
+        self->result.pixels = binary(self->result.height * self->stride);
+        self->header_ready = true;
+    }
+
+    static void row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass)
+    {
+        auto self = reinterpret_cast<png_incremental_decoder*>(png_get_progressive_ptr(png_ptr));
+        if (new_row == nullptr)
+            return;
+
+        png_progressive_combine_row(png_ptr, self->result.pixels.data + row_num * self->stride, new_row);
+        if (self->num_passes == 1)
+            self->rows_ready = row_num + 1;
+    }
+
+    static void end_callback(png_structp png_ptr, png_infop info_ptr)
+    {
+        auto self = reinterpret_cast<png_incremental_decoder*>(png_get_progressive_ptr(png_ptr));
+        self->result.exif = png_exif(png_ptr, info_ptr);
+        png_unknown_chunkp chunks = nullptr;
+        const int num_chunks = png_get_unknown_chunks(png_ptr, info_ptr, &chunks);
+        for (int i = 0; i < num_chunks && !self->result.exif.has_value(); i++)
+        {
+            if (memcmp(chunks[i].name, "eXIf", 4) == 0 && chunks[i].size > 0)
+                self->result.exif = binary::from_bytes(chunks[i].data, chunks[i].size);
+        }
+        self->result.text_chunks = png_text_chunks(png_ptr, info_ptr);
+        self->rows_ready = self->result.height;
+        self->done = true;
+    }
+
+    expected<void, string_view> push(const uint8_t* data, size_t size) override
+    {
+        if (!info_ptr)
+            return std::unexpected("couldn't initialize png read struct");
+        if (!done)
+            png_process_data(png_ptr, info_ptr, const_cast<png_bytep>(data), size);
+        return {};
+    }
+
+    expected<void, string_view> close() override
+    {
+        if (!done)
+            return std::unexpected("incomplete PNG image");
+        return {};
+    }
+};
+
+
+// PNG filter selection, as passed in from Elixir. The first five are the PNG filter types themselves.
+enum class png_filter_kind : int
+{
+    none = 0,
+    sub = 1,
+    up = 2,
+    avg = 3,
+    paeth = 4,
+    adaptive = 5,
+};
+
+
+static int png_filter_mask(png_filter_kind filter)
+{
+    switch (filter)
+    {
+    case png_filter_kind::none:
+        return PNG_FILTER_NONE;
+    case png_filter_kind::sub:
+        return PNG_FILTER_SUB;
+    case png_filter_kind::up:
+        return PNG_FILTER_UP;
+    case png_filter_kind::avg:
+        return PNG_FILTER_AVG;
+    case png_filter_kind::paeth:
+        return PNG_FILTER_PAETH;
+    case png_filter_kind::adaptive:
+        return PNG_ALL_FILTERS;
+    }
+    return PNG_ALL_FILTERS;
+}
+
+
+static uint8_t png_paeth_predictor(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+
+// Writes the filter type byte followed by the filtered row into out. prev is nullptr for the first row of the image.
+static void png_filter_row(
+    png_filter_kind filter, const uint8_t* row, const uint8_t* prev, size_t stride, size_t bpp, uint8_t* out)
+{
+    out[0] = static_cast<uint8_t>(filter);
+    uint8_t* dst = out + 1;
+    for (size_t i = 0; i < stride; i++)
+    {
+        const int a = i >= bpp ? row[i - bpp] : 0;
+        const int b = prev ? prev[i] : 0;
+        const int c = prev && i >= bpp ? prev[i - bpp] : 0;
+        switch (filter)
+        {
+        case png_filter_kind::sub:
+            dst[i] = row[i] - a;
+            break;
+        case png_filter_kind::up:
+            dst[i] = row[i] - b;
+            break;
+        case png_filter_kind::avg:
+            dst[i] = row[i] - ((a + b) >> 1);
+            break;
+        case png_filter_kind::paeth:
+            dst[i] = row[i] - png_paeth_predictor(a, b, c);
+            break;
+        default:
+            dst[i] = row[i];
+            break;
+        }
+    }
+}
+
+
+// Same as png_filter_row, but for png_filter_kind::adaptive picks the filter with the smallest sum of absolute
+// (signed) residuals, the same heuristic libpng uses. scratch must hold stride + 1 bytes.
+static void png_filter_row_adaptive(
+    png_filter_kind filter,
+    const uint8_t* row,
+    const uint8_t* prev,
+    size_t stride,
+    size_t bpp,
+    uint8_t* out,
+    uint8_t* scratch)
+{
+    if (filter != png_filter_kind::adaptive)
+        return png_filter_row(filter, row, prev, stride, bpp, out);
+
+    uint64_t best_sum = UINT64_MAX;
+    constexpr array<png_filter_kind, 5> candidates = {
+        png_filter_kind::none,
+        png_filter_kind::sub,
+        png_filter_kind::up,
+        png_filter_kind::avg,
+        png_filter_kind::paeth,
+    };
+    for (auto candidate : candidates)
+    {
+        png_filter_row(candidate, row, prev, stride, bpp, scratch);
+        uint64_t sum = 0;
+        for (size_t i = 1; i <= stride; i++)
+            sum += std::abs(static_cast<int8_t>(scratch[i]));
+        if (sum < best_sum)
+        {
+            best_sum = sum;
+            std::copy_n(scratch, stride + 1, out);
+        }
+    }
+}
+
+
+// Raw deflate output of one band of filtered rows, along with the band's Adler-32 checksum.
+struct png_deflate_band
+{
+    vector<uint8_t> data;
+    uLong adler = 0;
+    bool ok = false;
+};
+
+
+// Deflates one band of filtered scanlines as a raw deflate stream. All bands but the last end with a sync flush, so
+// that they end on a byte boundary and can be concatenated into one stream. dictionary is the (up to 32KB of) data
+// immediately preceding the band, so that matches can still reach back across the band boundary.
+static png_deflate_band png_deflate_band_data(
+    const uint8_t* data,
+    size_t length,
+    const uint8_t* dictionary,
+    size_t dictionary_length,
+    bool last,
+    int level,
+    int strategy)
+{
+    png_deflate_band band;
+    z_stream strm = {};
+    if (deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8, strategy) != Z_OK)
+        return band;
+
+    if (dictionary_length > 0)
+        deflateSetDictionary(&strm, dictionary, dictionary_length);
+
+    band.data.resize(deflateBound(&strm, length) + 16);
+    strm.next_in = const_cast<Bytef*>(data);
+    strm.avail_in = length;
+    strm.next_out = band.data.data();
+    strm.avail_out = band.data.size();
+
+    const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    for (;;)
+    {
+        if (strm.avail_out == 0)
+        {
+            band.data.resize(band.data.size() * 2);
+            strm.next_out = band.data.data() + strm.total_out;
+            strm.avail_out = band.data.size() - strm.total_out;
+        }
+
+        const int ret = deflate(&strm, flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            deflateEnd(&strm);
+            return band;
+        }
+        if (flush == Z_FINISH ? ret == Z_STREAM_END : strm.avail_out != 0)
+            break;
+    }
+
+    band.data.resize(strm.total_out);
+    band.adler = adler32(adler32(0, nullptr, 0), data, length);
+    band.ok = true;
+    deflateEnd(&strm);
+    return band;
+}
+
+
+// Filters and deflates the image data on multiple threads, pigz-style: the rows are split into bands that are
+// deflated independently and stitched together into a single zlib stream.
+static expected<vector<uint8_t>, string_view> png_parallel_idat(
+    const vector<uint8_t>& pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    png_filter_kind filter,
+    int level,
+    int strategy,
+    size_t num_threads)
+{
+    const size_t stride = static_cast<size_t>(width) * channels * bit_depth / 8;
+    const size_t bpp = std::max<size_t>(1, channels * bit_depth / 8);
+    const size_t filtered_stride = stride + 1;
+    const bool swap_bytes = bit_depth == 16 && std::endian::native == std::endian::little;
+    if (pixels.size() < stride * height)
+        return std::unexpected("pixel buffer is too small for the image dimensions");
+
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t num_bands = std::min<size_t>(num_threads, height);
+    const size_t rows_per_band = (height + num_bands - 1) / num_bands;
+
+    // filter each band of rows. PNG stores 16-bit samples big-endian, so swap them first on little-endian machines.
+    vector<uint8_t> filtered(filtered_stride * height);
+    parallel_for(num_bands, num_threads, [&](size_t band) {
+        const size_t first_row = band * rows_per_band;
+        const size_t last_row = std::min<size_t>(height, first_row + rows_per_band);
+        vector<uint8_t> scratch(filtered_stride);
+        vector<uint8_t> rows[2];
+        for (size_t y = first_row; y < last_row; y++)
+        {
+            const uint8_t* row = pixels.data() + y * stride;
+            const uint8_t* prev = y > 0 ? pixels.data() + (y - 1) * stride : nullptr;
+            if (swap_bytes)
+            {
+                for (size_t r = 0; r < 2; r++)
+                {
+                    const uint8_t* src = r == 0 ? row : prev;
+                    if (!src)
+                        continue;
+                    rows[r].assign(src, src + stride);
+                    for (size_t i = 0; i + 1 < stride; i += 2)
+                        std::swap(rows[r][i], rows[r][i + 1]);
+                }
+                row = rows[0].data();
+                prev = prev ? rows[1].data() : nullptr;
+            }
+            png_filter_row_adaptive(
+                filter, row, prev, stride, bpp, filtered.data() + y * filtered_stride, scratch.data());
+        }
+    });
+
+    // deflate each band, priming it with the tail of the previous band
+    vector<png_deflate_band> bands(num_bands);
+    parallel_for(num_bands, num_threads, [&](size_t band) {
+        const size_t begin = band * rows_per_band * filtered_stride;
+        const size_t end = std::min<size_t>(height, (band + 1) * rows_per_band) * filtered_stride;
+        const size_t dictionary_length = std::min<size_t>(begin, 32768);
+        bands[band] = png_deflate_band_data(
+            filtered.data() + begin,
+            end - begin,
+            filtered.data() + begin - dictionary_length,
+            dictionary_length,
+            band + 1 == num_bands,
+            level,
+            strategy);
+    });
+
+    // zlib header (no preset dictionary) + deflate bands + Adler-32 of all the filtered data
+    const int flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    uint8_t cmf = 0x78;
+    uint8_t flg = flevel << 6;
+    flg += 31 - ((cmf << 8 | flg) % 31);
+
+    vector<uint8_t> idat = {cmf, flg};
+    uLong adler = adler32(0, nullptr, 0);
+    for (size_t i = 0; i < num_bands; i++)
+    {
+        if (!bands[i].ok)
+            return std::unexpected("deflate failed");
+        idat.insert(idat.end(), bands[i].data.begin(), bands[i].data.end());
+
+        const size_t band_length = std::min<size_t>(height, (i + 1) * rows_per_band) * filtered_stride -
+                                   i * rows_per_band * filtered_stride;
+        adler = adler32_combine(adler, bands[i].adler, band_length);
+    }
+    idat.insert(idat.end(), {
+        static_cast<uint8_t>(adler >> 24),
+        static_cast<uint8_t>(adler >> 16),
+        static_cast<uint8_t>(adler >> 8),
+        static_cast<uint8_t>(adler),
+    });
+
+    return idat;
+}
+
+
+// Maximum size of each IDAT chunk written by the parallel encoder.
+constexpr size_t PNG_IDAT_CHUNK_SIZE = 1 << 20;
+
+
+// Writes IHDR and the text chunks, and sets up the compression options for the image data that follows.
+static void png_write_header(
+    png_structp png_ptr,
+    png_infop info_ptr,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    const optional<text_chunks_t>& text_chunks,
+    int compression_level,
+    int strategy,
+    png_filter_kind filter_kind)
+{
+    int color_type;
+    switch (channels)
+    {
+    case 1:
+        color_type = PNG_COLOR_TYPE_GRAY;
+        break;
+    case 2:
+        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        break;
+    case 3:
+        color_type = PNG_COLOR_TYPE_RGB;
+        break;
+    case 4:
+        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+        break;
+    default:
+        __builtin_unreachable();  // validated by the callers
+    }
+
+    png_set_IHDR(
+        png_ptr,
+        info_ptr,
+        width,
+        height,
+        bit_depth,
+        color_type,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_BASE,
+        PNG_FILTER_TYPE_BASE);
+
+    if (text_chunks.has_value())
+    {
+        vector<string> text_keys;
+        vector<string> text_values;
+        vector<string> language_tags;
+        vector<string> translated_keywords;
+        vector<png_text> png_text_entries;
+
+        text_keys.reserve(text_chunks->size());
+        text_values.reserve(text_chunks->size());
+        language_tags.reserve(text_chunks->size());
+        translated_keywords.reserve(text_chunks->size());
+        png_text_entries.reserve(text_chunks->size());
+
+        for (const auto& [key, value, language_tag, translated_keyword] : *text_chunks)
+        {
+            text_keys.emplace_back(reinterpret_cast<const char*>(key.data()), key.size());
+            text_values.emplace_back(reinterpret_cast<const char*>(value.data()), value.size());
+            language_tags.emplace_back(reinterpret_cast<const char*>(language_tag.data()), language_tag.size());
+            translated_keywords.emplace_back(
+                reinterpret_cast<const char*>(translated_keyword.data()), translated_keyword.size());
+
+            png_text entry = {};
+            entry.compression = PNG_ITXT_COMPRESSION_NONE;
+            entry.key = text_keys.back().data();
+            entry.text = text_values.back().data();
+            entry.text_length = text_values.back().size();
+            entry.itxt_length = text_values.back().size();
+            entry.lang = language_tags.back().data();
+            entry.lang_key = translated_keywords.back().data();
+            png_text_entries.push_back(entry);
+        }
+
+        if (!png_text_entries.empty())
+            png_set_text(png_ptr, info_ptr, png_text_entries.data(), png_text_entries.size());
+    }
+
+    png_set_compression_level(png_ptr, compression_level);
+    png_set_compression_strategy(png_ptr, strategy);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, png_filter_mask(filter_kind));
+
+    png_write_info(png_ptr, info_ptr);
+}
+
+
+yielding<expected<vector<png_byte>, string_view>> png_compress(
+    vector<uint8_t> pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    optional<text_chunks_t> text_chunks,
+    int compression_level,
+    int filter,
+    int strategy,
+    int num_threads)
+{
+    yielding_timer timer;
+
+    if (channels == 0 || channels > 4)
+    {
+        co_yield std::unexpected("unsupported number of channels (must be 1-4)");
+        co_return;
+    }
+
+    if (filter < 0 || filter > static_cast<int>(png_filter_kind::adaptive))
+    {
+        co_yield std::unexpected("unsupported png filter");
+        co_return;
+    }
+    const auto filter_kind = static_cast<png_filter_kind>(filter);
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
+    if (!png_ptr)
+    {
+        co_yield std::unexpected("couldn't initialize png write struct");
+        co_return;
+    }
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        png_destroy_write_struct(&png_ptr, nullptr);
+        co_yield std::unexpected("couldn't initialize png info struct");
+        co_return;
+    }
+
+    try
+    {
+        // set up the output data, as well as the callback to write into that data
+        vector<png_byte> out_data;
+        auto png_chunk_producer = [](png_structp png_ptr, png_bytep data, png_size_t length) {
+            auto out_data_p = reinterpret_cast<vector<png_byte>*>(png_get_io_ptr(png_ptr));
+            std::copy_n(data, length, std::back_inserter(*out_data_p));
+        };
+        png_set_write_fn(png_ptr, &out_data, png_chunk_producer, nullptr);
+
+        png_write_header(
+            png_ptr,
+            info_ptr,
+            width,
+            height,
+            channels,
+            bit_depth,
+            text_chunks,
+            compression_level,
+            strategy,
+            filter_kind);
+
+        if (num_threads != 1 && height > 1)
+        {
+            // filter and deflate the image data ourselves, then write it out as IDAT chunks directly
+            auto idat = png_parallel_idat(
+                pixels, width, height, channels, bit_depth, filter_kind, compression_level, strategy, num_threads);
+            if (!idat.has_value())
+            {
+                png_destroy_write_struct(&png_ptr, &info_ptr);
+                co_yield std::unexpected(idat.error());
+                co_return;
+            }
+
+            const png_byte idat_name[] = "IDAT";
+            const png_byte iend_name[] = "IEND";
+            for (size_t offset = 0; offset < idat->size(); offset += PNG_IDAT_CHUNK_SIZE)
+            {
+                const size_t length = std::min(PNG_IDAT_CHUNK_SIZE, idat->size() - offset);
+                png_write_chunk(png_ptr, idat_name, idat->data() + offset, length);
+            }
+            png_write_chunk(png_ptr, iend_name, nullptr, 0);
+
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            png_ptr = nullptr;
+
+            co_yield std::move(out_data);
+            co_return;
+        }
+
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            if (bit_depth == 16)
+                png_set_swap(png_ptr);
+        }
+
+        // write the pixels
+        const unsigned int stride = width * channels * bit_depth / 8;
+        for (size_t i = 0; i < height; i++)
+        {
+            png_write_row(png_ptr, pixels.data() + i * stride);
+
+            if (timer.times_up())
+            {
+                co_yield nullopt;
+                timer.reset();
+            }
+        }
+
+        // cleanup
+        png_write_end(png_ptr, nullptr);
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        png_ptr = nullptr;
+
+        co_yield std::move(out_data);
+    }
+    catch (erl_error<string>& e)
+    {
+        if (png_ptr)
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+        throw e;
+    }
+}
+
+
+// Incremental PNG encoder. libpng hands the compressed data to the write callback as it fills its IDAT buffer, which
+// collects it into chunks for the output.
+struct png_incremental_encoder : incremental_encoder
+{
+    png_structp png_ptr = nullptr;
+    png_infop info_ptr = nullptr;
+    std::vector<uint8_t> pending;
+
+    png_incremental_encoder(uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth) :
+        incremental_encoder(width, height, channels, bit_depth)
+    {
+        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
+        if (png_ptr)
+            info_ptr = png_create_info_struct(png_ptr);
+        if (!info_ptr)
+            return;
+
+        png_set_write_fn(
+            png_ptr,
+            this,
+            [](png_structp png_ptr, png_bytep data, png_size_t length) {
+                auto self = reinterpret_cast<png_incremental_encoder*>(png_get_io_ptr(png_ptr));
+                self->pending.insert(self->pending.end(), data, data + length);
+                if (self->pending.size() >= chunk_size)
+                    self->flush();
+            },
+            nullptr);
+    }
+
+    ~png_incremental_encoder() override
+    {
+        if (png_ptr)
+            png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : nullptr);
+    }
+
+    // Writes the header chunks.
+    expected<void, string_view> start(
+        const optional<text_chunks_t>& text_chunks, int compression_level, int filter, int strategy)
+    {
+        if (!info_ptr)
+            return std::unexpected("couldn't initialize png write struct");
+
+        png_write_header(
+            png_ptr,
+            info_ptr,
+            width,
+            height,
+            channels,
+            bit_depth,
+            text_chunks,
+            compression_level,
+            strategy,
+            static_cast<png_filter_kind>(filter));
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            if (bit_depth == 16)
+                png_set_swap(png_ptr);
+        }
+        flush();
+        return {};
+    }
+
+    void flush()
+    {
+        if (!pending.empty())
+            output.push_back(binary::from_bytes(pending.data(), pending.size()));
+        pending.clear();
+    }
+
+    expected<void, string_view> push_rows(const uint8_t* rows, uint32_t num_rows) override
+    {
+        for (uint32_t i = 0; i < num_rows; i++)
+            png_write_row(png_ptr, rows + i * stride());
+        flush();
+        return {};
+    }
+
+    expected<void, string_view> close() override
+    {
+        png_write_end(png_ptr, nullptr);
+        flush();
+        return {};
+    }
+};
+
+
+static_assert(JXL_ENC_SUCCESS == 0 && JXL_DEC_SUCCESS == 0);
+
+// NOTE: This macro uses `return`, NOT `co_return`. It is NOT safe to use inside coroutines.
+#define JXL_ENSURE_SUCCESS(func, ...)                                                                                  \
+    if (func(__VA_ARGS__) != 0)                                                                                        \
+    {                                                                                                                  \
+        return std::unexpected(#func " failed");                                                                       \
+    }
+
+
+static string_view unexpected_jxl_decoder_status_message(JxlDecoderStatus status)
+{
+    switch (status)
+    {
+    case JXL_DEC_NEED_PREVIEW_OUT_BUFFER:
+        return "JXL decoder requested unsupported preview output";
+    case JXL_DEC_FRAME:
+        return "JXL decoder returned unsupported frame event";
+    case JXL_DEC_FRAME_PROGRESSION:
+        return "JXL decoder returned unsupported frame progression event";
+    case JXL_DEC_BOX_COMPLETE:
+        return "JXL decoder returned unsupported box-complete event";
+    default:
+        return "Unknown or unsupported JXL decoder status";
+    }
+}
+
+
+enum class jxl_box_kind
+{
+    none,
+    exif,
+    xml,
+    jumb,
+};
+
+
+// The bit of the metadata mask that selects boxes of a kind.
+static uint32_t jxl_box_metadata(jxl_box_kind box_kind)
+{
+    switch (box_kind)
+    {
+    case jxl_box_kind::exif:
+        return METADATA_EXIF;
+    case jxl_box_kind::xml:
+        return METADATA_XMP;
+    case jxl_box_kind::jumb:
+        return METADATA_OTHER;
+    default:
+        return METADATA_NONE;
+    }
+}
+
+
+static optional<binary> finalize_jxl_box_data(std::vector<uint8_t>& box_data, JxlDecoder* dec)
+{
+    size_t remaining = JxlDecoderReleaseBoxBuffer(dec);
+    if (remaining > box_data.size())
+        return nullopt;
+
+    box_data.resize(box_data.size() - remaining);
+    return binary::from_bytes(box_data.data(), box_data.size());
+}
+
+
+// Parse JXL EXIF box data, handling the 4-byte big-endian offset prefix.
+static optional<binary> parse_jxl_exif(const binary& exif_data)
+{
+    if (exif_data.size < 4)
+        return nullopt;
+
+    // The first 4 bytes are a big-endian offset (usually 0)
+    size_t offset = static_cast<size_t>(exif_data.data[0]) << 24 | static_cast<size_t>(exif_data.data[1]) << 16 |
+                    static_cast<size_t>(exif_data.data[2]) << 8 | static_cast<size_t>(exif_data.data[3]);
+
+    if (4 + offset >= exif_data.size)
+        return nullopt;
+
+    return binary::from_bytes(exif_data.data + 4 + offset, exif_data.size - 4 - offset);
+}
+
+
+static optional<jxl_box_kind> jxl_box_kind_from_type(const JxlBoxType box_type)
+{
+    const string_view type(box_type, 4);
+    if (type == "Exif")
+        return jxl_box_kind::exif;
+    if (type == "xml ")
+        return jxl_box_kind::xml;
+    if (type == "jumb")
+        return jxl_box_kind::jumb;
+
+    return nullopt;
+}
+
+
+template <typename Result>
+static expected<void, string_view> append_jxl_box(Result& result, jxl_box_kind box_kind, binary box_data)
+{
+    switch (box_kind)
+    {
+    case jxl_box_kind::none:
+        return {};
+
+    case jxl_box_kind::exif: {
+        optional<binary> exif = parse_jxl_exif(box_data);
+        if (!exif.has_value())
+            return std::unexpected("invalid JXL metadata box");
+        result.exif = std::move(exif.value());
+        return {};
+    }
+
+    case jxl_box_kind::xml:
+        result.xml_boxes.push_back(std::move(box_data));
+        return {};
+
+    case jxl_box_kind::jumb:
+        result.jumb_boxes.push_back(std::move(box_data));
+        return {};
+    }
+
+    return {};
+}
+
+
+// Collects the Exif, xml and jumb boxes of a JXL file into result as the decoder emits JXL_DEC_BOX and
+// JXL_DEC_BOX_NEED_MORE_OUTPUT events. Result is anything with exif, xml_boxes and jumb_boxes fields. Boxes of kinds
+// that aren't in the metadata mask are skipped without reading them.
+template <typename Result>
+struct jxl_box_reader
+{
+    static constexpr size_t chunk_size = 0xffff;
+
+    Result& result;
+    JxlDecoder* dec;
+    uint32_t metadata;
+    jxl_box_kind current_box_kind = jxl_box_kind::none;
+    std::vector<uint8_t> current_box_data;
+
+    jxl_box_reader(Result& result, JxlDecoder* dec, uint32_t metadata = METADATA_ALL) :
+        result(result),
+        dec(dec),
+        metadata(metadata)
+    {}
+
+    // Finishes the box currently being read, if any. Call on every JXL_DEC_BOX event and on JXL_DEC_SUCCESS.
+    expected<void, string_view> finish_box()
+    {
+        if (current_box_kind == jxl_box_kind::none)
+            return {};
+
+        optional<binary> box_data = finalize_jxl_box_data(current_box_data, dec);
+        if (!box_data.has_value())
+            return std::unexpected("invalid JXL metadata box");
+
+        if (auto append_result = append_jxl_box(result, current_box_kind, std::move(box_data.value()));
+            !append_result.has_value())
+            return std::unexpected(append_result.error());
+
+        current_box_kind = jxl_box_kind::none;
+        current_box_data.clear();
+        return {};
+    }
+
+    // Handles a JXL_DEC_BOX event.
+    expected<void, string_view> start_box()
+    {
+        if (auto box_result = finish_box(); !box_result.has_value())
+            return box_result;
+
+        JxlBoxType box_type;
+        if (JxlDecoderGetBoxType(dec, box_type, JXL_TRUE) != JXL_DEC_SUCCESS)
+            return std::unexpected("JxlDecoderGetBoxType failed");
+        optional<jxl_box_kind> next_box_kind = jxl_box_kind_from_type(box_type);
+        if (!next_box_kind.has_value() || !(metadata & jxl_box_metadata(next_box_kind.value())))
+            return {};
+
+        current_box_kind = next_box_kind.value();
+        current_box_data.resize(chunk_size);
+        JxlDecoderSetBoxBuffer(dec, current_box_data.data(), current_box_data.size());
+        return {};
+    }
+
+    // Handles a JXL_DEC_BOX_NEED_MORE_OUTPUT event.
+    expected<void, string_view> grow_box()
+    {
+        const size_t remaining = JxlDecoderReleaseBoxBuffer(dec);
+        const size_t output_pos = current_box_data.size() - remaining;
+        current_box_data.resize(current_box_data.size() + chunk_size);
+        if (JxlDecoderSetBoxBuffer(dec, current_box_data.data() + output_pos, current_box_data.size() - output_pos) !=
+            JXL_DEC_SUCCESS)
+            return std::unexpected("JxlDecoderSetBoxBuffer failed");
+        return {};
+    }
+};
+
+
+static optional<array<char, 4>> jxl_box_type_from_atom(const atom& box_type_atom)
+{
+    if (box_type_atom == "xml"sv)
+        return array<char, 4>{'x', 'm', 'l', ' '};
+    if (box_type_atom == "jumb"sv)
+        return array<char, 4>{'j', 'u', 'm', 'b'};
+
+    return nullopt;
+}
+
+
+// Collect all output from a JXL encoder into a vector.
+static expected<vector<uint8_t>, string_view> jxl_collect_compressed(JxlEncoder* enc)
+{
+    vector<uint8_t> compressed(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    JxlEncoderStatus process_result;
+    while (true)
+    {
+        process_result = JxlEncoderProcessOutput(enc, &next_out, &avail_out);
+        if (process_result != JXL_ENC_NEED_MORE_OUTPUT)
+            break;
+        size_t offset = next_out - compressed.data();
+        compressed.resize(compressed.size() * 2);
+        next_out = compressed.data() + offset;
+        avail_out = compressed.size() - offset;
+    }
+    compressed.resize(next_out - compressed.data());
+    if (process_result != JXL_ENC_SUCCESS)
+    {
+        fprintf(stderr, "JxlEncoderProcessOutput failed with status: %d\n", process_result);
+        return std::unexpected("JxlEncoderProcessOutput failed");
+    }
+
+    return compressed;
+}
+
+
+JxlBasicInfo jxl_basic_info_from_pixel_format(const JxlPixelFormat& pixel_format)
+{
+    JxlBasicInfo basic_info;
+    JxlEncoderInitBasicInfo(&basic_info);
+
+    switch (pixel_format.data_type)
+    {
+    case JXL_TYPE_FLOAT:
+        basic_info.bits_per_sample = 32;
+        basic_info.exponent_bits_per_sample = 8;
+        break;
+    case JXL_TYPE_FLOAT16:
+        basic_info.bits_per_sample = 16;
+        basic_info.exponent_bits_per_sample = 5;
+        break;
+    case JXL_TYPE_UINT8:
+        basic_info.bits_per_sample = 8;
+        basic_info.exponent_bits_per_sample = 0;
+        break;
+    case JXL_TYPE_UINT16:
+        basic_info.bits_per_sample = 16;
+        basic_info.exponent_bits_per_sample = 0;
+        break;
+    }
+
+    if (pixel_format.num_channels < 3)
+        basic_info.num_color_channels = 1;
+    else
+        basic_info.num_color_channels = 3;
+
+    if (pixel_format.num_channels == 2 || pixel_format.num_channels == 4)
+    {
+        basic_info.alpha_exponent_bits = basic_info.exponent_bits_per_sample;
+        basic_info.alpha_bits = basic_info.bits_per_sample;
+        basic_info.num_extra_channels = 1;
+    }
+    else
+    {
+        basic_info.alpha_exponent_bits = 0;
+        basic_info.alpha_bits = 0;
+    }
+
+    return basic_info;
+}
+
+
+// Incremental JXL decoder. libjxl decodes as far as the input allows and reports how much of it is left unconsumed;
+// that tail is kept and handed back together with the next chunk. Rows become available once the whole frame is
+// decoded.
+// With use_parallel_runner false the image is decoded on the calling thread only, for callers that already run one
+// decode per core.
+struct jxl_incremental_decoder : incremental_decoder
+{
+    JxlDecoderPtr dec;
+    jxl_box_reader<decompress_result_t> box_reader;
+    std::vector<uint8_t> pending;
+    uint32_t exponent_bits_per_sample = 0;
+    bool animated = false;
+    bool initialized = false;
+    // when set, frames are decoded into this pixel buffer rather than into result.pixels
+    pixel_buffer* into = nullptr;
+    // the output format, which libjxl's image out callback converts runs of pixels to as they are decoded
+    output_format_args output;
+    optional<row_sink> sink;
+
+    explicit jxl_incremental_decoder(bool use_parallel_runner, uint32_t metadata = METADATA_ALL) :
+        dec(JxlDecoderMake(nullptr)),
+        box_reader(result, dec.get(), metadata)
+    {
+        initialized = init(use_parallel_runner).has_value();
+    }
+
+    expected<void, string_view> init(bool use_parallel_runner)
+    {
+        // Multi-threaded parallel runner.
+        static auto runner = JxlResizableParallelRunnerMake(nullptr);
+
+        // without any of the boxes in the mask, the decoder doesn't stop at boxes or brotli-decompress brob boxes
+        const bool read_boxes = box_reader.metadata & (METADATA_EXIF | METADATA_XMP | METADATA_OTHER);
+        JXL_ENSURE_SUCCESS(
+            JxlDecoderSubscribeEvents,
+            dec.get(),
+            JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE | (read_boxes ? JXL_DEC_BOX : 0));
+        if (use_parallel_runner)
+        {
+            JXL_ENSURE_SUCCESS(JxlDecoderSetParallelRunner, dec.get(), JxlResizableParallelRunner, runner.get());
+        }
+        if (read_boxes)
+        {
+            JXL_ENSURE_SUCCESS(JxlDecoderSetDecompressBoxes, dec.get(), JXL_TRUE);
+        }
+        return {};
+    }
+
+    expected<void, string_view> push(const uint8_t* data, size_t size) override
+    {
+        if (!initialized)
+            return std::unexpected("couldn't initialize JXL decoder");
+        if (done || size == 0)
+            return {};
+
+        // without a leftover tail the chunk can be decoded in place, and only what libjxl didn't consume is copied
+        const uint8_t* input = data;
+        size_t input_size = size;
+        if (!pending.empty())
+        {
+            pending.insert(pending.end(), data, data + size);
+            input = pending.data();
+            input_size = pending.size();
+        }
+
+        JXL_ENSURE_SUCCESS(JxlDecoderSetInput, dec.get(), input, input_size);
+        auto status = decode();
+        const size_t remaining = JxlDecoderReleaseInput(dec.get());
+        std::vector<uint8_t> tail(input + input_size - remaining, input + input_size);
+        pending = std::move(tail);
+        return status;
+    }
+
+    expected<void, string_view> close() override
+    {
+        if (!initialized)
+            return std::unexpected("couldn't initialize JXL decoder");
+        if (done)
+            return {};
+
+        if (!pending.empty())
+        {
+            JXL_ENSURE_SUCCESS(JxlDecoderSetInput, dec.get(), pending.data(), pending.size());
+        }
+        JxlDecoderCloseInput(dec.get());
+        auto status = decode();
+        JxlDecoderReleaseInput(dec.get());
+        if (status.has_value() && !done)
+            return std::unexpected("Decoder requested more input but all input was already provided");
+        return status;
+    }
+
+    // Processes the input that is set until libjxl needs more of it or the image is done.
+    expected<void, string_view> decode()
+    {
+        for (;;)
+        {
+            JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+
+            if (status == JXL_DEC_ERROR)
+            {
+                return std::unexpected("Decoder error");
+            }
+            else if (status == JXL_DEC_NEED_MORE_INPUT)
+            {
+                return {};
+            }
+            else if (status == JXL_DEC_BASIC_INFO)
+            {
+                JxlBasicInfo info;
+                JXL_ENSURE_SUCCESS(JxlDecoderGetBasicInfo, dec.get(), &info);
+
+                if (info.exponent_bits_per_sample != 0)
+                    return std::unexpected("FLOAT32 images are currently not yet supported");
+
+                result.width = info.xsize;
+                result.height = info.ysize;
+                result.channels = info.num_color_channels + info.num_extra_channels;
+                result.bit_depth = info.bits_per_sample;
+                exponent_bits_per_sample = info.exponent_bits_per_sample;
+                animated = info.have_animation;
+            }
+            else if (status == JXL_DEC_COLOR_ENCODING)
+            {
+                // Color encoding event received; no action needed.
+            }
+            else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER)
+            {
+                JxlDataType data_type;
+                if (result.bit_depth == 8)
+                    data_type = JXL_TYPE_UINT8;
+                else if (result.bit_depth == 16)
+                {
+                    // should be float16, but we're not going to worry about that for now
+                    if (exponent_bits_per_sample > 0)
+                        data_type = JXL_TYPE_FLOAT;
+                    else
+                        data_type = JXL_TYPE_UINT16;
+                }
+                else if (result.bit_depth == 32)
+                    data_type = JXL_TYPE_FLOAT;
+                else
+                    return std::unexpected("unrecognized bit depth");
+                JxlPixelFormat format = {result.channels, data_type, JXL_NATIVE_ENDIAN, 0};
+
+                size_t buffer_size;
+                JXL_ENSURE_SUCCESS(JxlDecoderImageOutBufferSize, dec.get(), &format, &buffer_size);
+                if (buffer_size != result.width * result.height * result.channels * result.bit_depth / 8)
+                    return std::unexpected("Invalid out buffer size");
+                // every frame of an animation is decoded into a new buffer, which replaces the last one. libjxl
+                // hands converted frames over through the callback, so there are no scratch rows.
+                sink.emplace(
+                    result.width,
+                    result.height,
+                    result.channels,
+                    result.bit_depth,
+                    buffer_size / result.height,
+                    output,
+                    0);
+                // a frame that fits in the reservation of the last one keeps it, so an animation isn't turned away
+                // by the budget between its frames
+                if (into != nullptr || sink->memory_size() > reservation.bytes)
+                {
+                    reservation.release();
+                    reservation = reserve_decode(result.width, result.height, sink->memory_size(), into);
+                }
+                sink->allocate(result.pixels, into);
+                if (sink->format.has_value())
+                {
+                    JXL_ENSURE_SUCCESS(
+                        JxlDecoderSetImageOutCallback, dec.get(), &format, convert_image_out, &sink.value());
+                }
+                else
+                {
+                    JXL_ENSURE_SUCCESS(JxlDecoderSetImageOutBuffer, dec.get(), &format, sink->pixels, buffer_size);
+                }
+                header_ready = true;
+            }
+            else if (status == JXL_DEC_BOX)
+            {
+                if (auto box_result = box_reader.start_box(); !box_result.has_value())
+                    return std::unexpected(box_result.error());
+            }
+            else if (status == JXL_DEC_BOX_NEED_MORE_OUTPUT)
+            {
+                if (auto box_result = box_reader.grow_box(); !box_result.has_value())
+                    return std::unexpected(box_result.error());
+            }
+            else if (status == JXL_DEC_FULL_IMAGE)
+            {
+                // Do not yet return. If the image is an animation, more full frames may be decoded, and only the last
+                // one is kept, so its rows are only final at the end.
+                if (!animated)
+                    rows_ready = result.height;
+            }
+            else if (status == JXL_DEC_SUCCESS)
+            {
+                if (auto box_result = box_reader.finish_box(); !box_result.has_value())
+                    return std::unexpected(box_result.error());
+                rows_ready = result.height;
+                done = true;
+                return {};
+            }
+            else
+            {
+                return std::unexpected(unexpected_jxl_decoder_status_message(status));
+            }
+        }
+    }
+
+    // Called by libjxl, possibly on several threads at once, with runs of decoded pixels of a row.
+    static void convert_image_out(void* opaque, size_t x, size_t y, size_t num_pixels, const void* pixels)
+    {
+        auto* sink = static_cast<row_sink*>(opaque);
+        sink->convert(static_cast<const uint8_t*>(pixels), y * sink->width + x, num_pixels);
+    }
+};
+
+
+static expected<decompress_result_t, string_view> jxl_decompress_impl(
+    std::span<const uint8_t> jxl_bytes,
+    bool use_parallel_runner,
+    pixel_buffer* into = nullptr,
+    uint32_t metadata = METADATA_ALL,
+    const output_format_args& output = {})
+{
+    jxl_incremental_decoder decoder(use_parallel_runner, metadata);
+    decoder.into = into;
+    decoder.output = output;
+    if (auto status = decoder.push(jxl_bytes.data(), jxl_bytes.size()); !status.has_value())
+        return std::unexpected(status.error());
+    if (auto status = decoder.close(); !status.has_value())
+        return std::unexpected(status.error());
+    return std::move(decoder.result);
+}
+
+
+expected<decompress_result_t, string_view> jxl_decompress(
+    const binary& jxl_bytes,
+    uint32_t metadata,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    return jxl_decompress_impl(
+        {jxl_bytes.data, jxl_bytes.size},
+        true,
+        nullptr,
+        metadata,
+        output_format_args{planar, type, std::move(scale), std::move(bias)});
+}
+
+
+// Sets up enc for a single frame with the given options and adds it, along with the metadata boxes. The output is then
+// read with JxlEncoderProcessOutput.
+static expected<void, string_view> jxl_encoder_add_image(
+    JxlEncoder* enc,
+    const uint8_t* pixels,
+    size_t pixels_size,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    const optional<binary>& exif_binary,
+    const optional<vector<pair<atom, binary>>>& jxl_boxes,
+    double distance,
+    bool lossless,
+    int effort,
+    int progressive,
+    int order)
+{
+    static auto runner = JxlThreadParallelRunnerMake(
+        /*memory_manager=*/nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+
+    JXL_ENSURE_SUCCESS(JxlEncoderSetParallelRunner, enc, JxlThreadParallelRunner, runner.get());
+
+    if (exif_binary.has_value() || jxl_boxes.has_value())
+        JXL_ENSURE_SUCCESS(JxlEncoderUseBoxes, enc);
+
+    JxlPixelFormat pixel_format = {channels, bit_depth == 16 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+
+    JxlBasicInfo basic_info = jxl_basic_info_from_pixel_format(pixel_format);
+    basic_info.xsize = width;
+    basic_info.ysize = height;
+    basic_info.uses_original_profile = lossless;
+    JXL_ENSURE_SUCCESS(JxlEncoderSetBasicInfo, enc, &basic_info);
+
+    JxlColorEncoding color_encoding = {};
+    const bool is_grayscale = pixel_format.num_channels < 3;
+    JxlColorEncodingSetToSRGB(&color_encoding, is_grayscale);
+    JXL_ENSURE_SUCCESS(JxlEncoderSetColorEncoding, enc, &color_encoding);
+
+    auto encoder_options = JxlEncoderFrameSettingsCreate(enc, nullptr);
+    JXL_ENSURE_SUCCESS(JxlEncoderSetFrameLossless, encoder_options, lossless);
+    JXL_ENSURE_SUCCESS(JxlEncoderSetFrameDistance, encoder_options, distance);
+    JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_EFFORT, effort);
+
+    if (progressive > 0)
+    {
+        JXL_ENSURE_SUCCESS(
+            JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, progressive);
+        JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC, 1);
+    }
+
+    if (order > 0)
+    {
+        JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_GROUP_ORDER, order);
+    }
+
+    if (exif_binary.has_value())
+    {
+        const JxlBoxType exif_box_type = {'E', 'x', 'i', 'f'};
+        vector<uint8_t> exif_box(4 + exif_binary->size);
+        exif_box[0] = exif_box[1] = exif_box[2] = exif_box[3] = 0;
+        std::copy_n(exif_binary->data, exif_binary->size, exif_box.data() + 4);
+        JXL_ENSURE_SUCCESS(JxlEncoderAddBox, enc, exif_box_type, exif_box.data(), exif_box.size(), JXL_FALSE);
+    }
+
+    if (jxl_boxes.has_value())
+    {
+        for (const auto& [box_type_atom, box_contents] : jxl_boxes.value())
+        {
+            optional<array<char, 4>> box_type = jxl_box_type_from_atom(box_type_atom);
+            if (!box_type.has_value())
+                return std::unexpected("unsupported JXL metadata box type");
+
+            JXL_ENSURE_SUCCESS(
+                JxlEncoderAddBox, enc, box_type->data(), box_contents.data, box_contents.size, JXL_FALSE);
+        }
+    }
+
+    JXL_ENSURE_SUCCESS(JxlEncoderAddImageFrame, encoder_options, &pixel_format, pixels, pixels_size);
+    JxlEncoderCloseInput(enc);
+    return {};
+}
+
+
+static expected<vector<uint8_t>, string_view> jxl_compress_impl(
+    std::span<const uint8_t> pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    const optional<binary>& exif_binary,
+    const optional<vector<pair<atom, binary>>>& jxl_boxes,
+    double distance,
+    bool lossless,
+    int effort,
+    int progressive,
+    int order)
+{
+    auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
+    if (auto status = jxl_encoder_add_image(
+            enc.get(),
+            pixels.data(),
+            pixels.size(),
+            width,
+            height,
+            channels,
+            bit_depth,
+            exif_binary,
+            jxl_boxes,
+            distance,
+            lossless,
+            effort,
+            progressive,
+            order);
+        !status.has_value())
+        return std::unexpected(status.error());
+
+    return jxl_collect_compressed(enc.get());
+}
+
+
+expected<vector<uint8_t>, string_view> jxl_compress(
+    const binary& pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    optional<binary> exif_binary,
+    optional<vector<pair<atom, binary>>> jxl_boxes,
+    double distance,
+    bool lossless,
+    int effort,
+    int progressive,
+    int order)
+{
+    return jxl_compress_impl(
+        {pixels.data, pixels.size},
+        width,
+        height,
+        channels,
+        bit_depth,
+        exif_binary,
+        jxl_boxes,
+        distance,
+        lossless,
+        effort,
+        progressive,
+        order);
+}
+
+
+// Encodes at the smallest distance whose output fits in target_size bytes. Every encode already runs on all cores, so
+// trials are sequential. The search models the size as inversely proportional to the distance until it has a distance
+// on each side of the target, then interpolates between them in log-log space, and stops once the output is within 3%
+// of the target or the two sides are within 2% of each other.
+expected<vector<uint8_t>, string> jxl_compress_to_size(
+    const binary& pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    optional<binary> exif_binary,
+    optional<vector<pair<atom, binary>>> jxl_boxes,
+    uint32_t target_size,
+    int effort,
+    int progressive,
+    int order)
+{
+    constexpr double min_distance = 0.1, max_distance = 25.0;
+    constexpr int max_trials = 8;
+
+    // fits is the smallest distance known to fit and misses the largest known not to, 0 when there is none yet
+    double fits = 0, misses = 0;
+    size_t fits_size = 0, misses_size = 0;
+    vector<uint8_t> best;
+    double distance = 1.0;
+    for (int trial = 0; trial < max_trials; trial++)
+    {
+        auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
+        if (auto status = jxl_encoder_add_image(
+                enc.get(),
+                pixels.data,
+                pixels.size,
+                width,
+                height,
+                channels,
+                bit_depth,
+                exif_binary,
+                jxl_boxes,
+                distance,
+                false,
+                effort,
+                progressive,
+                order);
+            !status.has_value())
+            return std::unexpected(string(status.error()));
+
+        auto compressed = jxl_collect_compressed(enc.get());
+        if (!compressed.has_value())
+            return std::unexpected(string(compressed.error()));
+
+        const size_t size = compressed->size();
+        if (size <= target_size)
+        {
+            fits = distance;
+            fits_size = size;
+            best = std::move(compressed.value());
+            if (size >= target_size * 0.97 || distance <= min_distance)
+                break;
+        }
+        else
+        {
+            misses = distance;
+            misses_size = size;
+            if (distance >= max_distance)
+                break;
+        }
+
+        if (fits > 0 && misses > 0)
+        {
+            if (fits / misses < 1.02)
+                break;
+            const double slope = std::log(static_cast<double>(fits_size) / misses_size) / std::log(fits / misses);
+            distance = misses * std::exp(std::log(static_cast<double>(target_size) / misses_size) / slope);
+            // the model can be off, so never leave the bracket or land right on one of its ends
+            if (!std::isfinite(distance) || distance <= misses * 1.01 || distance >= fits / 1.01)
+                distance = std::sqrt(fits * misses);
+        }
+        else
+        {
+            // aim a little below the target so the next trial is likely to fit
+            distance = std::clamp(distance * size / (target_size * 0.99), min_distance, max_distance);
+        }
+    }
+
+    if (best.empty())
+        return std::unexpected(
+            "the image does not fit in " + std::to_string(target_size) + " bytes, it takes " +
+            std::to_string(misses_size) + " bytes at distance " + std::to_string(static_cast<int>(misses)));
+    return best;
+}
+
+
+expected<vector<uint8_t>, string_view> jxl_transcode_from_jpeg(
+    const binary& jpeg_bytes, int effort, int store_jpeg_metadata)
+{
+    auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
+
+    JXL_ENSURE_SUCCESS(JxlEncoderUseContainer, enc.get(), JXL_TRUE);
+    JXL_ENSURE_SUCCESS(JxlEncoderStoreJPEGMetadata, enc.get(), JXL_TRUE);
+
+    auto encoder_options = JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    JXL_ENSURE_SUCCESS(JxlEncoderStoreJPEGMetadata, enc.get(), store_jpeg_metadata);
+    JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_EFFORT, effort);
+    JXL_ENSURE_SUCCESS(JxlEncoderAddJPEGFrame, encoder_options, jpeg_bytes.data, jpeg_bytes.size);
+    JxlEncoderCloseInput(enc.get());
+
+    return jxl_collect_compressed(enc.get());
+}
+
+
+expected<vector<uint8_t>, string_view> jxl_transcode_to_jpeg(const binary& jxl_bytes)
+{
+    // Multi-threaded parallel runner.
+    static auto runner = JxlResizableParallelRunnerMake(nullptr);
+
+    auto dec = JxlDecoderMake(nullptr);
+    JXL_ENSURE_SUCCESS(JxlDecoderSubscribeEvents, dec.get(), JXL_DEC_FULL_IMAGE | JXL_DEC_JPEG_RECONSTRUCTION);
+    JXL_ENSURE_SUCCESS(JxlDecoderSetParallelRunner, dec.get(), JxlResizableParallelRunner, runner.get());
+
+    JxlDecoderSetInput(dec.get(), jxl_bytes.data, jxl_bytes.size);
+
+    vector<uint8_t> jpeg_bytes;
+
+    for (;;)
+    {
+        JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+
+        if (status == JXL_DEC_ERROR)
+        {
+            return std::unexpected("Decoder error");
+        }
+        else if (status == JXL_DEC_NEED_MORE_INPUT)
+        {
+            return std::unexpected("Error, already provided all input");
+        }
+        else if (status == JXL_DEC_JPEG_RECONSTRUCTION)
+        {
+            jpeg_bytes.resize(static_cast<size_t>(jxl_bytes.size * 1.5));
+            JxlDecoderSetJPEGBuffer(dec.get(), jpeg_bytes.data(), jpeg_bytes.size());
+        }
+        else if (status == JXL_DEC_JPEG_NEED_MORE_OUTPUT)
+        {
+            const size_t existing_size = jpeg_bytes.size();
+            jpeg_bytes.resize(static_cast<size_t>(existing_size * 1.5));
+            const size_t bytes_unwritten = JxlDecoderReleaseJPEGBuffer(dec.get());
+            const size_t bytes_already_written = existing_size - bytes_unwritten;
+            if (bytes_already_written != 0)
+                return std::unexpected("JXL JPEG transcode: unexpected partial write after buffer resize");
+            JxlDecoderSetJPEGBuffer(dec.get(), jpeg_bytes.data(), jpeg_bytes.size());
+        }
+        else if (status == JXL_DEC_FULL_IMAGE)
+        {
+            // resize the vector back to the written size
+            const size_t bytes_unwritten = JxlDecoderReleaseJPEGBuffer(dec.get());
+            jpeg_bytes.resize(jpeg_bytes.size() - bytes_unwritten);
+        }
+        else if (status == JXL_DEC_SUCCESS)
+        {
+            // All decoding successfully finished.
+            return jpeg_bytes;
+        }
+        else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER)
+        {
+            return std::unexpected("Cannot transcode to JPEG: image was not originally transcoded from JPEG");
+        }
+        else
+        {
+            return std::unexpected(unexpected_jxl_decoder_status_message(status));
+        }
+    }
+}
+
+
+// Bytes of input handed to libwebp's incremental decoder at a time when decoding a whole file, between which a yielding
+// decode checks its timeslice.
+constexpr size_t WEBP_DECODE_SLICE = 64 << 10;
+
+// VP8X flags for the chunks of an extended format WebP file.
+constexpr uint8_t WEBP_ICC_FLAG = 0x20;
+constexpr uint8_t WEBP_ALPHA_FLAG = 0x10;
+constexpr uint8_t WEBP_EXIF_FLAG = 0x08;
+constexpr uint8_t WEBP_XMP_FLAG = 0x04;
+
+
+static uint32_t webp_read_le32(const uint8_t* p)
+{
+    return static_cast<uint32_t>(p[0]) | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+
+static void webp_append_le(vector<uint8_t>& out, uint32_t value, int num_bytes)
+{
+    for (int i = 0; i < num_bytes; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+
+static string_view webp_status_message(VP8StatusCode status)
+{
+    switch (status)
+    {
+    case VP8_STATUS_OUT_OF_MEMORY:
+        return "out of memory";
+    case VP8_STATUS_UNSUPPORTED_FEATURE:
+        return "unsupported WebP feature";
+    case VP8_STATUS_NOT_ENOUGH_DATA:
+    case VP8_STATUS_SUSPENDED:
+        return "truncated WebP image";
+    default:
+        return "invalid WebP image";
+    }
+}
+
+
+// Calls f(fourcc, payload, size) for every chunk in the RIFF container of a WebP file, stopping at the first one that
+// runs past the end of the data.
+template <typename F>
+static void webp_for_each_chunk(const uint8_t* data, size_t size, F&& f)
+{
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WEBP", 4) != 0)
+        return;
+
+    const size_t riff_end = std::min<size_t>(size, static_cast<size_t>(webp_read_le32(data + 4)) + 8);
+    for (size_t pos = 12; pos + 8 <= riff_end;)
+    {
+        const size_t length = webp_read_le32(data + pos + 4);
+        if (length > riff_end - pos - 8)
+            return;
+        f(string_view(reinterpret_cast<const char*>(data + pos), 4), data + pos + 8, length);
+        // chunks are padded to an even size
+        pos += 8 + length + (length & 1);
+    }
+}
+
+
+// Reads the EXIF, XMP and ICC chunks of an extended format WebP file, of the kinds in the metadata mask.
+template <typename Result>
+static void webp_read_metadata_chunks(
+    const uint8_t* data,
+    size_t size,
+    Result& result,
+    uint32_t metadata = METADATA_ALL)
+{
+    if (!(metadata & (METADATA_EXIF | METADATA_XMP | METADATA_ICC)))
+        return;
+
+    webp_for_each_chunk(data, size, [&](string_view fourcc, const uint8_t* payload, size_t length) {
+        if (fourcc == "EXIF" && (metadata & METADATA_EXIF))
+        {
+            // some writers keep the "Exif\0\0" header of the JPEG APP1 segment
+            if (length >= JPEG_EXIF_APP1_IDENTIFIER.size() &&
+                memcmp(payload, JPEG_EXIF_APP1_IDENTIFIER.data(), JPEG_EXIF_APP1_IDENTIFIER.size()) == 0)
+            {
+                payload += JPEG_EXIF_APP1_IDENTIFIER.size();
+                length -= JPEG_EXIF_APP1_IDENTIFIER.size();
+            }
+            result.exif = binary::from_bytes(payload, length);
+        }
+        else if (fourcc == "XMP " && (metadata & METADATA_XMP))
+            result.xmp = binary::from_bytes(payload, length);
+        else if (fourcc == "ICCP" && (metadata & METADATA_ICC))
+            result.icc_profile = binary::from_bytes(payload, length);
+    });
+}
+
+
+// The size of a decoded WebP image with the given features, as RGB or RGBA.
+static size_t webp_output_size(const WebPBitstreamFeatures& features)
+{
+    return static_cast<size_t>(features.width) * features.height * (features.has_alpha ? 4 : 3);
+}
+
+
+// Sets up decoding of a WebP image with the given features straight into pixels, as RGB or RGBA; pixels has room for
+// webp_output_size(features) bytes.
+static void webp_init_decoder_config(WebPDecoderConfig& config, const WebPBitstreamFeatures& features, uint8_t* pixels)
+{
+    const uint32_t channels = features.has_alpha ? 4 : 3;
+    config.output.colorspace = features.has_alpha ? MODE_RGBA : MODE_RGB;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = pixels;
+    config.output.u.RGBA.stride = static_cast<int>(features.width * channels);
+    config.output.u.RGBA.size = webp_output_size(features);
+}
+
+
+// Rows are converted to the output format as libwebp finishes them.
+template <template <typename> typename Generator, typename Bytes>
+static Generator<expected<decompress_result_t, string_view>> webp_decompress_impl(
+    Bytes webp_bytes,
+    bool use_threads,
+    uint32_t metadata = METADATA_ALL,
+    output_format_args output = {})
+{
+    yielding_timer timer;
+
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config))
+    {
+        co_yield std::unexpected("couldn't initialize the WebP decoder");
+        co_return;
+    }
+    if (auto status = WebPGetFeatures(webp_bytes.data(), webp_bytes.size(), &config.input); status != VP8_STATUS_OK)
+    {
+        co_yield std::unexpected(webp_status_message(status));
+        co_return;
+    }
+    if (config.input.has_animation)
+    {
+        co_yield std::unexpected("animated WebP images are not supported");
+        co_return;
+    }
+
+    const uint32_t width = static_cast<uint32_t>(config.input.width);
+    const uint32_t height = static_cast<uint32_t>(config.input.height);
+    const uint32_t channels = config.input.has_alpha ? 4u : 3u;
+    // libwebp decodes the whole image into one buffer, so that is what the scratch space of a conversion holds
+    row_sink sink(width, height, channels, 8, static_cast<size_t>(width) * channels, output, height);
+    auto reservation = reserve_decode(width, height, sink.memory_size());
+    binary pixels;
+    sink.allocate(pixels, nullptr);
+    webp_init_decoder_config(config, config.input, sink.row(0));
+    // lets libwebp run the lossy in-loop filter on a second thread
+    config.options.use_threads = use_threads;
+
+    const std::unique_ptr<WebPIDecoder, decltype(&WebPIDelete)> idec(WebPIDecode(nullptr, 0, &config), WebPIDelete);
+    if (!idec)
+    {
+        co_yield std::unexpected("couldn't initialize the WebP decoder");
+        co_return;
+    }
+
+    int converted_rows = 0;
+    for (size_t pos = 0;; pos += WEBP_DECODE_SLICE)
+    {
+        const size_t slice = std::min(WEBP_DECODE_SLICE, webp_bytes.size() - pos);
+        const auto status = WebPIAppend(idec.get(), webp_bytes.data() + pos, slice);
+
+        int last_y = 0;
+        if (WebPIDecGetRGB(idec.get(), &last_y, nullptr, nullptr, nullptr) != nullptr && last_y > converted_rows)
+        {
+            sink.commit(converted_rows, last_y - converted_rows);
+            converted_rows = last_y;
+        }
+
+        if (status == VP8_STATUS_OK)
+            break;
+        if (status != VP8_STATUS_SUSPENDED || pos + slice == webp_bytes.size())
+        {
+            co_yield std::unexpected(webp_status_message(status));
+            co_return;
+        }
+
+        if (timer.times_up())
+        {
+            co_yield nullopt;
+            timer.reset();
+        }
+    }
+
+    decompress_result_t result{
+        .pixels = std::move(pixels),
+        .width = width,
+        .height = height,
+        .channels = channels,
+        .bit_depth = 8,
+    };
+    webp_read_metadata_chunks(webp_bytes.data(), webp_bytes.size(), result, metadata);
+    co_yield std::move(result);
+}
+
+
+yielding<expected<decompress_result_t, string_view>> webp_decompress(
+    vector<uint8_t> webp_bytes,
+    uint32_t metadata,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    return webp_decompress_impl<yielding>(
+        std::move(webp_bytes), true, metadata, output_format_args{planar, type, std::move(scale), std::move(bias)});
+}
+
+
+// Incremental WebP decoder on top of libwebp's WebPIDecoder. Rows become available as their data arrives, for lossy
+// and lossless images alike. The metadata chunks follow the image data, so the input is kept to read them at the end.
+struct webp_incremental_decoder : incremental_decoder
+{
+    WebPDecoderConfig config;
+    std::unique_ptr<WebPIDecoder, decltype(&WebPIDelete)> idec{nullptr, WebPIDelete};
+    vector<uint8_t> input;
+
+    expected<void, string_view> push(const uint8_t* data, size_t size) override
+    {
+        input.insert(input.end(), data, data + size);
+        if (done)
+            return {};
+
+        if (!header_ready)
+        {
+            if (!WebPInitDecoderConfig(&config))
+                return std::unexpected("couldn't initialize the WebP decoder");
+            const auto status = WebPGetFeatures(input.data(), input.size(), &config.input);
+            if (status == VP8_STATUS_NOT_ENOUGH_DATA)
+                return {};
+            if (status != VP8_STATUS_OK)
+                return std::unexpected(webp_status_message(status));
+            if (config.input.has_animation)
+                return std::unexpected("animated WebP images are not supported");
+
+            reservation = reserve_decode(config.input.width, config.input.height, webp_output_size(config.input));
+            result.pixels = binary(webp_output_size(config.input));
+            webp_init_decoder_config(config, config.input, result.pixels.data);
+            result.width = static_cast<uint32_t>(config.input.width);
+            result.height = static_cast<uint32_t>(config.input.height);
+            result.channels = config.input.has_alpha ? 4 : 3;
+            result.bit_depth = 8;
+            idec.reset(WebPIDecode(nullptr, 0, &config));
+            if (!idec)
+                return std::unexpected("couldn't initialize the WebP decoder");
+            header_ready = true;
+
+            // everything received so far, the header included
+            data = input.data();
+            size = input.size();
+        }
+
+        const auto status = WebPIAppend(idec.get(), data, size);
+        if (status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED)
+            return std::unexpected(webp_status_message(status));
+
+        int last_y = 0;
+        if (WebPIDecGetRGB(idec.get(), &last_y, nullptr, nullptr, nullptr) != nullptr)
+            rows_ready = static_cast<uint32_t>(last_y);
+        if (status == VP8_STATUS_OK)
+        {
+            rows_ready = result.height;
+            done = true;
+        }
+        return {};
+    }
+
+    expected<void, string_view> close() override
+    {
+        if (!done)
+            return std::unexpected("incomplete WebP image");
+        webp_read_metadata_chunks(input.data(), input.size(), result);
+        return {};
+    }
+};
+
+
+static string_view webp_encoding_error_message(WebPEncodingError error)
+{
+    switch (error)
+    {
+    case VP8_ENC_ERROR_OUT_OF_MEMORY:
+    case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
+        return "out of memory";
+    case VP8_ENC_ERROR_BAD_DIMENSION:
+        return "image dimensions are too large for WebP";
+    case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
+    case VP8_ENC_ERROR_PARTITION_OVERFLOW:
+        return "WebP partition overflow, try a lower quality";
+    case VP8_ENC_ERROR_FILE_TOO_BIG:
+        return "image is too large for a WebP file";
+    default:
+        return "couldn't encode the WebP image";
+    }
+}
+
+
+static void webp_append_chunk(vector<uint8_t>& out, string_view fourcc, const uint8_t* payload, size_t size)
+{
+    out.insert(out.end(), fourcc.begin(), fourcc.end());
+    webp_append_le(out, static_cast<uint32_t>(size), 4);
+    out.insert(out.end(), payload, payload + size);
+    if (size & 1)
+        out.push_back(0);
+}
+
+
+// libwebp writes simple format files, or an extended one with a VP8X chunk for lossy images with alpha. The metadata
+// chunks need the extended format: the ICC profile goes right after VP8X and EXIF and XMP after the image data.
+static vector<uint8_t> webp_add_metadata_chunks(
+    std::span<const uint8_t> webp,
+    uint32_t width,
+    uint32_t height,
+    bool has_alpha,
+    const optional<vector<uint8_t>>& exif_binary,
+    const optional<vector<uint8_t>>& xmp_binary,
+    const optional<vector<uint8_t>>& icc_profile)
+{
+    const bool extended = webp.size() >= 30 && memcmp(webp.data() + 12, "VP8X", 4) == 0;
+    uint8_t flags = extended ? webp[20] : (has_alpha ? WEBP_ALPHA_FLAG : 0);
+    flags |= (exif_binary.has_value() ? WEBP_EXIF_FLAG : 0) | (xmp_binary.has_value() ? WEBP_XMP_FLAG : 0) |
+             (icc_profile.has_value() ? WEBP_ICC_FLAG : 0);
+
+    vector<uint8_t> out = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'E', 'B', 'P'};
+    vector<uint8_t> vp8x = {flags, 0, 0, 0};
+    webp_append_le(vp8x, width - 1, 3);
+    webp_append_le(vp8x, height - 1, 3);
+    webp_append_chunk(out, "VP8X", vp8x.data(), vp8x.size());
+    if (icc_profile.has_value())
+        webp_append_chunk(out, "ICCP", icc_profile->data(), icc_profile->size());
+    out.insert(out.end(), webp.begin() + (extended ? 30 : 12), webp.end());
+    if (exif_binary.has_value())
+        webp_append_chunk(out, "EXIF", exif_binary->data(), exif_binary->size());
+    if (xmp_binary.has_value())
+        webp_append_chunk(out, "XMP ", xmp_binary->data(), xmp_binary->size());
+
+    const uint32_t riff_size = static_cast<uint32_t>(out.size() - 8);
+    for (int i = 0; i < 4; i++)
+        out[4 + i] = static_cast<uint8_t>(riff_size >> (8 * i));
+    return out;
+}
+
+
+// Encodes 8-bit pixels with 1 to 4 channels; grayscale pixels are expanded to RGB, which is all libwebp takes.
+// multithreaded lets libwebp use a second thread for the lossy analysis and the alpha plane.
+expected<binary, string_view> webp_compress(
+    binary pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    double quality,
+    bool lossless,
+    int method,
+    bool multithreaded,
+    optional<vector<uint8_t>> exif_binary,
+    optional<vector<uint8_t>> xmp_binary,
+    optional<vector<uint8_t>> icc_profile)
+{
+    const size_t num_pixels = static_cast<size_t>(width) * height;
+    if (channels == 0 || channels > 4 || pixels.size != num_pixels * channels)
+        return std::unexpected("pixel data does not match the image shape");
+
+    WebPConfig config;
+    if (!WebPConfigInit(&config))
+        return std::unexpected("couldn't initialize the WebP encoder");
+    config.quality = static_cast<float>(quality);
+    config.lossless = lossless;
+    config.method = method;
+    config.thread_level = multithreaded;
+    if (!WebPValidateConfig(&config))
+        return std::unexpected("invalid WebP encoder settings");
+
+    const bool has_alpha = channels == 2 || channels == 4;
+    const uint8_t* input = pixels.data;
+    vector<uint8_t> expanded;
+    if (channels < 3)
+    {
+        const uint32_t out_channels = has_alpha ? 4 : 3;
+        expanded.resize(num_pixels * out_channels);
+        for (size_t i = 0; i < num_pixels; i++)
+        {
+            uint8_t* out = expanded.data() + i * out_channels;
+            out[0] = out[1] = out[2] = pixels.data[i * channels];
+            if (has_alpha)
+                out[3] = pixels.data[i * channels + 1];
+        }
+        input = expanded.data();
+    }
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture))
+        return std::unexpected("couldn't initialize the WebP encoder");
+    const std::unique_ptr<WebPPicture, decltype(&WebPPictureFree)> picture_guard(&picture, WebPPictureFree);
+    // lossless encoding works on ARGB, lossy encoding converts to YUV right away
+    picture.use_argb = lossless;
+    picture.width = static_cast<int>(width);
+    picture.height = static_cast<int>(height);
+
+    const int stride = static_cast<int>(width * (has_alpha ? 4 : 3));
+    if (!(has_alpha ? WebPPictureImportRGBA(&picture, input, stride) : WebPPictureImportRGB(&picture, input, stride)))
+        return std::unexpected("out of memory");
+    vector<uint8_t>().swap(expanded);
+
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    const std::unique_ptr<WebPMemoryWriter, decltype(&WebPMemoryWriterClear)> writer_guard(
+        &writer, WebPMemoryWriterClear);
+    picture.writer = WebPMemoryWrite;
+    picture.custom_ptr = &writer;
+    if (!WebPEncode(&config, &picture))
+        return std::unexpected(webp_encoding_error_message(picture.error_code));
+
+    if (!exif_binary.has_value() && !xmp_binary.has_value() && !icc_profile.has_value())
+        return binary::from_bytes(writer.mem, writer.size);
+
+    const auto out = webp_add_metadata_chunks(
+        {writer.mem, writer.size},
+        width,
+        height,
+        has_alpha,
+        exif_binary,
+        xmp_binary,
+        icc_profile);
+    return binary::from_bytes(out.data(), out.size());
+}
+
+
+// A whole file mapped read-only, which the decoders read in place instead of from a copy on the BEAM heap. Documents
+// opened from it hold on to it, as libtiff and poppler keep reading from the mapping when rendering pages.
+struct mapped_file
+{
+    string path;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    mapped_file(string path) :
+        path(std::move(path))
+    {}
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+        if (data)
+            munmap(const_cast<uint8_t*>(data), size);
+    }
+
+    static expected<shared_ptr<mapped_file>, string> open(string path)
+    {
+        auto file = make_shared<mapped_file>(std::move(path));
+        const int fd = ::open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return std::unexpected(file->path + ": "s + strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            ::close(fd);
+            return std::unexpected(file->path + ": not a regular file"s);
+        }
+
+        // an empty file can't be mapped, and isn't an image either
+        file->size = static_cast<size_t>(st.st_size);
+        if (file->size > 0)
+        {
+            void* addr = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                ::close(fd);
+                return std::unexpected(file->path + ": "s + strerror(errno));
+            }
+            file->data = static_cast<const uint8_t*>(addr);
+            madvise(addr, file->size, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+        return file;
+    }
+
+    std::span<const uint8_t> bytes() const
+    {
+        return {data, size};
+    }
+
+    // Switches to the default readahead, for documents whose pages are read in no particular order.
+    void advise_random_access() const
+    {
+        if (data)
+            madvise(const_cast<uint8_t*>(data), size, MADV_NORMAL);
+    }
+};
+
+
+typedef resource<shared_ptr<mapped_file>> mapped_file_resource_t;
+
+
+// libtiff client procs over a file mapping. libtiff reads strips and tiles through the map proc directly.
+struct tiff_mapped_stream
+{
+    shared_ptr<mapped_file> file;
+    toff_t offset = 0;
+
+    static tmsize_t read(thandle_t handle, void* buf, tmsize_t size)
+    {
+        auto self = static_cast<tiff_mapped_stream*>(handle);
+        if (size < 0 || self->offset >= self->file->size)
+            return 0;
+        const size_t n = std::min<size_t>(size, self->file->size - self->offset);
+        std::memcpy(buf, self->file->data + self->offset, n);
+        self->offset += n;
+        return static_cast<tmsize_t>(n);
+    }
+
+    static tmsize_t write(thandle_t, void*, tmsize_t)
+    {
+        return 0;
+    }
+
+    static toff_t seek(thandle_t handle, toff_t offset, int whence)
+    {
+        auto self = static_cast<tiff_mapped_stream*>(handle);
+        if (whence == SEEK_CUR)
+            offset += self->offset;
+        else if (whence == SEEK_END)
+            offset += self->file->size;
+        self->offset = offset;
+        return offset;
+    }
+
+    static int close(thandle_t)
+    {
+        return 0;
+    }
+
+    static toff_t size(thandle_t handle)
+    {
+        return static_cast<tiff_mapped_stream*>(handle)->file->size;
+    }
+
+    static int map(thandle_t handle, void** base, toff_t* size)
+    {
+        auto self = static_cast<tiff_mapped_stream*>(handle);
+        // the file is opened read-only, so libtiff never writes through this
+        *base = const_cast<uint8_t*>(self->file->data);
+        *size = self->file->size;
+        return 1;
+    }
+
+    static void unmap(thandle_t, void*, toff_t) {}
+};
+
+
+struct TIFFWrapper
+{
+    TIFF* tiff;
+    unique_ptr<stringstream> sstream;
+    unique_ptr<tiff_mapped_stream> mapped;
+
+    TIFFWrapper(TIFF* tiff, unique_ptr<stringstream> sstream) :
+        tiff(tiff),
+        sstream(std::move(sstream))
+    {}
+
+    TIFFWrapper(TIFF* tiff, unique_ptr<tiff_mapped_stream> mapped) :
+        tiff(tiff),
+        mapped(std::move(mapped))
+    {}
+
+    ~TIFFWrapper()
+    {
+        TIFFClose(this->tiff);
+    }
+};
+
+
+// A loaded PDF. Documents opened from a path read from the file mapping, which has to outlive them.
+struct pdf_document_t
+{
+    shared_ptr<mapped_file> mapping;
+    unique_ptr<poppler::document> document;
+
+    pdf_document_t(shared_ptr<mapped_file> mapping, unique_ptr<poppler::document> document) :
+        mapping(std::move(mapping)),
+        document(std::move(document))
+    {}
+};
+
+
+typedef resource<pdf_document_t> pdf_resource_t;
+
+
+static expected<tuple<pdf_resource_t, int>, string_view> pdf_open_document(
+    unique_ptr<poppler::document> document, shared_ptr<mapped_file> mapping)
+{
+    if (!document)
+        return std::unexpected("invalid pdf file");
+    if (document->is_locked())
+        return std::unexpected("document is locked");
+
+    const auto num_pages = document->pages();
+    return make_tuple(pdf_resource_t::alloc(std::move(mapping), std::move(document)), num_pages);
+}
+
+
+expected<tuple<pdf_resource_t, int>, string_view> pdf_load_document(binary bytes)
+{
+    // load document from bytes and check for errors
+    vector<char> buf(bytes.data, bytes.data + bytes.size);
+    return pdf_open_document(unique_ptr<poppler::document>(poppler::document::load_from_data(&buf)), nullptr);
+}
+
+
+expected<tuple<pdf_resource_t, int>, string_view> pdf_load_mapped(mapped_file_resource_t file_resource)
+{
+    const auto& file = file_resource.get();
+    file->advise_random_access();
+
+    // poppler takes the length as an int; larger files are left to poppler's own file reader, which doesn't read them
+    // into memory up front either
+    if (file->size > static_cast<size_t>(INT_MAX))
+    {
+        unique_ptr<poppler::document> document(poppler::document::load_from_file(file->path));
+        return pdf_open_document(std::move(document), nullptr);
+    }
+
+    unique_ptr<poppler::document> document(poppler::document::load_from_raw_data(
+        reinterpret_cast<const char*>(file->data), static_cast<int>(file->size)));
+    return pdf_open_document(std::move(document), file);
+}
+
+
+expected<decompress_result_t, string_view> pdf_render_page(pdf_resource_t document_resource, int page_idx, int dpi)
+{
+    auto& document = document_resource.get().document;
+    if (page_idx < 0 || page_idx >= document->pages())
+        throw std::invalid_argument("page index out of range");
+
+    unique_ptr<poppler::page> page(document->create_page(page_idx));
+
+    // the page is rendered into poppler's own image, and then copied
+    const auto page_rect = page->page_rect();
+    const auto render_width = static_cast<uint64_t>(std::ceil(page_rect.width() * dpi / 72.0));
+    const auto render_height = static_cast<uint64_t>(std::ceil(page_rect.height() * dpi / 72.0));
+    auto reservation = reserve_decode(render_width, render_height, render_width * render_height * 4 * 2);
+
+    poppler::page_renderer renderer;
+    renderer.set_render_hints(
+        poppler::page_renderer::antialiasing | poppler::page_renderer::text_antialiasing |
+        poppler::page_renderer::text_hinting);
+    auto image = renderer.render_page(page.get(), dpi, dpi);
+    if (!image.is_valid())
+        return std::unexpected("failed to render a valid image");
+
+    uint32_t height = image.height();
+    uint32_t width = image.width();
+    binary pixels = binary::from_bytes(image.data(), height * image.bytes_per_row());
+    uint32_t channels = image.bytes_per_row() / width;
+
+    const auto format = image.format();
+    if (format == poppler::image::format_invalid)
+        return std::unexpected("Invalid image format");
+    else if (format == poppler::image::format_mono)
+        return std::unexpected("Mono images not supported right now");
+    else if (format == poppler::image::format_bgr24 || format == poppler::image::format_argb32)
+    {
+        // convert bgr to rgb
+        for (uint32_t i = 0; i < pixels.size; i += channels)
+            std::swap(pixels.data[i], pixels.data[i + 2]);
+    }
+
+    return decompress_result_t{
+        .pixels = std::move(pixels),
+        .width = width,
+        .height = height,
+        .channels = channels,
+        .bit_depth = 8u,
+    };
+}
+
+typedef resource<TIFFWrapper> tiff_resource_t;
+
+
+static int tiff_count_pages(TIFF* document)
+{
+    int num_pages = 0;
+    do
+    {
+        num_pages++;
+    } while (TIFFReadDirectory(document));
+    return num_pages;
+}
+
+
+expected<tuple<tiff_resource_t, int>, string_view> tiff_load_document(binary bytes)
+{
+    // load document from bytes and check for errors
+    auto sstream = make_unique<stringstream>();
+    sstream->write(reinterpret_cast<char*>(bytes.data), bytes.size);
+    auto document = TIFFStreamOpen("file.tiff", reinterpret_cast<std::istream*>(sstream.get()));
+    if (!document)
+        return std::unexpected("invalid tiff file");
+
+    const int num_pages = tiff_count_pages(document);
+    return make_tuple(tiff_resource_t::alloc(document, std::move(sstream)), num_pages);
+}
+
+
+expected<tuple<tiff_resource_t, int>, string_view> tiff_load_mapped(mapped_file_resource_t file_resource)
+{
+    const auto& file = file_resource.get();
+    file->advise_random_access();
+
+    auto stream = make_unique<tiff_mapped_stream>(file);
+    auto document = TIFFClientOpen(
+        file->path.c_str(),
+        "r",
+        stream.get(),
+        tiff_mapped_stream::read,
+        tiff_mapped_stream::write,
+        tiff_mapped_stream::seek,
+        tiff_mapped_stream::close,
+        tiff_mapped_stream::size,
+        tiff_mapped_stream::map,
+        tiff_mapped_stream::unmap);
+    if (!document)
+        return std::unexpected("invalid tiff file");
+
+    const int num_pages = tiff_count_pages(document);
+    return make_tuple(tiff_resource_t::alloc(document, std::move(stream)), num_pages);
+}
+
+
+// Renders the whole page, oriented top-down, and keeps the region of it. The region is written to out, like the
+// readers below.
+static expected<void, string_view> tiff_read_oriented_region(
+    TIFF* document, uint32_t width, uint32_t height, const crop_region& region, uint8_t* out)
+{
+    if (region.width == width && region.height == height)
+    {
+        TIFFReadRGBAImageOriented(document, width, height, reinterpret_cast<uint32_t*>(out), 1, 0);
+        return {};
+    }
+
+    vector<uint32_t> page(static_cast<size_t>(width) * height);
+    TIFFReadRGBAImageOriented(document, width, height, page.data(), 1, 0);
+    for (uint32_t y = 0; y < region.height; y++)
+    {
+        const uint32_t* src = page.data() + static_cast<size_t>(region.y + y) * width + region.x;
+        std::memcpy(out + static_cast<size_t>(y) * region.width * 4, src, static_cast<size_t>(region.width) * 4);
+    }
+    return {};
+}
+
+
+// Reads region out of the tiles that intersect it. TIFFReadRGBATile returns each tile bottom-up.
+static expected<void, string_view> tiff_read_tiled_region(TIFF* document, const crop_region& region, uint8_t* out)
+{
+    uint32_t tile_width = 0, tile_height = 0;
+    TIFFGetField(document, TIFFTAG_TILEWIDTH, &tile_width);
+    TIFFGetField(document, TIFFTAG_TILELENGTH, &tile_height);
+    if (tile_width == 0 || tile_height == 0)
+        return std::unexpected("failed to read TIFF tile size");
+
+    vector<uint32_t> tile(static_cast<size_t>(tile_width) * tile_height);
+    const uint32_t region_bottom = region.y + region.height;
+    const uint32_t region_right = region.x + region.width;
+    for (uint32_t tile_y = region.y - region.y % tile_height; tile_y < region_bottom; tile_y += tile_height)
+    {
+        for (uint32_t tile_x = region.x - region.x % tile_width; tile_x < region_right; tile_x += tile_width)
+        {
+            if (!TIFFReadRGBATile(document, tile_x, tile_y, tile.data()))
+                return std::unexpected("failed to read TIFF tile");
+
+            const uint32_t x0 = std::max(tile_x, region.x);
+            const uint32_t x1 = std::min(tile_x + tile_width, region_right);
+            for (uint32_t y = std::max(tile_y, region.y); y < std::min(tile_y + tile_height, region_bottom); y++)
+            {
+                const uint32_t* src = tile.data() + (tile_height - 1 - (y - tile_y)) * tile_width + (x0 - tile_x);
+                const size_t out_offset = static_cast<size_t>(y - region.y) * region.width + (x0 - region.x);
+                std::memcpy(out + out_offset * 4, src, (x1 - x0) * 4);
+            }
+        }
+    }
+    return {};
+}
+
+
+// Reads region out of the strips that intersect it. TIFFReadRGBAStrip returns each strip bottom-up.
+static expected<void, string_view> tiff_read_stripped_region(
+    TIFF* document, uint32_t width, uint32_t height, const crop_region& region, uint8_t* out)
+{
+    uint32_t rows_per_strip = 0;
+    TIFFGetFieldDefaulted(document, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    rows_per_strip = std::clamp(rows_per_strip, 1u, height);
+
+    vector<uint32_t> strip(static_cast<size_t>(width) * rows_per_strip);
+    const uint32_t region_bottom = region.y + region.height;
+    for (uint32_t strip_y = region.y - region.y % rows_per_strip; strip_y < region_bottom; strip_y += rows_per_strip)
+    {
+        if (!TIFFReadRGBAStrip(document, strip_y, strip.data()))
+            return std::unexpected("failed to read TIFF strip");
+
+        const uint32_t strip_rows = std::min(rows_per_strip, height - strip_y);
+        for (uint32_t y = std::max(strip_y, region.y); y < std::min(strip_y + strip_rows, region_bottom); y++)
+        {
+            const uint32_t* src = strip.data() + static_cast<size_t>(strip_rows - 1 - (y - strip_y)) * width + region.x;
+            std::memcpy(out + static_cast<size_t>(y - region.y) * region.width * 4, src, region.width * 4);
+        }
+    }
+    return {};
+}
+
+
+// Returns the width, height and orientation of a page without rendering it. Crops of pages that aren't stored
+// top-down (ORIENTATION_TOPLEFT) render the whole page, see tiff_render_page_impl.
+expected<tuple<uint32_t, uint32_t, uint32_t>, string_view> tiff_page_size(
+    tiff_resource_t document_resource,
+    int page_index)
+{
+    TIFF* document = document_resource.get().tiff;
+    if (!TIFFSetDirectory(document, page_index))
+        return std::unexpected("failed to set TIFF directory");
+
+    uint32_t width = 0, height = 0;
+    if (!TIFFGetField(document, TIFFTAG_IMAGEWIDTH, &width) || !TIFFGetField(document, TIFFTAG_IMAGELENGTH, &height) ||
+        width == 0 || height == 0)
+        return std::unexpected("invalid TIFF image dimensions");
+    uint16_t orientation = ORIENTATION_TOPLEFT;
+    TIFFGetFieldDefaulted(document, TIFFTAG_ORIENTATION, &orientation);
+    return make_tuple(width, height, static_cast<uint32_t>(orientation));
+}
+
+
+// Renders a page, or only the part of it in the crop region. Cropped pages of tiled and stripped TIFFs only read the
+// tiles or strips that intersect the region. Given a pixel buffer, the page is rendered into it and result.pixels is
+// left empty.
+static expected<decompress_result_t, string_view> tiff_render_page_impl(
+    TIFF* document, int page_index, const crop_region& crop, pixel_buffer* into = nullptr)
+{
+    if (!TIFFSetDirectory(document, page_index))
+        return std::unexpected("failed to set TIFF directory");
+
+    int width = 0, height = 0;
+    if (!TIFFGetField(document, TIFFTAG_IMAGEWIDTH, &width))
+        return std::unexpected("failed to read TIFF image width");
+    if (!TIFFGetField(document, TIFFTAG_IMAGELENGTH, &height))
+        return std::unexpected("failed to read TIFF image height");
+    if (width <= 0 || height <= 0)
+        return std::unexpected("invalid TIFF image dimensions");
+
+    auto region = crop.clip(width, height);
+    if (!region.has_value())
+        return std::unexpected(region.error());
+
+    // the tile and strip readers don't reorient, so pages that aren't stored top-down are rendered whole and cropped
+    uint16_t orientation = ORIENTATION_TOPLEFT;
+    TIFFGetFieldDefaulted(document, TIFFTAG_ORIENTATION, &orientation);
+    const bool whole_page = crop.empty() || orientation != ORIENTATION_TOPLEFT;
+
+    const uint64_t page_bytes = static_cast<uint64_t>(width) * height * 4;
+    const uint64_t region_bytes = static_cast<uint64_t>(region->width) * region->height * 4;
+    const bool cropped_page = whole_page && (region->width != static_cast<uint32_t>(width) ||
+                                             region->height != static_cast<uint32_t>(height));
+    // the page a crop is cut from is scratch memory, which is reserved even when rendering into a pixel buffer
+    auto reservation = !cropped_page    ? reserve_decode(region->width, region->height, region_bytes, into)
+                       : into != nullptr ? reserve_decode(width, height, page_bytes)
+                                         : reserve_decode(width, height, page_bytes + region_bytes);
+
+    binary pixels;
+    uint8_t* out = allocate_pixels(pixels, region_bytes, into);
+    auto status = [&] {
+        if (whole_page)
+            return tiff_read_oriented_region(document, width, height, region.value(), out);
+        if (TIFFIsTiled(document))
+            return tiff_read_tiled_region(document, region.value(), out);
+        return tiff_read_stripped_region(document, width, height, region.value(), out);
+    }();
+    if (!status.has_value())
+        return std::unexpected(status.error());
+
+    return decompress_result_t{
+        .pixels = std::move(pixels),
+        .width = region->width,
+        .height = region->height,
+        .channels = 4u,
+        .bit_depth = 8u,
+    };
+}
+
+
+expected<decompress_result_t, string_view> tiff_render_page(
+    tiff_resource_t document_resource,
+    int page_index,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height)
+{
+    return tiff_render_page_impl(
+        document_resource.get().tiff, page_index, crop_region{crop_x, crop_y, crop_width, crop_height});
+}
+
+
+// Minimal bounds-checked reader for TIFF-structured data: TIFF files themselves, and EXIF payloads.
+struct tiff_reader
+{
+    struct entry
+    {
+        uint16_t type;
+        uint32_t count;
+        size_t value_offset;
+        size_t value_size;
+    };
+
+    const uint8_t* data;
+    size_t size;
+    bool big_endian;
+
+    static optional<tiff_reader> open(const uint8_t* data, size_t size)
+    {
+        if (size < 8)
+            return nullopt;
+        if (data[0] == 'I' && data[1] == 'I')
+            return tiff_reader{data, size, false};
+        if (data[0] == 'M' && data[1] == 'M')
+            return tiff_reader{data, size, true};
+        return nullopt;
+    }
+
+    optional<uint16_t> u16(size_t offset) const
+    {
+        if (offset + 2 > size)
+            return nullopt;
+        return big_endian ? data[offset] << 8 | data[offset + 1] : data[offset + 1] << 8 | data[offset];
+    }
+
+    optional<uint32_t> u32(size_t offset) const
+    {
+        if (offset + 4 > size)
+            return nullopt;
+        const uint32_t a = data[offset], b = data[offset + 1], c = data[offset + 2], d = data[offset + 3];
+        return big_endian ? a << 24 | b << 16 | c << 8 | d : d << 24 | c << 16 | b << 8 | a;
+    }
+
+    size_t first_ifd_offset() const
+    {
+        return u32(4).value_or(0);
+    }
+
+    // The offset of the IFD that follows the one at ifd_offset, or 0 if it is the last one.
+    size_t next_ifd_offset(size_t ifd_offset) const
+    {
+        const auto num_entries = u16(ifd_offset);
+        if (!num_entries.has_value())
+            return 0;
+        return u32(ifd_offset + 2 + static_cast<size_t>(num_entries.value()) * 12).value_or(0);
+    }
+
+    optional<entry> find(size_t ifd_offset, uint16_t tag) const
+    {
+        const auto num_entries = u16(ifd_offset);
+        if (!num_entries.has_value())
+            return nullopt;
+
+        for (size_t i = 0; i < num_entries.value(); i++)
+        {
+            const size_t entry_offset = ifd_offset + 2 + i * 12;
+            const auto entry_tag = u16(entry_offset);
+            if (!entry_tag.has_value())
+                return nullopt;
+            if (entry_tag.value() != tag)
+                continue;
+
+            const uint16_t type = u16(entry_offset + 2).value_or(0);
+            const uint32_t count = u32(entry_offset + 4).value_or(0);
+            static constexpr array<size_t, 13> type_sizes = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+            if (type == 0 || type >= type_sizes.size())
+                return nullopt;
+
+            const size_t value_size = static_cast<size_t>(count) * type_sizes[type];
+            const size_t value_offset = value_size <= 4 ? entry_offset + 8 : u32(entry_offset + 8).value_or(size);
+            if (value_offset > size || value_size > size - value_offset)
+                return nullopt;
+            return entry{type, count, value_offset, value_size};
+        }
+
+        return nullopt;
+    }
+
+    // The first value of a SHORT or LONG tag.
+    optional<uint32_t> find_uint(size_t ifd_offset, uint16_t tag) const
+    {
+        const auto e = find(ifd_offset, tag);
+        if (!e.has_value() || e->count == 0)
+            return nullopt;
+        if (e->type == 3)
+            return u16(e->value_offset);
+        if (e->type == 4)
+            return u32(e->value_offset);
+        return nullopt;
+    }
+
+    // The raw bytes of a tag. ASCII values are returned without their trailing NULs.
+    optional<binary> find_bytes(size_t ifd_offset, uint16_t tag) const
+    {
+        const auto e = find(ifd_offset, tag);
+        if (!e.has_value())
+            return nullopt;
+
+        size_t value_size = e->value_size;
+        if (e->type == 2)
+        {
+            while (value_size > 0 && data[e->value_offset + value_size - 1] == 0)
+                value_size--;
+        }
+        return binary::from_bytes(data + e->value_offset, value_size);
+    }
+};
+
+
+// EXIF/TIFF tags read by read_exif_tags and exif_jpeg_thumbnail.
+constexpr uint16_t TIFF_TAG_IMAGE_WIDTH = 0x0100;
+constexpr uint16_t TIFF_TAG_IMAGE_LENGTH = 0x0101;
+constexpr uint16_t TIFF_TAG_MAKE = 0x010f;
+constexpr uint16_t TIFF_TAG_MODEL = 0x0110;
+constexpr uint16_t TIFF_TAG_ORIENTATION = 0x0112;
+constexpr uint16_t TIFF_TAG_SOFTWARE = 0x0131;
+constexpr uint16_t TIFF_TAG_DATE_TIME = 0x0132;
+constexpr uint16_t TIFF_TAG_JPEG_INTERCHANGE_FORMAT = 0x0201;
+constexpr uint16_t TIFF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH = 0x0202;
+constexpr uint16_t TIFF_TAG_XMP = 0x02bc;
+constexpr uint16_t TIFF_TAG_EXIF_IFD = 0x8769;
+constexpr uint16_t TIFF_TAG_ICC_PROFILE = 0x8773;
+constexpr uint16_t EXIF_TAG_DATE_TIME_ORIGINAL = 0x9003;
+
+
+static exif_tags_t read_exif_tags(const tiff_reader& reader)
+{
+    const size_t ifd0 = reader.first_ifd_offset();
+
+    exif_tags_t tags{
+        .orientation = reader.find_uint(ifd0, TIFF_TAG_ORIENTATION),
+        .make = reader.find_bytes(ifd0, TIFF_TAG_MAKE),
+        .model = reader.find_bytes(ifd0, TIFF_TAG_MODEL),
+        .software = reader.find_bytes(ifd0, TIFF_TAG_SOFTWARE),
+        .date_time = reader.find_bytes(ifd0, TIFF_TAG_DATE_TIME),
+    };
+
+    if (const auto exif_ifd = reader.find_uint(ifd0, TIFF_TAG_EXIF_IFD); exif_ifd.has_value())
+        tags.date_time_original = reader.find_bytes(exif_ifd.value(), EXIF_TAG_DATE_TIME_ORIGINAL);
+
+    return tags;
+}
+
+
+static exif_tags_t read_exif_tags(const optional<binary>& exif)
+{
+    if (!exif.has_value())
+        return {};
+
+    const auto reader = tiff_reader::open(exif->data, exif->size);
+    return reader.has_value() ? read_exif_tags(reader.value()) : exif_tags_t{};
+}
+
+
+// Upper bound on the inflated size of compressed metadata (zTXt/iTXt/iCCP), to guard against zlib bombs.
+constexpr size_t METADATA_MAX_INFLATED_SIZE = 64 << 20;
+
+
+static optional<vector<uint8_t>> zlib_inflate(const uint8_t* data, size_t size)
+{
+    z_stream strm = {};
+    if (inflateInit(&strm) != Z_OK)
+        return nullopt;
+
+    vector<uint8_t> out(std::max<size_t>(size * 4, 1024));
+    strm.next_in = const_cast<Bytef*>(data);
+    strm.avail_in = size;
+
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END)
+    {
+        if (strm.total_out == out.size())
+        {
+            if (out.size() >= METADATA_MAX_INFLATED_SIZE)
+                break;
+            out.resize(std::min(out.size() * 2, METADATA_MAX_INFLATED_SIZE));
+        }
+        strm.next_out = out.data() + strm.total_out;
+        strm.avail_out = out.size() - strm.total_out;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            break;
+    }
+
+    out.resize(strm.total_out);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END)
+        return nullopt;
+    return out;
+}
+
+
+// Walks the JPEG markers up to the first SOS, without touching any entropy-coded data.
+static expected<metadata_result_t, string_view> read_jpeg_metadata(const uint8_t* data, size_t size)
+{
+    metadata_result_t result{};
+    vector<pair<uint8_t, vector<uint8_t>>> icc_segments;
+    uint8_t icc_segment_count = 0;
+
+    size_t pos = 2;
+    while (pos + 2 <= size)
+    {
+        if (data[pos] != 0xff)
+            return std::unexpected("invalid JPEG marker");
+        const uint8_t marker = data[pos + 1];
+        pos += 2;
+
+        if (marker == 0xff)  // fill byte
+        {
+            pos--;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8))  // standalone markers
+            continue;
+        if (marker == 0xd9 || marker == 0xda)  // EOI, or the start of the entropy-coded data
+            break;
+
+        if (pos + 2 > size)
+            return std::unexpected("truncated JPEG segment");
+        const size_t length = data[pos] << 8 | data[pos + 1];
+        if (length < 2 || pos + length > size)
+            return std::unexpected("truncated JPEG segment");
+
+        const uint8_t* payload = data + pos + 2;
+        const size_t payload_size = length - 2;
+        pos += length;
+
+        const bool is_sof = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if (is_sof && payload_size >= 5)
+        {
+            result.height = payload[1] << 8 | payload[2];
+            result.width = payload[3] << 8 | payload[4];
+        }
+        else if (marker == JPEG_APP0 + 1 && starts_with(payload, payload_size, JPEG_EXIF_APP1_IDENTIFIER))
+        {
+            if (!result.exif.has_value())
+                result.exif = binary::from_bytes(
+                    payload + JPEG_EXIF_APP1_IDENTIFIER.size(), payload_size - JPEG_EXIF_APP1_IDENTIFIER.size());
+        }
+        else if (marker == JPEG_APP0 + 1 && starts_with(payload, payload_size, JPEG_XMP_APP1_IDENTIFIER))
+        {
+            if (!result.xmp.has_value())
+                result.xmp = binary::from_bytes(
+                    payload + JPEG_XMP_APP1_IDENTIFIER.size(), payload_size - JPEG_XMP_APP1_IDENTIFIER.size());
+        }
+        else if (marker == JPEG_APP0 + 2 && starts_with(payload, payload_size, JPEG_ICC_APP2_IDENTIFIER) &&
+                 payload_size >= JPEG_ICC_APP2_IDENTIFIER.size() + 2)
+        {
+            // ICC profiles can span multiple APP2 segments, each tagged with a 1-based sequence number and a count
+            const uint8_t* segment = payload + JPEG_ICC_APP2_IDENTIFIER.size();
+            icc_segment_count = segment[1];
+            icc_segments.push_back({segment[0], vector<uint8_t>(segment + 2, payload + payload_size)});
+        }
+    }
+
+    if (icc_segment_count > 0 && icc_segments.size() == icc_segment_count)
+    {
+        std::sort(icc_segments.begin(), icc_segments.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+
+        vector<uint8_t> icc_profile;
+        for (size_t i = 0; i < icc_segments.size(); i++)
+        {
+            if (icc_segments[i].first != i + 1)
+                return std::unexpected("invalid JPEG ICC profile segments");
+            icc_profile.insert(icc_profile.end(), icc_segments[i].second.begin(), icc_segments[i].second.end());
+        }
+        if (!icc_profile.empty())
+            result.icc_profile = binary::from_bytes(icc_profile.data(), icc_profile.size());
+    }
+
+    result.exif_tags = read_exif_tags(result.exif);
+    return result;
+}
+
+
+// Walks the PNG chunks, skipping over (but never inflating) the image data.
+static expected<metadata_result_t, string_view> read_png_metadata(const uint8_t* data, size_t size)
+{
+    metadata_result_t result{};
+
+    auto be32 = [](const uint8_t* p) -> uint32_t {
+        return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    };
+
+    // splits off a NUL-terminated field from the front of [begin, end)
+    auto next_field = [](const uint8_t*& begin, const uint8_t* end) -> optional<vector<uint8_t>> {
+        const uint8_t* nul = std::find(begin, end, 0);
+        if (nul == end)
+            return nullopt;
+        vector<uint8_t> field(begin, nul);
+        begin = nul + 1;
+        return field;
+    };
+
+    size_t pos = 8;
+    while (pos + 12 <= size)
+    {
+        const size_t length = be32(data + pos);
+        const string_view type(reinterpret_cast<const char*>(data + pos + 4), 4);
+        if (length > size - pos - 12)
+            return std::unexpected("truncated PNG chunk");
+
+        const uint8_t* chunk = data + pos + 8;
+        const uint8_t* chunk_end = chunk + length;
+        pos += length + 12;
+
+        if (type == "IHDR" && length >= 8)
+        {
+            result.width = be32(chunk);
+            result.height = be32(chunk + 4);
+        }
+        else if (type == "eXIf")
+        {
+            result.exif = binary::from_bytes(chunk, length);
+        }
+        else if (type == "iCCP")
+        {
+            // profile name, compression method, zlib-compressed profile
+            if (!next_field(chunk, chunk_end).has_value() || chunk == chunk_end)
+                continue;
+            if (auto profile = zlib_inflate(chunk + 1, chunk_end - chunk - 1); profile.has_value())
+                result.icc_profile = binary::from_bytes(profile->data(), profile->size());
+        }
+        else if (type == "tEXt")
+        {
+            auto key = next_field(chunk, chunk_end);
+            if (!key.has_value())
+                continue;
+            result.text_chunks.push_back({std::move(key.value()), vector<uint8_t>(chunk, chunk_end), {}, {}});
+        }
+        else if (type == "zTXt")
+        {
+            auto key = next_field(chunk, chunk_end);
+            if (!key.has_value() || chunk == chunk_end)
+                continue;
+            auto text = zlib_inflate(chunk + 1, chunk_end - chunk - 1);
+            if (!text.has_value())
+                continue;
+            result.text_chunks.push_back({std::move(key.value()), std::move(text.value()), {}, {}});
+        }
+        else if (type == "iTXt")
+        {
+            // keyword, compression flag, compression method, language tag, translated keyword, text
+            auto key = next_field(chunk, chunk_end);
+            if (!key.has_value() || chunk_end - chunk < 2)
+                continue;
+            const bool compressed = chunk[0] != 0;
+            chunk += 2;
+            auto language_tag = next_field(chunk, chunk_end);
+            auto translated_keyword = language_tag.has_value() ? next_field(chunk, chunk_end) : nullopt;
+            if (!translated_keyword.has_value())
+                continue;
+
+            optional<vector<uint8_t>> text = compressed ? zlib_inflate(chunk, chunk_end - chunk)
+                                                        : vector<uint8_t>(chunk, chunk_end);
+            if (!text.has_value())
+                continue;
+
+            if (std::equal(key->begin(), key->end(), PNG_XMP_KEYWORD.begin(), PNG_XMP_KEYWORD.end()))
+                result.xmp = binary::from_bytes(text->data(), text->size());
+
+            result.text_chunks.push_back({
+                std::move(key.value()),
+                std::move(text.value()),
+                std::move(language_tag.value()),
+                std::move(translated_keyword.value()),
+            });
+        }
+        else if (type == "IEND")
+        {
+            break;
+        }
+    }
+
+    result.exif_tags = read_exif_tags(result.exif);
+    return result;
+}
+
+
+// Reads the basic info, color profile and metadata boxes of a JXL file without decoding any frames.
+static expected<metadata_result_t, string_view> read_jxl_metadata(const uint8_t* data, size_t size)
+{
+    auto dec = JxlDecoderMake(nullptr);
+    JXL_ENSURE_SUCCESS(
+        JxlDecoderSubscribeEvents, dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_BOX);
+    JXL_ENSURE_SUCCESS(JxlDecoderSetDecompressBoxes, dec.get(), JXL_TRUE);
+    JXL_ENSURE_SUCCESS(JxlDecoderSetInput, dec.get(), data, size);
+    JxlDecoderCloseInput(dec.get());
+
+    metadata_result_t result{};
+    jxl_box_reader box_reader(result, dec.get());
+
+    for (;;)
+    {
+        JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+
+        if (status == JXL_DEC_ERROR)
+        {
+            return std::unexpected("Decoder error");
+        }
+        else if (status == JXL_DEC_NEED_MORE_INPUT)
+        {
+            return std::unexpected("truncated JXL file");
+        }
+        else if (status == JXL_DEC_BASIC_INFO)
+        {
+            JxlBasicInfo info;
+            JXL_ENSURE_SUCCESS(JxlDecoderGetBasicInfo, dec.get(), &info);
+            result.width = info.xsize;
+            result.height = info.ysize;
+        }
+        else if (status == JXL_DEC_COLOR_ENCODING)
+        {
+            size_t icc_size = 0;
+            if (JxlDecoderGetICCProfileSize(dec.get(), JXL_COLOR_PROFILE_TARGET_ORIGINAL, &icc_size) ==
+                    JXL_DEC_SUCCESS &&
+                icc_size > 0)
+            {
+                binary icc_profile(icc_size);
+                if (JxlDecoderGetColorAsICCProfile(
+                        dec.get(), JXL_COLOR_PROFILE_TARGET_ORIGINAL, icc_profile.data, icc_profile.size) ==
+                    JXL_DEC_SUCCESS)
+                    result.icc_profile = std::move(icc_profile);
+            }
+        }
+        else if (status == JXL_DEC_BOX)
+        {
+            if (auto box_result = box_reader.start_box(); !box_result.has_value())
+                return std::unexpected(box_result.error());
+        }
+        else if (status == JXL_DEC_BOX_NEED_MORE_OUTPUT)
+        {
+            if (auto box_result = box_reader.grow_box(); !box_result.has_value())
+                return std::unexpected(box_result.error());
+        }
+        else if (status == JXL_DEC_SUCCESS)
+        {
+            if (auto box_result = box_reader.finish_box(); !box_result.has_value())
+                return std::unexpected(box_result.error());
+            break;
+        }
+        else
+        {
+            return std::unexpected(unexpected_jxl_decoder_status_message(status));
+        }
+    }
+
+    if (result.xml_boxes.size() == 1)
+        result.xmp = binary::from_bytes(result.xml_boxes[0].data, result.xml_boxes[0].size);
+    result.exif_tags = read_exif_tags(result.exif);
+    return result;
+}
+
+
+// Reads the metadata of the first IFD of a TIFF file.
+static expected<metadata_result_t, string_view> read_tiff_metadata(const uint8_t* data, size_t size)
+{
+    const auto reader = tiff_reader::open(data, size);
+    if (!reader.has_value())
+        return std::unexpected("invalid tiff file");
+
+    const size_t ifd0 = reader->first_ifd_offset();
+    metadata_result_t result{
+        .width = reader->find_uint(ifd0, TIFF_TAG_IMAGE_WIDTH),
+        .height = reader->find_uint(ifd0, TIFF_TAG_IMAGE_LENGTH),
+        .xmp = reader->find_bytes(ifd0, TIFF_TAG_XMP),
+        .icc_profile = reader->find_bytes(ifd0, TIFF_TAG_ICC_PROFILE),
+        .exif_tags = read_exif_tags(reader.value()),
+    };
+    return result;
+}
+
+
+static expected<metadata_result_t, string_view> read_webp_metadata(const uint8_t* data, size_t size)
+{
+    WebPBitstreamFeatures features;
+    if (auto status = WebPGetFeatures(data, size, &features); status != VP8_STATUS_OK)
+        return std::unexpected(webp_status_message(status));
+
+    metadata_result_t result{};
+    result.width = static_cast<uint32_t>(features.width);
+    result.height = static_cast<uint32_t>(features.height);
+    webp_read_metadata_chunks(data, size, result);
+    result.exif_tags = read_exif_tags(result.exif);
+    return result;
+}
+
+
+expected<metadata_result_t, string_view> read_metadata(const binary& bytes)
+{
+    switch (detect_format(bytes.data, bytes.size))
+    {
+    case image_format::jpeg:
+        return read_jpeg_metadata(bytes.data, bytes.size);
+    case image_format::png:
+        return read_png_metadata(bytes.data, bytes.size);
+    case image_format::jxl:
+        return read_jxl_metadata(bytes.data, bytes.size);
+    case image_format::tiff:
+        return read_tiff_metadata(bytes.data, bytes.size);
+    case image_format::webp:
+        return read_webp_metadata(bytes.data, bytes.size);
+    default:
+        return std::unexpected("unsupported format for metadata extraction");
+    }
+}
+
+
+// Lossless JPEG transforms, done on the quantized DCT coefficients like jpegtran. Every transform is a transpose
+// followed by optional horizontal/vertical mirrors, applied to the block grid and to the coefficients inside each
+// block (mirroring a block negates its odd frequencies).
+enum class jpeg_transform_kind : int
+{
+    none = 0,
+    flip_horizontal,
+    flip_vertical,
+    transpose,
+    transverse,
+    rotate_90,
+    rotate_180,
+    rotate_270,
+};
+
+
+struct jpeg_transform_steps
+{
+    bool transpose;
+    bool mirror_x;
+    bool mirror_y;
+};
+
+
+static optional<jpeg_transform_steps> jpeg_transform_steps_of(int transform)
+{
+    switch (static_cast<jpeg_transform_kind>(transform))
+    {
+    case jpeg_transform_kind::none:
+        return jpeg_transform_steps{false, false, false};
+    case jpeg_transform_kind::flip_horizontal:
+        return jpeg_transform_steps{false, true, false};
+    case jpeg_transform_kind::flip_vertical:
+        return jpeg_transform_steps{false, false, true};
+    case jpeg_transform_kind::transpose:
+        return jpeg_transform_steps{true, false, false};
+    case jpeg_transform_kind::transverse:
+        return jpeg_transform_steps{true, true, true};
+    case jpeg_transform_kind::rotate_90:
+        return jpeg_transform_steps{true, true, false};
+    case jpeg_transform_kind::rotate_180:
+        return jpeg_transform_steps{false, true, true};
+    case jpeg_transform_kind::rotate_270:
+        return jpeg_transform_steps{true, false, true};
+    default:
+        return nullopt;
+    }
+}
+
+
+// The transform that undoes an EXIF orientation.
+static jpeg_transform_kind jpeg_transform_for_orientation(uint32_t orientation)
+{
+    switch (orientation)
+    {
+    case 2:
+        return jpeg_transform_kind::flip_horizontal;
+    case 3:
+        return jpeg_transform_kind::rotate_180;
+    case 4:
+        return jpeg_transform_kind::flip_vertical;
+    case 5:
+        return jpeg_transform_kind::transpose;
+    case 6:
+        return jpeg_transform_kind::rotate_90;
+    case 7:
+        return jpeg_transform_kind::transverse;
+    case 8:
+        return jpeg_transform_kind::rotate_270;
+    default:
+        return jpeg_transform_kind::none;
+    }
+}
+
+
+static void jpeg_transform_block(const JCOEF* src, JCOEF* dst, const jpeg_transform_steps& steps)
+{
+    for (int row = 0; row < DCTSIZE; row++)
+    {
+        for (int col = 0; col < DCTSIZE; col++)
+        {
+            JCOEF value = steps.transpose ? src[col * DCTSIZE + row] : src[row * DCTSIZE + col];
+            if ((steps.mirror_x && (col & 1)) != (steps.mirror_y && (row & 1)))
+                value = static_cast<JCOEF>(-value);
+            dst[row * DCTSIZE + col] = value;
+        }
+    }
+}
+
+
+constexpr uint16_t EXIF_TAG_PIXEL_X_DIMENSION = 0xa002;
+constexpr uint16_t EXIF_TAG_PIXEL_Y_DIMENSION = 0xa003;
+
+
+// Overwrites a SHORT or LONG tag in place; tags that are missing or of another type are left alone.
+static void exif_set_uint(const tiff_reader& reader, size_t ifd_offset, uint16_t tag, uint32_t value)
+{
+    const auto e = reader.find(ifd_offset, tag);
+    if (!e.has_value() || e->count == 0)
+        return;
+
+    auto data = const_cast<uint8_t*>(reader.data) + e->value_offset;
+    const int size = e->type == 3 ? 2 : e->type == 4 ? 4 : 0;
+    for (int i = 0; i < size; i++)
+        data[reader.big_endian ? size - 1 - i : i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+
+// Resets the orientation and updates the pixel dimensions of the EXIF block in an APP1 payload.
+static void jpeg_update_exif(
+    uint8_t* app1_data,
+    size_t app1_size,
+    bool reset_orientation,
+    uint32_t width,
+    uint32_t height)
+{
+    const auto reader = tiff_reader::open(
+        app1_data + JPEG_EXIF_APP1_IDENTIFIER.size(), app1_size - JPEG_EXIF_APP1_IDENTIFIER.size());
+    if (!reader.has_value())
+        return;
+
+    const size_t ifd0 = reader->first_ifd_offset();
+    if (reset_orientation)
+        exif_set_uint(reader.value(), ifd0, TIFF_TAG_ORIENTATION, 1);
+    if (const auto exif_ifd = reader->find_uint(ifd0, TIFF_TAG_EXIF_IFD); exif_ifd.has_value())
+    {
+        exif_set_uint(reader.value(), exif_ifd.value(), EXIF_TAG_PIXEL_X_DIMENSION, width);
+        exif_set_uint(reader.value(), exif_ifd.value(), EXIF_TAG_PIXEL_Y_DIMENSION, height);
+    }
+}
+
+
+static jpeg_saved_marker_ptr jpeg_find_exif_marker(jpeg_decompress_struct* cinfo)
+{
+    for (auto marker = cinfo->marker_list; marker != nullptr; marker = marker->next)
+    {
+        if (marker->marker == JPEG_APP0 + 1
+            && starts_with(marker->data, marker->data_length, JPEG_EXIF_APP1_IDENTIFIER))
+            return marker;
+    }
+    return nullptr;
+}
+
+
+static JDIMENSION div_round_up(JDIMENSION a, JDIMENSION b)
+{
+    return (a + b - 1) / b;
+}
+
+
+// Rotates, flips and/or crops a JPEG without decoding it. Edges that would have to move but are not a whole MCU are
+// trimmed (jpegtran -trim), and the crop origin is rounded down to an MCU boundary. A crop_width of 0 means no crop.
+// With auto_orient, the transform comes from the EXIF orientation, which is then reset to 1.
+expected<binary, string> jpeg_transform(
+    vector<uint8_t> jpeg_bytes,
+    int transform,
+    bool auto_orient,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height,
+    bool copy_metadata)
+{
+    struct jpeg_error_mgr src_err, dst_err;
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    jpeg_decompress_guard src_guard(&src);
+
+    src.err = jpeg_std_error(&src_err);
+    jpeg_create_decompress(&src);
+    src_err.error_exit = jpeg_error_exit;
+    jpeg_mem_src(&src, jpeg_bytes.data(), jpeg_bytes.size());
+
+    if (copy_metadata)
+    {
+        jpeg_save_markers(&src, JPEG_COM, 0xffff);
+        for (int i = 0; i < 16; i++)
+            jpeg_save_markers(&src, JPEG_APP0 + i, 0xffff);
+    }
+    else if (auto_orient)
+    {
+        jpeg_save_markers(&src, JPEG_APP0 + 1, 0xffff);
+    }
+    jpeg_read_header(&src, TRUE);
+
+    const auto exif_marker = jpeg_find_exif_marker(&src);
+    if (auto_orient)
+    {
+        optional<uint32_t> orientation;
+        if (exif_marker != nullptr)
+            orientation = read_exif_tags(binary::from_bytes(
+                                             exif_marker->data + JPEG_EXIF_APP1_IDENTIFIER.size(),
+                                             exif_marker->data_length - JPEG_EXIF_APP1_IDENTIFIER.size()))
+                              .orientation;
+        transform = static_cast<int>(jpeg_transform_for_orientation(orientation.value_or(1)));
+    }
+
+    const auto steps = jpeg_transform_steps_of(transform);
+    if (!steps.has_value())
+        return std::unexpected("unsupported JPEG transform");
+
+    const int num_components = src.num_components;
+    int max_h_samp = 1, max_v_samp = 1;
+    for (int ci = 0; ci < num_components; ci++)
+    {
+        max_h_samp = std::max(max_h_samp, src.comp_info[ci].h_samp_factor);
+        max_v_samp = std::max(max_v_samp, src.comp_info[ci].v_samp_factor);
+    }
+    if (num_components == 1)
+        max_h_samp = max_v_samp = 1;
+
+    // everything below is in destination (transformed) coordinates
+    vector<int> h_samp(num_components), v_samp(num_components);
+    for (int ci = 0; ci < num_components; ci++)
+    {
+        const auto& comp = src.comp_info[ci];
+        h_samp[ci] = num_components == 1 ? 1 : steps->transpose ? comp.v_samp_factor : comp.h_samp_factor;
+        v_samp[ci] = num_components == 1 ? 1 : steps->transpose ? comp.h_samp_factor : comp.v_samp_factor;
+    }
+    const JDIMENSION mcu_width = DCTSIZE * (steps->transpose ? max_v_samp : max_h_samp);
+    const JDIMENSION mcu_height = DCTSIZE * (steps->transpose ? max_h_samp : max_v_samp);
+
+    JDIMENSION full_width = steps->transpose ? src.image_height : src.image_width;
+    JDIMENSION full_height = steps->transpose ? src.image_width : src.image_height;
+    if (steps->mirror_x)
+        full_width -= full_width % mcu_width;
+    if (steps->mirror_y)
+        full_height -= full_height % mcu_height;
+    if (full_width == 0 || full_height == 0)
+        return std::unexpected("image is smaller than one MCU along a flipped axis");
+
+    JDIMENSION x = 0, y = 0, width = full_width, height = full_height;
+    if (crop_width > 0)
+    {
+        if (crop_height == 0 || crop_x >= full_width || crop_y >= full_height)
+            return std::unexpected("crop region is outside of the image");
+        x = crop_x - crop_x % mcu_width;
+        y = crop_y - crop_y % mcu_height;
+        width = std::min<JDIMENSION>(crop_width + (crop_x - x), full_width - x);
+        height = std::min<JDIMENSION>(crop_height + (crop_y - y), full_height - y);
+    }
+
+    // the destination coefficient arrays have to be requested before jpeg_read_coefficients realizes them
+    vector<jvirt_barray_ptr> dst_arrays(num_components);
+    for (int ci = 0; ci < num_components; ci++)
+    {
+        dst_arrays[ci] = src.mem->request_virt_barray(
+            reinterpret_cast<j_common_ptr>(&src),
+            JPOOL_IMAGE,
+            FALSE,
+            div_round_up(width, mcu_width) * h_samp[ci],
+            div_round_up(height, mcu_height) * v_samp[ci],
+            v_samp[ci]);
+    }
+    const auto src_arrays = jpeg_read_coefficients(&src);
+
+    for (int ci = 0; ci < num_components; ci++)
+    {
+        const JDIMENSION full_width_in_blocks = div_round_up(full_width, mcu_width) * h_samp[ci];
+        const JDIMENSION full_height_in_blocks = div_round_up(full_height, mcu_height) * v_samp[ci];
+        const JDIMENSION x_offset = x / mcu_width * h_samp[ci];
+        const JDIMENSION y_offset = y / mcu_height * v_samp[ci];
+        const JDIMENSION width_in_blocks = div_round_up(width, mcu_width) * h_samp[ci];
+        const JDIMENSION height_in_blocks = div_round_up(height, mcu_height) * v_samp[ci];
+
+        for (JDIMENSION by = 0; by < height_in_blocks; by++)
+        {
+            const JBLOCKROW dst_row = src.mem->access_virt_barray(
+                reinterpret_cast<j_common_ptr>(&src), dst_arrays[ci], by, 1, TRUE)[0];
+            for (JDIMENSION bx = 0; bx < width_in_blocks; bx++)
+            {
+                JDIMENSION mx = bx + x_offset, my = by + y_offset;
+                if (steps->mirror_x)
+                    mx = full_width_in_blocks - 1 - mx;
+                if (steps->mirror_y)
+                    my = full_height_in_blocks - 1 - my;
+                const JDIMENSION sx = steps->transpose ? my : mx;
+                const JDIMENSION sy = steps->transpose ? mx : my;
+
+                const JBLOCKROW src_row = src.mem->access_virt_barray(
+                    reinterpret_cast<j_common_ptr>(&src), src_arrays[ci], sy, 1, FALSE)[0];
+                jpeg_transform_block(src_row[sx], dst_row[bx], steps.value());
+            }
+        }
+    }
+
+    jpeg_compress_guard dst_guard(&dst);
+    dst.err = jpeg_std_error(&dst_err);
+    jpeg_create_compress(&dst);
+    dst_err.error_exit = jpeg_error_exit;
+
+    uint8_t* buf = nullptr;
+    unsigned long outsize = 0;
+    jpeg_mem_dest(&dst, &buf, &outsize);
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.image_width = width;
+    dst.image_height = height;
+    dst.optimize_coding = TRUE;
+    if (jpeg_has_multiple_scans(&src))
+        jpeg_simple_progression(&dst);
+    for (int ci = 0; ci < num_components; ci++)
+    {
+        dst.comp_info[ci].h_samp_factor = h_samp[ci];
+        dst.comp_info[ci].v_samp_factor = v_samp[ci];
+    }
+    if (steps->transpose)
+    {
+        for (auto table : dst.quant_tbl_ptrs)
+        {
+            if (table == nullptr)
+                continue;
+            for (int row = 0; row < DCTSIZE; row++)
+            {
+                for (int col = row + 1; col < DCTSIZE; col++)
+                    std::swap(table->quantval[row * DCTSIZE + col], table->quantval[col * DCTSIZE + row]);
+            }
+        }
+    }
+
+    jpeg_write_coefficients(&dst, dst_arrays.data());
+
+    if (copy_metadata)
+    {
+        if (exif_marker != nullptr)
+            jpeg_update_exif(exif_marker->data, exif_marker->data_length, auto_orient, width, height);
+
+        for (auto marker = src.marker_list; marker != nullptr; marker = marker->next)
+        {
+            // libjpeg already wrote its own JFIF and Adobe markers
+            if (dst.write_JFIF_header && marker->marker == JPEG_APP0
+                && starts_with(marker->data, marker->data_length, "JFIF\0"sv))
+                continue;
+            if (dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14
+                && starts_with(marker->data, marker->data_length, "Adobe"sv))
+                continue;
+            jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
+        }
+    }
+
+    jpeg_finish_compress(&dst);
+    dst_guard.release();
+    jpeg_destroy_compress(&dst);
+    jpeg_finish_decompress(&src);
+
+    binary out = binary::from_bytes(buf, outsize);
+    free(buf);  // free the buf created by jpeg_mem_dest
+    return out;
+}
+
+
+// Formats accepted by decoder_new, as passed in from Elixir.
+enum class incremental_format : int
+{
+    jpeg = 0,
+    png = 1,
+    jxl = 2,
+    webp = 3,
+};
+
+
+typedef resource<std::unique_ptr<incremental_decoder>> decoder_resource_t;
+
+// The rows that became final since the previous push: width, height, channels, bit depth, index of the first row, and
+// the pixels of the rows themselves.
+using decoder_rows_t = tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, binary>;
+
+
+expected<decoder_resource_t, string_view> decoder_new(int format, bool verify_checksums, bool keep_palette)
+{
+    switch (static_cast<incremental_format>(format))
+    {
+    case incremental_format::jpeg:
+        return decoder_resource_t::alloc(std::make_unique<jpeg_incremental_decoder>());
+    case incremental_format::png:
+        return decoder_resource_t::alloc(std::make_unique<png_incremental_decoder>(verify_checksums, keep_palette));
+    case incremental_format::jxl:
+        return decoder_resource_t::alloc(std::make_unique<jxl_incremental_decoder>(true));
+    case incremental_format::webp:
+        return decoder_resource_t::alloc(std::make_unique<webp_incremental_decoder>());
+    default:
+        return std::unexpected("unsupported format for incremental decoding");
+    }
+}
+
+
+expected<optional<decoder_rows_t>, string> decoder_push(decoder_resource_t decoder_resource, binary chunk)
+{
+    auto& decoder = decoder_resource.get();
+    lock_guard lock(decoder->mutex);
+
+    if (auto status = decoder->run([&] { return decoder->push(chunk.data, chunk.size); }); !status.has_value())
+        return std::unexpected(status.error());
+    if (!decoder->header_ready || decoder->rows_ready == decoder->rows_returned)
+        return nullopt;
+
+    const auto& result = decoder->result;
+    const size_t stride = result.pixels.size / result.height;
+    const uint32_t first_row = decoder->rows_returned;
+    decoder->rows_returned = decoder->rows_ready;
+    return make_tuple(
+        result.width,
+        result.height,
+        result.channels,
+        result.bit_depth,
+        first_row,
+        binary::from_bytes(result.pixels.data + first_row * stride, (decoder->rows_ready - first_row) * stride));
+}
+
+
+expected<decompress_result_t, string> decoder_finish(decoder_resource_t decoder_resource)
+{
+    auto& decoder = decoder_resource.get();
+    lock_guard lock(decoder->mutex);
+
+    if (auto status = decoder->run([&] { return decoder->close(); }); !status.has_value())
+        return std::unexpected(status.error());
+    decoder->finished = true;
+    // the pixels now belong to the VM
+    decoder->reservation.release();
+    return std::move(decoder->result);
+}
+
+
+typedef resource<std::unique_ptr<incremental_encoder>> encoder_resource_t;
+
+
+// Wraps a freshly constructed encoder, running its start step under the encoder's own error handling.
+template <typename Encoder, typename F>
+static expected<encoder_resource_t, string> encoder_start(std::unique_ptr<Encoder> encoder, F&& start)
+{
+    auto& ref = *encoder;
+    if (auto status = ref.run([&] { return start(ref); }); !status.has_value())
+        return std::unexpected(status.error());
+    return encoder_resource_t::alloc(std::move(encoder));
+}
+
+
+expected<encoder_resource_t, string> jpeg_encoder_new(
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    int quality,
+    bool optimize_coding,
+    bool progressive,
+    int subsampling,
+    int dct_method,
+    bool grayscale,
+    optional<vector<uint8_t>> exif_binary,
+    optional<vector<uint8_t>> xmp_binary,
+    optional<vector<uint8_t>> icc_profile)
+{
+    const jpeg_encode_params params{quality, optimize_coding, progressive, subsampling, dct_method, grayscale};
+    return encoder_start(std::make_unique<jpeg_incremental_encoder>(width, height, channels), [&](auto& encoder) {
+        return encoder.start(params, exif_binary, xmp_binary, icc_profile);
+    });
+}
+
+
+expected<encoder_resource_t, string> png_encoder_new(
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    optional<text_chunks_t> text_chunks,
+    int compression_level,
+    int filter,
+    int strategy)
+{
+    if (channels == 0 || channels > 4)
+        return std::unexpected("unsupported number of channels (must be 1-4)");
+    if (filter < 0 || filter > static_cast<int>(png_filter_kind::adaptive))
+        return std::unexpected("unsupported png filter");
+
+    return encoder_start(
+        std::make_unique<png_incremental_encoder>(width, height, channels, bit_depth), [&](auto& encoder) {
+            return encoder.start(text_chunks, compression_level, filter, strategy);
+        });
+}
+
+
+// Encodes the next rows of the image, returning the compressed data produced so far.
+expected<vector<binary>, string> encoder_push(encoder_resource_t encoder_resource, binary rows)
+{
+    auto& encoder = encoder_resource.get();
+    lock_guard lock(encoder->mutex);
+
+    // checked outside of run so that a bad call leaves the encoder usable
+    const size_t stride = encoder->stride();
+    if (stride == 0 || rows.size % stride != 0)
+        return std::unexpected("row data must be a whole number of rows");
+    const size_t num_rows = rows.size / stride;
+    if (num_rows > encoder->height - encoder->rows_written)
+        return std::unexpected("more rows than the image height");
+
+    if (auto status = encoder->run([&] { return encoder->push_rows(rows.data, static_cast<uint32_t>(num_rows)); });
+        !status.has_value())
+        return std::unexpected(status.error());
+    encoder->rows_written += static_cast<uint32_t>(num_rows);
+    return std::exchange(encoder->output, {});
+}
+
+
+// Completes the image once all rows have been pushed, returning the rest of the compressed data.
+expected<vector<binary>, string> encoder_finish(encoder_resource_t encoder_resource)
+{
+    auto& encoder = encoder_resource.get();
+    lock_guard lock(encoder->mutex);
+
+    if (encoder->rows_written < encoder->height && !encoder->finished && !encoder->error.has_value())
+        return std::unexpected("not all rows have been pushed");
+
+    if (auto status = encoder->run([&] { return encoder->close(); }); !status.has_value())
+        return std::unexpected(status.error());
+    encoder->finished = true;
+    return std::exchange(encoder->output, {});
+}
+
+
+// Tile pyramids (Deep Zoom, IIIF) built from an image whose rows arrive from the top down. The last level is the
+// full image, and every level before it is half the size of the next one, rounded up, down to a single pixel. Each
+// level only buffers the rows of its current row of tiles, plus the overlap it shares with the next one. Pairs of
+// rows are reduced 2x2 into the level below as soon as they are in, and a row of tiles is encoded once its last row
+// is in, so peak memory is about a row of tiles per level however large the image is.
+enum class pyramid_tile_format : int
+{
+    jpeg = 0,
+    png,
+    jxl,
+};
+
+
+struct pyramid_tile_params
+{
+    pyramid_tile_format format;
+    // JPEG quality, PNG compression level or JPEG XL distance
+    double quality;
+    // JPEG XL effort
+    int effort;
+};
+
+
+// A tile, as its level, column, row and encoded bytes.
+using pyramid_tile_t = tuple<uint32_t, uint32_t, uint32_t, binary>;
+
+
+static vector<uint8_t> png_encode_tile(
+    const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t channels, int compression_level)
+{
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, nullptr);
+    png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : nullptr;
+    if (!info_ptr)
+    {
+        png_destroy_write_struct(&png_ptr, nullptr);
+        throw std::bad_alloc();
+    }
+
+    vector<uint8_t> out_data;
+    try
+    {
+        png_set_write_fn(
+            png_ptr,
+            &out_data,
+            [](png_structp png_ptr, png_bytep data, png_size_t length) {
+                auto out = reinterpret_cast<vector<uint8_t>*>(png_get_io_ptr(png_ptr));
+                out->insert(out->end(), data, data + length);
+            },
+            nullptr);
+        png_write_header(
+            png_ptr,
+            info_ptr,
+            width,
+            height,
+            channels,
+            8,
+            nullopt,
+            compression_level,
+            Z_DEFAULT_STRATEGY,
+            png_filter_kind::adaptive);
+        for (uint32_t y = 0; y < height; y++)
+            png_write_row(png_ptr, const_cast<png_bytep>(pixels + static_cast<size_t>(y) * width * channels));
+        png_write_end(png_ptr, nullptr);
+    }
+    catch (...)
+    {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        throw;
+    }
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return out_data;
+}
+
+
+static vector<uint8_t> pyramid_encode_tile(
+    const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t channels, const pyramid_tile_params& params)
+{
+    switch (params.format)
+    {
+    case pyramid_tile_format::jpeg:
+    {
+        const jpeg_encode_params jpeg_params{static_cast<int>(params.quality), false, false, 2, 0, false};
+        return jpeg_encode_to_memory(pixels, width, height, channels, jpeg_params, {}, nullopt, nullopt, nullopt);
+    }
+    case pyramid_tile_format::png:
+        return png_encode_tile(pixels, width, height, channels, static_cast<int>(params.quality));
+    default:
+    {
+        auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
+        const size_t size = static_cast<size_t>(width) * height * channels;
+        if (auto status = jxl_encoder_add_image(
+                enc.get(), pixels, size, width, height, channels, 8, nullopt, nullopt, params.quality,
+                params.quality == 0, params.effort, 0, 0);
+            !status.has_value())
+            throw codec_error(string(status.error()));
+        auto compressed = jxl_collect_compressed(enc.get());
+        if (!compressed.has_value())
+            throw codec_error(string(compressed.error()));
+        return std::move(compressed.value());
+    }
+    }
+}
+
+
+struct pyramid_level
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t rows_received = 0;
+    uint32_t next_tile_row = 0;
+    // rows [first_buffered_row, rows_received)
+    uint32_t first_buffered_row = 0;
+    vector<uint8_t> rows;
+    // an even row waiting for the next one, to be reduced with it into the level before
+    vector<uint8_t> pending_row;
+    vector<uint8_t> reduced_row;
+};
+
+
+// Reads a JPEG a few scanlines at a time from a file mapping, which it keeps alive. CMYK and YCCK JPEGs are read as
+// RGB.
+struct pyramid_jpeg_source
+{
+    shared_ptr<mapped_file> file;
+    struct jpeg_error_mgr err;
+    struct jpeg_decompress_struct cinfo;
+    vector<uint8_t> cmyk_row;
+
+    explicit pyramid_jpeg_source(shared_ptr<mapped_file> file) :
+        file(std::move(file))
+    {
+        cinfo.err = jpeg_std_error(&err);
+        jpeg_create_decompress(&cinfo);
+        err.error_exit = jpeg_error_exit;
+    }
+
+    ~pyramid_jpeg_source()
+    {
+        jpeg_destroy_decompress(&cinfo);
+    }
+
+    pyramid_jpeg_source(const pyramid_jpeg_source&) = delete;
+    pyramid_jpeg_source& operator=(const pyramid_jpeg_source&) = delete;
+
+    void start()
+    {
+        jpeg_mem_src(&cinfo, file->data, file->size);
+        jpeg_read_header(&cinfo, TRUE);
+        jpeg_start_decompress(&cinfo);
+        if (cinfo.out_color_space == JCS_CMYK)
+            cmyk_row.resize(static_cast<size_t>(cinfo.output_width) * 4);
+    }
+
+    uint32_t channels() const
+    {
+        return cmyk_row.empty() ? static_cast<uint32_t>(cinfo.output_components) : 3u;
+    }
+
+    void read_rows(uint8_t* out, uint32_t num_rows)
+    {
+        const size_t stride = static_cast<size_t>(cinfo.output_width) * channels();
+        for (uint32_t i = 0; i < num_rows; i++)
+        {
+            auto row_ptr = out + i * stride;
+            if (cmyk_row.empty())
+            {
+                jpeg_read_scanlines(&cinfo, &row_ptr, 1);
+                continue;
+            }
+
+            auto cmyk_ptr = cmyk_row.data();
+            jpeg_read_scanlines(&cinfo, &cmyk_ptr, 1);
+            jpeg_cmyk_to_rgb(cmyk_row.data(), row_ptr, cinfo.output_width, cinfo.saw_Adobe_marker);
+        }
+    }
+};
+
+
+struct tile_pyramid : incremental_codec
+{
+    uint32_t channels;
+    uint32_t tile_size;
+    uint32_t overlap;
+    uint32_t num_threads;
+    pyramid_tile_params params;
+    vector<pyramid_level> levels;
+    vector<pyramid_tile_t> output;
+    std::unique_ptr<pyramid_jpeg_source> source;
+
+    tile_pyramid(
+        uint32_t width,
+        uint32_t height,
+        uint32_t channels,
+        uint32_t tile_size,
+        uint32_t overlap,
+        const pyramid_tile_params& params,
+        uint32_t num_threads) :
+        channels(channels),
+        tile_size(tile_size),
+        overlap(overlap),
+        num_threads(num_threads),
+        params(params)
+    {
+        for (;;)
+        {
+            pyramid_level level;
+            level.width = width;
+            level.height = height;
+            levels.push_back(std::move(level));
+            if (width == 1 && height == 1)
+                break;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        std::reverse(levels.begin(), levels.end());
+    }
+
+    string_view finished_error() const override
+    {
+        return "pyramid already finished";
+    }
+
+    pyramid_level& full_level()
+    {
+        return levels.back();
+    }
+
+    size_t stride() const
+    {
+        return static_cast<size_t>(levels.back().width) * channels;
+    }
+
+    expected<void, string_view> push_rows(const uint8_t* rows, uint32_t num_rows)
+    {
+        for (uint32_t y = 0; y < num_rows; y++)
+            add_row(levels.size() - 1, rows + y * stride());
+        return {};
+    }
+
+    // Adds the next row of a level, reducing it into the level before with the row above it, and encodes the row of
+    // tiles it completes, if any.
+    void add_row(size_t index, const uint8_t* row)
+    {
+        auto& level = levels[index];
+        const size_t row_size = static_cast<size_t>(level.width) * channels;
+        level.rows.insert(level.rows.end(), row, row + row_size);
+        const uint32_t y = level.rows_received++;
+
+        if (index > 0)
+        {
+            if (y % 2 == 0 && y + 1 < level.height)
+                level.pending_row.assign(row, row + row_size);
+            else
+            {
+                reduce_rows(level, y % 2 == 1 ? level.pending_row.data() : row, row);
+                add_row(index - 1, level.reduced_row.data());
+            }
+        }
+
+        encode_ready_tiles(index);
+    }
+
+    // Averages the 2x2 blocks of two rows, which are the same row for the last row of an odd height. The last column
+    // of an odd width is averaged with itself the same way.
+    void reduce_rows(pyramid_level& level, const uint8_t* upper, const uint8_t* lower)
+    {
+        const uint32_t reduced_width = (level.width + 1) / 2;
+        level.reduced_row.resize(static_cast<size_t>(reduced_width) * channels);
+        for (uint32_t x = 0; x < reduced_width; x++)
+        {
+            const size_t left = static_cast<size_t>(2 * x) * channels;
+            const size_t right = static_cast<size_t>(std::min(2 * x + 1, level.width - 1)) * channels;
+            for (uint32_t c = 0; c < channels; c++)
+                level.reduced_row[x * channels + c] = static_cast<uint8_t>(
+                    (upper[left + c] + upper[right + c] + lower[left + c] + lower[right + c] + 2) / 4);
+        }
+    }
+
+    void encode_ready_tiles(size_t index)
+    {
+        auto& level = levels[index];
+        const uint32_t tile_rows = (level.height + tile_size - 1) / tile_size;
+        while (level.next_tile_row < tile_rows)
+        {
+            const uint32_t tile_row = level.next_tile_row;
+            const uint32_t top = tile_row == 0 ? 0 : tile_row * tile_size - overlap;
+            const uint32_t bottom = std::min((tile_row + 1) * tile_size + overlap, level.height);
+            if (level.rows_received < bottom)
+                return;
+
+            encode_tile_row(index, tile_row, top, bottom);
+            level.next_tile_row++;
+
+            // drop the rows that the next row of tiles doesn't overlap
+            const uint32_t next_top = std::min((tile_row + 1) * tile_size - overlap, level.rows_received);
+            if (next_top > level.first_buffered_row)
+            {
+                const size_t dropped_rows = next_top - level.first_buffered_row;
+                level.rows.erase(level.rows.begin(), level.rows.begin() + dropped_rows * level.width * channels);
+                level.first_buffered_row = next_top;
+            }
+        }
+    }
+
+    // Encodes the tiles of a row of tiles on up to num_threads threads.
+    void encode_tile_row(size_t index, uint32_t tile_row, uint32_t top, uint32_t bottom)
+    {
+        const auto& level = levels[index];
+        const uint32_t tile_columns = (level.width + tile_size - 1) / tile_size;
+        const uint32_t tile_height = bottom - top;
+        vector<pyramid_tile_t> tiles(tile_columns);
+        vector<optional<string>> errors(tile_columns);
+        parallel_for(tile_columns, num_threads, [&](size_t column) {
+            const uint32_t left = column == 0 ? 0 : static_cast<uint32_t>(column) * tile_size - overlap;
+            const uint32_t right = std::min((static_cast<uint32_t>(column) + 1) * tile_size + overlap, level.width);
+            const size_t tile_stride = static_cast<size_t>(right - left) * channels;
+            try
+            {
+                vector<uint8_t> pixels(tile_stride * tile_height);
+                for (uint32_t y = 0; y < tile_height; y++)
+                {
+                    const size_t row = top + y - level.first_buffered_row;
+                    std::copy_n(
+                        &level.rows[(row * level.width + left) * channels], tile_stride, &pixels[y * tile_stride]);
+                }
+                const auto encoded = pyramid_encode_tile(pixels.data(), right - left, tile_height, channels, params);
+                tiles[column] = make_tuple(
+                    static_cast<uint32_t>(index),
+                    static_cast<uint32_t>(column),
+                    tile_row,
+                    binary::from_bytes(encoded.data(), encoded.size()));
+            }
+            catch (codec_error& e)
+            {
+                errors[column] = std::move(e.message);
+            }
+            catch (std::bad_alloc&)
+            {
+                errors[column] = "out of memory";
+            }
+        });
+
+        for (auto& error : errors)
+            if (error.has_value())
+                throw codec_error(std::move(error.value()));
+        std::move(tiles.begin(), tiles.end(), std::back_inserter(output));
+    }
+};
+
+
+typedef resource<std::unique_ptr<tile_pyramid>> pyramid_resource_t;
+
+
+static expected<pyramid_tile_params, string_view> pyramid_tile_params_of(
+    uint32_t channels, uint32_t tile_size, uint32_t overlap, int format, double quality, int effort)
+{
+    if (channels == 0 || channels > 4)
+        return std::unexpected("unsupported number of channels (must be 1-4)");
+    if (tile_size == 0 || overlap >= tile_size)
+        return std::unexpected("tile size must be positive and larger than the overlap");
+    if (format < static_cast<int>(pyramid_tile_format::jpeg) || format > static_cast<int>(pyramid_tile_format::jxl))
+        return std::unexpected("unsupported tile format");
+    if (format == static_cast<int>(pyramid_tile_format::jpeg) && channels != 1 && channels != 3)
+        return std::unexpected("JPEG tiles must have 1 or 3 channels");
+    return pyramid_tile_params{static_cast<pyramid_tile_format>(format), quality, effort};
+}
+
+
+// Starts a pyramid for an image of the given size, whose rows are pushed with pyramid_push.
+expected<pyramid_resource_t, string_view> pyramid_new(
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t tile_size,
+    uint32_t overlap,
+    int format,
+    double quality,
+    int effort,
+    uint32_t num_threads)
+{
+    if (width == 0 || height == 0)
+        return std::unexpected("the image must have a non-zero width and height");
+    auto params = pyramid_tile_params_of(channels, tile_size, overlap, format, quality, effort);
+    if (!params.has_value())
+        return std::unexpected(params.error());
+    return pyramid_resource_t::alloc(
+        std::make_unique<tile_pyramid>(width, height, channels, tile_size, overlap, params.value(), num_threads));
+}
+
+
+// Starts a pyramid whose rows are read from a mapped JPEG with pyramid_read, returning it with the size and number of
+// channels of the image.
+expected<tuple<pyramid_resource_t, uint32_t, uint32_t, uint32_t>, string> pyramid_open_jpeg(
+    mapped_file_resource_t file_resource,
+    uint32_t tile_size,
+    uint32_t overlap,
+    int format,
+    double quality,
+    int effort,
+    uint32_t num_threads)
+{
+    try
+    {
+        auto source = std::make_unique<pyramid_jpeg_source>(file_resource.get());
+        source->start();
+        const uint32_t width = source->cinfo.output_width;
+        const uint32_t height = source->cinfo.output_height;
+        const uint32_t channels = source->channels();
+        auto params = pyramid_tile_params_of(channels, tile_size, overlap, format, quality, effort);
+        if (!params.has_value())
+            return std::unexpected(string(params.error()));
+
+        auto pyramid =
+            std::make_unique<tile_pyramid>(width, height, channels, tile_size, overlap, params.value(), num_threads);
+        pyramid->source = std::move(source);
+        return make_tuple(pyramid_resource_t::alloc(std::move(pyramid)), width, height, channels);
+    }
+    catch (codec_error& e)
+    {
+        return std::unexpected(std::move(e.message));
+    }
+}
+
+
+// Adds the next rows of the image, returning the tiles they complete.
+expected<vector<pyramid_tile_t>, string> pyramid_push(pyramid_resource_t pyramid_resource, binary rows)
+{
+    auto& pyramid = pyramid_resource.get();
+    lock_guard lock(pyramid->mutex);
+
+    // checked outside of run so that a bad call leaves the pyramid usable
+    if (pyramid->source)
+        return std::unexpected("the pyramid reads its own rows");
+    if (rows.size % pyramid->stride() != 0)
+        return std::unexpected("row data must be a whole number of rows");
+    const size_t num_rows = rows.size / pyramid->stride();
+    if (num_rows > pyramid->full_level().height - pyramid->full_level().rows_received)
+        return std::unexpected("more rows than the image height");
+
+    if (auto status = pyramid->run([&] { return pyramid->push_rows(rows.data, static_cast<uint32_t>(num_rows)); });
+        !status.has_value())
+        return std::unexpected(status.error());
+    return std::exchange(pyramid->output, {});
+}
+
+
+// Reads up to max_rows more rows from the pyramid's source, returning the tiles they complete; an empty list once
+// every row has been read.
+expected<vector<pyramid_tile_t>, string> pyramid_read(pyramid_resource_t pyramid_resource, uint32_t max_rows)
+{
+    auto& pyramid = pyramid_resource.get();
+    lock_guard lock(pyramid->mutex);
+
+    if (!pyramid->source)
+        return std::unexpected("the pyramid has no source to read rows from");
+    const uint32_t num_rows =
+        std::min(std::max(max_rows, 1u), pyramid->full_level().height - pyramid->full_level().rows_received);
+
+    if (auto status = pyramid->run([&]() -> expected<void, string_view> {
+            vector<uint8_t> rows(num_rows * pyramid->stride());
+            pyramid->source->read_rows(rows.data(), num_rows);
+            return pyramid->push_rows(rows.data(), num_rows);
+        });
+        !status.has_value())
+        return std::unexpected(status.error());
+    return std::exchange(pyramid->output, {});
+}
+
+
+// Completes the pyramid once every row is in. All tiles have been returned by then.
+expected<vector<pyramid_tile_t>, string> pyramid_finish(pyramid_resource_t pyramid_resource)
+{
+    auto& pyramid = pyramid_resource.get();
+    lock_guard lock(pyramid->mutex);
+
+    if (pyramid->full_level().rows_received < pyramid->full_level().height && !pyramid->finished &&
+        !pyramid->error.has_value())
+        return std::unexpected("not all rows have been pushed");
+
+    if (auto status = pyramid->run([&]() -> expected<void, string_view> {
+            if (pyramid->source)
+                jpeg_finish_decompress(&pyramid->source->cinfo);
+            pyramid->source.reset();
+            return {};
+        });
+        !status.has_value())
+        return std::unexpected(status.error());
+    pyramid->finished = true;
+    return std::exchange(pyramid->output, {});
+}
+
+
+using batch_decompress_item_t = expected<decompress_result_t, string>;
+
+
+namespace expp
+{
+template <>
+struct type_cast<batch_decompress_item_t>
+{
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const batch_decompress_item_t& item) noexcept
+    {
+        if (item.has_value())
+            return enif_make_tuple2(
+                env, enif_make_atom(env, "ok"), type_cast<decompress_result_t>::to_term(env, item.value()));
+        return enif_make_tuple2(env, enif_make_atom(env, "error"), type_cast<string>::to_term(env, item.error()));
+    }
+};
+}  // namespace expp
+
+
+template <typename E>
+static batch_decompress_item_t to_batch_item(expected<decompress_result_t, E> result)
+{
+    if (!result.has_value())
+        return std::unexpected(string(result.error()));
+    return std::move(result.value());
+}
+
+
+// Decodes a JPEG, PNG, JXL or WebP image on the calling (non-scheduler) thread, straight from bytes that outlive the
+// call. JPEG, PNG and JXL images can be decoded into a pixel buffer, see jpeg_decompress_impl. Only the kinds of
+// metadata in the mask are extracted, and the pixels are converted to the output format as they are decoded.
+static batch_decompress_item_t decompress_blocking(
+    std::span<const uint8_t> bytes,
+    image_format format,
+    bool verify_checksums,
+    bool keep_palette,
+    bool use_parallel_runner,
+    crop_region crop = {},
+    pixel_buffer* into = nullptr,
+    uint32_t metadata = METADATA_ALL,
+    const output_format_args& output = {})
+{
+    try
+    {
+        switch (format)
+        {
+        case image_format::jpeg:
+            return jpeg_decompress_impl<blocking>(bytes, crop, 1, into, metadata, output).get();
+        case image_format::png:
+            return to_batch_item(
+                png_decompress_impl<blocking>(bytes, verify_checksums, keep_palette, into, metadata, output).get());
+        case image_format::jxl:
+            return to_batch_item(jxl_decompress_impl(bytes, use_parallel_runner, into, metadata, output));
+        case image_format::webp:
+            if (into != nullptr)
+                return std::unexpected("pixel buffers are only supported for JPEG, PNG and JPEG XL images"s);
+            return to_batch_item(webp_decompress_impl<blocking>(bytes, use_parallel_runner, metadata, output).get());
+        default:
+            return std::unexpected("unsupported image format"s);
+        }
+    }
+    catch (...)
+    {
+        return std::unexpected(current_exception_message());
+    }
+}
+
+
+// Decodes one image of a batch on the calling (non-scheduler) thread, with the default decode options, the kinds of
+// metadata in the mask and the output format.
+static batch_decompress_item_t decompress_batch_item(
+    std::span<const uint8_t> bytes,
+    uint32_t metadata,
+    const output_format_args& output = {})
+{
+    const auto format = detect_format(bytes.data(), bytes.size());
+    if (format != image_format::jpeg && format != image_format::png && format != image_format::jxl &&
+        format != image_format::webp)
+        return std::unexpected("unsupported format for batch decoding"s);
+    return decompress_blocking(bytes, format, true, false, false, {}, nullptr, metadata, output);
+}
+
+
+// Maps the file at path and detects its format from the mapping, as an image_format value.
+expected<tuple<mapped_file_resource_t, int>, string> open_path(binary path)
+{
+    auto file = mapped_file::open(string(reinterpret_cast<const char*>(path.data), path.size));
+    if (!file.has_value())
+        return std::unexpected(file.error());
+
+    const auto format = detect_format((*file)->data, (*file)->size);
+    return make_tuple(mapped_file_resource_t::alloc(std::move(file.value())), static_cast<int>(format));
+}
+
+
+// Decodes a JPEG, PNG, JXL or WebP image straight from a file mapping. The crop region only applies to JPEG.
+expected<decompress_result_t, string> decompress_mapped(
+    mapped_file_resource_t file_resource,
+    int format,
+    bool verify_checksums,
+    bool keep_palette,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height,
+    uint32_t metadata,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    const auto& file = file_resource.get();
+    return decompress_blocking(
+        file->bytes(),
+        static_cast<image_format>(format),
+        verify_checksums,
+        keep_palette,
+        true,
+        crop_region{crop_x, crop_y, crop_width, crop_height},
+        nullptr,
+        metadata,
+        output_format_args{planar, type, std::move(scale), std::move(bias)});
+}
+
+
+// Decodes a list of JPEG, PNG, JXL and WebP images on up to num_threads threads (0 means one per core). Threads pull
+// the next undecoded image from a shared cursor, so a few large images don't hold up the rest of the batch. Results
+// are in input order, and a failure only affects its own entry. Each thread converts the pixels of the images it
+// decodes to the output format as it decodes them.
+expected<vector<batch_decompress_item_t>, string_view> decompress_batch(
+    vector<binary> images,
+    uint32_t num_threads,
+    uint32_t metadata,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    const output_format_args output{planar, type, std::move(scale), std::move(bias)};
+    vector<batch_decompress_item_t> results(images.size());
+    parallel_for(
+        images.size(),
+        num_threads,
+        [&](size_t i) {
+            const budget_turn_scope no_turn;
+            results[i] = decompress_batch_item({images[i].data, images[i].size}, metadata, output);
+            // one image can't be retried without decoding the whole batch again
+            if (!results[i].has_value())
+                results[i] = std::unexpected(global_decode_budget.reject_busy(std::move(results[i].error())));
+        },
+        [&](size_t i, string message) { results[i] = std::unexpected(std::move(message)); });
+    return results;
+}
+
+
+// The JPEG thumbnail that IFD1 of an EXIF block points to, if there is one.
+static optional<std::span<const uint8_t>> exif_jpeg_thumbnail(const binary& exif)
+{
+    const auto reader = tiff_reader::open(exif.data, exif.size);
+    if (!reader.has_value())
+        return nullopt;
+    const size_t ifd1 = reader->next_ifd_offset(reader->first_ifd_offset());
+    if (ifd1 == 0)
+        return nullopt;
+
+    const auto offset = reader->find_uint(ifd1, TIFF_TAG_JPEG_INTERCHANGE_FORMAT);
+    const auto length = reader->find_uint(ifd1, TIFF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH);
+    if (!offset.has_value() || !length.has_value() || offset.value() > exif.size ||
+        length.value() > exif.size - offset.value())
+        return nullopt;
+
+    const std::span<const uint8_t> thumbnail(exif.data + offset.value(), length.value());
+    if (detect_format(thumbnail.data(), thumbnail.size()) != image_format::jpeg)
+        return nullopt;
+    return thumbnail;
+}
+
+
+// Decodes the EXIF thumbnail of an image if its longer side is at least min_size. A broken thumbnail is no reason to
+// fail the preview, which then falls back to the image itself.
+static optional<decompress_result_t> decompress_exif_thumbnail(const binary& exif, uint32_t min_size)
+{
+    const auto thumbnail = exif_jpeg_thumbnail(exif);
+    if (!thumbnail.has_value())
+        return nullopt;
+
+    const auto info = read_jpeg_metadata(thumbnail->data(), thumbnail->size());
+    if (!info.has_value() || !info->width.has_value() || !info->height.has_value() ||
+        std::max(info->width.value(), info->height.value()) < min_size)
+        return nullopt;
+
+    try
+    {
+        auto decoded = jpeg_decompress_impl<blocking>(thumbnail.value()).get();
+        if (!decoded.has_value())
+            return nullopt;
+        return std::move(decoded.value());
+    }
+    catch (codec_error&)
+    {
+        return nullopt;
+    }
+}
+
+
+// Decodes the preview frame of a JXL file, if it has one whose longer side is at least min_size. The preview is stored
+// ahead of the frames of the image, and decoding stops once it is done.
+static optional<decompress_result_t> jxl_decompress_preview(std::span<const uint8_t> jxl_bytes, uint32_t min_size)
+{
+    auto dec = JxlDecoderMake(nullptr);
+    if (JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_PREVIEW_IMAGE) != JXL_DEC_SUCCESS ||
+        JxlDecoderSetInput(dec.get(), jxl_bytes.data(), jxl_bytes.size()) != JXL_DEC_SUCCESS)
+        return nullopt;
+    JxlDecoderCloseInput(dec.get());
+
+    decompress_result_t result{};
+    JxlPixelFormat format{};
+    for (;;)
+    {
+        const JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+        if (status == JXL_DEC_BASIC_INFO)
+        {
+            JxlBasicInfo info;
+            if (JxlDecoderGetBasicInfo(dec.get(), &info) != JXL_DEC_SUCCESS || !info.have_preview ||
+                info.exponent_bits_per_sample != 0 || std::max(info.preview.xsize, info.preview.ysize) < min_size)
+                return nullopt;
+
+            result.width = info.preview.xsize;
+            result.height = info.preview.ysize;
+            result.channels = info.num_color_channels + (info.alpha_bits > 0 ? 1 : 0);
+            result.bit_depth = info.bits_per_sample > 8 ? 16 : 8;
+            format = {result.channels, result.bit_depth == 8 ? JXL_TYPE_UINT8 : JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+        }
+        else if (status == JXL_DEC_NEED_PREVIEW_OUT_BUFFER)
+        {
+            size_t buffer_size;
+            const size_t expected_size =
+                static_cast<size_t>(result.width) * result.height * result.channels * result.bit_depth / 8;
+            if (JxlDecoderPreviewOutBufferSize(dec.get(), &format, &buffer_size) != JXL_DEC_SUCCESS ||
+                buffer_size != expected_size)
+                return nullopt;
+            result.pixels = binary{buffer_size};
+            if (JxlDecoderSetPreviewOutBuffer(dec.get(), &format, result.pixels.data, result.pixels.size) !=
+                JXL_DEC_SUCCESS)
+                return nullopt;
+        }
+        else if (status == JXL_DEC_PREVIEW_IMAGE)
+        {
+            return result;
+        }
+        else
+        {
+            return nullopt;
+        }
+    }
+}
+
+
+// The largest DCT scale denominator (up to 8) that leaves the longer side of a JPEG at least min_size pixels long.
+static unsigned int jpeg_preview_scale_denom(uint32_t width, uint32_t height, uint32_t min_size)
+{
+    const uint32_t longer_side = std::max(width, height);
+    unsigned int scale_denom = 8;
+    while (scale_denom > 1 && (longer_side + scale_denom - 1) / scale_denom < min_size)
+        scale_denom /= 2;
+    return scale_denom;
+}
+
+
+// Decodes a small version of a JPEG, PNG, JXL or WebP image whose longer side is at least min_size pixels, as cheaply
+// as the file allows: the JPEG thumbnail in its EXIF IFD1 or the preview frame of a JXL when they are large enough,
+// else a JPEG decoded at a reduced DCT scale, else the full image. Previews carry the metadata of the full image.
+static batch_decompress_item_t decompress_preview_blocking(std::span<const uint8_t> bytes, uint32_t min_size)
+{
+    try
+    {
+        const auto format = detect_format(bytes.data(), bytes.size());
+        expected<metadata_result_t, string_view> metadata = std::unexpected("unsupported format for previews");
+        if (format == image_format::jpeg)
+            metadata = read_jpeg_metadata(bytes.data(), bytes.size());
+        else if (format == image_format::png)
+            metadata = read_png_metadata(bytes.data(), bytes.size());
+        else if (format == image_format::jxl)
+            metadata = read_jxl_metadata(bytes.data(), bytes.size());
+        else if (format == image_format::webp)
+            metadata = read_webp_metadata(bytes.data(), bytes.size());
+        else
+            return std::unexpected(string(metadata.error()));
+
+        // the metadata only needs to be valid for an embedded preview to be trusted; the full decode reports errors
+        if (metadata.has_value())
+        {
+            optional<decompress_result_t> preview;
+            if (metadata->exif.has_value())
+                preview = decompress_exif_thumbnail(metadata->exif.value(), min_size);
+            if (!preview.has_value() && format == image_format::jxl)
+                preview = jxl_decompress_preview(bytes, min_size);
+
+            if (preview.has_value())
+            {
+                // PNG and JXL decodes leave the XMP in their text chunks and boxes
+                preview->exif = std::move(metadata->exif);
+                preview->text_chunks = std::move(metadata->text_chunks);
+                preview->xml_boxes = std::move(metadata->xml_boxes);
+                preview->jumb_boxes = std::move(metadata->jumb_boxes);
+                preview->icc_profile = std::move(metadata->icc_profile);
+                preview->xmp = format == image_format::jpeg || format == image_format::webp
+                                   ? std::move(metadata->xmp)
+                                   : nullopt;
+                preview->app0_segments.clear();
+                return std::move(preview.value());
+            }
+
+            if (format == image_format::jpeg && metadata->width.has_value() && metadata->height.has_value())
+            {
+                const auto scale_denom =
+                    jpeg_preview_scale_denom(metadata->width.value(), metadata->height.value(), min_size);
+                return jpeg_decompress_impl<blocking>(bytes, crop_region{}, scale_denom).get();
+            }
+        }
+
+        return decompress_blocking(bytes, format, true, false, true);
+    }
+    catch (...)
+    {
+        return std::unexpected(current_exception_message());
+    }
+}
+
+
+// Decodes a preview of an encoded image whose longer side is at least min_size pixels, see
+// decompress_preview_blocking.
+expected<decompress_result_t, string> decompress_preview(binary bytes, uint32_t min_size)
+{
+    return decompress_preview_blocking({bytes.data, bytes.size}, min_size);
+}
+
+
+// Decodes a preview of an image straight from a file mapping.
+expected<decompress_result_t, string> decompress_mapped_preview(mapped_file_resource_t file_resource, uint32_t min_size)
+{
+    return decompress_preview_blocking(file_resource.get()->bytes(), min_size);
+}
+
+
+// Converts decoded pixels to the layout, type and per-channel scale and bias that a model expects as its input. type
+// is a pixel_type value.
+expected<binary, string_view> convert_pixels(
+    binary pixels,
+    uint32_t channels,
+    uint32_t bit_depth,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    if (type < static_cast<int>(pixel_type::u8) || type > static_cast<int>(pixel_type::f32))
+        return std::unexpected("unsupported output type");
+
+    output_format format{
+        .planar = planar,
+        .type = static_cast<pixel_type>(type),
+        .scale = vector<float>(scale.begin(), scale.end()),
+        .bias = vector<float>(bias.begin(), bias.end()),
+    };
+    return convert_decoded_pixels({pixels.data, pixels.size}, channels, bit_depth, format);
+}
+
+
+// How an image is fitted into a batch slot of a different aspect ratio.
+enum class batch_fit : int
+{
+    // resize to the slot size, ignoring the aspect ratio
+    stretch = 0,
+    // resize to fit inside the slot, centered, and pad the rest
+    letterbox,
+    // resize to cover the slot, and crop what falls outside of it evenly on both sides
+    crop,
+};
+
+
+// A rectangle in pixels, either of the source image or of a batch slot.
+struct pixel_rect
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+
+// For every output pixel along one axis, the range of input pixels that contribute to it and their weights. Uses a
+// triangle filter widened by the downscaling factor, so that shrinking averages over the pixels that are dropped
+// instead of aliasing.
+struct resample_axis
+{
+    vector<uint32_t> first;
+    vector<uint32_t> count;
+    vector<float> weights;
+    size_t max_count;
+
+    resample_axis(uint32_t in_size, uint32_t out_size)
+    {
+        const double scale = static_cast<double>(in_size) / out_size;
+        const double support = std::max(scale, 1.0);
+        max_count = static_cast<size_t>(std::ceil(support)) * 2 + 2;
+        first.resize(out_size);
+        count.resize(out_size);
+        weights.assign(out_size * max_count, 0.0f);
+
+        for (uint32_t i = 0; i < out_size; i++)
+        {
+            const double center = (i + 0.5) * scale;
+            const auto lo = static_cast<uint32_t>(std::max(0.0, std::floor(center - support)));
+            const auto hi = static_cast<uint32_t>(std::min<double>(in_size, std::ceil(center + support)));
+            double total = 0;
+            for (uint32_t j = lo; j < hi && j - lo < max_count; j++)
+            {
+                const double w = std::max(0.0, 1.0 - std::abs((j + 0.5 - center) / support));
+                weights[i * max_count + (j - lo)] = static_cast<float>(w);
+                total += w;
+            }
+            first[i] = lo;
+            count[i] = std::min<uint32_t>(hi - lo, max_count);
+            for (uint32_t k = 0; k < count[i]; k++)
+                weights[i * max_count + k] = static_cast<float>(weights[i * max_count + k] / total);
+        }
+    }
+};
+
+
+// Where the source image is read from and where it lands in a slot of the given size.
+static tuple<pixel_rect, pixel_rect> batch_fit_rects(
+    uint32_t width, uint32_t height, uint32_t slot_width, uint32_t slot_height, batch_fit fit)
+{
+    const pixel_rect whole_image{0, 0, width, height};
+    const pixel_rect whole_slot{0, 0, slot_width, slot_height};
+    const double scale_x = static_cast<double>(slot_width) / width;
+    const double scale_y = static_cast<double>(slot_height) / height;
+
+    switch (fit)
+    {
+    case batch_fit::letterbox:
+    {
+        const double scale = std::min(scale_x, scale_y);
+        const auto fitted_width = std::clamp<uint32_t>(std::lround(width * scale), 1, slot_width);
+        const auto fitted_height = std::clamp<uint32_t>(std::lround(height * scale), 1, slot_height);
+        const pixel_rect fitted{
+            (slot_width - fitted_width) / 2, (slot_height - fitted_height) / 2, fitted_width, fitted_height};
+        return {whole_image, fitted};
+    }
+    case batch_fit::crop:
+    {
+        const double scale = std::max(scale_x, scale_y);
+        const auto cropped_width = std::clamp<uint32_t>(std::lround(slot_width / scale), 1, width);
+        const auto cropped_height = std::clamp<uint32_t>(std::lround(slot_height / scale), 1, height);
+        const pixel_rect cropped{
+            (width - cropped_width) / 2, (height - cropped_height) / 2, cropped_width, cropped_height};
+        return {cropped, whole_slot};
+    }
+    default:
+        return {whole_image, whole_slot};
+    }
+}
+
+
+// Reads pixel x of a decoded row as channels floats in 0..255, converting between gray, gray + alpha, RGB and RGBA.
+template <typename In>
+static void read_batch_pixel(const In* pixel, uint32_t in_channels, float unit, float* out, uint32_t channels)
+{
+    float rgba[4];
+    if (in_channels <= 2)
+    {
+        rgba[0] = rgba[1] = rgba[2] = pixel[0] * unit;
+        rgba[3] = in_channels == 2 ? pixel[1] * unit : 255.0f;
+    }
+    else
+    {
+        for (uint32_t c = 0; c < 3; c++)
+            rgba[c] = pixel[c] * unit;
+        rgba[3] = in_channels == 4 ? pixel[3] * unit : 255.0f;
+    }
+
+    switch (channels)
+    {
+    case 1:
+        out[0] = in_channels <= 2 ? rgba[0] : 0.299f * rgba[0] + 0.587f * rgba[1] + 0.114f * rgba[2];
+        break;
+    case 3:
+        std::copy_n(rgba, 3, out);
+        break;
+    default:
+        std::copy_n(rgba, 4, out);
+        break;
+    }
+}
+
+
+// Resamples the source rectangle of an image with image_channels samples per pixel into the destination rectangle of
+// slot, a channels-interleaved float image of slot_width pixels per row. Rows are resized horizontally first, then the
+// columns vertically.
+template <typename In>
+static void resample_into_slot(
+    const uint8_t* image_pixels,
+    uint32_t image_width,
+    uint32_t image_channels,
+    const pixel_rect& src,
+    const pixel_rect& dst,
+    float* slot,
+    uint32_t slot_width,
+    uint32_t channels)
+{
+    const auto* pixels = reinterpret_cast<const In*>(image_pixels);
+    const float unit = std::is_same_v<In, float> ? 255.0f : 255.0f / std::numeric_limits<In>::max();
+    const resample_axis horizontal(src.width, dst.width);
+    const resample_axis vertical(src.height, dst.height);
+
+    vector<float> row(static_cast<size_t>(src.width) * channels);
+    vector<float> resized_rows(static_cast<size_t>(src.height) * dst.width * channels);
+    for (uint32_t y = 0; y < src.height; y++)
+    {
+        const In* in_row = pixels + (static_cast<size_t>(src.y + y) * image_width + src.x) * image_channels;
+        for (uint32_t x = 0; x < src.width; x++)
+            read_batch_pixel(in_row + x * image_channels, image_channels, unit, &row[x * channels], channels);
+
+        float* out_row = &resized_rows[static_cast<size_t>(y) * dst.width * channels];
+        for (uint32_t x = 0; x < dst.width; x++)
+        {
+            const float* weights = &horizontal.weights[x * horizontal.max_count];
+            for (uint32_t c = 0; c < channels; c++)
+            {
+                float sum = 0;
+                for (uint32_t k = 0; k < horizontal.count[x]; k++)
+                    sum += row[(horizontal.first[x] + k) * channels + c] * weights[k];
+                out_row[x * channels + c] = sum;
+            }
+        }
+    }
+
+    const size_t row_size = static_cast<size_t>(dst.width) * channels;
+    for (uint32_t y = 0; y < dst.height; y++)
+    {
+        float* out_row = slot + (static_cast<size_t>(dst.y + y) * slot_width + dst.x) * channels;
+        std::fill_n(out_row, row_size, 0.0f);
+        const float* weights = &vertical.weights[y * vertical.max_count];
+        for (uint32_t k = 0; k < vertical.count[y]; k++)
+        {
+            const float* in_row = &resized_rows[(vertical.first[y] + k) * row_size];
+            for (size_t i = 0; i < row_size; i++)
+                out_row[i] += in_row[i] * weights[k];
+        }
+    }
+}
+
+
+// Calls resample_into_slot for pixels of the given bit depth, where 32 means floats.
+static void resample_pixels_into_slot(
+    const uint8_t* pixels,
+    uint32_t width,
+    uint32_t in_channels,
+    uint32_t bit_depth,
+    const pixel_rect& src,
+    const pixel_rect& dst,
+    float* slot,
+    uint32_t slot_width,
+    uint32_t channels)
+{
+    switch (bit_depth)
+    {
+    case 8:
+        resample_into_slot<uint8_t>(pixels, width, in_channels, src, dst, slot, slot_width, channels);
+        break;
+    case 16:
+        resample_into_slot<uint16_t>(pixels, width, in_channels, src, dst, slot, slot_width, channels);
+        break;
+    default:
+        resample_into_slot<float>(pixels, width, in_channels, src, dst, slot, slot_width, channels);
+        break;
+    }
+}
+
+
+using batch_slot_result_t = expected<tuple<uint32_t, uint32_t>, string>;
+
+
+// Decodes one image of a batch, fits it into its slot as 0..255 floats padded with pad, and converts the slot to the
+// output format at out. A failed image leaves a slot that is all padding.
+static batch_slot_result_t decompress_into_slot(
+    const binary& bytes,
+    uint32_t slot_width,
+    uint32_t slot_height,
+    batch_fit fit,
+    float pad,
+    const output_format& format,
+    uint8_t* out)
+{
+    const uint32_t channels = static_cast<uint32_t>(format.scale.size());
+    const size_t num_pixels = static_cast<size_t>(slot_width) * slot_height;
+    vector<float> slot(num_pixels * channels, pad);
+
+    // only the pixels end up in the batch
+    const budget_turn_scope no_turn;
+    auto decoded = decompress_batch_item({bytes.data, bytes.size}, METADATA_NONE);
+    batch_slot_result_t result = std::unexpected(""s);
+    if (decoded.has_value())
+    {
+        const auto& image = decoded.value();
+        const auto [src, dst] = batch_fit_rects(image.width, image.height, slot_width, slot_height, fit);
+        resample_pixels_into_slot(
+            image.pixels.data,
+            image.width,
+            image.channels,
+            image.bit_depth,
+            src,
+            dst,
+            slot.data(),
+            slot_width,
+            channels);
+        result = make_tuple(image.width, image.height);
+    }
+    else
+        result = std::unexpected(global_decode_budget.reject_busy(std::move(decoded.error())));
+
+    convert_pixels_from<float>(reinterpret_cast<const uint8_t*>(slot.data()), out, 0, num_pixels, num_pixels, format);
+    return result;
+}
+
+
+// Fills a slot of num_pixels pixels with padding in the output format, for an image that failed in a way that left
+// its slot unwritten. It allocates nothing, as the failure may have been running out of memory.
+static void fill_slot_padding(uint8_t* out, size_t num_pixels, float pad, const output_format& format)
+{
+    const size_t channels = format.scale.size();
+    const size_t sample_size = pixel_type_size(format.type);
+    std::array<float, 4> pad_pixel;
+    pad_pixel.fill(pad);
+    // a single pixel comes out the same way in either layout, one sample per channel
+    std::array<uint8_t, 4 * sizeof(float)> pad_samples;
+    convert_pixels_from<float>(
+        reinterpret_cast<const uint8_t*>(pad_pixel.data()), pad_samples.data(), 0, 1, 1, format);
+
+    for (size_t c = 0; c < channels; c++)
+    {
+        const uint8_t* sample = pad_samples.data() + c * sample_size;
+        for (size_t i = 0; i < num_pixels; i++)
+        {
+            const size_t index = format.planar ? c * num_pixels + i : i * channels + c;
+            std::copy_n(sample, sample_size, out + index * sample_size);
+        }
+    }
+}
+
+
+// Decodes a list of JPEG, PNG, JXL and WebP images on up to num_threads threads straight into the slots of one
+// {N, height, width, channels} batch (or {N, channels, height, width} when planar), fitting each image to the slot
+// size. Returns the batch and, per image, its original width and height or why it could not be decoded. Slots hold
+// 0..255 samples before the scale and bias, stretched to 0..65535 for 16-bit output.
+expected<tuple<binary, vector<batch_slot_result_t>>, string_view> decompress_into_batch(
+    vector<binary> images,
+    uint32_t num_threads,
+    uint32_t height,
+    uint32_t width,
+    uint32_t channels,
+    int fit,
+    double pad,
+    bool planar,
+    int type,
+    vector<double> scale,
+    vector<double> bias)
+{
+    if (width == 0 || height == 0)
+        return std::unexpected("batch images must have a non-zero width and height");
+    if (channels != 1 && channels != 3 && channels != 4)
+        return std::unexpected("batch images must have 1, 3 or 4 channels");
+    if (fit < static_cast<int>(batch_fit::stretch) || fit > static_cast<int>(batch_fit::crop))
+        return std::unexpected("unsupported fit");
+    if (type < static_cast<int>(pixel_type::u8) || type > static_cast<int>(pixel_type::f32))
+        return std::unexpected("unsupported output type");
+    if (scale.size() != channels || bias.size() != channels)
+        return std::unexpected("scale and bias must have one value per channel");
+
+    output_format format{
+        .planar = planar,
+        .type = static_cast<pixel_type>(type),
+        .scale = vector<float>(scale.begin(), scale.end()),
+        .bias = vector<float>(bias.begin(), bias.end()),
+    };
+    if (format.type == pixel_type::u16)
+    {
+        for (auto& channel_scale : format.scale)
+            channel_scale *= 257.0f;
+    }
+
+    const size_t slot_size = static_cast<size_t>(width) * height * channels * pixel_type_size(format.type);
+    binary batch{slot_size * images.size()};
+    vector<batch_slot_result_t> results(images.size());
+    parallel_for(
+        images.size(),
+        num_threads,
+        [&](size_t i) {
+            results[i] = decompress_into_slot(
+                images[i],
+                width,
+                height,
+                static_cast<batch_fit>(fit),
+                static_cast<float>(pad),
+                format,
+                batch.data + i * slot_size);
+        },
+        [&](size_t i, string message) {
+            const size_t num_pixels = static_cast<size_t>(width) * height;
+            fill_slot_padding(batch.data + i * slot_size, num_pixels, static_cast<float>(pad), format);
+            results[i] = std::unexpected(std::move(message));
+        });
+    return make_tuple(std::move(batch), std::move(results));
+}
+
+
+// Perceptual hashes for finding near-duplicate images, all computed from one small luma thumbnail, so that resized,
+// re-encoded or lightly edited copies of an image get hashes a few bits apart. aHash compares an 8x8 thumbnail with its
+// mean, dHash compares horizontally adjacent pixels of a 9x8 one, pHash compares the lowest 8x8 DCT coefficients of a
+// 32x32 one with their median, and the block mean signature compares the means of 16x16 blocks with their median.
+// Bits are in row-major order, most significant first.
+using image_hashes_t = tuple<uint64_t, uint64_t, uint64_t, binary>;
+
+constexpr uint32_t HASH_THUMBNAIL_SIZE = 64;
+
+
+// Means of the size x size blocks of a square float image whose side is a multiple of size.
+static vector<float> block_means(const vector<float>& image, uint32_t image_size, uint32_t size)
+{
+    const uint32_t block = image_size / size;
+    vector<float> means(static_cast<size_t>(size) * size, 0.0f);
+    for (uint32_t y = 0; y < image_size; y++)
+        for (uint32_t x = 0; x < image_size; x++)
+            means[(y / block) * size + x / block] += image[y * image_size + x];
+    for (auto& mean : means)
+        mean /= static_cast<float>(block * block);
+    return means;
+}
+
+
+static float median_of(vector<float> values)
+{
+    const auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    if (values.size() % 2 == 1)
+        return *middle;
+    return (*std::max_element(values.begin(), middle) + *middle) / 2;
+}
+
+
+// Packs one bit per value, set when the value is above threshold.
+static uint64_t hash_bits(const vector<float>& values, float threshold)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < 64; i++)
+        hash = (hash << 1) | (values[i] > threshold ? 1u : 0u);
+    return hash;
+}
+
+
+static image_hashes_t hash_thumbnail(const vector<float>& thumbnail)
+{
+    constexpr uint32_t size = HASH_THUMBNAIL_SIZE;
+
+    const auto small = block_means(thumbnail, size, 8);
+    float mean = 0;
+    for (float value : small)
+        mean += value / small.size();
+    const uint64_t ahash = hash_bits(small, mean);
+
+    const resample_axis horizontal(size, 9);
+    const resample_axis vertical(size, 8);
+    vector<float> gradients(64);
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        float row[9] = {};
+        for (uint32_t x = 0; x < 9; x++)
+            for (uint32_t i = 0; i < vertical.count[y]; i++)
+                for (uint32_t j = 0; j < horizontal.count[x]; j++)
+                    row[x] += thumbnail[(vertical.first[y] + i) * size + horizontal.first[x] + j] *
+                        vertical.weights[y * vertical.max_count + i] *
+                        horizontal.weights[x * horizontal.max_count + j];
+        for (uint32_t x = 0; x < 8; x++)
+            gradients[y * 8 + x] = row[x + 1] - row[x];
+    }
+    const uint64_t dhash = hash_bits(gradients, 0.0f);
+
+    // only the lowest 8 frequencies of each axis of the DCT-II are needed; its scale doesn't matter for the median
+    constexpr uint32_t dct_size = 32;
+    const auto dct_input = block_means(thumbnail, size, dct_size);
+    array<array<float, dct_size>, 8> cosines;
+    for (uint32_t k = 0; k < 8; k++)
+        for (uint32_t n = 0; n < dct_size; n++)
+            cosines[k][n] = static_cast<float>(std::cos(M_PI * k * (2 * n + 1) / (2 * dct_size)));
+    vector<float> row_coefficients(dct_size * 8, 0.0f);
+    for (uint32_t y = 0; y < dct_size; y++)
+        for (uint32_t u = 0; u < 8; u++)
+            for (uint32_t x = 0; x < dct_size; x++)
+                row_coefficients[y * 8 + u] += dct_input[y * dct_size + x] * cosines[u][x];
+    vector<float> coefficients(64, 0.0f);
+    for (uint32_t v = 0; v < 8; v++)
+        for (uint32_t u = 0; u < 8; u++)
+            for (uint32_t y = 0; y < dct_size; y++)
+                coefficients[v * 8 + u] += row_coefficients[y * 8 + u] * cosines[v][y];
+    const uint64_t phash = hash_bits(coefficients, median_of(coefficients));
+
+    const auto blocks = block_means(thumbnail, size, 16);
+    const float blocks_median = median_of(blocks);
+    binary block_mean(blocks.size() / 8);
+    std::fill_n(block_mean.data, block_mean.size, 0);
+    for (size_t i = 0; i < blocks.size(); i++)
+        if (blocks[i] > blocks_median)
+            block_mean.data[i / 8] |= 0x80 >> (i % 8);
+
+    return make_tuple(ahash, dhash, phash, std::move(block_mean));
+}
+
+
+// Hashes pixels of the given bit depth (32 for floats in 0..1) with 1 to 4 channels, ignoring alpha.
+static image_hashes_t hash_pixels(
+    const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth)
+{
+    constexpr uint32_t size = HASH_THUMBNAIL_SIZE;
+    vector<float> thumbnail(size * size);
+    resample_pixels_into_slot(
+        pixels, width, channels, bit_depth, {0, 0, width, height}, {0, 0, size, size}, thumbnail.data(), size, 1);
+    return hash_thumbnail(thumbnail);
+}
+
+
+// Decodes only the luma of a JPEG, at the smallest DCT scale (down to 1/8) that leaves it at least as large as the hash
+// thumbnail. At 1/8 scale libjpeg takes each block's DC coefficient as its pixel, so large photos are hashed without an
+// IDCT, upsampling or color conversion, and without materializing the full image. CMYK and YCCK images come out of
+// libjpeg as CMYK, which is turned into RGB here row by row rather than being mistaken for RGBA.
+static decompress_result_t jpeg_decompress_for_hash(std::span<const uint8_t> jpeg_bytes)
+{
+    struct jpeg_error_mgr err;
+    struct jpeg_decompress_struct cinfo;
+    jpeg_decompress_guard guard(&cinfo);
+
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&cinfo);
+    err.error_exit = jpeg_error_exit;
+    jpeg_mem_src(&cinfo, jpeg_bytes.data(), jpeg_bytes.size());
+    jpeg_read_header(&cinfo, TRUE);
+
+    if (cinfo.jpeg_color_space == JCS_YCbCr || cinfo.jpeg_color_space == JCS_GRAYSCALE)
+        cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 8;
+    while (cinfo.scale_denom > 1 &&
+           (cinfo.image_width < HASH_THUMBNAIL_SIZE * cinfo.scale_denom ||
+            cinfo.image_height < HASH_THUMBNAIL_SIZE * cinfo.scale_denom))
+        cinfo.scale_denom /= 2;
+    jpeg_start_decompress(&cinfo);
+
+    const bool cmyk = cinfo.out_color_space == JCS_CMYK;
+    decompress_result_t result{};
+    result.width = cinfo.output_width;
+    result.height = cinfo.output_height;
+    result.channels = cmyk ? 3u : static_cast<uint32_t>(cinfo.output_components);
+    result.bit_depth = 8u;
+    const size_t row_stride = static_cast<size_t>(result.width) * result.channels;
+    result.pixels = binary(row_stride * result.height);
+    vector<uint8_t> cmyk_row(cmyk ? static_cast<size_t>(result.width) * 4 : 0);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        auto row_ptr = result.pixels.data + cinfo.output_scanline * row_stride;
+        if (!cmyk)
+        {
+            jpeg_read_scanlines(&cinfo, &row_ptr, 1);
+            continue;
+        }
+
+        auto cmyk_ptr = cmyk_row.data();
+        jpeg_read_scanlines(&cinfo, &cmyk_ptr, 1);
+        jpeg_cmyk_to_rgb(cmyk_row.data(), row_ptr, result.width, cinfo.saw_Adobe_marker);
+    }
+    jpeg_finish_decompress(&cinfo);
+    return result;
+}
+
+
+using image_hash_result_t = expected<image_hashes_t, string>;
+
+
+// Hashes an encoded JPEG, PNG, JXL or WebP image on the calling (non-scheduler) thread. JPEGs are hashed from a reduced
+// decode; the other formats are decoded in full first.
+static image_hash_result_t hash_encoded_image(std::span<const uint8_t> bytes)
+{
+    try
+    {
+        const auto format = detect_format(bytes.data(), bytes.size());
+        if (format == image_format::jpeg)
+        {
+            const auto image = jpeg_decompress_for_hash(bytes);
+            return hash_pixels(image.pixels.data, image.width, image.height, image.channels, image.bit_depth);
+        }
+        if (format != image_format::png && format != image_format::jxl && format != image_format::webp)
+            return std::unexpected("unsupported format for hashing"s);
+
+        auto decoded = decompress_blocking(bytes, format, true, false, false, {}, nullptr, METADATA_NONE);
+        if (!decoded.has_value())
+            return std::unexpected(std::move(decoded.error()));
+        const auto& image = decoded.value();
+        return hash_pixels(image.pixels.data, image.width, image.height, image.channels, image.bit_depth);
+    }
+    catch (codec_error& e)
+    {
+        return std::unexpected(std::move(e.message));
+    }
+    catch (std::bad_alloc&)
+    {
+        return std::unexpected("out of memory"s);
+    }
+}
+
+
+// Computes the perceptual hashes of an encoded JPEG, PNG, JXL or WebP image.
+image_hash_result_t image_hash(binary bytes)
+{
+    return hash_encoded_image({bytes.data, bytes.size});
+}
+
+
+// Computes the perceptual hashes of a list of encoded images on up to num_threads threads (0 means one per core).
+// Results are in input order, and a failure only affects its own entry.
+expected<vector<image_hash_result_t>, string_view> image_hash_batch(vector<binary> images, uint32_t num_threads)
+{
+    vector<image_hash_result_t> results(images.size());
+    parallel_for(images.size(), num_threads, [&](size_t i) {
+        const budget_turn_scope no_turn;
+        results[i] = hash_encoded_image({images[i].data, images[i].size});
+        if (!results[i].has_value())
+            results[i] = std::unexpected(global_decode_budget.reject_busy(std::move(results[i].error())));
+    });
+    return results;
+}
+
+
+// Computes the perceptual hashes of raw interleaved pixels with 1 to 4 channels, 8 or 16-bit integers or 32-bit floats
+// in 0..1.
+expected<image_hashes_t, string_view> pixels_hash(
+    binary pixels, uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth)
+{
+    if (width == 0 || height == 0 || channels == 0 || channels > 4)
+        return std::unexpected("unsupported image shape");
+    if (bit_depth != 8 && bit_depth != 16 && bit_depth != 32)
+        return std::unexpected("unsupported bit depth");
+    if (pixels.size != static_cast<size_t>(width) * height * channels * (bit_depth / 8))
+        return std::unexpected("pixel data does not match the image shape");
+    return hash_pixels(pixels.data, width, height, channels, bit_depth);
+}
+
+
+// Full-reference quality metrics, for comparing an encoded and decoded image with its original. Both images have the
+// layout of decompress_result_t pixels. SSIM follows Wang et al. (2004) on the luma of the images, with an 11x11
+// Gaussian window of standard deviation 1.5 that only covers whole windows, and MS-SSIM (Wang et al., 2003) repeats
+// it over five scales, halving the image between them with a 2x2 box filter. Samples are scaled to 0..1 first, so
+// the constants are the same for every bit depth. Every pass is split into bands of rows on up to num_threads
+// threads, and the per-band sums are added up in order, so the results don't depend on the number of threads.
+constexpr uint32_t SSIM_WINDOW = 11;
+constexpr uint32_t SSIM_BAND_ROWS = 64;
+constexpr uint32_t MS_SSIM_SCALES = 5;
+constexpr array<double, MS_SSIM_SCALES> MS_SSIM_WEIGHTS = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+
+
+static size_t num_row_bands(uint32_t rows)
+{
+    return (rows + SSIM_BAND_ROWS - 1) / SSIM_BAND_ROWS;
+}
+
+
+template <typename In>
+static double squared_error_sum(const uint8_t* reference, const uint8_t* distorted, size_t first, size_t last)
+{
+    const double unit = std::is_same_v<In, float> ? 1.0 : 1.0 / std::numeric_limits<In>::max();
+    const auto* a = reinterpret_cast<const In*>(reference);
+    const auto* b = reinterpret_cast<const In*>(distorted);
+    double sum = 0;
+    for (size_t i = first; i < last; i++)
+    {
+        const double difference = (static_cast<double>(a[i]) - static_cast<double>(b[i])) * unit;
+        sum += difference * difference;
+    }
+    return sum;
+}
+
+
+// The mean squared error over all samples, alpha included, on a 0..1 scale.
+static double mean_squared_error(
+    const binary& reference,
+    const binary& distorted,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    uint32_t num_threads)
+{
+    const size_t row_samples = static_cast<size_t>(width) * channels;
+    vector<double> band_sums(num_row_bands(height));
+    parallel_for(band_sums.size(), num_threads, [&](size_t band) {
+        const size_t first = band * SSIM_BAND_ROWS * row_samples;
+        const size_t last = std::min<size_t>((band + 1) * SSIM_BAND_ROWS, height) * row_samples;
+        switch (bit_depth)
+        {
+        case 8:
+            band_sums[band] = squared_error_sum<uint8_t>(reference.data, distorted.data, first, last);
+            break;
+        case 16:
+            band_sums[band] = squared_error_sum<uint16_t>(reference.data, distorted.data, first, last);
+            break;
+        default:
+            band_sums[band] = squared_error_sum<float>(reference.data, distorted.data, first, last);
+            break;
+        }
+    });
+
+    double sum = 0;
+    for (double band_sum : band_sums)
+        sum += band_sum;
+    return sum / (row_samples * height);
+}
+
+
+// The luma of an image as floats in 0..1, ignoring alpha.
+static vector<float> quality_luma(
+    const binary& pixels, uint32_t width, uint32_t height, uint32_t channels, uint32_t bit_depth, uint32_t num_threads)
+{
+    vector<float> luma(static_cast<size_t>(width) * height);
+    parallel_for(num_row_bands(height), num_threads, [&](size_t band) {
+        const uint32_t first = static_cast<uint32_t>(band) * SSIM_BAND_ROWS;
+        const uint32_t rows = std::min(first + SSIM_BAND_ROWS, height) - first;
+        const size_t offset = static_cast<size_t>(first) * width * channels * (bit_depth / 8);
+        resample_pixels_into_slot(
+            pixels.data + offset,
+            width,
+            channels,
+            bit_depth,
+            {0, 0, width, rows},
+            {0, 0, width, rows},
+            &luma[static_cast<size_t>(first) * width],
+            width,
+            1);
+    });
+    for (auto& value : luma)
+        value /= 255.0f;
+    return luma;
+}
+
+
+struct ssim_sums
+{
+    // sums of the SSIM and of its contrast-structure term over every window
+    double ssim = 0;
+    double contrast_structure = 0;
+    size_t count = 0;
+};
+
+
+// Sums the SSIM of two same-size planes over every window position.
+static ssim_sums ssim_at_scale(
+    const vector<float>& x, const vector<float>& y, uint32_t width, uint32_t height, uint32_t num_threads)
+{
+    constexpr double c1 = 0.01 * 0.01;
+    constexpr double c2 = 0.03 * 0.03;
+    array<float, SSIM_WINDOW> gaussian;
+    double total = 0;
+    for (uint32_t k = 0; k < SSIM_WINDOW; k++)
+    {
+        const double offset = static_cast<double>(k) - SSIM_WINDOW / 2;
+        gaussian[k] = static_cast<float>(std::exp(-offset * offset / (2 * 1.5 * 1.5)));
+        total += gaussian[k];
+    }
+    for (auto& weight : gaussian)
+        weight = static_cast<float>(weight / total);
+
+    const uint32_t out_width = width - SSIM_WINDOW + 1;
+    const uint32_t out_height = height - SSIM_WINDOW + 1;
+    vector<ssim_sums> band_sums(num_row_bands(out_height));
+    parallel_for(band_sums.size(), num_threads, [&](size_t band) {
+        const uint32_t first = static_cast<uint32_t>(band) * SSIM_BAND_ROWS;
+        const uint32_t out_rows = std::min(first + SSIM_BAND_ROWS, out_height) - first;
+        const uint32_t in_rows = out_rows + SSIM_WINDOW - 1;
+
+        // filter the rows the band needs horizontally, as mean x, mean y, x², y² and xy; the loops run over
+        // contiguous samples so that they vectorize
+        vector<float> filtered(static_cast<size_t>(5) * in_rows * out_width, 0.0f);
+        const auto plane = [&](int q, uint32_t row) {
+            return &filtered[(q * static_cast<size_t>(in_rows) + row) * out_width];
+        };
+        for (uint32_t row = 0; row < in_rows; row++)
+        {
+            const float* xs = &x[static_cast<size_t>(first + row) * width];
+            const float* ys = &y[static_cast<size_t>(first + row) * width];
+            float* mean_x = plane(0, row);
+            float* mean_y = plane(1, row);
+            float* xx = plane(2, row);
+            float* yy = plane(3, row);
+            float* xy = plane(4, row);
+            for (uint32_t k = 0; k < SSIM_WINDOW; k++)
+            {
+                const float weight = gaussian[k];
+                for (uint32_t i = 0; i < out_width; i++)
+                {
+                    const float a = xs[i + k];
+                    const float b = ys[i + k];
+                    mean_x[i] += weight * a;
+                    mean_y[i] += weight * b;
+                    xx[i] += weight * a * a;
+                    yy[i] += weight * b * b;
+                    xy[i] += weight * a * b;
+                }
+            }
+        }
+
+        // then vertically, one output row at a time
+        vector<float> window(static_cast<size_t>(5) * out_width);
+        ssim_sums sums;
+        for (uint32_t row = 0; row < out_rows; row++)
+        {
+            std::fill(window.begin(), window.end(), 0.0f);
+            for (int q = 0; q < 5; q++)
+            {
+                float* out = &window[q * static_cast<size_t>(out_width)];
+                for (uint32_t k = 0; k < SSIM_WINDOW; k++)
+                {
+                    const float weight = gaussian[k];
+                    const float* in = plane(q, row + k);
+                    for (uint32_t i = 0; i < out_width; i++)
+                        out[i] += weight * in[i];
+                }
+            }
+
+            for (uint32_t i = 0; i < out_width; i++)
+            {
+                const double mean_x = window[i];
+                const double mean_y = window[out_width + i];
+                const double variance_x = window[2 * out_width + i] - mean_x * mean_x;
+                const double variance_y = window[3 * out_width + i] - mean_y * mean_y;
+                const double covariance = window[4 * out_width + i] - mean_x * mean_y;
+                const double luminance = (2 * mean_x * mean_y + c1) / (mean_x * mean_x + mean_y * mean_y + c1);
+                const double contrast_structure = (2 * covariance + c2) / (variance_x + variance_y + c2);
+                sums.ssim += luminance * contrast_structure;
+                sums.contrast_structure += contrast_structure;
+            }
+            sums.count += out_width;
+        }
+        band_sums[band] = sums;
+    });
+
+    ssim_sums sums;
+    for (const auto& band : band_sums)
+    {
+        sums.ssim += band.ssim;
+        sums.contrast_structure += band.contrast_structure;
+        sums.count += band.count;
+    }
+    return sums;
+}
+
+
+// Halves a plane with a 2x2 box filter, dropping an odd last row or column.
+static vector<float> halve_plane(const vector<float>& plane, uint32_t width, uint32_t height)
+{
+    const uint32_t half_width = width / 2;
+    const uint32_t half_height = height / 2;
+    vector<float> half(static_cast<size_t>(half_width) * half_height);
+    for (uint32_t y = 0; y < half_height; y++)
+    {
+        const float* top = &plane[static_cast<size_t>(2 * y) * width];
+        const float* bottom = top + width;
+        for (uint32_t x = 0; x < half_width; x++)
+            half[static_cast<size_t>(y) * half_width + x] =
+                (top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1]) * 0.25f;
+    }
+    return half;
+}
+
+
+// Compares a distorted image with a reference of the same shape, returning the mean squared error of their samples on
+// a 0..1 scale, and their SSIM and MS-SSIM when asked for.
+expected<tuple<double, optional<double>, optional<double>>, string_view> image_quality(
+    binary reference,
+    binary distorted,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    bool ssim,
+    bool ms_ssim,
+    uint32_t num_threads)
+{
+    if (width == 0 || height == 0 || channels == 0 || channels > 4)
+        return std::unexpected("unsupported image shape");
+    if (bit_depth != 8 && bit_depth != 16 && bit_depth != 32)
+        return std::unexpected("unsupported bit depth");
+    const size_t size = static_cast<size_t>(width) * height * channels * (bit_depth / 8);
+    if (reference.size != size || distorted.size != size)
+        return std::unexpected("pixel data does not match the image shape");
+    if ((ssim || ms_ssim) && (width < SSIM_WINDOW || height < SSIM_WINDOW))
+        return std::unexpected("SSIM needs images of at least 11x11 pixels");
+    const uint32_t smallest_scale = 1u << (MS_SSIM_SCALES - 1);
+    if (ms_ssim && (width / smallest_scale < SSIM_WINDOW || height / smallest_scale < SSIM_WINDOW))
+        return std::unexpected("MS-SSIM needs images of at least 176x176 pixels");
+
+    try
+    {
+        const double mse = mean_squared_error(reference, distorted, width, height, channels, bit_depth, num_threads);
+        if (!ssim && !ms_ssim)
+            return make_tuple(mse, nullopt, nullopt);
+
+        auto x = quality_luma(reference, width, height, channels, bit_depth, num_threads);
+        auto y = quality_luma(distorted, width, height, channels, bit_depth, num_threads);
+        const auto full_scale = ssim_at_scale(x, y, width, height, num_threads);
+        const optional<double> ssim_value = ssim ? optional<double>(full_scale.ssim / full_scale.count) : nullopt;
+        if (!ms_ssim)
+            return make_tuple(mse, ssim_value, nullopt);
+
+        // contrast-structure terms of the four finer scales, and the full SSIM of the coarsest one; negative terms
+        // are clamped to 0 so that the weighted product stays real
+        double product = std::pow(std::max(0.0, full_scale.contrast_structure / full_scale.count), MS_SSIM_WEIGHTS[0]);
+        for (uint32_t scale = 1; scale < MS_SSIM_SCALES; scale++)
+        {
+            x = halve_plane(x, width, height);
+            y = halve_plane(y, width, height);
+            width /= 2;
+            height /= 2;
+            const auto sums = ssim_at_scale(x, y, width, height, num_threads);
+            const double term = scale + 1 < MS_SSIM_SCALES ? sums.contrast_structure : sums.ssim;
+            product *= std::pow(std::max(0.0, term / sums.count), MS_SSIM_WEIGHTS[scale]);
+        }
+        return make_tuple(mse, ssim_value, optional<double>(product));
+    }
+    catch (std::bad_alloc&)
+    {
+        return std::unexpected("out of memory");
+    }
+}
+
+
+// Cache of decoded images, keyed by the encoded bytes and the decode options. Hot images that are decoded over and over
+// cost a hash and a compare of their bytes instead of a full decode. It is empty and disabled until it's given a byte
+// budget.
+struct decode_cache_key
+{
+    uint64_t hash;
+    size_t size;
+    int format;
+    bool verify_checksums;
+    bool keep_palette;
+    crop_region crop;
+
+    bool operator==(const decode_cache_key& other) const
+    {
+        return hash == other.hash && size == other.size && format == other.format &&
+               verify_checksums == other.verify_checksums && keep_palette == other.keep_palette &&
+               crop.x == other.crop.x && crop.y == other.crop.y && crop.width == other.crop.width &&
+               crop.height == other.crop.height;
+    }
+};
+
+
+struct decode_cache_key_hash
+{
+    size_t operator()(const decode_cache_key& key) const
+    {
+        return key.hash;
+    }
+};
+
+
+// Fast non-cryptographic hash of the encoded bytes. Four independent lanes over 32-byte blocks keep several
+// multiplies in flight. Equal hashes are confirmed by comparing the bytes, so collisions cost a compare, not a wrong
+// image.
+static uint64_t content_hash(std::span<const uint8_t> bytes)
+{
+    constexpr uint64_t k = 0x9e3779b97f4a7c15ull;
+    const auto mix = [](uint64_t lane, uint64_t word) { return std::rotl((lane ^ word) * k, 29); };
+
+    std::array<uint64_t, 4> lanes{k, k * 3, k * 5, k * 7};
+    size_t i = 0;
+    for (; i + 32 <= bytes.size(); i += 32)
+    {
+        for (size_t j = 0; j < 4; j++)
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes.data() + i + j * 8, 8);
+            lanes[j] = mix(lanes[j], word);
+        }
+    }
+    for (size_t j = 0; i < bytes.size(); i += 8, j++)
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, bytes.data() + i, std::min<size_t>(8, bytes.size() - i));
+        lanes[j] = mix(lanes[j], word);
+    }
+
+    uint64_t hash = bytes.size() * k;
+    for (const uint64_t lane : lanes)
+        hash = (hash ^ lane) * k;
+    return hash ^ (hash >> 32);
+}
+
+
+struct cached_decode
+{
+    // the encoded bytes, to confirm a hash match
+    vector<uint8_t> input;
+    decompress_result_t result;
+    size_t size;
+};
+
+typedef shared_ptr<const cached_decode> cached_decode_ptr;
+
+
+// Cached pixels are handed out as resource binaries over this resource, which holds a reference to the entry. Entries
+// evicted while the VM still references their pixels stay alive until the last binary is garbage collected. It is a
+// raw NIF resource type because enif_make_resource_binary needs the resource object itself.
+static ErlNifResourceType* cached_decode_resource_type = nullptr;
+
+
+struct decode_cache
+{
+    std::mutex mutex;
+    std::list<tuple<decode_cache_key, cached_decode_ptr>> entries;  // most recently used first
+    std::unordered_map<decode_cache_key, decltype(entries)::iterator, decode_cache_key_hash> index;
+    size_t size = 0;
+    size_t max_size = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    cached_decode_ptr find(const decode_cache_key& key, std::span<const uint8_t> bytes)
+    {
+        std::lock_guard lock(mutex);
+        if (max_size == 0)
+            return nullptr;
+
+        auto it = index.find(key);
+        if (it == index.end() || !std::ranges::equal(std::get<1>(*it->second)->input, bytes))
+        {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        return std::get<1>(*it->second);
+    }
+
+    // Adds entry unless an equal one was added by a concurrent miss, and returns the one that is cached.
+    cached_decode_ptr insert(const decode_cache_key& key, cached_decode_ptr entry)
+    {
+        std::lock_guard lock(mutex);
+        if (entry->size > max_size)
+            return entry;
+        if (auto it = index.find(key); it != index.end())
+        {
+            if (std::ranges::equal(std::get<1>(*it->second)->input, entry->input))
+                return std::get<1>(*it->second);
+            remove(it->second);
+        }
+
+        entries.emplace_front(key, entry);
+        index.emplace(key, entries.begin());
+        size += entry->size;
+        evict();
+        return entry;
+    }
 
-    case jxl_box_kind::xml:
-        result.xml_boxes.push_back(std::move(box_data));
-        return {};
+    // The byte budget, which is 0 while the cache is disabled.
+    size_t limit()
+    {
+        std::lock_guard lock(mutex);
+        return max_size;
+    }
 
-    case jxl_box_kind::jumb:
-        result.jumb_boxes.push_back(std::move(box_data));
-        return {};
+    void resize(size_t new_max_size)
+    {
+        std::lock_guard lock(mutex);
+        max_size = new_max_size;
+        evict();
     }
 
-    return {};
+    void clear()
+    {
+        std::lock_guard lock(mutex);
+        entries.clear();
+        index.clear();
+        size = 0;
+    }
+
+private:
+    void remove(decltype(entries)::iterator it)
+    {
+        size -= std::get<1>(*it)->size;
+        index.erase(std::get<0>(*it));
+        entries.erase(it);
+    }
+
+    void evict()
+    {
+        while (size > max_size)
+        {
+            remove(std::prev(entries.end()));
+            evictions++;
+        }
+    }
+};
+
+
+static decode_cache global_decode_cache;
+
+
+static binary copy_binary(const binary& b)
+{
+    return binary::from_bytes(b.data, b.size);
 }
 
 
-static optional<array<char, 4>> jxl_box_type_from_atom(const atom& box_type_atom)
+static optional<binary> copy_binary(const optional<binary>& b)
 {
-    if (box_type_atom == "xml"sv)
-        return array<char, 4>{'x', 'm', 'l', ' '};
-    if (box_type_atom == "jumb"sv)
-        return array<char, 4>{'j', 'u', 'm', 'b'};
+    return b.has_value() ? optional(copy_binary(b.value())) : nullopt;
+}
 
-    return nullopt;
+
+static vector<binary> copy_binaries(const vector<binary>& binaries)
+{
+    vector<binary> copies;
+    for (const auto& b : binaries)
+        copies.push_back(copy_binary(b));
+    return copies;
 }
 
 
-// Collect all output from a JXL encoder into a vector.
-static expected<vector<uint8_t>, string_view> jxl_collect_compressed(JxlEncoder* enc)
+// A decoded image from the cache, returned without copying its pixels.
+struct cached_decode_ref
 {
-    vector<uint8_t> compressed(64);
-    uint8_t* next_out = compressed.data();
-    size_t avail_out = compressed.size();
-    JxlEncoderStatus process_result;
-    while (true)
-    {
-        process_result = JxlEncoderProcessOutput(enc, &next_out, &avail_out);
-        if (process_result != JXL_ENC_NEED_MORE_OUTPUT)
-            break;
-        size_t offset = next_out - compressed.data();
-        compressed.resize(compressed.size() * 2);
-        next_out = compressed.data() + offset;
-        avail_out = compressed.size() - offset;
-    }
-    compressed.resize(next_out - compressed.data());
-    if (process_result != JXL_ENC_SUCCESS)
+    cached_decode_ptr entry;
+};
+
+
+namespace expp
+{
+template <>
+struct type_cast<cached_decode_ref>
+{
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const cached_decode_ref& ref) noexcept
     {
-        fprintf(stderr, "JxlEncoderProcessOutput failed with status: %d\n", process_result);
-        return std::unexpected("JxlEncoderProcessOutput failed");
+        const auto& result = ref.entry->result;
+        void* object = enif_alloc_resource(cached_decode_resource_type, sizeof(cached_decode_ptr));
+        new (object) cached_decode_ptr(ref.entry);
+        ERL_NIF_TERM pixels = enif_make_resource_binary(env, object, result.pixels.data, result.pixels.size);
+        enif_release_resource(object);
+
+        // the metadata is small; copies keep the cached binaries from being handed to the VM
+        decompress_result_t metadata{
+            .pixels = binary{},
+            .width = result.width,
+            .height = result.height,
+            .channels = result.channels,
+            .bit_depth = result.bit_depth,
+            .exif = copy_binary(result.exif),
+            .text_chunks = result.text_chunks,
+            .xml_boxes = copy_binaries(result.xml_boxes),
+            .jumb_boxes = copy_binaries(result.jumb_boxes),
+            .palette = nullopt,
+            .xmp = copy_binary(result.xmp),
+            .icc_profile = copy_binary(result.icc_profile),
+            .app0_segments = copy_binaries(result.app0_segments),
+        };
+        if (result.palette.has_value())
+        {
+            const auto& [entries, palette_channels] = result.palette.value();
+            metadata.palette = make_tuple(copy_binary(entries), palette_channels);
+        }
+        return type_cast<decompress_result_t>::to_term(env, metadata, pixels);
     }
+};
+}  // namespace expp
 
-    return compressed;
+
+static size_t cached_decode_size(const cached_decode& entry)
+{
+    const auto& result = entry.result;
+    size_t size = sizeof(cached_decode) + entry.input.size() + result.pixels.size;
+    for (const auto* b : {&result.exif, &result.xmp, &result.icc_profile})
+        size += b->has_value() ? (*b)->size : 0;
+    for (const auto* binaries : {&result.xml_boxes, &result.jumb_boxes, &result.app0_segments})
+        for (const auto& b : *binaries)
+            size += b.size;
+    for (const auto& [keyword, compressed, language, text] : result.text_chunks)
+        size += keyword.size() + compressed.size() + language.size() + text.size();
+    if (result.palette.has_value())
+        size += std::get<0>(*result.palette).size;
+    return size;
 }
 
 
-JxlBasicInfo jxl_basic_info_from_pixel_format(const JxlPixelFormat& pixel_format)
+// Decodes a JPEG, PNG, JXL or WebP image through the decode cache. Cache hits share the cached pixels with the VM.
+expected<cached_decode_ref, string> decompress_cached(
+    binary bytes,
+    int format,
+    bool verify_checksums,
+    bool keep_palette,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height)
 {
-    JxlBasicInfo basic_info;
-    JxlEncoderInitBasicInfo(&basic_info);
-
-    switch (pixel_format.data_type)
+    const std::span<const uint8_t> input{bytes.data, bytes.size};
+    const crop_region crop{crop_x, crop_y, crop_width, crop_height};
+    // a disabled cache has nothing to look up, so the input is neither hashed nor copied
+    optional<decode_cache_key> key;
+    if (global_decode_cache.limit() != 0)
     {
-    case JXL_TYPE_FLOAT:
-        basic_info.bits_per_sample = 32;
-        basic_info.exponent_bits_per_sample = 8;
-        break;
-    case JXL_TYPE_FLOAT16:
-        basic_info.bits_per_sample = 16;
-        basic_info.exponent_bits_per_sample = 5;
-        break;
-    case JXL_TYPE_UINT8:
-        basic_info.bits_per_sample = 8;
-        basic_info.exponent_bits_per_sample = 0;
-        break;
-    case JXL_TYPE_UINT16:
-        basic_info.bits_per_sample = 16;
-        basic_info.exponent_bits_per_sample = 0;
-        break;
+        key = decode_cache_key{content_hash(input), input.size(), format, verify_checksums, keep_palette, crop};
+        if (auto entry = global_decode_cache.find(key.value(), input))
+            return cached_decode_ref{std::move(entry)};
     }
 
-    if (pixel_format.num_channels < 3)
-        basic_info.num_color_channels = 1;
-    else
-        basic_info.num_color_channels = 3;
+    auto result = decompress_blocking(
+        input, static_cast<image_format>(format), verify_checksums, keep_palette, true, crop);
+    if (!result.has_value())
+        return std::unexpected(std::move(result.error()));
 
-    if (pixel_format.num_channels == 2 || pixel_format.num_channels == 4)
-    {
-        basic_info.alpha_exponent_bits = basic_info.exponent_bits_per_sample;
-        basic_info.alpha_bits = basic_info.bits_per_sample;
-        basic_info.num_extra_channels = 1;
-    }
-    else
-    {
-        basic_info.alpha_exponent_bits = 0;
-        basic_info.alpha_bits = 0;
-    }
+    auto entry = std::make_shared<cached_decode>(cached_decode{{}, std::move(result.value()), 0});
+    entry->size = cached_decode_size(*entry) + input.size();
+    if (!key.has_value() || entry->size > global_decode_cache.limit())
+        return cached_decode_ref{std::move(entry)};
 
-    return basic_info;
+    entry->input.assign(input.begin(), input.end());
+    return cached_decode_ref{global_decode_cache.insert(key.value(), std::move(entry))};
 }
 
 
-expected<decompress_result_t, string_view> jxl_decompress(const binary& jxl_bytes)
-{
-    // Multi-threaded parallel runner.
-    static auto runner = JxlResizableParallelRunnerMake(nullptr);
+typedef tuple<uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t> decode_cache_stats_t;
 
-    auto dec = JxlDecoderMake(nullptr);
-    JXL_ENSURE_SUCCESS(
-        JxlDecoderSubscribeEvents,
-        dec.get(),
-        JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE | JXL_DEC_BOX);
-    JXL_ENSURE_SUCCESS(JxlDecoderSetParallelRunner, dec.get(), JxlResizableParallelRunner, runner.get());
-    JXL_ENSURE_SUCCESS(JxlDecoderSetDecompressBoxes, dec.get(), JXL_TRUE);
 
-    JXL_ENSURE_SUCCESS(JxlDecoderSetInput, dec.get(), jxl_bytes.data, jxl_bytes.size);
+// {hits, misses, evictions, entries, size, max_size}
+decode_cache_stats_t decode_cache_stats()
+{
+    auto& cache = global_decode_cache;
+    std::lock_guard lock(cache.mutex);
+    return make_tuple(cache.hits, cache.misses, cache.evictions, cache.index.size(), cache.size, cache.max_size);
+}
 
-    decompress_result_t result{};
-    uint32_t exponent_bits_per_sample = 0;
-    const constexpr size_t chunk_size = 0xffff;
-    jxl_box_kind current_box_kind = jxl_box_kind::none;
-    std::vector<uint8_t> current_box_data;
 
-    int need_more_input_retries = 0;
-    const int max_need_more_input_retries = 3;
+// Sets the byte budget of the decode cache, evicting the least recently used images that don't fit. 0 disables it.
+decode_cache_stats_t decode_cache_configure(uint64_t max_size)
+{
+    global_decode_cache.resize(max_size);
+    return decode_cache_stats();
+}
 
-    auto finish_current_box = [&]() -> expected<void, string_view> {
-        if (current_box_kind == jxl_box_kind::none)
-            return {};
 
-        optional<binary> box_data = finalize_jxl_box_data(current_box_data, dec.get());
-        if (!box_data.has_value())
-            return std::unexpected("invalid JXL metadata box");
+decode_cache_stats_t decode_cache_clear()
+{
+    global_decode_cache.clear();
+    return decode_cache_stats();
+}
 
-        if (auto append_result = append_jxl_box(result, current_box_kind, std::move(box_data.value()));
-            !append_result.has_value())
-            return std::unexpected(append_result.error());
 
-        current_box_kind = jxl_box_kind::none;
-        current_box_data.clear();
-        return {};
-    };
+// A term passed to or returned from a NIF as is, along with the env of the call: the pid of decode_budget_queue, and
+// the arguments of the async NIFs, which move them to the job's env with enif_make_copy instead of converting them.
+struct erl_term
+{
+    ErlNifEnv* env;
+    ERL_NIF_TERM term;
+};
 
-    for (;;)
+
+namespace expp
+{
+template <>
+struct type_cast<erl_term>
+{
+    static std::optional<erl_term> from_term(ErlNifEnv* env, ERL_NIF_TERM term) noexcept
     {
-        JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+        return erl_term{env, term};
+    }
+    static ERL_NIF_TERM to_term(ErlNifEnv*, const erl_term& value) noexcept
+    {
+        return value.term;
+    }
+};
+}  // namespace expp
 
-        if (status == JXL_DEC_ERROR)
-        {
-            return std::unexpected("Decoder error");
-        }
-        else if (status == JXL_DEC_NEED_MORE_INPUT)
-        {
-            if (++need_more_input_retries > max_need_more_input_retries)
-                return std::unexpected("Decoder requested more input but all input was already provided");
-            JxlDecoderReleaseInput(dec.get());
-            JxlDecoderSetInput(dec.get(), jxl_bytes.data, jxl_bytes.size);
-        }
-        else if (status == JXL_DEC_BASIC_INFO)
-        {
-            JxlBasicInfo info;
-            JXL_ENSURE_SUCCESS(JxlDecoderGetBasicInfo, dec.get(), &info);
 
-            if (info.exponent_bits_per_sample != 0)
-                return std::unexpected("FLOAT32 images are currently not yet supported");
+typedef tuple<uint64_t, uint64_t, uint64_t, uint64_t, uint64_t> decode_budget_stats_t;
 
-            result.width = info.xsize;
-            result.height = info.ysize;
-            result.channels = info.num_color_channels + info.num_extra_channels;
-            result.bit_depth = info.bits_per_sample;
-            exponent_bits_per_sample = info.exponent_bits_per_sample;
-        }
-        else if (status == JXL_DEC_COLOR_ENCODING)
-        {
-            // Color encoding event received; no action needed.
-        }
-        else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER)
-        {
-            JxlDataType data_type;
-            if (result.bit_depth == 8)
-                data_type = JXL_TYPE_UINT8;
-            else if (result.bit_depth == 16)
-            {
-                if (exponent_bits_per_sample > 0)
-                    data_type = JXL_TYPE_FLOAT;  // should be float16, but we're not going to worry about that for now
-                else
-                    data_type = JXL_TYPE_UINT16;
-            }
-            else if (result.bit_depth == 32)
-                data_type = JXL_TYPE_FLOAT;
-            else
-                return std::unexpected("unrecognized bit depth");
-            JxlPixelFormat format = {result.channels, data_type, JXL_NATIVE_ENDIAN, 0};
 
-            size_t buffer_size;
-            JXL_ENSURE_SUCCESS(JxlDecoderImageOutBufferSize, dec.get(), &format, &buffer_size);
-            if (buffer_size != result.width * result.height * result.channels * result.bit_depth / 8)
-                return std::unexpected("Invalid out buffer size");
-            result.pixels = binary{buffer_size};
-            JXL_ENSURE_SUCCESS(JxlDecoderSetImageOutBuffer, dec.get(), &format, result.pixels.data, result.pixels.size);
-        }
-        else if (status == JXL_DEC_BOX)
-        {
-            if (auto box_result = finish_current_box(); !box_result.has_value())
-                return std::unexpected(box_result.error());
+// {bytes_in_use, admitted, rejected, max_pixels, max_bytes}
+decode_budget_stats_t decode_budget_stats()
+{
+    auto& budget = global_decode_budget;
+    std::lock_guard lock(budget.mutex);
+    return make_tuple(budget.bytes_in_use, budget.admitted, budget.rejected, budget.max_pixels, budget.max_bytes);
+}
 
-            JxlBoxType box_type;
-            JXL_ENSURE_SUCCESS(JxlDecoderGetBoxType, dec.get(), box_type, JXL_TRUE);
-            optional<jxl_box_kind> next_box_kind = jxl_box_kind_from_type(box_type);
-            if (!next_box_kind.has_value())
-                continue;
 
-            current_box_kind = next_box_kind.value();
-            current_box_data.resize(chunk_size);
-            JxlDecoderSetBoxBuffer(dec.get(), current_box_data.data(), current_box_data.size());
-        }
-        else if (status == JXL_DEC_BOX_NEED_MORE_OUTPUT)
-        {
-            const size_t remaining = JxlDecoderReleaseBoxBuffer(dec.get());
-            const size_t output_pos = current_box_data.size() - remaining;
-            current_box_data.resize(current_box_data.size() + chunk_size);
-            JXL_ENSURE_SUCCESS(
-                JxlDecoderSetBoxBuffer,
-                dec.get(),
-                current_box_data.data() + output_pos,
-                current_box_data.size() - output_pos);
-        }
-        else if (status == JXL_DEC_FULL_IMAGE)
-        {
-            // Nothing to do. Do not yet return. If the image is an animation, more
-            // full frames may be decoded. This example only keeps the last one.
-        }
-        else if (status == JXL_DEC_SUCCESS)
-        {
-            if (auto box_result = finish_current_box(); !box_result.has_value())
-                return std::unexpected(box_result.error());
-            return result;
-        }
-        else
-        {
-            return std::unexpected(unexpected_jxl_decoder_status_message(status));
-        }
-    }
+// Sets the limits of the decode budget. 0 lifts a limit.
+decode_budget_stats_t decode_budget_configure(uint64_t max_pixels, uint64_t max_bytes, bool reject_when_exhausted)
+{
+    global_decode_budget.configure(max_pixels, max_bytes, reject_when_exhausted);
+    return decode_budget_stats();
 }
 
 
-expected<vector<uint8_t>, string_view> jxl_compress(
-    const binary& pixels,
-    uint32_t width,
-    uint32_t height,
-    uint32_t channels,
-    uint32_t bit_depth,
-    optional<binary> exif_binary,
-    optional<vector<pair<atom, binary>>> jxl_boxes,
-    double distance,
-    bool lossless,
-    int effort,
-    int progressive,
-    int order)
+// Tells the decode budget how many decodes Imagex.Budget has queued and whether the one it is retrying has its turn,
+// and has decode_budget_released sent to the given pid whenever a decode releases its share of the budget, or to no
+// one when it isn't a pid. Returns whether it is a pid. Imagex.Budget listens while decodes are queued.
+bool decode_budget_queue(erl_term pid, uint64_t waiting, bool turn_open)
 {
-    static auto runner = JxlThreadParallelRunnerMake(
-        /*memory_manager=*/nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+    return global_decode_budget.listen(pid.env, pid.term, waiting, turn_open);
+}
 
-    auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
-    JXL_ENSURE_SUCCESS(JxlEncoderSetParallelRunner, enc.get(), JxlThreadParallelRunner, runner.get());
 
-    if (exif_binary.has_value() || jxl_boxes.has_value())
-        JXL_ENSURE_SUCCESS(JxlEncoderUseBoxes, enc.get());
+// Whether Imagex.Budget has decodes queued, which a new decode joins rather than taking the budget ahead of them.
+bool decode_budget_queued()
+{
+    return global_decode_budget.queued();
+}
 
-    JxlPixelFormat pixel_format = {channels, bit_depth == 16 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
 
-    JxlBasicInfo basic_info = jxl_basic_info_from_pixel_format(pixel_format);
-    basic_info.xsize = width;
-    basic_info.ysize = height;
-    basic_info.uses_original_profile = lossless;
-    JXL_ENSURE_SUCCESS(JxlEncoderSetBasicInfo, enc.get(), &basic_info);
+typedef resource<shared_ptr<pixel_buffer>> pixel_buffer_resource_t;
 
-    JxlColorEncoding color_encoding = {};
-    const bool is_grayscale = pixel_format.num_channels < 3;
-    JxlColorEncodingSetToSRGB(&color_encoding, is_grayscale);
-    JXL_ENSURE_SUCCESS(JxlEncoderSetColorEncoding, enc.get(), &color_encoding);
 
-    auto encoder_options = JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
-    JXL_ENSURE_SUCCESS(JxlEncoderSetFrameLossless, encoder_options, lossless);
-    JXL_ENSURE_SUCCESS(JxlEncoderSetFrameDistance, encoder_options, distance);
-    JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_EFFORT, effort);
+// Decoded pixels in a pixel buffer are handed out as resource binaries over this resource, which holds a reference to
+// the storage, like cached_decode_resource_type does for cached images.
+static ErlNifResourceType* pixel_storage_resource_type = nullptr;
+
+
+// An image decoded into a pixel buffer, returned without copying its pixels.
+struct buffered_decode_ref
+{
+    pixel_storage_ptr storage;
+    size_t size;
+    decompress_result_t result;
+};
+
+
+namespace expp
+{
+template <>
+struct type_cast<buffered_decode_ref>
+{
+    static ERL_NIF_TERM to_term(ErlNifEnv* env, const buffered_decode_ref& ref) noexcept
+    {
+        void* object = enif_alloc_resource(pixel_storage_resource_type, sizeof(pixel_storage_ptr));
+        new (object) pixel_storage_ptr(ref.storage);
+        ERL_NIF_TERM pixels = enif_make_resource_binary(env, object, ref.storage->data.get(), ref.size);
+        enif_release_resource(object);
+        return type_cast<decompress_result_t>::to_term(env, ref.result, pixels);
+    }
+};
+}  // namespace expp
+
+
+// Marks a pixel buffer as being decoded into for as long as it is in scope, so that concurrent decodes into the same
+// buffer fail instead of writing over each other.
+struct pixel_buffer_lock
+{
+    pixel_buffer& buffer;
+    bool locked;
+
+    explicit pixel_buffer_lock(pixel_buffer& buffer) :
+        buffer(buffer),
+        locked(!buffer.in_use.exchange(true))
+    {}
+
+    ~pixel_buffer_lock()
+    {
+        if (locked)
+            buffer.in_use = false;
+    }
+};
+
 
-    if (progressive > 0)
+expected<pixel_buffer_resource_t, string> pixel_buffer_new(uint64_t capacity)
+{
+    if (capacity == 0)
+        return std::unexpected("pixel buffer capacity must be positive"s);
+    try
     {
-        JXL_ENSURE_SUCCESS(
-            JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, progressive);
-        JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC, 1);
+        return pixel_buffer_resource_t::alloc(std::make_shared<pixel_buffer>(capacity));
     }
-
-    if (order > 0)
+    catch (codec_error& e)
     {
-        JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_GROUP_ORDER, order);
+        // the storage is reserved in the decode budget like the pixels of a decode
+        return std::unexpected(std::move(e.message));
     }
-
-    if (exif_binary.has_value())
+    catch (std::bad_alloc&)
     {
-        const JxlBoxType exif_box_type = {'E', 'x', 'i', 'f'};
-        vector<uint8_t> exif_box(4 + exif_binary->size);
-        exif_box[0] = exif_box[1] = exif_box[2] = exif_box[3] = 0;
-        std::copy_n(exif_binary->data, exif_binary->size, exif_box.data() + 4);
-        JXL_ENSURE_SUCCESS(JxlEncoderAddBox, enc.get(), exif_box_type, exif_box.data(), exif_box.size(), JXL_FALSE);
+        return std::unexpected("out of memory"s);
     }
+}
 
-    if (jxl_boxes.has_value())
-    {
-        for (const auto& [box_type_atom, box_contents] : jxl_boxes.value())
-        {
-            optional<array<char, 4>> box_type = jxl_box_type_from_atom(box_type_atom);
-            if (!box_type.has_value())
-                return std::unexpected("unsupported JXL metadata box type");
 
-            JXL_ENSURE_SUCCESS(
-                JxlEncoderAddBox, enc.get(), box_type->data(), box_contents.data, box_contents.size, JXL_FALSE);
-        }
-    }
+// The size of the buffer's storage, which grows to fit the largest image decoded into it.
+uint64_t pixel_buffer_capacity(pixel_buffer_resource_t buffer_resource)
+{
+    return buffer_resource.get()->capacity;
+}
 
-    JXL_ENSURE_SUCCESS(JxlEncoderAddImageFrame, encoder_options, &pixel_format, pixels.data, pixels.size);
-    JxlEncoderCloseInput(enc.get());
 
-    return jxl_collect_compressed(enc.get());
+template <typename Decode>
+static expected<buffered_decode_ref, string> decode_into_buffer(pixel_buffer& buffer, Decode&& decode)
+{
+    pixel_buffer_lock lock(buffer);
+    if (!lock.locked)
+        return std::unexpected("pixel buffer is in use by another decode"s);
+
+    auto result = decode(&buffer);
+    if (!result.has_value())
+        return std::unexpected(string(result.error()));
+    return buffered_decode_ref{buffer.storage, buffer.size, std::move(result.value())};
 }
 
 
-expected<vector<uint8_t>, string_view> jxl_transcode_from_jpeg(
-    const binary& jpeg_bytes, int effort, int store_jpeg_metadata)
+// Decodes a JPEG, PNG or JXL image into a pixel buffer; the crop region only applies to JPEG.
+expected<buffered_decode_ref, string> decompress_into(
+    pixel_buffer_resource_t buffer_resource,
+    binary bytes,
+    int format,
+    bool verify_checksums,
+    bool keep_palette,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height,
+    uint32_t metadata)
 {
-    auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
+    return decode_into_buffer(*buffer_resource.get(), [&](pixel_buffer* into) {
+        return decompress_blocking(
+            {bytes.data, bytes.size},
+            static_cast<image_format>(format),
+            verify_checksums,
+            keep_palette,
+            true,
+            crop_region{crop_x, crop_y, crop_width, crop_height},
+            into,
+            metadata);
+    });
+}
 
-    JXL_ENSURE_SUCCESS(JxlEncoderUseContainer, enc.get(), JXL_TRUE);
-    JXL_ENSURE_SUCCESS(JxlEncoderStoreJPEGMetadata, enc.get(), JXL_TRUE);
 
-    auto encoder_options = JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
-    JXL_ENSURE_SUCCESS(JxlEncoderStoreJPEGMetadata, enc.get(), store_jpeg_metadata);
-    JXL_ENSURE_SUCCESS(JxlEncoderFrameSettingsSetOption, encoder_options, JXL_ENC_FRAME_SETTING_EFFORT, effort);
-    JXL_ENSURE_SUCCESS(JxlEncoderAddJPEGFrame, encoder_options, jpeg_bytes.data, jpeg_bytes.size);
-    JxlEncoderCloseInput(enc.get());
+expected<buffered_decode_ref, string> decompress_mapped_into(
+    pixel_buffer_resource_t buffer_resource,
+    mapped_file_resource_t file_resource,
+    int format,
+    bool verify_checksums,
+    bool keep_palette,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height,
+    uint32_t metadata)
+{
+    return decode_into_buffer(*buffer_resource.get(), [&](pixel_buffer* into) {
+        return decompress_blocking(
+            file_resource.get()->bytes(),
+            static_cast<image_format>(format),
+            verify_checksums,
+            keep_palette,
+            true,
+            crop_region{crop_x, crop_y, crop_width, crop_height},
+            into,
+            metadata);
+    });
+}
 
-    return jxl_collect_compressed(enc.get());
+
+// Renders a TIFF page, or the crop region of it, into a pixel buffer.
+expected<buffered_decode_ref, string> tiff_render_page_into(
+    pixel_buffer_resource_t buffer_resource,
+    tiff_resource_t document_resource,
+    int page_index,
+    uint32_t crop_x,
+    uint32_t crop_y,
+    uint32_t crop_width,
+    uint32_t crop_height)
+{
+    return decode_into_buffer(*buffer_resource.get(), [&](pixel_buffer* into) {
+        return tiff_render_page_impl(
+            document_resource.get().tiff, page_index, crop_region{crop_x, crop_y, crop_width, crop_height}, into);
+    });
 }
 
 
-expected<vector<uint8_t>, string_view> jxl_transcode_to_jpeg(const binary& jxl_bytes)
+// Async execution: heavy calls can be queued on an imagex-owned thread pool instead of holding a dirty scheduler for
+// their whole duration. The caller gets a handle back right away, and the worker sends {ref, result} to it when done.
+enum class async_priority : int
 {
-    // Multi-threaded parallel runner.
-    static auto runner = JxlResizableParallelRunnerMake(nullptr);
+    high = 0,
+    normal,
+    low,
+};
 
-    auto dec = JxlDecoderMake(nullptr);
-    JXL_ENSURE_SUCCESS(JxlDecoderSubscribeEvents, dec.get(), JXL_DEC_FULL_IMAGE | JXL_DEC_JPEG_RECONSTRUCTION);
-    JXL_ENSURE_SUCCESS(JxlDecoderSetParallelRunner, dec.get(), JxlResizableParallelRunner, runner.get());
 
-    JxlDecoderSetInput(dec.get(), jxl_bytes.data, jxl_bytes.size);
+// Jobs that can be queued before submissions are rejected.
+constexpr size_t ASYNC_QUEUE_DEPTH = 256;
 
-    vector<uint8_t> jpeg_bytes;
 
-    for (;;)
+// Returned to the caller as a resource that monitors it. A job that no worker has picked up yet is dropped from the
+// queue when the caller exits, so abandoned jobs don't fill it up.
+struct async_handle_t
+{
+    atomic<bool> cancelled = false;
+    ErlNifMonitor monitor;
+};
+
+static ErlNifResourceType* async_handle_resource_type = nullptr;
+
+
+struct async_job_t
+{
+    // builds the result term in env, from the arguments copied into it
+    std::move_only_function<ERL_NIF_TERM(ErlNifEnv*)> work;
+    // process-independent env that holds the copied arguments, the caller's ref and the reply
+    ErlNifEnv* env;
+    ErlNifPid caller;
+    ERL_NIF_TERM ref;
+    // kept until the job is done
+    async_handle_t* handle;
+};
+
+
+// Frees a job that won't run, or has run. env is the env of the calling thread, or null on the worker threads.
+static void async_job_release(async_job_t& job, ErlNifEnv* env)
+{
+    enif_demonitor_process(env, job.handle, &job.handle->monitor);
+    enif_release_resource(job.handle);
+    enif_free_env(job.env);
+}
+
+
+template <typename T, typename E>
+static ERL_NIF_TERM async_result_to_term(ErlNifEnv* env, const expected<T, E>& result)
+{
+    if (result.has_value())
+        return enif_make_tuple2(env, enif_make_atom(env, "ok"), type_cast<T>::to_term(env, result.value()));
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), type_cast<E>::to_term(env, result.error()));
+}
+
+
+static ERL_NIF_TERM async_error_to_term(ErlNifEnv* env, string_view message)
+{
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), type_cast<string_view>::to_term(env, message));
+}
+
+
+class async_pool
+{
+public:
+    static async_pool& instance()
     {
-        JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+        static async_pool pool;
+        return pool;
+    }
 
-        if (status == JXL_DEC_ERROR)
-        {
-            return std::unexpected("Decoder error");
-        }
-        else if (status == JXL_DEC_NEED_MORE_INPUT)
-        {
-            return std::unexpected("Error, already provided all input");
-        }
-        else if (status == JXL_DEC_JPEG_RECONSTRUCTION)
-        {
-            jpeg_bytes.resize(static_cast<size_t>(jxl_bytes.size * 1.5));
-            JxlDecoderSetJPEGBuffer(dec.get(), jpeg_bytes.data(), jpeg_bytes.size());
-        }
-        else if (status == JXL_DEC_JPEG_NEED_MORE_OUTPUT)
-        {
-            const size_t existing_size = jpeg_bytes.size();
-            jpeg_bytes.resize(static_cast<size_t>(existing_size * 1.5));
-            const size_t bytes_unwritten = JxlDecoderReleaseJPEGBuffer(dec.get());
-            const size_t bytes_already_written = existing_size - bytes_unwritten;
-            if (bytes_already_written != 0)
-                return std::unexpected("JXL JPEG transcode: unexpected partial write after buffer resize");
-            JxlDecoderSetJPEGBuffer(dec.get(), jpeg_bytes.data(), jpeg_bytes.size());
-        }
-        else if (status == JXL_DEC_FULL_IMAGE)
-        {
-            // resize the vector back to the written size
-            const size_t bytes_unwritten = JxlDecoderReleaseJPEGBuffer(dec.get());
-            jpeg_bytes.resize(jpeg_bytes.size() - bytes_unwritten);
-        }
-        else if (status == JXL_DEC_SUCCESS)
+    expected<void, string_view> submit(async_job_t job, async_priority priority)
+    {
+        std::lock_guard lock(mutex);
+        if (num_queued >= ASYNC_QUEUE_DEPTH)
+            return std::unexpected("async queue is full");
+
+        // the workers are started on first use, and live until the library is unloaded
+        if (threads.empty())
         {
-            // All decoding successfully finished.
-            return jpeg_bytes;
+            stopping = false;
+            const unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned i = 0; i < num_threads; i++)
+            {
+                ErlNifTid tid;
+                if (enif_thread_create(const_cast<char*>("imagex_async"), &tid, thread_main, this, nullptr) != 0)
+                    break;
+                threads.push_back(tid);
+            }
+            if (threads.empty())
+                return std::unexpected("couldn't start the async worker threads");
         }
-        else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER)
+
+        queues[static_cast<size_t>(priority)].push_back(std::move(job));
+        num_queued++;
+        ready.notify_one();
+        return {};
+    }
+
+    // Drops the job of handle if no worker has picked it up yet.
+    void cancel(async_handle_t* handle, ErlNifEnv* env)
+    {
+        std::lock_guard lock(mutex);
+        for (auto& queue : queues)
         {
-            return std::unexpected("Cannot transcode to JPEG: image was not originally transcoded from JPEG");
+            auto job = std::find_if(queue.begin(), queue.end(), [&](const auto& j) { return j.handle == handle; });
+            if (job != queue.end())
+            {
+                async_job_release(*job, env);
+                queue.erase(job);
+                num_queued--;
+                return;
+            }
         }
-        else
+    }
+
+    // Drops the jobs that haven't started, and joins the workers once they finish the ones that have.
+    void shutdown(ErlNifEnv* env)
+    {
+        vector<ErlNifTid> workers;
         {
-            return std::unexpected(unexpected_jxl_decoder_status_message(status));
+            std::lock_guard lock(mutex);
+            stopping = true;
+            for (auto& queue : queues)
+            {
+                for (auto& job : queue)
+                    async_job_release(job, env);
+                queue.clear();
+            }
+            num_queued = 0;
+            workers = std::exchange(threads, {});
         }
+        ready.notify_all();
+        for (ErlNifTid tid : workers)
+            enif_thread_join(tid, nullptr);
     }
-}
 
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    array<std::deque<async_job_t>, 3> queues;
+    size_t num_queued = 0;
+    bool stopping = false;
+    vector<ErlNifTid> threads;
 
-struct TIFFWrapper
-{
-    TIFF* tiff;
-    unique_ptr<stringstream> sstream;
+    static void* thread_main(void* pool)
+    {
+        static_cast<async_pool*>(pool)->run();
+        return nullptr;
+    }
 
-    TIFFWrapper(TIFF* tiff, unique_ptr<stringstream> sstream) :
-        tiff(tiff),
-        sstream(std::move(sstream))
-    {}
+    // Pops the oldest job of the highest priority available, or returns nullopt once the pool is shutting down.
+    optional<async_job_t> next_job()
+    {
+        std::unique_lock lock(mutex);
+        ready.wait(lock, [this] { return num_queued > 0 || stopping; });
+        if (stopping)
+            return nullopt;
+        auto& queue = *std::find_if(queues.begin(), queues.end(), [](const auto& q) { return !q.empty(); });
+        async_job_t job = std::move(queue.front());
+        queue.pop_front();
+        num_queued--;
+        return job;
+    }
 
-    ~TIFFWrapper()
+    void run()
     {
-        TIFFClose(this->tiff);
+        while (optional<async_job_t> job = next_job())
+        {
+            if (!job->handle->cancelled.load())
+            {
+                ERL_NIF_TERM result;
+                try
+                {
+                    result = job->work(job->env);
+                }
+                catch (...)
+                {
+                    result = async_error_to_term(job->env, current_exception_message());
+                }
+                enif_send(nullptr, &job->caller, job->env, enif_make_tuple2(job->env, job->ref, result));
+            }
+            async_job_release(job.value(), nullptr);
+        }
     }
 };
 
 
-typedef resource<std::unique_ptr<poppler::document>> pdf_resource_t;
-
-
-expected<tuple<pdf_resource_t, int>, string_view> pdf_load_document(binary bytes)
+// The caller of a job exited: the job is dropped if it is still queued, and skipped if a worker took it but hasn't
+// started it.
+static void async_handle_down(ErlNifEnv* env, void* object, ErlNifPid*, ErlNifMonitor*)
 {
-    // load document from bytes and check for errors
-    vector<char> buf(bytes.data, bytes.data + bytes.size);
-    unique_ptr<poppler::document> document(poppler::document::load_from_data(&buf));
-    if (!document)
-        return std::unexpected("invalid pdf file");
-    if (document->is_locked())
-        return std::unexpected("document is locked");
-
-    const auto num_pages = document->pages();
-    return make_tuple(pdf_resource_t::alloc(std::move(document)), num_pages);
+    auto* handle = static_cast<async_handle_t*>(object);
+    handle->cancelled.store(true);
+    async_pool::instance().cancel(handle, env);
 }
 
 
-expected<decompress_result_t, string_view> pdf_render_page(pdf_resource_t document_resource, int page_idx, int dpi)
+// Queues work for the calling process, which gets {ref, result} back. args are the terms that work reads, copied into
+// the job's env, which refc binaries are without copying their bytes.
+template <size_t N, typename Work>
+static expected<erl_term, string_view> async_submit(
+    const erl_term& ref, int priority, const array<ERL_NIF_TERM, N>& args, Work work)
 {
-    auto& document = document_resource.get();
-    if (page_idx < 0 || page_idx >= document->pages())
-        throw std::invalid_argument("page index out of range");
-
-    unique_ptr<poppler::page> page(document->create_page(page_idx));
-    poppler::page_renderer renderer;
-    renderer.set_render_hints(
-        poppler::page_renderer::antialiasing | poppler::page_renderer::text_antialiasing |
-        poppler::page_renderer::text_hinting);
-    auto image = renderer.render_page(page.get(), dpi, dpi);
-    if (!image.is_valid())
-        return std::unexpected("failed to render a valid image");
-
-    uint32_t height = image.height();
-    uint32_t width = image.width();
-    binary pixels = binary::from_bytes(image.data(), height * image.bytes_per_row());
-    uint32_t channels = image.bytes_per_row() / width;
-
-    const auto format = image.format();
-    if (format == poppler::image::format_invalid)
-        return std::unexpected("Invalid image format");
-    else if (format == poppler::image::format_mono)
-        return std::unexpected("Mono images not supported right now");
-    else if (format == poppler::image::format_bgr24 || format == poppler::image::format_argb32)
+    if (priority < static_cast<int>(async_priority::high) || priority > static_cast<int>(async_priority::low))
+        return std::unexpected("invalid async priority");
+    if (!enif_is_ref(ref.env, ref.term))
+        return std::unexpected("invalid async reply ref");
+
+    async_job_t job{.env = enif_alloc_env()};
+    enif_self(ref.env, &job.caller);
+    job.ref = enif_make_copy(job.env, ref.term);
+    array<ERL_NIF_TERM, N> copies;
+    for (size_t i = 0; i < N; i++)
+        copies[i] = enif_make_copy(job.env, args[i]);
+    job.work = [work = std::move(work), copies](ErlNifEnv* env) mutable { return work(env, copies); };
+
+    // the reference from enif_alloc_resource is the job's, and the caller gets its own with the term
+    auto* handle = new (enif_alloc_resource(async_handle_resource_type, sizeof(async_handle_t))) async_handle_t();
+    const ERL_NIF_TERM handle_term = enif_make_resource(ref.env, handle);
+    job.handle = handle;
+    ErlNifEnv* env = job.env;
+    if (enif_monitor_process(ref.env, handle, &job.caller, &handle->monitor) != 0)
     {
-        // convert bgr to rgb
-        for (uint32_t i = 0; i < pixels.size; i += channels)
-            std::swap(pixels.data[i], pixels.data[i + 2]);
+        enif_release_resource(handle);
+        enif_free_env(env);
+        return std::unexpected("couldn't monitor the calling process");
     }
 
-    return decompress_result_t{
-        .pixels = std::move(pixels),
-        .width = width,
-        .height = height,
-        .channels = channels,
-        .bit_depth = 8u,
-    };
+    if (auto submitted = async_pool::instance().submit(std::move(job), static_cast<async_priority>(priority));
+        !submitted.has_value())
+    {
+        enif_demonitor_process(ref.env, handle, &handle->monitor);
+        enif_release_resource(handle);
+        enif_free_env(env);
+        return std::unexpected(submitted.error());
+    }
+    return erl_term{ref.env, handle_term};
 }
 
-typedef resource<TIFFWrapper> tiff_resource_t;
 
-expected<tuple<tiff_resource_t, int>, string_view> tiff_load_document(binary bytes)
+// The bytes of a binary that async_submit copied into the job's env, which keeps them alive.
+static std::span<const uint8_t> async_binary(ErlNifEnv* env, ERL_NIF_TERM term)
 {
-    // load document from bytes and check for errors
-    auto sstream = make_unique<stringstream>();
-    sstream->write(reinterpret_cast<char*>(bytes.data), bytes.size);
-    auto document = TIFFStreamOpen("file.tiff", reinterpret_cast<std::istream*>(sstream.get()));
-    if (!document)
-        return std::unexpected("invalid tiff file");
+    ErlNifBinary bin;
+    if (!enif_inspect_binary(env, term, &bin))
+        throw codec_error("expected a binary");
+    return {bin.data, bin.size};
+}
 
-    int num_pages = 0;
-    do
-    {
-        num_pages++;
-    } while (TIFFReadDirectory(document));
 
-    return make_tuple(tiff_resource_t::alloc(document, std::move(sstream)), num_pages);
+// retry is set when Imagex.Budget runs the job again in its turn, which it may take ahead of the decodes it queued.
+expected<erl_term, string_view> decompress_async(
+    erl_term ref, int priority, erl_term bytes, uint32_t metadata, bool retry)
+{
+    return async_submit(ref, priority, array{bytes.term}, [metadata, retry](ErlNifEnv* env, const auto& args) {
+        const budget_turn_scope turn(retry);
+        return type_cast<batch_decompress_item_t>::to_term(
+            env, decompress_batch_item(async_binary(env, args[0]), metadata));
+    });
 }
 
 
-expected<decompress_result_t, string_view> tiff_render_page(tiff_resource_t document_resource, int page_index)
+expected<erl_term, string_view> jxl_compress_async(
+    erl_term ref,
+    int priority,
+    erl_term pixels,
+    uint32_t width,
+    uint32_t height,
+    uint32_t channels,
+    uint32_t bit_depth,
+    optional<binary> exif_binary,
+    optional<vector<pair<atom, binary>>> jxl_boxes,
+    double distance,
+    bool lossless,
+    int effort,
+    int progressive,
+    int order)
 {
-    auto& [document, _] = document_resource.get();
+    // the metadata is small and converted already, so the worker gets copies of it rather than of its terms
+    optional<binary> exif_copy;
+    if (exif_binary.has_value())
+        exif_copy = binary::from_bytes(exif_binary->data, exif_binary->size);
 
-    if (!TIFFSetDirectory(document, page_index))
-        return std::unexpected("failed to set TIFF directory");
+    optional<vector<pair<atom, binary>>> boxes_copy;
+    if (jxl_boxes.has_value())
+    {
+        boxes_copy.emplace();
+        for (const auto& [box_type, box_data] : jxl_boxes.value())
+            boxes_copy->emplace_back(box_type, binary::from_bytes(box_data.data, box_data.size));
+    }
 
-    int width = 0, height = 0;
-    if (!TIFFGetField(document, TIFFTAG_IMAGEWIDTH, &width))
-        return std::unexpected("failed to read TIFF image width");
-    if (!TIFFGetField(document, TIFFTAG_IMAGELENGTH, &height))
-        return std::unexpected("failed to read TIFF image height");
-    if (width <= 0 || height <= 0)
-        return std::unexpected("invalid TIFF image dimensions");
+    return async_submit(
+        ref,
+        priority,
+        array{pixels.term},
+        [=, exif_binary = std::move(exif_copy), jxl_boxes = std::move(boxes_copy)](
+            ErlNifEnv* env, const auto& args) {
+            return async_result_to_term(
+                env,
+                jxl_compress_impl(
+                    async_binary(env, args[0]),
+                    width,
+                    height,
+                    channels,
+                    bit_depth,
+                    exif_binary,
+                    jxl_boxes,
+                    distance,
+                    lossless,
+                    effort,
+                    progressive,
+                    order));
+        });
+}
 
-    binary pixels{static_cast<size_t>(width * height * 4)};
-    TIFFReadRGBAImageOriented(document, width, height, reinterpret_cast<uint32_t*>(pixels.data), 1, 0);
 
-    return decompress_result_t{
-        .pixels = std::move(pixels),
-        .width = static_cast<uint32_t>(width),
-        .height = static_cast<uint32_t>(height),
-        .channels = 4u,
-        .bit_depth = 8u,
-    };
+expected<erl_term, string_view> pdf_render_page_async(
+    erl_term ref, int priority, pdf_resource_t document_resource, int page_idx, int dpi, bool retry)
+{
+    return async_submit(ref, priority, array<ERL_NIF_TERM, 0>{}, [=](ErlNifEnv* env, const auto&) {
+        const budget_turn_scope turn(retry);
+        return async_result_to_term(env, pdf_render_page(document_resource, page_idx, dpi));
+    });
 }
 
 
@@ -1223,26 +8537,107 @@ int load(ErlNifEnv* caller_env, void** priv_data, ERL_NIF_TERM load_info)
     pdf_resource_t::init(caller_env, "poppler");
     tiff_resource_t::init(caller_env, "tiff");
     yielding_resource_t::init(caller_env, "yielding_generator");
+    decoder_resource_t::init(caller_env, "incremental_decoder");
+    encoder_resource_t::init(caller_env, "incremental_encoder");
+    pyramid_resource_t::init(caller_env, "tile_pyramid");
+    mapped_file_resource_t::init(caller_env, "mapped_file");
+    pixel_buffer_resource_t::init(caller_env, "pixel_buffer");
+    pixel_storage_resource_type = enif_open_resource_type(
+        caller_env,
+        nullptr,
+        "pixel_storage",
+        [](ErlNifEnv*, void* object) { static_cast<pixel_storage_ptr*>(object)->~pixel_storage_ptr(); },
+        ERL_NIF_RT_CREATE,
+        nullptr);
+    cached_decode_resource_type = enif_open_resource_type(
+        caller_env,
+        nullptr,
+        "cached_decode",
+        [](ErlNifEnv*, void* object) { static_cast<cached_decode_ptr*>(object)->~cached_decode_ptr(); },
+        ERL_NIF_RT_CREATE,
+        nullptr);
+    ErlNifResourceTypeInit async_handle_init{
+        .dtor = [](ErlNifEnv*, void* object) { static_cast<async_handle_t*>(object)->~async_handle_t(); },
+        .stop = nullptr,
+        .down = async_handle_down,
+    };
+    async_handle_resource_type =
+        enif_open_resource_type_x(caller_env, "async_handle", &async_handle_init, ERL_NIF_RT_CREATE, nullptr);
     TIFFSetWarningHandler(nullptr);
 
     return 0;
 }
 
 
+void unload(ErlNifEnv* caller_env, void* priv_data)
+{
+    async_pool::instance().shutdown(caller_env);
+    global_decode_budget.shutdown();
+}
+
+
 MODULE(
     Elixir.Imagex.C,
     load,
     nullptr,
-    nullptr,
+    unload,
     def(jpeg_decompress, DirtyFlags::DirtyCpu),
     def(jpeg_compress, DirtyFlags::DirtyCpu),
+    def(jpeg_compress_to_size, DirtyFlags::DirtyCpu),
     def(png_decompress, DirtyFlags::DirtyCpu),
     def(png_compress, DirtyFlags::DirtyCpu),
     def(jxl_decompress, DirtyFlags::DirtyCpu),
     def(jxl_compress, DirtyFlags::DirtyCpu),
+    def(jxl_compress_to_size, DirtyFlags::DirtyCpu),
     def(jxl_transcode_from_jpeg, DirtyFlags::DirtyCpu),
     def(jxl_transcode_to_jpeg, DirtyFlags::DirtyCpu),
+    def(webp_decompress, DirtyFlags::DirtyCpu),
+    def(webp_compress, DirtyFlags::DirtyCpu),
     def(pdf_load_document, DirtyFlags::DirtyCpu),
     def(pdf_render_page, DirtyFlags::DirtyCpu),
     def(tiff_load_document, DirtyFlags::DirtyCpu),
-    def(tiff_render_page, DirtyFlags::DirtyCpu), )
+    def(tiff_render_page, DirtyFlags::DirtyCpu),
+    def(tiff_page_size, DirtyFlags::DirtyCpu),
+    def(read_metadata, DirtyFlags::DirtyCpu),
+    def(jpeg_transform, DirtyFlags::DirtyCpu),
+    def(decompress_batch, DirtyFlags::DirtyCpu),
+    def(convert_pixels, DirtyFlags::DirtyCpu),
+    def(decompress_into_batch, DirtyFlags::DirtyCpu),
+    def(image_hash, DirtyFlags::DirtyCpu),
+    def(image_hash_batch, DirtyFlags::DirtyCpu),
+    def(pixels_hash, DirtyFlags::DirtyCpu),
+    def(image_quality, DirtyFlags::DirtyCpu),
+    def(decompress_cached, DirtyFlags::DirtyCpu),
+    def(decode_cache_configure, DirtyFlags::DirtyCpu),
+    def(decode_cache_clear, DirtyFlags::DirtyCpu),
+    def(decode_cache_stats),
+    def(decode_budget_configure),
+    def(decode_budget_stats),
+    def(decode_budget_queue),
+    def(decode_budget_queued),
+    def(pixel_buffer_new, DirtyFlags::DirtyCpu),
+    def(pixel_buffer_capacity),
+    def(decompress_into, DirtyFlags::DirtyCpu),
+    def(decompress_mapped_into, DirtyFlags::DirtyCpu),
+    def(tiff_render_page_into, DirtyFlags::DirtyCpu),
+    def(decompress_async),
+    def(jxl_compress_async),
+    def(pdf_render_page_async),
+    def(decoder_new),
+    def(decoder_push, DirtyFlags::DirtyCpu),
+    def(decoder_finish, DirtyFlags::DirtyCpu),
+    def(jpeg_encoder_new, DirtyFlags::DirtyCpu),
+    def(png_encoder_new, DirtyFlags::DirtyCpu),
+    def(encoder_push, DirtyFlags::DirtyCpu),
+    def(encoder_finish, DirtyFlags::DirtyCpu),
+    def(pyramid_new),
+    def(pyramid_open_jpeg, DirtyFlags::DirtyCpu),
+    def(pyramid_push, DirtyFlags::DirtyCpu),
+    def(pyramid_read, DirtyFlags::DirtyCpu),
+    def(pyramid_finish, DirtyFlags::DirtyCpu),
+    def(open_path, DirtyFlags::DirtyIO),
+    def(decompress_mapped, DirtyFlags::DirtyCpu),
+    def(decompress_preview, DirtyFlags::DirtyCpu),
+    def(decompress_mapped_preview, DirtyFlags::DirtyCpu),
+    def(pdf_load_mapped, DirtyFlags::DirtyCpu),
+    def(tiff_load_mapped, DirtyFlags::DirtyCpu), )
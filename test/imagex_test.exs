@@ -60,6 +60,39 @@ defmodule ImagexTest do
                byte_size(source_image.metadata.exif.ifd1.thumbnail_data)
     end
 
+    test "decode image captures metadata segments anywhere before the scan" do
+      # the XMP segment comes after SOF here
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(File.read!("test/assets/exif/gps/DSCN0010.jpg"), format: :jpeg)
+      assert metadata.exif.ifd0.make == "NIKON"
+      assert String.contains?(metadata.xmp, "x:xmpmeta")
+
+      jpeg_bytes = File.read!("test/assets/exif/exif-jpeg-thumbnail-sony-dsc-p150-inverted-colors.jpg")
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(jpeg_bytes, format: :jpeg)
+      {:ok, %{icc_profile: icc_profile}} = Imagex.read_metadata(jpeg_bytes)
+      assert metadata.icc_profile == icc_profile
+    end
+
+    test "decode image keeps jfif metadata" do
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(File.read!("test/assets/lena.jpg"), format: :jpeg)
+      assert metadata.jfif.version_major == 1
+      assert Map.has_key?(metadata, :exif)
+    end
+
+    test "encode image preserves icc profile", %{image: test_image} do
+      # larger than a single APP2 segment
+      icc_profile = :binary.copy(<<1, 2, 3, 4>>, 25_000)
+      image = %Image{tensor: test_image.tensor, metadata: %{icc_profile: icc_profile}}
+
+      {:ok, compressed_bytes} = Imagex.encode(image, :jpeg)
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(compressed_bytes, format: :jpeg)
+      assert metadata.icc_profile == icc_profile
+    end
+
+    test "encode image returns error for malformed icc profile", %{image: test_image} do
+      image = %Image{tensor: test_image.tensor, metadata: %{icc_profile: 42}}
+      assert {:error, "ICC profile must be a binary, got: 42"} = Imagex.encode(image, :jpeg)
+    end
+
     test "encode image returns error for unsupported exif values", %{image: test_image} do
       image = %Image{tensor: test_image.tensor, metadata: %{exif: %{ifd0: %{orientation: %{bad: true}}}}}
 
@@ -73,6 +106,97 @@ defmodule ImagexTest do
       assert {:error, "EXIF metadata must be a map, got: :bad_metadata"} = Imagex.encode(image, :jpeg)
     end
 
+    test "encode on several threads decodes to the same pixels", %{image: test_image} do
+      {:ok, single} = Imagex.encode(test_image, :jpeg, quality: 90)
+      {:ok, banded} = Imagex.encode(test_image, :jpeg, quality: 90, threads: 4)
+      assert banded != single
+
+      {:ok, %Image{tensor: expected}} = Imagex.decode(single, format: :jpeg)
+      assert {:ok, %Image{tensor: ^expected}} = Imagex.decode(banded, format: :jpeg)
+
+      image = %Image{tensor: test_image.tensor, metadata: %{exif: %{ifd0: %{orientation: 6}}}}
+      {:ok, banded} = Imagex.encode(image, :jpeg, threads: :auto, subsampling: "4:4:4")
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(banded, format: :jpeg)
+      assert metadata.exif.ifd0.orientation == 6
+    end
+
+    test "encode with progressive scans and optimized tables decodes to the same pixels", %{image: test_image} do
+      {:ok, baseline} = Imagex.encode(test_image, :jpeg)
+      {:ok, progressive} = Imagex.encode(test_image, :jpeg, progressive: true)
+      {:ok, optimized} = Imagex.encode(test_image, :jpeg, optimize_coding: true, threads: 4)
+      assert byte_size(optimized) < byte_size(baseline)
+
+      {:ok, %Image{tensor: expected}} = Imagex.decode(baseline, format: :jpeg)
+      assert {:ok, %Image{tensor: ^expected}} = Imagex.decode(progressive, format: :jpeg)
+      assert {:ok, %Image{tensor: ^expected}} = Imagex.decode(optimized, format: :jpeg)
+    end
+
+    test "encode with chroma subsampling, DCT method and grayscale output", %{image: test_image} do
+      {:ok, full} = Imagex.encode(test_image, :jpeg, subsampling: "4:4:4")
+      {:ok, half} = Imagex.encode(test_image, :jpeg, subsampling: "4:2:2")
+      {:ok, quarter} = Imagex.encode(test_image, :jpeg, subsampling: "4:2:0")
+      assert byte_size(full) > byte_size(half) and byte_size(half) > byte_size(quarter)
+
+      {:ok, fast} = Imagex.encode(test_image, :jpeg, dct_method: :ifast)
+      assert {:ok, %Image{}} = Imagex.decode(fast, format: :jpeg)
+
+      {:ok, gray} = Imagex.encode(test_image, :jpeg, grayscale: true, threads: 3)
+      {:ok, %Image{tensor: gray_tensor}} = Imagex.decode(gray, format: :jpeg)
+      assert gray_tensor.shape == {512, 512}
+
+      {:ok, from_gray} = Imagex.encode(gray_tensor, :jpeg)
+      assert {:ok, %Image{tensor: %{shape: {512, 512}}}} = Imagex.decode(from_gray, format: :jpeg)
+    end
+
+    test "encode returns error for bad encoder options", %{image: test_image} do
+      assert {:error, ~s(subsampling must be "4:4:4", "4:2:2" or "4:2:0", got: "4:1:1")} =
+               Imagex.encode(test_image, :jpeg, subsampling: "4:1:1")
+
+      assert {:error, "dct_method must be :islow, :ifast or :float, got: :exact"} =
+               Imagex.encode(test_image, :jpeg, dct_method: :exact)
+
+      assert {:error, "progressive must be a boolean, got: 1"} = Imagex.encode(test_image, :jpeg, progressive: 1)
+      assert {:error, "threads must be a positive integer or :auto, got: 0"} =
+               Imagex.encode(test_image, :jpeg, threads: 0)
+    end
+
+    test "encode to a target size picks the highest quality that fits", %{image: test_image} do
+      target_size = 30_000
+      {:ok, sized} = Imagex.encode(test_image, :jpeg, target_size: target_size, threads: 4)
+      assert byte_size(sized) <= target_size
+
+      quality =
+        Enum.find(100..1//-1, fn quality ->
+          {:ok, bytes} = Imagex.encode(test_image, :jpeg, quality: quality)
+          byte_size(bytes) <= target_size
+        end)
+
+      assert {:ok, ^sized} = Imagex.encode(test_image, :jpeg, quality: quality)
+    end
+
+    test "encode to a target size keeps metadata and grows with the target", %{image: test_image} do
+      image = %Image{tensor: test_image.tensor, metadata: %{exif: %{ifd0: %{orientation: 6}}}}
+
+      {:ok, small} = Imagex.encode(image, :jpeg, target_size: 15_000)
+      {:ok, large} = Imagex.encode(image, :jpeg, target_size: 60_000)
+      assert byte_size(small) <= 15_000 and byte_size(large) <= 60_000
+      assert byte_size(small) < byte_size(large)
+
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(small, format: :jpeg)
+      assert metadata.exif.ifd0.orientation == 6
+    end
+
+    test "encode to a target size returns error when it cannot fit", %{image: test_image} do
+      assert {:error, reason} = Imagex.encode(test_image, :jpeg, target_size: 100)
+      assert String.starts_with?(reason, "the image does not fit in 100 bytes")
+
+      assert {:error, "target_size cannot be combined with quality"} =
+               Imagex.encode(test_image, :jpeg, target_size: 10_000, quality: 90)
+
+      assert {:error, "target_size must be a positive integer, got: 0"} =
+               Imagex.encode(test_image, :jpeg, target_size: 0)
+    end
+
     @tag :skip
     test "decode rgb image without parsing exif data" do
       jpeg_bytes = File.read!("test/assets/lena.jpg")
@@ -130,6 +254,33 @@ defmodule ImagexTest do
       assert image.metadata == nil
     end
 
+    test "decode palette image keeping the palette" do
+      png_bytes = File.read!("test/assets/lena-palette.png")
+      {:ok, %Image{} = expanded} = Imagex.decode(png_bytes, format: :png)
+      {:ok, %Image{} = indexed} = Imagex.decode(png_bytes, format: :png, keep_palette: true)
+
+      assert indexed.tensor.shape == {512, 512}
+      assert indexed.tensor.type == {:u, 8}
+      assert {_num_entries, 3} = indexed.palette.shape
+      assert expanded.palette == nil
+
+      # looking up every index in the palette should give back the expanded rgb image
+      assert Nx.to_binary(Nx.take(indexed.palette, indexed.tensor)) == Nx.to_binary(expanded.tensor)
+    end
+
+    test "decode image with checksum verification disabled" do
+      [signature, ihdr_chunk | remaining_chunks] = split_png_chunks(File.read!("test/assets/lena.png"))
+      ihdr_size = byte_size(ihdr_chunk) - 4
+      <<ihdr::binary-size(^ihdr_size), crc::32>> = ihdr_chunk
+      corrupted_bytes = IO.iodata_to_binary([signature, <<ihdr::binary, Bitwise.bxor(crc, 1)::32>>, remaining_chunks])
+
+      assert {:error, _reason} = Imagex.decode(corrupted_bytes, format: :png)
+
+      {:ok, %Image{} = image} = Imagex.decode(corrupted_bytes, format: :png, verify_checksums: false)
+      {:ok, %Image{} = expected} = Imagex.decode(File.read!("test/assets/lena.png"), format: :png)
+      assert Nx.to_binary(image.tensor) == Nx.to_binary(expected.tensor)
+    end
+
     test "decode rgba image" do
       png_bytes = File.read!("test/assets/lena-rgba.png")
       {:ok, %Image{} = image} = Imagex.decode(png_bytes, format: :png)
@@ -171,6 +322,42 @@ defmodule ImagexTest do
       assert image.metadata == nil
     end
 
+    test "encode rgb image with compression options", %{image: test_image} do
+      for filter <- [:none, :sub, :up, :avg, :paeth, :adaptive],
+          strategy <- [:default, :filtered, :huffman_only, :rle, :fixed] do
+        {:ok, compressed_bytes} = Imagex.encode(test_image, :png, filter: filter, strategy: strategy)
+        {:ok, image} = Imagex.decode(compressed_bytes, format: :png)
+        assert Nx.to_binary(image.tensor) == Nx.to_binary(test_image.tensor)
+      end
+
+      {:ok, fastest} = Imagex.encode(test_image, :png, compression_level: 1)
+      {:ok, smallest} = Imagex.encode(test_image, :png, compression_level: 9)
+      assert byte_size(smallest) < byte_size(fastest)
+
+      {:ok, fast} = Imagex.encode(test_image, :png, fast: true)
+      {:ok, image} = Imagex.decode(fast, format: :png)
+      assert Nx.to_binary(image.tensor) == Nx.to_binary(test_image.tensor)
+
+      assert {:error, _} = Imagex.encode(test_image, :png, filter: :bogus)
+      assert {:error, _} = Imagex.encode(test_image, :png, compression_level: 10)
+    end
+
+    test "encode rgb image on multiple threads", %{image: test_image} do
+      for threads <- [2, 3, 8, :auto], filter <- [:up, :paeth, :adaptive] do
+        {:ok, compressed_bytes} = Imagex.encode(test_image, :png, threads: threads, filter: filter)
+        {:ok, image} = Imagex.decode(compressed_bytes, format: :png)
+        assert Nx.to_binary(image.tensor) == Nx.to_binary(test_image.tensor)
+      end
+    end
+
+    test "encode 16-bit image on multiple threads" do
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(File.read!("test/assets/16bit.png"), format: :png)
+      {:ok, compressed_bytes} = Imagex.encode(tensor, :png, threads: 4)
+      {:ok, image} = Imagex.decode(compressed_bytes, format: :png)
+      assert image.tensor.type == {:u, 16}
+      assert Nx.to_binary(image.tensor) == Nx.to_binary(tensor)
+    end
+
     test "encode image preserves png text metadata", %{image: test_image} do
       image = %Image{
         tensor: test_image.tensor,
@@ -449,6 +636,24 @@ defmodule ImagexTest do
       assert roundtrip_image_lossless.tensor == test_image.tensor
     end
 
+    test "encode to a target size", %{image: test_image} do
+      {:ok, small} = Imagex.encode(test_image, :jxl, target_size: 10_000)
+      {:ok, large} = Imagex.encode(test_image, :jxl, target_size: 40_000)
+      assert byte_size(small) <= 10_000 and byte_size(large) <= 40_000
+      assert byte_size(small) < byte_size(large)
+
+      {:ok, %Image{} = roundtrip_image} = Imagex.decode(large, format: :jxl)
+      assert roundtrip_image.tensor.shape == test_image.tensor.shape
+    end
+
+    test "encode to a target size returns error for lossless and impossible targets", %{image: test_image} do
+      assert {:error, "target_size cannot be combined with lossless"} =
+               Imagex.encode(test_image, :jxl, target_size: 10_000, lossless: true)
+
+      assert {:error, reason} = Imagex.encode(test_image, :jxl, target_size: 10)
+      assert String.starts_with?(reason, "the image does not fit in 10 bytes")
+    end
+
     test "encode image preserves exif metadata from Image struct", %{image: test_image} do
       {:ok, %Image{metadata: metadata}} = Imagex.decode(File.read!("test/assets/lena.jpg"), format: :jpeg)
       image = %Image{tensor: test_image.tensor, metadata: metadata}
@@ -503,6 +708,14 @@ defmodule ImagexTest do
              ]
     end
 
+    test "read_metadata_from_jxl rejects other formats", %{image: test_image} do
+      {:ok, jxl_bytes} = Imagex.encode(%Image{tensor: test_image.tensor, metadata: %{xmp: "<x:xmpmeta/>"}}, :jxl)
+      assert {:ok, %{xmp: "<x:xmpmeta/>"}} = Imagex.Jxl.read_metadata_from_jxl(jxl_bytes)
+
+      assert {:error, "Decoder error"} = Imagex.Jxl.read_metadata_from_jxl(File.read!("test/assets/lena.jpg"))
+      assert {:error, "Decoder error"} = Imagex.Jxl.read_metadata_from_jxl(File.read!("test/assets/lena.png"))
+    end
+
     test "encode image returns error for malformed jxl metadata", %{image: test_image} do
       image = %Image{tensor: test_image.tensor, metadata: %{jxl_boxes: :bad_metadata}}
 
@@ -703,6 +916,736 @@ defmodule ImagexTest do
     assert Nx.to_binary(rgb_only_image) == Nx.to_binary(test_image.tensor)
   end
 
+  describe "webp" do
+    test "lossless round trip", %{image: test_image} do
+      {:ok, webp_bytes} = Imagex.encode(test_image, :webp, lossless: true, method: 1)
+      assert Imagex.Detect.detect(webp_bytes) == :webp
+
+      {:ok, %Image{} = image} = Imagex.decode(webp_bytes)
+      assert image.tensor == test_image.tensor
+      assert image.metadata == nil
+    end
+
+    test "lossy encode is smaller than JPEG at similar quality", %{image: test_image} do
+      {:ok, jpeg_bytes} = Imagex.encode(test_image, :jpeg, quality: 80)
+      {:ok, webp_bytes} = Imagex.encode(test_image, :webp, quality: 80, threads: :auto)
+      assert byte_size(webp_bytes) < byte_size(jpeg_bytes)
+
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(webp_bytes, format: :webp)
+      assert tensor.shape == {512, 512, 3}
+      diff = Nx.subtract(Nx.as_type(tensor, :s16), Nx.as_type(test_image.tensor, :s16))
+      assert Nx.to_number(Nx.mean(Nx.abs(diff))) < 5
+    end
+
+    test "keeps alpha and expands grayscale", %{image: test_image} do
+      {:ok, %Image{tensor: rgba}} = Imagex.decode(File.read!("test/assets/lena-rgba.jxl"))
+      {:ok, webp_bytes} = Imagex.encode(rgba, :webp, lossless: true)
+      assert {:ok, %Image{tensor: ^rgba}} = Imagex.decode(webp_bytes)
+
+      {:ok, lossy_bytes} = Imagex.encode(rgba, :webp, quality: 90)
+      assert {:ok, %Image{tensor: %{shape: {512, 512, 4}}}} = Imagex.decode(lossy_bytes)
+
+      gray = test_image.tensor[[.., .., 0]]
+      {:ok, webp_bytes} = Imagex.encode(gray, :webp, lossless: true)
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(webp_bytes)
+      assert tensor == Nx.broadcast(Nx.new_axis(gray, 2), {512, 512, 3})
+    end
+
+    test "metadata round trip", %{image: test_image} do
+      icc_profile = :binary.copy(<<1, 2, 3>>, 1001)
+      metadata = %{exif: %{ifd0: %{orientation: 6}}, icc_profile: icc_profile, xmp: "<x:xmpmeta/>"}
+      image = %Image{tensor: test_image.tensor, metadata: metadata}
+
+      for options <- [[quality: 60], [lossless: true, method: 0]] do
+        {:ok, webp_bytes} = Imagex.encode(image, :webp, options)
+        {:ok, %Image{metadata: decoded}} = Imagex.decode(webp_bytes, format: :webp)
+        assert decoded.exif.ifd0.orientation == 6
+        assert decoded.icc_profile == icc_profile
+        assert decoded.xmp == "<x:xmpmeta/>"
+
+        {:ok, read} = Imagex.read_metadata(webp_bytes)
+        assert {read.width, read.height} == {512, 512}
+        assert read.tags.orientation == 6
+      end
+    end
+
+    test "save, open and batch decode", %{image: test_image} do
+      path = Path.join(System.tmp_dir!(), "imagex-test-#{System.unique_integer([:positive])}.webp")
+      on_exit(fn -> File.rm(path) end)
+
+      :ok = Imagex.save(test_image, path, lossless: true)
+      assert {:ok, %Image{tensor: tensor}} = Imagex.open(path)
+      assert tensor == test_image.tensor
+
+      {:ok, [{:ok, %Image{tensor: ^tensor}}]} = Imagex.decode_batch([File.read!(path)])
+      assert {:ok, %Image{tensor: ^tensor}} = Imagex.decode(File.read!(path), cache: true)
+    end
+
+    test "returns errors for bad input and options", %{image: test_image} do
+      assert {:error, _} = Imagex.decode("RIFF" <> <<4::little-32>> <> "WEBPjunk", format: :webp)
+
+      {:ok, webp_bytes} = Imagex.encode(test_image, :webp)
+      assert {:error, "truncated WebP image"} = Imagex.decode(binary_part(webp_bytes, 0, 1000), format: :webp)
+
+      assert {:error, "WebP method must be an integer in 0..6, got: 7"} = Imagex.encode(test_image, :webp, method: 7)
+
+      assert {:error, "WebP only supports {:u, 8} pixels, got: {:u, 16}"} =
+               Imagex.encode(Nx.as_type(test_image.tensor, :u16), :webp)
+    end
+  end
+
+  describe "perceptual hashes" do
+    test "hashes of the same picture are close and of a different one are far", %{image: test_image} do
+      {:ok, jpeg_hashes} = Imagex.Hash.compute(File.read!("test/assets/lena.jpg"))
+      {:ok, png_hashes} = Imagex.Hash.compute(File.read!("test/assets/lena.png"))
+      {:ok, tensor_hashes} = Imagex.Hash.compute(test_image.tensor)
+      assert png_hashes == tensor_hashes
+      assert byte_size(jpeg_hashes.block_mean) == 32
+      assert jpeg_hashes.phash < Bitwise.bsl(1, 64)
+
+      distances = Imagex.Hash.distance(jpeg_hashes, png_hashes)
+      assert distances.ahash <= 8 and distances.dhash <= 8 and distances.phash <= 8
+      assert distances.block_mean <= 24
+
+      {:ok, mirrored_hashes} = Imagex.Hash.compute(Nx.reverse(test_image.tensor, axes: [1]))
+      assert Imagex.Hash.distance(png_hashes.phash, mirrored_hashes.phash) > 16
+    end
+
+    test "a JPEG hashed from its reduced decode matches its decoded tensor" do
+      jpeg_bytes = File.read!("test/assets/lena.jpg")
+      {:ok, image} = Imagex.decode(jpeg_bytes)
+      {:ok, reduced_hashes} = Imagex.Hash.compute(jpeg_bytes)
+      {:ok, decoded_hashes} = Imagex.Hash.compute(image)
+
+      for {_kind, distance} <- Imagex.Hash.distance(reduced_hashes, decoded_hashes) do
+        assert distance <= 4
+      end
+    end
+
+    test "hashes tensors of every supported type and shape", %{image: test_image} do
+      {:ok, hashes} = Imagex.Hash.compute(test_image)
+      {:ok, u16_hashes} = Imagex.Hash.compute(Nx.multiply(Nx.as_type(test_image.tensor, :u16), 257))
+      {:ok, f32_hashes} = Imagex.Hash.compute(Nx.divide(test_image.tensor, 255))
+      {:ok, rgba_hashes} = Imagex.Hash.compute(Nx.pad(test_image.tensor, 255, [{0, 0, 0}, {0, 0, 0}, {0, 1, 0}]))
+
+      for other <- [u16_hashes, f32_hashes, rgba_hashes] do
+        assert Enum.all?(Imagex.Hash.distance(hashes, other), fn {_kind, distance} -> distance <= 2 end)
+      end
+
+      {:ok, gray} = Imagex.decode(File.read!("test/assets/lena-grayscale.png"))
+      assert {:ok, %{phash: phash}} = Imagex.Hash.compute(gray.tensor)
+      assert Imagex.Hash.distance(phash, hashes.phash) <= 10
+    end
+
+    test "hashes a batch of images in order" do
+      images = [
+        File.read!("test/assets/lena.png"),
+        File.read!("test/assets/lena.ppm"),
+        File.read!("test/assets/lena.jpg"),
+        File.read!("test/assets/lena.jxl")
+      ]
+
+      {:ok, results} = Imagex.Hash.compute_batch(images, threads: 2)
+      assert length(results) == 4
+      assert Enum.at(results, 1) == {:error, "unsupported format for hashing"}
+
+      for i <- [0, 2, 3] do
+        assert Enum.at(results, i) == Imagex.Hash.compute(Enum.at(images, i))
+      end
+
+      assert {:error, "threads must be a positive integer or :auto, got: 0"} =
+               Imagex.Hash.compute_batch(images, threads: 0)
+    end
+
+    test "counts differing bits" do
+      assert Imagex.Hash.distance(0b1011, 0b0001) == 2
+      assert Imagex.Hash.distance(0, Bitwise.bsl(1, 64) - 1) == 64
+      assert Imagex.Hash.distance(<<0xF0, 0x01>>, <<0x0F, 0x01>>) == 8
+    end
+
+    test "returns errors for unsupported input" do
+      assert {:error, "unsupported pixel type: {:s, 8}"} = Imagex.Hash.compute(Nx.iota({4, 4}, type: :s8))
+      assert {:error, "unsupported image shape: {4, 4, 5}"} = Imagex.Hash.compute(Nx.iota({4, 4, 5}, type: :u8))
+      assert {:error, _} = Imagex.Hash.compute(<<0xFF, 0xD8, 0xFF, 0xE0>>)
+    end
+  end
+
+  describe "quality metrics" do
+    test "identical images are a perfect match", %{image: test_image} do
+      assert {:ok, %{psnr: :infinity, ssim: ssim, ms_ssim: ms_ssim}} =
+               Imagex.Quality.compare(test_image, test_image.tensor, metrics: [:psnr, :ssim, :ms_ssim])
+
+      assert_in_delta ssim, 1.0, 1.0e-9
+      assert_in_delta ms_ssim, 1.0, 1.0e-9
+    end
+
+    test "higher quality encodes score higher", %{image: test_image} do
+      {:ok, high} = Imagex.encode(test_image, :jpeg, quality: 90)
+      {:ok, low} = Imagex.encode(test_image, :jpeg, quality: 20)
+      metrics = [:psnr, :ssim, :ms_ssim]
+
+      {:ok, high_scores} = Imagex.Quality.compare(test_image, high, metrics: metrics)
+      {:ok, low_scores} = Imagex.Quality.compare(test_image, low, metrics: metrics)
+
+      for metric <- metrics do
+        assert high_scores[metric] > low_scores[metric]
+      end
+
+      assert high_scores.psnr > 30 and low_scores.psnr > 20
+      assert high_scores.ssim < 1 and low_scores.ssim > 0.5
+      assert high_scores.ms_ssim < 1 and low_scores.ms_ssim > 0.5
+    end
+
+    test "PSNR is relative to the full range of the pixel type" do
+      black = Nx.broadcast(Nx.tensor(0, type: :u8), {16, 16})
+      assert {:ok, %{psnr: psnr}} = Imagex.Quality.compare(black, Nx.add(black, 255), metrics: [:psnr])
+      assert_in_delta psnr, 0.0, 1.0e-6
+
+      assert {:ok, %{psnr: psnr}} = Imagex.Quality.compare(black, Nx.add(black, 1), metrics: [:psnr])
+      assert_in_delta psnr, 20 * :math.log10(255), 1.0e-6
+
+      wide = Nx.as_type(black, :u16)
+      assert {:ok, %{psnr: psnr}} = Imagex.Quality.compare(wide, Nx.add(wide, 257), metrics: [:psnr])
+      assert_in_delta psnr, 20 * :math.log10(255), 1.0e-6
+    end
+
+    test "results don't depend on the number of threads", %{image: test_image} do
+      {:ok, jpeg_bytes} = Imagex.encode(test_image, :jpeg, quality: 50)
+      {:ok, distorted} = Imagex.decode(jpeg_bytes)
+      metrics = [:psnr, :ssim, :ms_ssim]
+
+      assert Imagex.Quality.compare(test_image, distorted, metrics: metrics, threads: 1) ==
+               Imagex.Quality.compare(test_image, distorted, metrics: metrics, threads: :auto)
+
+      gray = Nx.slice_along_axis(test_image.tensor, 0, 1, axis: 2) |> Nx.squeeze(axes: [2])
+      {:ok, gray_jpeg} = Imagex.encode(gray, :jpeg, quality: 50)
+
+      assert Imagex.Quality.compare(gray, gray_jpeg, threads: 3) ==
+               Imagex.Quality.compare(gray, gray_jpeg, threads: 1)
+    end
+
+    test "returns errors for bad input and options", %{image: test_image} do
+      small = Nx.iota({100, 100, 3}, type: :u8)
+
+      assert {:error, "MS-SSIM needs images of at least 176x176 pixels"} =
+               Imagex.Quality.compare(small, small, metrics: [:ms_ssim])
+
+      assert {:error, "SSIM needs images of at least 11x11 pixels"} =
+               Imagex.Quality.compare(Nx.iota({8, 8}, type: :u8), Nx.iota({8, 8}, type: :u8))
+
+      assert {:error, "images must have the same shape and type, got: " <> _} =
+               Imagex.Quality.compare(test_image, small)
+
+      assert {:error, "unsupported metric: :butteraugli"} =
+               Imagex.Quality.compare(test_image, test_image, metrics: [:butteraugli])
+
+      assert {:error, "unsupported pixel type: {:s, 8}"} =
+               Imagex.Quality.compare(Nx.iota({16, 16}, type: :s8), Nx.iota({16, 16}, type: :s8))
+    end
+  end
+
+  describe "pyramid" do
+    test "tiles every level of the image", %{image: test_image} do
+      {:ok, pyramid} = Imagex.Pyramid.new(512, 512, format: :png)
+      assert Imagex.Pyramid.max_level(pyramid) == 9
+
+      tiles = pyramid_tiles(pyramid, [test_image.tensor])
+      counts = Enum.frequencies_by(tiles, fn {level, _column, _row, _bytes} -> level end)
+      assert counts == Map.merge(Map.new(0..7, &{&1, 1}), %{8 => 4, 9 => 9})
+
+      # tiles take in the overlap on the sides that have a neighbour
+      {9, 1, 0, bytes} = Enum.find(tiles, &match?({9, 1, 0, _}, &1))
+      assert tile_tensor(bytes) == Nx.slice(test_image.tensor, [0, 253, 0], [255, 256, 3])
+
+      {9, 2, 2, bytes} = Enum.find(tiles, &match?({9, 2, 2, _}, &1))
+      assert tile_tensor(bytes) == Nx.slice(test_image.tensor, [507, 507, 0], [5, 5, 3])
+
+      # lower levels are rounded 2x2 averages of the level above
+      reduced =
+        test_image.tensor
+        |> Nx.as_type(:u32)
+        |> Nx.reshape({256, 2, 256, 2, 3})
+        |> Nx.sum(axes: [1, 3])
+        |> Nx.add(2)
+        |> Nx.quotient(4)
+        |> Nx.as_type(:u8)
+
+      {8, 1, 1, bytes} = Enum.find(tiles, &match?({8, 1, 1, _}, &1))
+      assert tile_tensor(bytes) == Nx.slice(reduced, [253, 253, 0], [3, 3, 3])
+
+      {0, 0, 0, bytes} = Enum.find(tiles, &match?({0, 0, 0, _}, &1))
+      assert Nx.shape(tile_tensor(bytes)) == {1, 1, 3}
+    end
+
+    test "doesn't depend on how rows are split into bands", %{image: test_image} do
+      {:ok, whole} = Imagex.Pyramid.new(512, 512, format: :png, tile_size: 100, overlap: 2)
+      expected = pyramid_tiles(whole, [test_image.tensor]) |> Enum.sort()
+
+      band_sizes = [1, 7, 99, 101, 200, 104]
+      assert Enum.sum(band_sizes) == 512
+
+      {bands, _y} =
+        Enum.map_reduce(band_sizes, 0, fn rows, y ->
+          {Nx.slice_along_axis(test_image.tensor, y, rows, axis: 0) |> Nx.to_binary(), y + rows}
+        end)
+
+      {:ok, banded} = Imagex.Pyramid.new(512, 512, format: :png, tile_size: 100, overlap: 2, threads: 1)
+      assert pyramid_tiles(banded, bands) |> Enum.sort() == expected
+    end
+
+    test "reads its rows from jpeg, tiff and tensor sources", %{image: test_image} do
+      {:ok, pyramid} = Imagex.Pyramid.open("test/assets/lena.jpg", tile_size: 128, overlap: 0, format: :png)
+      assert pyramid.source == :native
+      {:ok, tiles} = Imagex.Pyramid.reduce(pyramid, [], &[&1 | &2])
+      {:ok, %Image{tensor: decoded}} = Imagex.decode(File.read!("test/assets/lena.jpg"))
+
+      {9, 3, 2, bytes} = Enum.find(tiles, &match?({9, 3, 2, _}, &1))
+      assert tile_tensor(bytes) == Nx.slice(decoded, [256, 384, 0], [128, 128, 3])
+
+      {:ok, tiff} = Imagex.open("test/assets/lena.tiff")
+      {:ok, %Image{tensor: rendered}} = Imagex.Tiff.render_page(tiff, 0)
+      {:ok, pyramid} = Imagex.Pyramid.open(tiff, tile_size: 128, overlap: 0, format: :png)
+      assert pyramid.channels == 4
+      {:ok, tiles} = Imagex.Pyramid.reduce(pyramid, [], &[&1 | &2])
+      {9, 1, 3, bytes} = Enum.find(tiles, &match?({9, 1, 3, _}, &1))
+      assert tile_tensor(bytes) == Nx.slice(rendered, [384, 128, 0], [128, 128, 4])
+
+      {:ok, pyramid} = Imagex.Pyramid.open(test_image, tile_size: 256, format: :jpeg, quality: 90)
+      {:ok, count} =
+        Imagex.Pyramid.reduce(pyramid, 0, fn {_level, _column, _row, <<0xFF, 0xD8, _::binary>>}, count -> count + 1 end)
+      assert count == 4 + 9
+
+      {:ok, pyramid} = Imagex.Pyramid.new(512, 512, format: :jxl, distance: 0)
+      {0, 0, 0, bytes} = pyramid_tiles(pyramid, [test_image.tensor]) |> Enum.find(&match?({0, 0, 0, _}, &1))
+      assert Nx.shape(tile_tensor(bytes)) == {1, 1, 3}
+    end
+
+    test "describes itself as deep zoom" do
+      {:ok, pyramid} = Imagex.Pyramid.new(1000, 600, tile_size: 510, overlap: 1, channels: 1)
+      assert Imagex.Pyramid.max_level(pyramid) == 10
+
+      assert Imagex.Pyramid.dzi(pyramid) ==
+               ~s(<?xml version="1.0" encoding="UTF-8"?>\n) <>
+                 ~s(<Image xmlns="http://schemas.microsoft.com/deepzoom/2008" Format="jpg" Overlap="1" ) <>
+                 ~s(TileSize="510"><Size Width="1000" Height="600"/></Image>\n)
+    end
+
+    test "returns errors for bad input and options", %{image: test_image} do
+      assert {:error, "JPEG tiles must have 1 or 3 channels"} = Imagex.Pyramid.new(16, 16, channels: 4)
+
+      assert {:error, "tile size must be positive and larger than the overlap"} =
+               Imagex.Pyramid.new(16, 16, tile_size: 4, overlap: 4)
+
+      assert {:error, "unsupported tile format: :gif"} = Imagex.Pyramid.new(16, 16, format: :gif)
+      assert {:error, "the image must have a non-zero width and height"} = Imagex.Pyramid.new(0, 16)
+
+      {:ok, pyramid} = Imagex.Pyramid.new(512, 512)
+
+      assert {:error, "rows must be a {:u, 8} tensor of shape {num_rows, 512, 3}"} =
+               Imagex.Pyramid.push(pyramid, Nx.iota({2, 512}, type: :u8))
+
+      assert {:error, "row data must be a whole number of rows"} = Imagex.Pyramid.push(pyramid, <<0, 0, 0>>)
+      assert {:ok, _tiles} = Imagex.Pyramid.push(pyramid, Nx.slice_along_axis(test_image.tensor, 0, 300, axis: 0))
+      assert {:error, "not all rows have been pushed"} = Imagex.Pyramid.finish(pyramid)
+      assert {:error, "more rows than the image height"} = Imagex.Pyramid.push(pyramid, test_image.tensor)
+      assert {:error, "the pyramid has no source, push its rows instead"} = Imagex.Pyramid.reduce(pyramid, 0, & &2)
+
+      {:ok, pyramid} = Imagex.Pyramid.open("test/assets/lena.jpg")
+      assert {:error, "the pyramid reads its own rows"} = Imagex.Pyramid.push(pyramid, <<>>)
+      assert {:error, "pyramids can only read JPEG and TIFF files"} = Imagex.Pyramid.open("test/assets/lena.png")
+    end
+  end
+
+  describe "preview" do
+    test "decodes the exif thumbnail when it is large enough" do
+      path = "test/assets/exif/exif-jpeg-thumbnail-sony-dsc-p150-inverted-colors.jpg"
+      bytes = File.read!(path)
+      {:ok, %Image{tensor: full, metadata: metadata}} = Imagex.decode(bytes)
+      assert Nx.shape(full) == {1662, 2437, 3}
+
+      {:ok, %Image{tensor: preview} = image} = Imagex.decode(bytes, preview: 160)
+      assert Nx.shape(preview) == {109, 160, 3}
+      assert image.metadata.exif == metadata.exif
+      assert {:ok, %Image{tensor: ^preview}} = Imagex.decode(metadata.exif.ifd1.thumbnail_data)
+      assert {:ok, %Image{tensor: ^preview}} = Imagex.open(path, preview: 160)
+    end
+
+    test "falls back to a scaled decode, or to the full image" do
+      bytes = File.read!("test/assets/exif/exif-jpeg-thumbnail-sony-dsc-p150-inverted-colors.jpg")
+
+      sizes = [{161, {208, 305, 3}}, {305, {208, 305, 3}}, {306, {416, 610, 3}}, {5000, {1662, 2437, 3}}]
+
+      for {min_size, shape} <- sizes do
+        assert {:ok, %Image{tensor: tensor}} = Imagex.decode(bytes, preview: min_size)
+        assert Nx.shape(tensor) == shape
+      end
+
+      lena = File.read!("test/assets/lena.png")
+      assert Imagex.decode(lena, preview: 64) == Imagex.decode(lena)
+
+      assert {:ok, %Image{tensor: tensor}} = Imagex.decode(File.read!("test/assets/lena.jpg"), preview: 100)
+      assert Nx.shape(tensor) == {128, 128, 3}
+
+      assert {:ok, %Image{tensor: tensor}} = Imagex.decode(bytes, preview: 160, type: {:f, 32}, layout: :chw)
+      assert Nx.shape(tensor) == {3, 109, 160}
+    end
+
+    test "returns errors for bad options" do
+      bytes = File.read!("test/assets/lena.jpg")
+      assert {:error, "preview must be a positive integer, got: 0"} = Imagex.decode(bytes, preview: 0)
+      assert {:error, "preview cannot be combined with crop"} = Imagex.decode(bytes, preview: 64, crop: {0, 0, 8, 8})
+      assert {:error, "preview cannot be combined with cache"} = Imagex.decode(bytes, preview: 64, cache: true)
+
+      assert {:error, "preview is only supported for JPEG, PNG, JPEG XL and WebP images, got: :tiff"} =
+               Imagex.open("test/assets/lena.tiff", preview: 64)
+    end
+  end
+
+  describe "read_metadata" do
+    test "reads jpeg metadata without decoding" do
+      jpeg_bytes = File.read!("test/assets/exif/exif-org/canon-ixus.jpg")
+      {:ok, metadata} = Imagex.read_metadata(jpeg_bytes)
+
+      assert metadata.width == 640
+      assert metadata.height == 480
+      assert metadata.tags.make == "Canon"
+      assert metadata.tags.model == "Canon DIGITAL IXUS"
+      assert metadata.tags.orientation == 1
+      assert metadata.tags.date_time_original == "2001:06:09 15:17:32"
+      assert is_binary(metadata.exif_binary)
+      assert metadata.icc_profile == nil
+      refute Map.has_key?(metadata, :exif)
+
+      {:ok, %Image{metadata: decoded_metadata}} = Imagex.decode(jpeg_bytes, format: :jpeg)
+      {:ok, parsed_metadata} = Imagex.read_metadata(jpeg_bytes, parse_exif: true)
+      assert parsed_metadata.exif == decoded_metadata.exif
+    end
+
+    test "reads jpeg xmp" do
+      {:ok, metadata} = Imagex.read_metadata(File.read!("test/assets/exif/gps/DSCN0010.jpg"))
+      assert metadata.xmp =~ "<x:xmpmeta"
+      assert metadata.tags.make == "NIKON"
+    end
+
+    test "reads png metadata without decoding" do
+      png_bytes = File.read!("test/assets/lena.png")
+      {:ok, metadata} = Imagex.read_metadata(png_bytes)
+      {:ok, %Image{metadata: decoded_metadata}} = Imagex.decode(png_bytes, format: :png)
+
+      assert {metadata.width, metadata.height} == {512, 512}
+      assert metadata.xmp == decoded_metadata.xmp
+      assert metadata.png_chunks == decoded_metadata.png_chunks
+      assert metadata.exif_binary == nil
+    end
+
+    test "reads compressed png text chunks" do
+      {:ok, metadata} = Imagex.read_metadata(png_with_ztxt("Comment", "compressed comment"))
+      assert [%{keyword: "Comment", text: "compressed comment"}] = metadata.png_chunks
+    end
+
+    test "reads jxl metadata without decoding" do
+      jxl_bytes = File.read!("test/assets/jxl/1x1_exif_xmp.jxl")
+      {:ok, metadata} = Imagex.read_metadata(jxl_bytes)
+      {:ok, %Image{metadata: decoded_metadata}} = Imagex.decode(jxl_bytes, format: :jxl)
+
+      assert {metadata.width, metadata.height} == {1, 1}
+      assert metadata.tags.software == "GIMP 2.10.28"
+      assert metadata.jxl_boxes == decoded_metadata.jxl_boxes
+      assert metadata.xmp == decoded_metadata.xmp
+    end
+
+    test "reads tiff metadata without decoding" do
+      {:ok, metadata} = Imagex.read_metadata(File.read!("test/assets/lena.tiff"))
+      assert {metadata.width, metadata.height} == {512, 512}
+      assert metadata.xmp =~ "<x:xmpmeta"
+      assert is_binary(metadata.icc_profile)
+    end
+
+    test "returns an error for unsupported formats" do
+      assert {:error, _} = Imagex.read_metadata(File.read!("test/assets/lena.ppm"))
+    end
+  end
+
+  describe "decode_batch" do
+    test "decodes mixed formats in order, with per-item errors" do
+      paths = ["test/assets/lena.jpg", "test/assets/lena.png", "test/assets/lena.jxl", "test/assets/16bit.png"]
+      images = Enum.map(paths, &File.read!/1)
+
+      {:ok, results} = Imagex.decode_batch(images ++ [File.read!("test/assets/lena.ppm"), <<0xFF, 0xD8, 0, 1>>])
+      assert length(results) == 6
+
+      for {bytes, result} <- Enum.zip(images, results) do
+        {:ok, %Image{tensor: expected}} = Imagex.decode(bytes)
+        assert {:ok, %Image{tensor: ^expected}} = result
+      end
+
+      assert {:error, "unsupported format for batch decoding"} = Enum.at(results, 4)
+      assert {:error, _} = Enum.at(results, 5)
+    end
+
+    test "gives the same results on one thread" do
+      images = Enum.map(["test/assets/lena.jpg", "test/assets/lena-palette.png"], &File.read!/1)
+      assert Imagex.decode_batch(images, threads: 1) == Imagex.decode_batch(images, threads: :auto)
+    end
+
+    test "keeps metadata unless parse_metadata: false" do
+      jpeg_bytes = File.read!("test/assets/lena.jpg")
+      {:ok, [{:ok, %Image{metadata: metadata}}]} = Imagex.decode_batch([jpeg_bytes])
+      assert Map.has_key?(metadata, :exif)
+
+      {:ok, [{:ok, %Image{metadata: nil}}]} = Imagex.decode_batch([jpeg_bytes], parse_metadata: false)
+    end
+
+    test "returns an empty list for an empty batch and rejects bad options" do
+      assert {:ok, []} = Imagex.decode_batch([])
+      assert {:error, _} = Imagex.decode_batch([], threads: 0)
+    end
+  end
+
+  describe "async" do
+    test "decodes to the same image as the synchronous call" do
+      for path <- ["test/assets/lena.jpg", "test/assets/lena.png", "test/assets/lena.jxl"] do
+        bytes = File.read!(path)
+        {:ok, job} = Imagex.Async.decode(bytes, priority: :high)
+        assert Imagex.Async.await(job) == Imagex.decode(bytes)
+      end
+    end
+
+    test "runs many jobs at once and replies to the calling process" do
+      bytes = File.read!("test/assets/lena.png")
+      {:ok, expected} = Imagex.decode(bytes, parse_metadata: false)
+
+      jobs =
+        for priority <- [:low, :normal, :high, :normal] do
+          {:ok, job} = Imagex.Async.decode(bytes, priority: priority, parse_metadata: false)
+          job
+        end
+
+      for job <- jobs, do: assert({:ok, ^expected} = Imagex.Async.await(job))
+    end
+
+    test "extracts only the requested kinds of metadata", %{image: test_image} do
+      xmp = sample_xmp("async-selection")
+      icc_profile = :binary.copy(<<1, 2, 3, 4>>, 64)
+      image = %Image{tensor: test_image.tensor, metadata: %{xmp: xmp, icc_profile: icc_profile}}
+      {:ok, jpeg_bytes} = Imagex.encode(image, :jpeg)
+
+      {:ok, job} = Imagex.Async.decode(jpeg_bytes, parse_metadata: [:xmp])
+      assert {:ok, %Image{metadata: metadata}} = Imagex.Async.await(job)
+      assert metadata == %{xmp: xmp}
+
+      assert Imagex.Async.decode(jpeg_bytes, parse_metadata: [:gps]) ==
+               {:error, "parse_metadata must be a boolean or a list of :exif, :xmp, :icc and :text, got: [:gps]"}
+    end
+
+    test "reports decode errors through await" do
+      {:ok, job} = Imagex.Async.decode(<<0xFF, 0xD8, 0, 1>>)
+      assert {:error, _} = Imagex.Async.await(job)
+    end
+
+    test "encodes JXL" do
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(File.read!("test/assets/lena.png"))
+      {:ok, job} = Imagex.Async.encode(tensor, :jxl, lossless: true, effort: 1, priority: :low)
+      {:ok, jxl_bytes} = Imagex.Async.await(job)
+      assert {:ok, %Image{tensor: ^tensor}} = Imagex.decode(jxl_bytes)
+    end
+
+    test "renders PDF pages" do
+      {:ok, pdf} = Imagex.decode(File.read!("test/assets/lena.pdf"), format: :pdf)
+      {:ok, job} = Imagex.Async.render_page(pdf, 0, dpi: 36)
+      assert Imagex.Async.await(job) == Imagex.Pdf.render_page(pdf, 0, dpi: 36)
+    end
+
+    test "rejects bad priorities and options" do
+      assert {:error, _} = Imagex.Async.decode(<<>>, priority: :urgent)
+      assert {:error, _} = Imagex.Async.encode(Nx.iota({4, 4}, type: {:u, 8}), :jxl, distance: 0)
+    end
+
+    test "drops the queued jobs of a process that exits" do
+      bytes = File.read!("test/assets/lena.jxl")
+
+      {pid, monitor} =
+        spawn_monitor(fn ->
+          for _ <- 1..32, do: {:ok, _job} = Imagex.Async.decode(bytes, priority: :low)
+        end)
+
+      assert_receive {:DOWN, ^monitor, :process, ^pid, :normal}, 5_000
+      {:ok, job} = Imagex.Async.decode(bytes, priority: :high)
+      assert {:ok, %Image{}} = Imagex.Async.await(job)
+    end
+
+    test "await times out without consuming the reply" do
+      {:ok, job} = Imagex.Async.decode(File.read!("test/assets/lena.jxl"))
+      assert {:error, :timeout} = Imagex.Async.await(job, 0)
+      assert {:ok, %Image{}} = Imagex.Async.await(job)
+    end
+  end
+
+  describe "incremental decoder" do
+    test "returns rows as they arrive and the same image as decode" do
+      for {bytes, format} <- [
+            {File.read!("test/assets/lena.jpg"), :jpeg},
+            {File.read!("test/assets/lena.png"), :png},
+            {File.read!("test/assets/16bit.png"), :png},
+            {File.read!("test/assets/lena.jxl"), :jxl},
+            {webp_test_bytes(), :webp}
+          ] do
+        {:ok, decoder} = Imagex.Decoder.new(format)
+        rows = push_in_chunks(decoder, bytes, 4096)
+        {:ok, %Image{tensor: tensor} = expected} = Imagex.decode(bytes)
+
+        assert {:ok, ^expected} = Imagex.Decoder.finish(decoder)
+        assert [{0, _} | _] = rows
+        assert Nx.concatenate(Enum.map(rows, &elem(&1, 1))) == tensor
+        if format != :jxl, do: assert(length(rows) > 1)
+      end
+    end
+
+    test "keeps the palette when asked to" do
+      bytes = File.read!("test/assets/lena-palette.png")
+      {:ok, decoder} = Imagex.Decoder.new(:png, keep_palette: true)
+      {:ok, _rows} = Imagex.Decoder.push(decoder, bytes)
+      assert Imagex.Decoder.finish(decoder) == Imagex.decode(bytes, keep_palette: true)
+    end
+
+    test "reports truncated and invalid input" do
+      bytes = File.read!("test/assets/lena.png")
+      {:ok, decoder} = Imagex.Decoder.new(:png)
+      {:ok, _rows} = Imagex.Decoder.push(decoder, binary_part(bytes, 0, 1000))
+      assert {:error, "incomplete PNG image"} = Imagex.Decoder.finish(decoder)
+      assert {:error, "decoder already finished"} = Imagex.Decoder.finish(decoder)
+
+      {:ok, decoder} = Imagex.Decoder.new(:png)
+      assert {:error, reason} = Imagex.Decoder.push(decoder, "definitely not a png")
+      assert {:error, ^reason} = Imagex.Decoder.push(decoder, bytes)
+
+      assert {:error, _} = Imagex.Decoder.new(:bmp)
+    end
+  end
+
+  describe "streaming encoder" do
+    setup do
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(File.read!("test/assets/lena.png"))
+      {:ok, tensor: tensor}
+    end
+
+    test "JPEG output matches encode", %{tensor: tensor} do
+      metadata = %{exif: %{ifd0: %{orientation: 6}}}
+      {:ok, encoder} = Imagex.Encoder.new(:jpeg, tensor.shape, quality: 90, metadata: metadata)
+      streamed = push_rows_in_batches(encoder, tensor, 7)
+
+      assert {:ok, ^streamed} = Imagex.encode(tensor, :jpeg, quality: 90, metadata: metadata)
+    end
+
+    test "progressive JPEG output matches encode", %{tensor: tensor} do
+      {:ok, encoder} = Imagex.Encoder.new(:jpeg, tensor.shape, progressive: true, subsampling: "4:4:4")
+      streamed = push_rows_in_batches(encoder, tensor, 32)
+
+      assert {:ok, ^streamed} = Imagex.encode(tensor, :jpeg, progressive: true, subsampling: "4:4:4")
+    end
+
+    test "PNG output decodes to the pushed pixels", %{tensor: tensor} do
+      {:ok, encoder} = Imagex.Encoder.new(:png, tensor.shape, filter: :paeth)
+      streamed = push_rows_in_batches(encoder, tensor, 16)
+
+      assert {:ok, %Image{tensor: ^tensor}} = Imagex.decode(streamed)
+      assert {:ok, ^streamed} = Imagex.encode(tensor, :png, filter: :paeth)
+
+      bytes = File.read!("test/assets/16bit.png")
+      {:ok, %Image{tensor: tensor16}} = Imagex.decode(bytes)
+      {:ok, encoder} = Imagex.Encoder.new(:png, tensor16.shape, type: {:u, 16})
+      assert {:ok, %Image{tensor: ^tensor16}} = Imagex.decode(push_rows_in_batches(encoder, tensor16, 5))
+    end
+
+    test "does not stream JXL", %{tensor: tensor} do
+      assert {:error, "unsupported format for streaming encoding: :jxl"} =
+               Imagex.Encoder.new(:jxl, tensor.shape, lossless: true)
+    end
+
+    test "rejects partial rows and incomplete images", %{tensor: tensor} do
+      {height, width, 3} = tensor.shape
+      {:ok, encoder} = Imagex.Encoder.new(:png, tensor.shape)
+
+      assert {:error, "row data must be a whole number of rows"} =
+               Imagex.Encoder.push(encoder, :binary.copy(<<0>>, width * 3 + 1))
+
+      assert {:error, _} = Imagex.Encoder.push(encoder, Nx.reshape(tensor, {height, width * 3}))
+      assert {:ok, _} = Imagex.Encoder.push(encoder, tensor[0..9])
+      assert {:error, "not all rows have been pushed"} = Imagex.Encoder.finish(encoder)
+      assert {:error, "more rows than the image height"} = Imagex.Encoder.push(encoder, tensor)
+      assert {:ok, _} = Imagex.Encoder.push(encoder, tensor[10..-1//1])
+      assert {:ok, _} = Imagex.Encoder.finish(encoder)
+      assert {:error, "encoder already finished"} = Imagex.Encoder.finish(encoder)
+
+      assert {:error, _} = Imagex.Encoder.new(:jpeg, tensor.shape, type: {:u, 16})
+      assert {:error, _} = Imagex.Encoder.new(:bmp, tensor.shape)
+    end
+  end
+
+  describe "jpeg transform" do
+    setup do
+      jpeg_bytes = File.read!("test/assets/lena.jpg")
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(jpeg_bytes, format: :jpeg)
+      {:ok, jpeg_bytes: jpeg_bytes, tensor: tensor}
+    end
+
+    test "rotate_90 matches rotating the decoded pixels", %{jpeg_bytes: jpeg_bytes, tensor: tensor} do
+      {:ok, rotated_bytes} = Imagex.Jpeg.transform(jpeg_bytes, transform: :rotate_90)
+      {:ok, %Image{tensor: rotated}} = Imagex.decode(rotated_bytes, format: :jpeg)
+
+      expected = tensor |> Nx.transpose(axes: [1, 0, 2]) |> Nx.reverse(axes: [1])
+      assert rotated.shape == expected.shape
+
+      # the IDCT rounds slightly differently once rows and columns are swapped
+      max_diff = Nx.subtract(Nx.as_type(rotated, :s16), Nx.as_type(expected, :s16)) |> Nx.abs() |> Nx.reduce_max()
+      assert Nx.to_number(max_diff) <= 3
+    end
+
+    test "flipping twice gives back the same pixels", %{jpeg_bytes: jpeg_bytes, tensor: tensor} do
+      {:ok, flipped_bytes} = Imagex.Jpeg.transform(jpeg_bytes, transform: :flip_horizontal)
+      {:ok, restored_bytes} = Imagex.Jpeg.transform(flipped_bytes, transform: :flip_horizontal)
+      {:ok, %Image{tensor: restored}} = Imagex.decode(restored_bytes, format: :jpeg)
+
+      assert restored == tensor
+    end
+
+    test "crop is aligned to the MCU grid", %{jpeg_bytes: jpeg_bytes, tensor: tensor} do
+      {:ok, cropped_bytes} = Imagex.Jpeg.transform(jpeg_bytes, crop: {20, 20, 100, 100})
+      {:ok, %Image{tensor: cropped, metadata: metadata}} = Imagex.decode(cropped_bytes, format: :jpeg)
+
+      assert cropped == Nx.slice(tensor, [16, 16, 0], [104, 104, 3])
+      assert Map.has_key?(metadata, :exif)
+    end
+
+    test "auto_orient applies and resets the EXIF orientation", %{image: test_image} do
+      tensor = Nx.slice(test_image.tensor, [0, 0, 0], [32, 48, 3])
+      {:ok, jpeg_bytes} = Imagex.encode(tensor, :jpeg, metadata: %{exif: %{ifd0: %{orientation: 6}}})
+
+      {:ok, oriented_bytes} = Imagex.Jpeg.transform(jpeg_bytes, auto_orient: true)
+      {:ok, metadata} = Imagex.read_metadata(oriented_bytes)
+
+      assert {metadata.width, metadata.height} == {32, 48}
+      assert metadata.tags.orientation == 1
+    end
+
+    test "copy_metadata: false drops the metadata segments", %{jpeg_bytes: jpeg_bytes} do
+      {:ok, rotated_bytes} = Imagex.Jpeg.transform(jpeg_bytes, transform: :rotate_180, copy_metadata: false)
+      {:ok, metadata} = Imagex.read_metadata(rotated_bytes)
+
+      assert metadata.exif_binary == nil
+    end
+
+    test "returns errors for bad options and input", %{jpeg_bytes: jpeg_bytes} do
+      assert {:error, "unsupported JPEG transform: :rotate_45"} =
+               Imagex.Jpeg.transform(jpeg_bytes, transform: :rotate_45)
+
+      assert {:error, _} = Imagex.Jpeg.transform(jpeg_bytes, transform: :rotate_90, auto_orient: true)
+      assert {:error, _} = Imagex.Jpeg.transform(jpeg_bytes, crop: {0, 0, 0, 10})
+      assert {:error, "crop region is outside of the image"} = Imagex.Jpeg.transform(jpeg_bytes, crop: {600, 0, 8, 8})
+      assert {:error, _} = Imagex.Jpeg.transform(<<0xFF, 0xD8, 0, 1, 2, 3>>)
+    end
+  end
+
   test "generic decode" do
     {:ok, %Image{} = image} = Imagex.decode(File.read!("test/assets/lena.jpg"))
     assert image.tensor.shape == {512, 512, 3}
@@ -725,6 +1668,45 @@ defmodule ImagexTest do
     assert image.tensor.shape == {512, 512, 3}
   end
 
+  test "open decodes memory-mapped files the same as decode" do
+    for path <- ["test/assets/lena.jpg", "test/assets/lena.png", "test/assets/16bit.png", "test/assets/lena.jxl"] do
+      assert Imagex.open(path) == Imagex.decode(File.read!(path))
+    end
+
+    assert Imagex.open(~c"test/assets/lena-palette.png", keep_palette: true) ==
+             Imagex.decode(File.read!("test/assets/lena-palette.png"), keep_palette: true)
+
+    assert Imagex.open("test/assets/lena.ppm") == Imagex.decode(File.read!("test/assets/lena.ppm"))
+  end
+
+  test "open fails on truncated PNG files instead of reading past the mapping" do
+    path = Path.join(System.tmp_dir!(), "imagex-test-#{System.unique_integer([:positive])}.png")
+    on_exit(fn -> File.rm(path) end)
+    File.write!(path, binary_part(File.read!("test/assets/lena.png"), 0, 4096))
+
+    assert {:error, "unexpected end of PNG data"} = Imagex.open(path)
+    assert {:error, "unexpected end of PNG data"} = Imagex.decode(File.read!(path))
+  end
+
+  test "open keeps the mapping of pdf and tiff documents" do
+    {:ok, %Imagex.Pdf{num_pages: 1} = pdf} = Imagex.open("test/assets/lena.pdf")
+    {:ok, expected_pdf} = Imagex.decode(File.read!("test/assets/lena.pdf"), format: :pdf)
+    :erlang.garbage_collect()
+    assert Imagex.Pdf.render_page(pdf, 0) == Imagex.Pdf.render_page(expected_pdf, 0)
+
+    {:ok, %Imagex.Tiff{} = tiff} = Imagex.open("test/assets/lena.tiff")
+    {:ok, expected_tiff} = Imagex.decode(File.read!("test/assets/lena.tiff"))
+    :erlang.garbage_collect()
+    assert tiff.num_pages == expected_tiff.num_pages
+    assert Imagex.Tiff.render_page(tiff, 0) == Imagex.Tiff.render_page(expected_tiff, 0)
+  end
+
+  test "open reports missing and unsupported files" do
+    assert {:error, "test/assets/missing.png: No such file or directory"} = Imagex.open("test/assets/missing.png")
+    assert {:error, "test/assets: not a regular file"} = Imagex.open("test/assets")
+    assert {:error, "invalid png header"} = Imagex.open("test/assets/lena.pdf", format: :png)
+  end
+
   test "load and render pdf document" do
     bytes = File.read!("test/assets/lena.pdf")
     {:ok, %Imagex.Pdf{} = pdf} = Imagex.decode(bytes, format: :pdf)
@@ -747,6 +1729,629 @@ defmodule ImagexTest do
     assert image.tensor.shape == {512, 512, 4}
   end
 
+  test "decode and open only a region of a jpeg" do
+    bytes = File.read!("test/assets/lena.jpg")
+    {:ok, %Image{tensor: full}} = Imagex.decode(bytes)
+
+    for {x, y, width, height} = crop <- [{0, 0, 512, 512}, {37, 101, 200, 77}, {0, 300, 512, 16}, {511, 511, 1, 1}] do
+      expected = Nx.slice(full, [y, x, 0], [height, width, 3])
+      {:ok, %Image{tensor: tensor}} = Imagex.decode(bytes, crop: crop)
+      assert tensor == expected
+      {:ok, %Image{tensor: tensor}} = Imagex.open("test/assets/lena.jpg", crop: crop)
+      assert tensor == expected
+    end
+
+    # regions that extend past the image are clamped to it
+    {:ok, %Image{tensor: tensor}} = Imagex.decode(bytes, crop: {500, 400, 100, 300})
+    assert tensor == Nx.slice(full, [400, 500, 0], [112, 12, 3])
+  end
+
+  test "crop is validated" do
+    bytes = File.read!("test/assets/lena.jpg")
+    assert Imagex.decode(bytes, crop: {512, 0, 10, 10}) == {:error, "crop region is outside of the image"}
+    assert Imagex.open("test/assets/lena.jpg", crop: {0, 600, 1, 1}) ==
+             {:error, "crop region is outside of the image"}
+    assert Imagex.decode(bytes, crop: {0, 0, 0, 10}) ==
+             {:error, "crop must be {x, y, width, height}, got: {0, 0, 0, 10}"}
+
+    assert Imagex.decode(File.read!("test/assets/lena.png"), crop: {0, 0, 10, 10}) ==
+             {:error, "crop is only supported for JPEG images, got: :png"}
+
+    assert Imagex.open("test/assets/lena.jxl", crop: {0, 0, 10, 10}) ==
+             {:error, "crop is only supported for JPEG images, got: :jxl"}
+  end
+
+  test "render only a region of a tiff page" do
+    {:ok, tiff} = Imagex.decode(File.read!("test/assets/lena.tiff"))
+    {:ok, %Image{tensor: full}} = Imagex.Tiff.render_page(tiff, 0)
+
+    for {x, y, width, height} = crop <- [{0, 0, 512, 512}, {13, 250, 301, 99}, {511, 0, 1, 512}] do
+      {:ok, %Image{tensor: tensor}} = Imagex.Tiff.render_page(tiff, 0, crop: crop)
+      assert tensor == Nx.slice(full, [y, x, 0], [height, width, 4])
+    end
+
+    assert Imagex.Tiff.render_page(tiff, 0, crop: {0, 512, 1, 1}) == {:error, "crop region is outside of the image"}
+
+    assert {:error, "crop is not supported when opening TIFF documents" <> _} =
+             Imagex.open("test/assets/lena.tiff", crop: {0, 0, 1, 1})
+  end
+
+  describe "output layout and type" do
+    test "decodes to planar CHW" do
+      bytes = File.read!("test/assets/lena.jpg")
+      {:ok, %Image{tensor: hwc}} = Imagex.decode(bytes)
+      {:ok, %Image{tensor: chw}} = Imagex.decode(bytes, layout: :chw)
+      assert chw == Nx.transpose(hwc, axes: [2, 0, 1])
+
+      {:ok, %Image{tensor: gray}} = Imagex.decode(File.read!("test/assets/lena-grayscale.png"), layout: :chw)
+      assert Nx.shape(gray) == {1, 512, 512}
+    end
+
+    test "normalizes to floats with per-channel scale and bias" do
+      bytes = File.read!("test/assets/lena.png")
+      {:ok, %Image{tensor: hwc}} = Imagex.decode(bytes)
+      mean = [0.485, 0.456, 0.406]
+      std = [0.229, 0.224, 0.225]
+      scale = Enum.map(std, &(1 / (255 * &1)))
+      bias = Enum.zip_with(mean, std, &(-&1 / &2))
+
+      expected =
+        hwc
+        |> Nx.as_type(:f32)
+        |> Nx.divide(255)
+        |> Nx.subtract(Nx.tensor(mean))
+        |> Nx.divide(Nx.tensor(std))
+        |> Nx.transpose(axes: [2, 0, 1])
+
+      {:ok, %Image{tensor: chw}} = Imagex.decode(bytes, layout: :chw, type: {:f, 32}, scale: scale, bias: bias)
+      assert Nx.type(chw) == {:f, 32}
+      assert Nx.to_number(Nx.all_close(chw, expected, atol: 1.0e-5)) == 1
+
+      {:ok, %Image{tensor: half}} = Imagex.decode(bytes, layout: :chw, type: {:f, 16}, scale: scale, bias: bias)
+      assert Nx.type(half) == {:f, 16}
+      assert Nx.to_number(Nx.all_close(Nx.as_type(half, :f32), expected, atol: 1.0e-2)) == 1
+
+      {:ok, %Image{tensor: sixteen}} =
+        Imagex.decode(File.read!("test/assets/16bit.png"), type: {:f, 32}, scale: 1 / 65535)
+
+      {:ok, %Image{tensor: original}} = Imagex.decode(File.read!("test/assets/16bit.png"))
+      assert Nx.to_number(Nx.all_close(sixteen, Nx.divide(original, 65535), atol: 1.0e-6)) == 1
+    end
+
+    test "rounds and saturates integer output" do
+      bytes = File.read!("test/assets/lena.jpg")
+      {:ok, %Image{tensor: hwc}} = Imagex.decode(bytes)
+      {:ok, %Image{tensor: scaled}} = Imagex.decode(bytes, scale: 2, bias: -100)
+      expected = hwc |> Nx.as_type(:s32) |> Nx.multiply(2) |> Nx.subtract(100) |> Nx.clip(0, 255) |> Nx.as_type(:u8)
+      assert scaled == expected
+
+      {:ok, %Image{tensor: wide}} = Imagex.decode(bytes, type: {:u, 16}, scale: 257)
+      assert wide == Nx.multiply(Nx.as_type(hwc, :u16), 257)
+    end
+
+    test "applies to open, decode_batch and formats decoded in Elixir" do
+      options = [layout: :chw, type: {:f, 32}, scale: [1.0, 0.5, 0.25], bias: 1]
+
+      for path <- ["test/assets/lena.jpg", "test/assets/lena.jxl", "test/assets/lena.ppm"] do
+        bytes = File.read!(path)
+        {:ok, %Image{tensor: expected}} = Imagex.decode(bytes, options)
+        assert Nx.shape(expected) == {3, 512, 512}
+        {:ok, %Image{tensor: tensor}} = Imagex.open(path, options)
+        assert tensor == expected
+      end
+
+      images = [File.read!("test/assets/lena.jpg"), File.read!("test/assets/lena.png")]
+      {:ok, results} = Imagex.decode_batch(images, options)
+
+      for {bytes, {:ok, %Image{tensor: tensor}}} <- Enum.zip(images, results) do
+        assert {:ok, %Image{tensor: ^tensor}} = Imagex.decode(bytes, options)
+      end
+    end
+
+    test "converts rows as they are decoded, for every native decoder" do
+      {:ok, %Image{tensor: rgba}} = Imagex.decode(File.read!("test/assets/lena-rgba.png"))
+      {:ok, webp} = Imagex.encode(rgba, :webp, lossless: true)
+      options = [layout: :chw, type: {:f, 32}, scale: [1.0, 0.5, 0.25, 2.0], bias: -1]
+
+      for bytes <- [File.read!("test/assets/lena-rgba.png"), File.read!("test/assets/lena-rgba.jxl"), webp] do
+        {:ok, %Image{tensor: hwc}} = Imagex.decode(bytes)
+
+        expected =
+          hwc
+          |> Nx.as_type(:f32)
+          |> Nx.multiply(Nx.tensor([1.0, 0.5, 0.25, 2.0]))
+          |> Nx.subtract(1)
+          |> Nx.transpose(axes: [2, 0, 1])
+
+        {:ok, %Image{tensor: chw}} = Imagex.decode(bytes, options)
+        assert Nx.to_number(Nx.all_close(chw, expected, atol: 1.0e-5)) == 1
+      end
+    end
+
+    test "validates output options" do
+      bytes = File.read!("test/assets/lena.jpg")
+      assert Imagex.decode(bytes, layout: :nhwc) == {:error, "layout must be :hwc or :chw, got: :nhwc"}
+
+      assert Imagex.decode(bytes, type: {:s, 8}) ==
+               {:error, "type must be one of {:u, 8}, {:u, 16}, {:f, 16} and {:f, 32}, got: {:s, 8}"}
+
+      assert Imagex.decode(bytes, scale: [1, 2]) == {:error, "scale has 2 values but the image has 3 channels"}
+      assert Imagex.decode(bytes, bias: "0") == {:error, "bias must be a number or a list of numbers, got: \"0\""}
+
+      assert Imagex.decode(File.read!("test/assets/lena-palette.png"), keep_palette: true, type: {:f, 32}) ==
+               {:error, "layout, type, scale and bias cannot be combined with keep_palette: true"}
+
+      assert Imagex.decode(File.read!("test/assets/lena.tiff"), layout: :chw) ==
+               {:error, "layout, type, scale and bias are not supported for tiff documents"}
+    end
+  end
+
+  describe "decode into batch" do
+    test "stacks images of the slot size unchanged" do
+      images = [File.read!("test/assets/lena.jpg"), File.read!("test/assets/lena.png")]
+      {:ok, {batch, results}} = Imagex.decode_into_batch(images, {512, 512, 3})
+      assert Nx.shape(batch) == {2, 512, 512, 3}
+      assert Nx.type(batch) == {:u, 8}
+      assert results == [{:ok, {512, 512}}, {:ok, {512, 512}}]
+
+      expected = Enum.map(images, fn bytes -> Imagex.decode(bytes) |> elem(1) |> Map.get(:tensor) end)
+      assert batch == Nx.stack(expected)
+    end
+
+    test "resizes, converts channels and scales" do
+      images = [File.read!("test/assets/lena-rgba.png"), File.read!("test/assets/lena-grayscale.png")]
+      {:ok, {batch, _results}} = Imagex.decode_into_batch(images, {64, 32, 3}, type: {:f, 32}, scale: 1 / 255)
+      assert Nx.shape(batch) == {2, 64, 32, 3}
+
+      # a 16x downscale averages the image, so the mean is kept
+      {:ok, %Image{tensor: rgba}} = Imagex.decode(hd(images))
+      expected_mean = rgba |> Nx.slice_along_axis(0, 3, axis: 2) |> Nx.mean() |> Nx.divide(255) |> Nx.to_number()
+      assert_in_delta Nx.to_number(Nx.mean(batch[0])), expected_mean, 0.01
+
+      # gray pixels are replicated to every channel
+      assert batch[1][[.., .., 0]] == batch[1][[.., .., 1]]
+      assert batch[1][[.., .., 0]] == batch[1][[.., .., 2]]
+
+      {:ok, {planar, _results}} =
+        Imagex.decode_into_batch(images, {64, 32, 3}, type: {:f, 32}, scale: 1 / 255, layout: :nchw)
+
+      assert planar == Nx.transpose(batch, axes: [0, 3, 1, 2])
+
+      {:ok, {bytes, _results}} = Imagex.decode_into_batch(images, {64, 32, 3})
+      {:ok, {wide, _results}} = Imagex.decode_into_batch(images, {64, 32, 3}, type: {:u, 16})
+      assert wide == Nx.multiply(Nx.as_type(bytes, :u16), 257)
+    end
+
+    test "letterboxes and center-crops to the slot aspect ratio" do
+      images = [File.read!("test/assets/lena.jpg")]
+      {:ok, {boxed, _results}} = Imagex.decode_into_batch(images, {64, 32, 1}, fit: :letterbox, pad: 255)
+      # the square image becomes 32x32, centered, with 16 rows of padding above and below
+      assert boxed[0][0..15] == Nx.broadcast(Nx.tensor(255, type: :u8), {16, 32, 1})
+      assert boxed[0][48..63] == Nx.broadcast(Nx.tensor(255, type: :u8), {16, 32, 1})
+      assert Nx.to_number(Nx.reduce_min(boxed[0][16..47])) < 255
+
+      {:ok, {cropped, _results}} = Imagex.decode_into_batch(images, {256, 128, 3}, fit: :crop)
+      {:ok, {expected, _results}} = Imagex.decode_into_batch(images, {256, 256, 3})
+      # away from the crop edges, cropping the middle columns is the same 2x downscale as stretching the whole image
+      diff = Nx.subtract(Nx.as_type(cropped[[.., .., 1..126]], :s16), Nx.as_type(expected[[.., .., 65..190]], :s16))
+      assert Nx.to_number(Nx.reduce_max(Nx.abs(diff))) <= 1
+    end
+
+    test "reports images that fail to decode and validates options" do
+      images = [File.read!("test/assets/lena.jpg"), <<0, 1, 2>>]
+      {:ok, {batch, results}} = Imagex.decode_into_batch(images, {8, 8, 3}, pad: 7)
+      assert [{:ok, {512, 512}}, {:error, "unsupported format for batch decoding"}] = results
+      assert batch[1] == Nx.broadcast(Nx.tensor(7, type: :u8), {8, 8, 3})
+
+      assert Imagex.decode_into_batch(images, {8, 8, 3}, fit: :cover) ==
+               {:error, "fit must be :stretch, :letterbox or :crop, got: :cover"}
+
+      assert Imagex.decode_into_batch(images, {8, 8, 3}, layout: :chw) ==
+               {:error, "layout must be :nhwc or :nchw, got: :chw"}
+
+      assert Imagex.decode_into_batch(images, {8, 8, 1}, scale: [1, 2]) ==
+               {:error, "scale has 2 values but the image has 1 channels"}
+    end
+  end
+
+  describe "decode cache" do
+    setup do
+      :ok = Imagex.Cache.configure(max_bytes: 64 * 1024 * 1024)
+      :ok = Imagex.Cache.clear()
+      on_exit(fn -> Imagex.Cache.configure(max_bytes: 0) end)
+    end
+
+    test "returns cached images on repeated decodes" do
+      for path <- ["test/assets/lena.jpg", "test/assets/lena-palette.png", "test/assets/16bit.jxl"] do
+        bytes = File.read!(path)
+        expected = Imagex.decode(bytes)
+        %{hits: hits, misses: misses} = Imagex.Cache.stats()
+
+        assert Imagex.decode(bytes, cache: true) == expected
+        assert %{hits: ^hits} = Imagex.Cache.stats()
+        assert Imagex.decode(bytes, cache: true) == expected
+        assert Imagex.decode(bytes, cache: true) == expected
+        assert %{misses: new_misses, hits: new_hits} = Imagex.Cache.stats()
+        assert new_misses == misses + 1
+        assert new_hits == hits + 2
+      end
+
+      assert %{entries: 3, bytes: bytes} = Imagex.Cache.stats()
+      assert bytes > 512 * 512 * 3
+    end
+
+    test "keys entries by the decode options" do
+      bytes = File.read!("test/assets/lena-palette.png")
+      %{hits: hits} = Imagex.Cache.stats()
+      {:ok, %Image{palette: nil}} = Imagex.decode(bytes, cache: true)
+      {:ok, %Image{palette: palette}} = Imagex.decode(bytes, cache: true, keep_palette: true)
+      assert palette != nil
+
+      jpeg = File.read!("test/assets/lena.jpg")
+      {:ok, %Image{tensor: full}} = Imagex.decode(jpeg, cache: true)
+      {:ok, %Image{tensor: tile}} = Imagex.decode(jpeg, cache: true, crop: {10, 20, 30, 40})
+      assert tile == Nx.slice(full, [20, 10, 0], [40, 30, 3])
+      assert %{entries: 4, hits: ^hits} = Imagex.Cache.stats()
+    end
+
+    test "evicts the least recently used images beyond the budget" do
+      jpeg = File.read!("test/assets/lena.jpg")
+      jxl = File.read!("test/assets/lena.jxl")
+      # room for one decoded 512x512 RGB image and its encoded bytes, but not two
+      :ok = Imagex.Cache.configure(max_bytes: 1_500_000)
+      %{evictions: evictions, misses: misses} = Imagex.Cache.stats()
+
+      {:ok, cached_jpeg} = Imagex.decode(jpeg, cache: true)
+      {:ok, _} = Imagex.decode(jxl, cache: true)
+      assert %{entries: 1, evictions: new_evictions} = Imagex.Cache.stats()
+      assert new_evictions == evictions + 1
+
+      {:ok, _} = Imagex.decode(jxl, cache: true)
+      assert %{misses: new_misses} = Imagex.Cache.stats()
+      assert new_misses == misses + 2
+
+      # evicted pixels stay valid while they are referenced
+      assert {:ok, cached_jpeg} == Imagex.decode(jpeg)
+
+      :ok = Imagex.Cache.configure(max_bytes: 0)
+      assert %{entries: 0, bytes: 0} = Imagex.Cache.stats()
+      assert {:ok, _} = Imagex.decode(jpeg, cache: true)
+      assert %{entries: 0} = Imagex.Cache.stats()
+
+      assert Imagex.Cache.configure(max_bytes: -1) == {:error, "max_bytes must be a non-negative integer, got: -1"}
+    end
+  end
+
+  describe "decode budget" do
+    setup do
+      :ok = Imagex.Budget.configure([])
+      on_exit(fn -> Imagex.Budget.configure([]) end)
+    end
+
+    test "rejects images beyond the pixel and memory limits" do
+      jpeg = File.read!("test/assets/lena.jpg")
+      %{rejected: rejected} = Imagex.Budget.stats()
+
+      :ok = Imagex.Budget.configure(max_pixels: 1000)
+      assert Imagex.decode(jpeg) == {:error, "image exceeds the pixel budget"}
+      assert Imagex.decode(File.read!("test/assets/lena.png")) == {:error, "image exceeds the pixel budget"}
+
+      :ok = Imagex.Budget.configure(max_bytes: 512 * 512)
+      assert Imagex.decode(jpeg) == {:error, "image exceeds the memory budget"}
+
+      assert %{rejected: new_rejected, max_bytes: 262_144, max_pixels: 0, bytes_in_use: 0} = Imagex.Budget.stats()
+      assert new_rejected == rejected + 3
+
+      :ok = Imagex.Budget.configure(max_pixels: 512 * 512, max_bytes: 512 * 512 * 3)
+      assert {:ok, %Image{}} = Imagex.decode(jpeg)
+    end
+
+    test "queues or rejects decodes while the budget is held" do
+      jpeg = File.read!("test/assets/lena.jpg")
+      :ok = Imagex.Budget.configure(max_bytes: 1_000_000, when_exhausted: :reject)
+
+      {:ok, decoder} = Imagex.Decoder.new(:jpeg)
+      {:ok, _} = Imagex.Decoder.push(decoder, jpeg)
+      assert %{bytes_in_use: 786_432} = Imagex.Budget.stats()
+      assert Imagex.decode(jpeg) == {:error, "memory budget exhausted"}
+
+      :ok = Imagex.Budget.configure(max_bytes: 1_000_000, queue_timeout: 50)
+      %{queued: queued} = Imagex.Budget.stats()
+      assert Imagex.decode(jpeg) == {:error, "timed out waiting for the memory budget"}
+      assert %{queued: new_queued, waiting: 0} = Imagex.Budget.stats()
+      assert new_queued == queued + 1
+
+      # a queued decode goes ahead once the reservation it waits for is released
+      :ok = Imagex.Budget.configure(max_bytes: 1_000_000)
+      task = Task.async(fn -> Imagex.decode(jpeg) end)
+      Process.sleep(20)
+      assert {:ok, %Image{}} = Imagex.Decoder.finish(decoder)
+      assert {:ok, %Image{}} = Task.await(task)
+      assert %{bytes_in_use: 0} = Imagex.Budget.stats()
+    end
+
+    test "keeps later decodes behind the queued ones" do
+      jpeg = File.read!("test/assets/lena.jpg")
+      {:ok, small} = Imagex.encode(Nx.iota({8, 8, 3}, type: {:u, 8}), :png)
+      :ok = Imagex.Budget.configure(max_bytes: 1_000_000)
+
+      {:ok, decoder} = Imagex.Decoder.new(:jpeg)
+      {:ok, _} = Imagex.Decoder.push(decoder, jpeg)
+      task = Task.async(fn -> Imagex.decode(jpeg) end)
+      Process.sleep(20)
+      assert %{waiting: 1} = Imagex.Budget.stats()
+
+      # the small image fits in what is left, but may not take it ahead of the queued decode
+      assert {:ok, [{:error, "memory budget exhausted"}]} = Imagex.decode_batch([small])
+      later = Task.async(fn -> Imagex.decode(small) end)
+      Process.sleep(20)
+      assert %{waiting: 2} = Imagex.Budget.stats()
+
+      assert {:ok, %Image{}} = Imagex.Decoder.finish(decoder)
+      assert {:ok, %Image{}} = Task.await(task)
+      assert {:ok, %Image{}} = Task.await(later)
+      assert %{bytes_in_use: 0, waiting: 0} = Imagex.Budget.stats()
+    end
+
+    test "fails batch images and counts pixel buffers while the budget is held" do
+      jpeg = File.read!("test/assets/lena.jpg")
+      :ok = Imagex.Budget.configure(max_bytes: 1_000_000, when_exhausted: :reject)
+
+      {:ok, decoder} = Imagex.Decoder.new(:jpeg)
+      {:ok, _} = Imagex.Decoder.push(decoder, jpeg)
+      assert {:ok, [{:error, "memory budget exhausted"}]} = Imagex.decode_batch([jpeg])
+      # the memory of a pixel buffer is reserved like the pixels of a decode
+      assert Imagex.PixelBuffer.new(512 * 512 * 3) == {:error, "memory budget exhausted"}
+
+      assert {:ok, %Image{}} = Imagex.Decoder.finish(decoder)
+      assert {:ok, [{:ok, %Image{}}]} = Imagex.decode_batch([jpeg])
+
+      {:ok, buffer} = Imagex.PixelBuffer.new(512 * 512 * 3)
+      assert %{bytes_in_use: 786_432} = Imagex.Budget.stats()
+      assert {:ok, [{:error, "memory budget exhausted"}]} = Imagex.decode_batch([jpeg])
+
+      # decodes into the buffer are held to the limits
+      :ok = Imagex.Budget.configure(max_pixels: 1000)
+      assert Imagex.decode(jpeg, into: buffer) == {:error, "image exceeds the pixel budget"}
+    end
+
+    test "validates its options" do
+      assert Imagex.Budget.configure(max_pixels: -1) == {:error, "max_pixels must be a non-negative integer, got: -1"}
+      assert Imagex.Budget.configure(max_bytes: 1.5) == {:error, "max_bytes must be a non-negative integer, got: 1.5"}
+
+      assert Imagex.Budget.configure(when_exhausted: :drop) ==
+               {:error, "when_exhausted must be :queue or :reject, got: :drop"}
+
+      assert Imagex.Budget.configure(queue_timeout: 0) ==
+               {:error, "queue_timeout must be a positive integer or :infinity, got: 0"}
+    end
+  end
+
+  describe "pixel buffer" do
+    test "decodes images into the buffer" do
+      {:ok, buffer} = Imagex.PixelBuffer.new(512 * 512 * 3)
+
+      for path <- ["test/assets/lena.jpg", "test/assets/lena.png", "test/assets/lena.jxl"] do
+        bytes = File.read!(path)
+        {:ok, %Image{tensor: expected, metadata: metadata}} = Imagex.decode(bytes)
+        assert {:ok, %Image{tensor: ^expected, metadata: ^metadata}} = Imagex.decode(bytes, into: buffer)
+        assert {:ok, %Image{tensor: ^expected}} = Imagex.open(path, into: buffer)
+      end
+
+      crop = {10, 20, 30, 40}
+      {:ok, %Image{tensor: expected}} = Imagex.decode(File.read!("test/assets/lena.jpg"), crop: crop)
+      assert {:ok, %Image{tensor: ^expected}} = Imagex.open("test/assets/lena.jpg", crop: crop, into: buffer)
+      assert Imagex.PixelBuffer.capacity(buffer) == 512 * 512 * 3
+    end
+
+    test "leaves the tensors of earlier decodes unchanged and grows to fit" do
+      {:ok, buffer} = Imagex.PixelBuffer.new(16)
+      jpeg = File.read!("test/assets/lena.jpg")
+      png = File.read!("test/assets/lena.png")
+      {:ok, %Image{tensor: decoded_jpeg}} = Imagex.decode(jpeg)
+      {:ok, %Image{tensor: decoded_png}} = Imagex.decode(png)
+
+      {:ok, %Image{tensor: first}} = Imagex.decode(jpeg, into: buffer)
+      assert Imagex.PixelBuffer.capacity(buffer) == 512 * 512 * 3
+      # the first tensor still refers to the memory, so the second decode copies on write
+      {:ok, %Image{tensor: second}} = Imagex.decode(png, into: buffer)
+      assert second == decoded_png
+      assert first == decoded_jpeg
+
+      # a larger image moves to new memory too
+      {:ok, tiff} = Imagex.open("test/assets/lena.tiff")
+      {:ok, %Image{tensor: rendered}} = Imagex.Tiff.render_page(tiff, 0)
+      assert {:ok, %Image{tensor: ^rendered}} = Imagex.Tiff.render_page(tiff, 0, into: buffer)
+      assert Imagex.PixelBuffer.capacity(buffer) == 512 * 512 * 4
+      assert first == decoded_jpeg
+      assert second == decoded_png
+
+      {:ok, %Image{tensor: cropped}} = Imagex.Tiff.render_page(tiff, 0, crop: {100, 50, 64, 32})
+      assert {:ok, %Image{tensor: ^cropped}} = Imagex.Tiff.render_page(tiff, 0, crop: {100, 50, 64, 32}, into: buffer)
+    end
+
+    test "reuses its memory once the tensors of earlier decodes are gone" do
+      :ok = Imagex.Budget.configure([])
+      jpeg = File.read!("test/assets/lena.jpg")
+      {:ok, %Image{tensor: expected}} = Imagex.decode(jpeg)
+      {:ok, buffer} = Imagex.PixelBuffer.new(512 * 512 * 3)
+
+      decode_frame = fn ->
+        {:ok, %Image{tensor: tensor}} = Imagex.decode(jpeg, into: buffer)
+        tensor == expected
+      end
+
+      # the budget counts every allocation of the buffer
+      assert decode_frame.()
+      :erlang.garbage_collect()
+      assert decode_frame.()
+      assert %{bytes_in_use: 786_432} = Imagex.Budget.stats()
+
+      # a tensor that another process holds makes the next decode copy
+      :erlang.garbage_collect()
+      {:ok, holder} = Agent.start_link(fn -> Imagex.decode(jpeg, into: buffer) end)
+      assert decode_frame.()
+      assert %{bytes_in_use: 1_572_864} = Imagex.Budget.stats()
+      assert Agent.get(holder, fn {:ok, %Image{tensor: tensor}} -> tensor == expected end)
+      :ok = Agent.stop(holder)
+    end
+
+    test "rejects unsupported options" do
+      {:ok, buffer} = Imagex.PixelBuffer.new(1024)
+      jpeg = File.read!("test/assets/lena.jpg")
+      {:ok, webp} = Imagex.encode(Nx.iota({8, 8, 3}, type: {:u, 8}), :webp, lossless: true)
+
+      assert Imagex.decode(webp, into: buffer) ==
+               {:error, "into is only supported for JPEG, PNG and JPEG XL images, got: :webp"}
+
+      assert Imagex.decode(jpeg, into: buffer, cache: true) == {:error, "into cannot be combined with cache"}
+      assert Imagex.decode(jpeg, into: buffer, preview: 64) == {:error, "into cannot be combined with preview"}
+
+      assert Imagex.decode(jpeg, into: buffer, type: {:f, 32}) ==
+               {:error, "into cannot be combined with layout, type, scale and bias"}
+
+      assert Imagex.decode(jpeg, into: :buffer) == {:error, "into must be an Imagex.PixelBuffer, got: :buffer"}
+      assert Imagex.PixelBuffer.new(0) == {:error, "capacity must be a positive integer, got: 0"}
+    end
+  end
+
+  describe "metadata selection" do
+    test "extracts only the requested kinds of JPEG metadata", %{image: test_image} do
+      xmp = sample_xmp("jpeg-selection")
+      icc_profile = :binary.copy(<<1, 2, 3, 4>>, 64)
+
+      image = %Image{
+        tensor: test_image.tensor,
+        metadata: %{xmp: xmp, icc_profile: icc_profile, exif: %{ifd0: %{orientation: 6}}}
+      }
+
+      {:ok, jpeg_bytes} = Imagex.encode(image, :jpeg)
+
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(jpeg_bytes, parse_metadata: [:xmp])
+      assert metadata == %{xmp: xmp}
+
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(jpeg_bytes, parse_metadata: [:exif, :icc])
+      assert metadata.icc_profile == icc_profile
+      assert metadata.exif.ifd0.orientation == 6
+      refute Map.has_key?(metadata, :xmp)
+
+      {:ok, %Image{metadata: nil}} = Imagex.decode(jpeg_bytes, parse_metadata: [])
+      {:ok, %Image{metadata: nil}} = Imagex.decode(jpeg_bytes, parse_metadata: false)
+    end
+
+    test "keeps the PNG XMP chunk without the other text chunks", %{image: test_image} do
+      xmp = sample_xmp("png-selection")
+
+      image = %Image{
+        tensor: test_image.tensor,
+        metadata: %{xmp: xmp, png_chunks: [%{keyword: "Author", text: "Imagex"}]}
+      }
+
+      {:ok, png_bytes} = Imagex.encode(image, :png)
+
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(png_bytes, parse_metadata: [:xmp])
+      assert metadata.xmp == xmp
+      assert Enum.map(metadata.png_chunks, & &1.keyword) == ["XML:com.adobe.xmp"]
+
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(png_bytes, parse_metadata: [:text])
+      assert Enum.map(metadata.png_chunks, & &1.keyword) == ["Author"]
+      refute Map.has_key?(metadata, :xmp)
+    end
+
+    test "skips JPEG XL boxes that were not requested", %{image: test_image} do
+      xmp = sample_xmp("jxl-selection")
+
+      image = %Image{
+        tensor: test_image.tensor,
+        metadata: %{xmp: xmp, jxl_boxes: [%{type: :jumb, contents: <<1, 2, 3>>}]}
+      }
+
+      {:ok, jxl_bytes} = Imagex.encode(image, :jxl, lossless: true)
+
+      {:ok, %Image{metadata: nil}} = Imagex.decode(jxl_bytes, parse_metadata: [:exif])
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(jxl_bytes, parse_metadata: [:xmp])
+      assert metadata.xmp == xmp
+      assert metadata.jxl_boxes == [%{type: :xml, contents: xmp}]
+
+      {:ok, %Image{metadata: metadata}} = Imagex.decode(jxl_bytes)
+      assert length(metadata.jxl_boxes) == 2
+    end
+
+    test "applies to decode_batch and open", %{image: test_image} do
+      xmp = sample_xmp("batch-selection")
+      {:ok, jpeg_bytes} = Imagex.encode(%Image{tensor: test_image.tensor, metadata: %{xmp: xmp}}, :jpeg)
+
+      {:ok, [{:ok, %Image{metadata: metadata}}]} = Imagex.decode_batch([jpeg_bytes], parse_metadata: [:xmp])
+      assert metadata == %{xmp: xmp}
+
+      path = Path.join(System.tmp_dir!(), "imagex-test-#{System.unique_integer([:positive])}.jpg")
+      on_exit(fn -> File.rm(path) end)
+      File.write!(path, jpeg_bytes)
+
+      {:ok, %Image{metadata: nil}} = Imagex.open(path, parse_metadata: [:icc])
+      {:ok, %Image{metadata: %{xmp: ^xmp}}} = Imagex.open(path, parse_metadata: [:xmp])
+    end
+
+    test "rejects unknown kinds of metadata" do
+      jpeg_bytes = File.read!("test/assets/lena.jpg")
+      message = "parse_metadata must be a boolean or a list of :exif, :xmp, :icc and :text, got: [:gps]"
+
+      assert {:error, ^message} = Imagex.decode(jpeg_bytes, parse_metadata: [:gps])
+      assert {:error, ^message} = Imagex.decode_batch([jpeg_bytes], parse_metadata: [:gps])
+    end
+  end
+
+  defp pyramid_tiles(pyramid, bands) do
+    pushed =
+      Enum.flat_map(bands, fn band ->
+        {:ok, tiles} = Imagex.Pyramid.push(pyramid, band)
+        tiles
+      end)
+
+    {:ok, remaining} = Imagex.Pyramid.finish(pyramid)
+    pushed ++ remaining
+  end
+
+  defp tile_tensor(bytes) do
+    {:ok, %Image{tensor: tensor}} = Imagex.decode(bytes)
+    tensor
+  end
+
+  defp push_in_chunks(decoder, bytes, chunk_size) do
+    bytes
+    |> binary_chunks(chunk_size)
+    |> Enum.flat_map(fn chunk ->
+      {:ok, rows} = Imagex.Decoder.push(decoder, chunk)
+      List.wrap(rows)
+    end)
+  end
+
+  defp webp_test_bytes do
+    {:ok, image} = Imagex.decode(File.read!("test/assets/lena.ppm"), format: :ppm)
+    {:ok, webp_bytes} = Imagex.encode(image, :webp, quality: 90)
+    webp_bytes
+  end
+
+  defp push_rows_in_batches(encoder, tensor, batch_size) do
+    height = elem(tensor.shape, 0)
+
+    pushed =
+      for first_row <- 0..(height - 1)//batch_size do
+        rows = Nx.slice_along_axis(tensor, first_row, min(batch_size, height - first_row))
+        {:ok, output} = Imagex.Encoder.push(encoder, rows)
+        output
+      end
+
+    {:ok, rest} = Imagex.Encoder.finish(encoder)
+    IO.iodata_to_binary([pushed, rest])
+  end
+
+  defp binary_chunks(bytes, size) when byte_size(bytes) <= size, do: [bytes]
+
+  defp binary_chunks(bytes, size) do
+    [binary_part(bytes, 0, size) | binary_chunks(binary_part(bytes, size, byte_size(bytes) - size), size)]
+  end
+
   defp png_with_ztxt(keyword, text) do
     tensor = Nx.broadcast(Nx.tensor([0, 0, 0], type: {:u, 8}), {8, 8, 3})
     {:ok, png_bytes} = Imagex.encode(tensor, :png)